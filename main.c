@@ -4,6 +4,7 @@
 #include "vm/Repl.h"
 #include "vm/Thread.h"
 #include "vm/Cli.h"
+#include "vm/Optimizer.h"
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
@@ -18,7 +19,14 @@ int main(int argc, char **args)
 	int result = EXIT_SUCCESS;
 
 	parseCliArgs(&cliArgs, argc, args);
-	initThread(&CurrentThread);
+	if (cliArgs.optimizationThreshold >= 0) {
+		OptimizationThreshold = cliArgs.optimizationThreshold;
+	}
+	DefaultHeapSettings = cliArgs.heapSettings;
+	if (!initThread(&CurrentThread)) {
+		printf("Invalid heap settings\n");
+		return EXIT_FAILURE;
+	}
 	bootstrapSmalltalk(cliArgs.snapshotFileName, cliArgs.bootstrapDir);
 
 	if (cliArgs.error != NULL) {
@@ -40,8 +48,9 @@ int main(int argc, char **args)
 		runRepl();
 	}
 
-	freeHandles();
+	// sweeping left by last collection is finished by freeing heap, it still needs handles
 	freeThread(&CurrentThread);
+	freeHandles();
 	return result;
 }
 
@@ -14,6 +14,9 @@ typedef struct {
 	uint8_t *argRegs;
 	uint8_t regsSize;
 	uint8_t *regs;
+	// callee-saved registers, which keep variables live across sends
+	uint8_t savedRegsSize;
+	uint8_t *savedRegs;
 } AvailableRegs;
 
 typedef struct {
@@ -41,7 +44,7 @@ typedef struct {
 	ptrdiff_t instOffset;
 	AssemblerFixup fixups[8];
 	uint8_t fixupsSize;
-	uint16_t pointersOffsets[1024]; // TODO: get rid of fixed size buffer?
+	uint16_t pointersOffsets[4096]; // TODO: get rid of fixed size buffer?
 	size_t pointersOffsetsSize;
 } AssemblerBuffer;
 
@@ -199,7 +202,7 @@ static void asmBindFixup(AssemblerBuffer *buffer, AssemblerFixup *fixup, int64_t
 static void asmAddPointerOffset(AssemblerBuffer *buffer, ptrdiff_t offset)
 {
 	ASSERT(INT16_MIN <= offset && offset <= INT16_MAX);
-	ASSERT(buffer->pointersOffsetsSize < 1024);
+	ASSERT(buffer->pointersOffsetsSize < 4096);
 	buffer->pointersOffsets[buffer->pointersOffsetsSize++] = offset;
 }
 
@@ -130,11 +130,14 @@ typedef struct {
 	int32_t disp;
 } MemoryOperand;
 
-static uint8_t Registers[] = { R11, R13, R14, R15, RBX, R9, R8, RCX, RDX, /*RSI, RDI*/ };
+static uint8_t Registers[] = { R11, R9, R8, RCX, RDX, /*RSI, RDI*/ };
+static uint8_t SavedRegisters[] = { RBX, R13, R14, R15 };
 static uint8_t ArgumentsRegisters[] = { RDI, RSI, RDX, RCX, R8, R9 };
 static AvailableRegs X64AvailableRegs = {
 	.regsSize = sizeof(Registers),
 	.regs = Registers,
+	.savedRegsSize = sizeof(SavedRegisters),
+	.savedRegs = SavedRegisters,
 };
 static _Bool CalleeSavedRegisters[] = {
 	/* RAX */ 0,
@@ -204,6 +207,7 @@ static void asmNegb(AssemblerBuffer *buffer, ByteRegister dst);
 
 static void asmIncq(AssemblerBuffer *buffer, Register dst);
 static void asmIncqMem(AssemblerBuffer *buffer, MemoryOperand operand);
+static void asmInclMem(AssemblerBuffer *buffer, MemoryOperand operand);
 static void asmDecq(AssemblerBuffer *buffer, Register dst);
 
 static void asmAndq(AssemblerBuffer *buffer, Register src, Register dst);
@@ -240,12 +244,14 @@ static void asmCqo(AssemblerBuffer *buffer);
 
 static void asmCallq(AssemblerBuffer *buffer, Register src);
 static void asmCallqMem(AssemblerBuffer *buffer, MemoryOperand operand);
+static void asmCalldImm(AssemblerBuffer *buffer, int32_t imm);
 static void asmJmpq(AssemblerBuffer *buffer, Register src);
 static void asmJmpqMem(AssemblerBuffer *buffer, MemoryOperand operand);
 static void asmJmpdImm(AssemblerBuffer *buffer, int32_t imm);
 static void asmJmpLabel(AssemblerBuffer *buffer, AssemblerLabel *label);
 static void asmJ(AssemblerBuffer *buffer, uint8_t condition, AssemblerLabel *label);
 static void asmInt3(AssemblerBuffer *buffer);
+static void asmNop5(AssemblerBuffer *buffer);
 
 static void asmEmitAddImm(AssemblerBuffer *buffer, uint8_t op, Register reg, int32_t imm);
 static void asmEmitShift(AssemblerBuffer *buffer, uint8_t op, Register dst);
@@ -686,6 +692,17 @@ static void asmIncqMem(AssemblerBuffer *buffer, MemoryOperand operand)
 }
 
 
+static void asmInclMem(AssemblerBuffer *buffer, MemoryOperand operand)
+{
+	Operands operands = {.reg = 0};
+	asmInitMemoryOperand(&operands, operand);
+	asmEnsureCapacity(buffer);
+	asmEmitRexOperands(buffer, 0, &operands);
+	asmEmitUint8(buffer, 0xFF);
+	asmEmitOperands(buffer, &operands);
+}
+
+
 static void asmDecq(AssemblerBuffer *buffer, Register dst)
 {
 	Operands operands = {.mod = MOD_REG, .reg = 1, .rm = dst};
@@ -1010,6 +1027,14 @@ static void asmCallqMem(AssemblerBuffer *buffer, MemoryOperand operand)
 }
 
 
+static void asmCalldImm(AssemblerBuffer *buffer, int32_t imm)
+{
+	asmEnsureCapacity(buffer);
+	asmEmitUint8(buffer, 0xE8);
+	asmEmitInt32(buffer, imm);
+}
+
+
 static void asmJmpq(AssemblerBuffer *buffer, Register src)
 {
 	Operands operands = {.mod = MOD_REG, .reg = JUMP_ABSOLUTE, .rm = src};
@@ -1063,6 +1088,18 @@ static void asmInt3(AssemblerBuffer *buffer)
 }
 
 
+// nopl 0(%rax,%rax,1) of the same size as call rel32
+static void asmNop5(AssemblerBuffer *buffer)
+{
+	asmEnsureCapacity(buffer);
+	asmEmitUint8(buffer, 0x0F);
+	asmEmitUint8(buffer, 0x1F);
+	asmEmitUint8(buffer, 0x44);
+	asmEmitUint8(buffer, 0x00);
+	asmEmitUint8(buffer, 0x00);
+}
+
+
 static void asmInitMemoryOperand(Operands *operands, MemoryOperand operand)
 {
 	if (operand.base == RIP) {
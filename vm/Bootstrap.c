@@ -53,7 +53,6 @@ static void initSmalltalkStubs(void)
 	Handles.Dictionary = newStubClass(metaClass, FixedShape, 2);
 	Handles.OrderedCollection = newStubClass(metaClass, FixedShape, 3);
 	Handles.Class = newStubClass(metaClass, FixedShape, 9);
-	Handles.TypeFeedback = newStubClass(metaClass, FixedShape, 2);
 	Handles.CompiledMethod = newStubClass(metaClass, CompiledCodeShape, 6);
 	Handles.CompiledBlock = newStubClass(metaClass, CompiledCodeShape, 4);
 	Handles.SourceCode = newStubClass(metaClass, FixedShape, 5);
@@ -66,7 +65,7 @@ static void initSmalltalkStubs(void)
 	Handles.ClassNode = newStubClass(metaClass, FixedShape, 6);
 	Handles.MethodNode = newStubClass(metaClass, FixedShape, 5);
 	Handles.BlockNode = newStubClass(metaClass, FixedShape, 5);
-	Handles.BlockScope = newStubClass(metaClass, FixedShape, 6);
+	Handles.BlockScope = newStubClass(metaClass, FixedShape, 7);
 	Handles.ExpressionNode = newStubClass(metaClass, FixedShape, 5);
 	Handles.MessageExpressionNode = newStubClass(metaClass, FixedShape, 3);
 	Handles.NilNode = newStubClass(metaClass, FixedShape, 2);
@@ -85,7 +84,7 @@ static void initSmalltalkStubs(void)
 	Handles.InvalidPragmaError = newStubClass(metaClass, FixedShape, 2);
 	Handles.IoError = newStubClass(metaClass, FixedShape, 1);
 
-	Handles.nil->raw->class = Handles.UndefinedObject->raw;
+	rawObjectSetClass(Handles.nil->raw, Handles.UndefinedObject->raw);
 	Handles.true = persistHandle(newObject(Handles.True, 0));
 	Handles.false = persistHandle(newObject(Handles.False, 0));
 	Handles.Smalltalk = persistHandle(newDictionary(256));
@@ -127,7 +126,6 @@ static void initSmalltalkStubs(void)
 	setGlobalObject("OrderedCollection", (Object *) Handles.OrderedCollection);
 	setGlobalObject("MetaClass", (Object *) Handles.MetaClass);
 	setGlobalObject("Class", (Object *) Handles.Class);
-	setGlobalObject("TypeFeedback", (Object *) Handles.TypeFeedback);
 	setGlobalObject("CompiledMethod", (Object *) Handles.CompiledMethod);
 	setGlobalObject("CompiledBlock", (Object *) Handles.CompiledBlock);
 	setGlobalObject("SourceCode", (Object *) Handles.SourceCode);
@@ -168,7 +166,7 @@ static void initSmalltalkStubs(void)
 static Class *newStubClass(Class *metaClass, InstanceShape shape, size_t instanceSize)
 {
 	Class *class = (Class *) newStubObject(sizeof(RawClass));
-	class->raw->class = metaClass->raw;
+	rawObjectSetClass((RawObject *) class->raw, metaClass->raw);
 	objectStorePtr((Object *) class,  &class->raw->superClass, (Object *) Handles.nil);
 	objectStorePtr((Object *) class,  &class->raw->subClasses, (Object *) Handles.nil);
 	objectStorePtr((Object *) class,  &class->raw->methodDictionary, (Object *) Handles.nil);
@@ -188,15 +186,16 @@ static Class *newStubMetaClass(InstanceShape shape, size_t instanceSize)
 {
 	RawObject *object = (RawObject *) allocate(&CurrentThread.heap, sizeof(RawMetaClass));
 	object->hash = (Value) object >> 2; // XXX: replace with random hash generator
+	object->age = 0;
 	object->payloadSize = 0;
 	object->varsSize = 0;
 	object->tags = 0;
 
 	Class *metaClass = newStubClass(scopeHandle(NULL), FixedShape, 6);
-	metaClass->raw->class = (RawClass *) object;
+	rawObjectSetClass((RawObject *) metaClass->raw, (RawClass *) object);
 
 	MetaClass *class = (MetaClass *) scopeHandle(object);
-	class->raw->class = metaClass->raw;
+	rawObjectSetClass((RawObject *) class->raw, metaClass->raw);
 	objectStorePtr((Object *) class,  &class->raw->superClass, (Object *) Handles.nil);
 	objectStorePtr((Object *) class,  &class->raw->subClasses, (Object *) Handles.nil);
 	objectStorePtr((Object *) class,  &class->raw->methodDictionary, (Object *) Handles.nil);
@@ -213,6 +212,7 @@ static Object *newStubObject(size_t size)
 {
 	RawObject *object = (RawObject *) allocate(&CurrentThread.heap, size);
 	object->hash = (Value) object >> 2; // XXX: replace with random hash generator
+	object->age = 0;
 	object->payloadSize = 0;
 	object->varsSize = 0;
 	object->tags = 0;
@@ -232,7 +232,6 @@ static _Bool parseKernelFiles(char *kernelDir)
 		"Boolean.st",
 		"True.st",
 		"False.st",
-		"TypeFeedback.st",
 		"Magnitudes/Magnitude.st",
 		"Magnitudes/Number.st",
 		"Magnitudes/Integer.st",
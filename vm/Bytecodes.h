@@ -3,6 +3,7 @@
 
 #include "Object.h"
 #include "Assembler.h"
+#include "Class.h"
 #include "Assert.h"
 #include <stdlib.h>
 #include <stdint.h>
@@ -13,10 +14,19 @@ typedef enum {
 	BYTECODE_SEND_WITH_STORE, // selector:literal, noOfArgs:byte, receiver:op, arg:op[0..noOfArgs], result:op
 	BYTECODE_RETURN, // source:op
 	BYTECODE_OUTER_RETURN, // source:op
-	BYTECODE_JUMP, // target:int32
-	BYTECODE_JUMP_NOT_MEMBER_OF // class:literal, arg:op, target:int32
+	BYTECODE_JUMP, // target:int32 relative to next bytecode
+	BYTECODE_JUMP_NOT_MEMBER_OF, // class:literal, arg:op, target:int32 relative to next bytecode
+	BYTECODE_JUMP_IF_TRUE, // arg:op, target:int32 relative to next bytecode
+	BYTECODE_JUMP_IF_FALSE, // arg:op, target:int32 relative to next bytecode
+	BYTECODE_FALLBACK_SEND, // selector:literal, noOfArgs:byte, noOfVars:byte, flags:byte, receiver:op, block:op[0..noOfArgs], self:op, var:op[0..noOfVars], result:op
+	BYTECODE_DEOPTIMIZATION_STATE // noOfOperands:byte, (method:op, bytecode:op, self:op, arg:op[0..noOfArgs], temp:op[0..noOfTemps])[] of send following it
 } Bytecode;
 
+typedef enum {
+	FALLBACK_RETURNS = 1, // blocks return from home of the sending code
+	FALLBACK_OUTER = 2, // blocks use context of the sending code
+} FallbackFlags;
+
 typedef enum {
 	OPERAND_VALUE, // 64b int
 	OPERAND_NIL,
@@ -28,10 +38,11 @@ typedef enum {
 	OPERAND_SUPER,
 	OPERAND_CONTEXT_VAR, // index level
 	OPERAND_INST_VAR, // index
-	OPERAND_INST_VAR_OF, // index operandType index [level]
+	OPERAND_INST_VAR_OF, // slot operandType index [level]
 	OPERAND_LITERAL, // index
 	OPERAND_ASSOC, // index
 	OPERAND_BLOCK, // index
+	OPERAND_BOUND_VAR, // index, box of variable is in next temporary slot
 } OperandType;
 
 typedef struct {
@@ -67,7 +78,11 @@ static void bytecodeSendWithStore(AssemblerBuffer *buffer, uint8_t selector, Ope
 static void bytecodeReturn(AssemblerBuffer *buffer, Operand *operand, _Bool outer);
 static void bytecodeJump(AssemblerBuffer *buffer, AssemblerLabel *label);
 static void bytecodeJumpNotMemberOf(AssemblerBuffer *buffer, Operand *operand, uint8_t class, AssemblerLabel *label);
+static void bytecodeJumpIf(AssemblerBuffer *buffer, Operand *operand, _Bool value, AssemblerLabel *label);
+static void bytecodeFallbackSend(AssemblerBuffer *buffer, uint8_t selector, Operand *receiver, Operand *blocks, uint8_t numArgs, Operand *self, Operand *vars, uint8_t numVars, uint8_t flags, Operand *result);
+static void bytecodeDeoptimizationState(AssemblerBuffer *buffer, Operand *operands, uint8_t numOperands);
 static void bytecodeOperand(AssemblerBuffer *buffer, Operand *operand);
+static Operand bytecodeInstanceOperand(Operand *operand);
 
 static void bytecodeInitIterator(BytecodesIterator *iterator, uint8_t *bytecodes, size_t size);
 static ptrdiff_t bytecodeNumber(BytecodesIterator *iterator);
@@ -75,7 +90,9 @@ static ptrdiff_t bytecodeOffset(BytecodesIterator *iterator);
 static Bytecode bytecodeNext(BytecodesIterator *iterator);
 static Operand bytecodeNextOperand(BytecodesIterator *iterator);
 static uint8_t bytecodeNextByte(BytecodesIterator *iterator);
+static ptrdiff_t bytecodeNextJumpTarget(BytecodesIterator *iterator);
 static _Bool bytecodeHasNext(BytecodesIterator *iterator);
+static void bytecodeSkip(BytecodesIterator *iterator, Bytecode bytecode);
 
 
 static void bytecodeCopy(AssemblerBuffer *buffer, Operand *source, Operand *dest)
@@ -83,7 +100,7 @@ static void bytecodeCopy(AssemblerBuffer *buffer, Operand *source, Operand *dest
 	asmEnsureCapacity(buffer);
 	asmEmitUint8(buffer, BYTECODE_COPY);
 	bytecodeOperand(buffer, source);
-	ASSERT(dest->type == OPERAND_TEMP_VAR || dest->type == OPERAND_CONTEXT_VAR || dest->type == OPERAND_INST_VAR || dest->type == OPERAND_ASSOC);
+	ASSERT(dest->type == OPERAND_TEMP_VAR || dest->type == OPERAND_BOUND_VAR || dest->type == OPERAND_CONTEXT_VAR || dest->type == OPERAND_INST_VAR || dest->type == OPERAND_INST_VAR_OF || dest->type == OPERAND_ASSOC);
 	bytecodeOperand(buffer, dest);
 	buffer->instOffset++;
 }
@@ -147,6 +164,51 @@ static void bytecodeJumpNotMemberOf(AssemblerBuffer *buffer, Operand *operand, u
 }
 
 
+static void bytecodeJumpIf(AssemblerBuffer *buffer, Operand *operand, _Bool value, AssemblerLabel *label)
+{
+	asmEnsureCapacity(buffer);
+	asmEmitUint8(buffer, value ? BYTECODE_JUMP_IF_TRUE : BYTECODE_JUMP_IF_FALSE);
+	bytecodeOperand(buffer, operand);
+	asmEmitLabel32(buffer, label);
+	buffer->instOffset++;
+}
+
+
+static void bytecodeFallbackSend(AssemblerBuffer *buffer, uint8_t selector, Operand *receiver, Operand *blocks, uint8_t numArgs, Operand *self, Operand *vars, uint8_t numVars, uint8_t flags, Operand *result)
+{
+	asmEnsureCapacity(buffer);
+	asmEmitUint8(buffer, BYTECODE_FALLBACK_SEND);
+	asmEmitUint8(buffer, selector);
+	asmEmitUint8(buffer, numArgs);
+	asmEmitUint8(buffer, numVars);
+	asmEmitUint8(buffer, flags);
+	bytecodeOperand(buffer, receiver);
+	for (ptrdiff_t i = numArgs - 1; i >= 0; i--) {
+		bytecodeOperand(buffer, blocks + i);
+	}
+	bytecodeOperand(buffer, self);
+	for (uint8_t i = 0; i < numVars; i++) {
+		asmEnsureCapacity(buffer);
+		bytecodeOperand(buffer, vars + i);
+	}
+	bytecodeOperand(buffer, result);
+	buffer->instOffset++;
+}
+
+
+static void bytecodeDeoptimizationState(AssemblerBuffer *buffer, Operand *operands, uint8_t numOperands)
+{
+	asmEnsureCapacity(buffer);
+	asmEmitUint8(buffer, BYTECODE_DEOPTIMIZATION_STATE);
+	asmEmitUint8(buffer, numOperands);
+	for (uint8_t i = 0; i < numOperands; i++) {
+		asmEnsureCapacity(buffer);
+		bytecodeOperand(buffer, operands + i);
+	}
+	buffer->instOffset++;
+}
+
+
 static void bytecodeOperand(AssemblerBuffer *buffer, Operand *operand)
 {
 	switch (operand->type) {
@@ -162,18 +224,21 @@ static void bytecodeOperand(AssemblerBuffer *buffer, Operand *operand)
 	case OPERAND_LITERAL:
 	case OPERAND_ASSOC:
 	case OPERAND_BLOCK:
+	case OPERAND_BOUND_VAR:
 		asmEmitUint8(buffer, operand->type);
 		asmEmitUint8(buffer, operand->index);
 		break;
 
-	case OPERAND_INST_VAR_OF:
+	case OPERAND_INST_VAR_OF: {
+		Operand instance = bytecodeInstanceOperand(operand);
 		asmEmitUint8(buffer, operand->type);
 		asmEmitUint8(buffer, operand->index);
-		ASSERT(operand->instance.type != OPERAND_VALUE)
-		ASSERT(operand->instance.type != OPERAND_INST_VAR);
-		ASSERT(operand->instance.type != OPERAND_INST_VAR_OF);
-		bytecodeOperand(buffer, (Operand *) &operand->instance);
+		ASSERT(instance.type != OPERAND_VALUE)
+		ASSERT(instance.type != OPERAND_INST_VAR);
+		ASSERT(instance.type != OPERAND_INST_VAR_OF);
+		bytecodeOperand(buffer, &instance);
 		break;
+	}
 
 	case OPERAND_CONTEXT_VAR:
 		asmEmitUint8(buffer, operand->type);
@@ -187,6 +252,19 @@ static void bytecodeOperand(AssemblerBuffer *buffer, Operand *operand)
 }
 
 
+static Operand bytecodeInstanceOperand(Operand *operand)
+{
+	ASSERT(operand->type == OPERAND_INST_VAR_OF);
+	Operand instance = {
+		.isValid = 1,
+		.type = operand->instance.type,
+		.index = operand->instance.index,
+		.level = operand->instance.level,
+	};
+	return instance;
+}
+
+
 static void bytecodeInitIterator(BytecodesIterator *iterator, uint8_t *bytecodes, size_t size)
 {
 	iterator->p = bytecodes;
@@ -229,6 +307,7 @@ static Operand bytecodeNextOperand(BytecodesIterator *iterator)
 	case OPERAND_LITERAL:
 	case OPERAND_ASSOC:
 	case OPERAND_BLOCK:
+	case OPERAND_BOUND_VAR:
 		operand.index = bytecodeNextByte(iterator);
 		break;
 	case OPERAND_INST_VAR_OF:
@@ -266,12 +345,74 @@ static int32_t bytecodeNextInt32(BytecodesIterator *iterator)
 }
 
 
+// jump targets are encoded relative to the next bytecode
+static ptrdiff_t bytecodeNextJumpTarget(BytecodesIterator *iterator)
+{
+	int32_t target = bytecodeNextInt32(iterator);
+	return bytecodeOffset(iterator) + target;
+}
+
+
 static _Bool bytecodeHasNext(BytecodesIterator *iterator)
 {
 	return iterator->p < iterator->end;
 }
 
 
+// skips rest of bytecode which was just read
+static void bytecodeSkip(BytecodesIterator *iterator, Bytecode bytecode)
+{
+	size_t operandsSize;
+	switch (bytecode) {
+	case BYTECODE_COPY:
+		operandsSize = 2;
+		break;
+
+	case BYTECODE_SEND:
+	case BYTECODE_SEND_WITH_STORE:
+		bytecodeNextByte(iterator); // skip selector
+		operandsSize = bytecodeNextByte(iterator) + 1 + (bytecode == BYTECODE_SEND_WITH_STORE);
+		break;
+
+	case BYTECODE_FALLBACK_SEND:
+		bytecodeNextByte(iterator); // skip selector
+		operandsSize = bytecodeNextByte(iterator);
+		operandsSize += bytecodeNextByte(iterator) + 3;
+		bytecodeNextByte(iterator); // skip flags
+		break;
+
+	case BYTECODE_RETURN:
+	case BYTECODE_OUTER_RETURN:
+		operandsSize = 1;
+		break;
+
+	case BYTECODE_JUMP:
+		bytecodeNextInt32(iterator);
+		return;
+
+	case BYTECODE_JUMP_NOT_MEMBER_OF:
+		bytecodeNextByte(iterator); // skip class
+		// fall through
+
+	case BYTECODE_JUMP_IF_TRUE:
+	case BYTECODE_JUMP_IF_FALSE:
+		bytecodeNextOperand(iterator);
+		bytecodeNextInt32(iterator);
+		return;
+
+	case BYTECODE_DEOPTIMIZATION_STATE:
+		operandsSize = bytecodeNextByte(iterator);
+		break;
+
+	default:
+		FAIL();
+	}
+	for (size_t i = 0; i < operandsSize; i++) {
+		bytecodeNextOperand(iterator);
+	}
+}
+
+
 static void printOperand(Operand operand, RawArray *literals)
 {
 	switch (operand.type) {
@@ -296,6 +437,9 @@ static void printOperand(Operand operand, RawArray *literals)
 	case OPERAND_ARG_VAR:
 		printf(" arg#%i", operand.index);
 		break;
+	case OPERAND_BOUND_VAR:
+		printf(" bound#%i", operand.index);
+		break;
 	case OPERAND_SUPER:
 		printf(" super");
 		break;
@@ -306,8 +450,8 @@ static void printOperand(Operand operand, RawArray *literals)
 		printf(" instVar#%i", operand.index);
 		break;
 	case OPERAND_INST_VAR_OF:
-		printf(" instVar#%i of", operand.index);
-		printOperand(*(Operand *) &operand.instance, literals);
+		printf(" slot#%i of", operand.index);
+		printOperand(bytecodeInstanceOperand(&operand), literals);
 		break;
 	case OPERAND_LITERAL:
 	case OPERAND_ASSOC:
@@ -363,17 +507,66 @@ static void printBytecodes(uint8_t *bytecodes, size_t size, RawArray *literals)
 			printOperand(bytecodeNextOperand(&iterator), literals);
 			break;
 		case BYTECODE_JUMP:
-			printf("JUMP 0x%X", bytecodeNextInt32(&iterator));
+			printf("JUMP 0x%tX", bytecodeNextJumpTarget(&iterator));
 			break;
 		case BYTECODE_JUMP_NOT_MEMBER_OF: {
 			RawClass *class = (RawClass *) asObject(literals->vars[bytecodeNextByte(&iterator)]);
 			Operand operand = bytecodeNextOperand(&iterator);
-			printf("JUMP 0x%X IF", bytecodeNextInt32(&iterator));
+			printf("JUMP 0x%tX IF", bytecodeNextJumpTarget(&iterator));
 			printOperand(operand, literals);
 			printf(" IS NOT MEMBER OF ");
 			printClassName(class);
 			break;
 		}
+		case BYTECODE_JUMP_IF_TRUE:
+		case BYTECODE_JUMP_IF_FALSE: {
+			Operand operand = bytecodeNextOperand(&iterator);
+			printf("JUMP 0x%tX IF", bytecodeNextJumpTarget(&iterator));
+			printOperand(operand, literals);
+			printf(bytecode == BYTECODE_JUMP_IF_TRUE ? " IS TRUE" : " IS FALSE");
+			break;
+		}
+		case BYTECODE_FALLBACK_SEND: {
+			printf("FALLBACK SEND #");
+			printRawString((RawString *) asObject(literals->vars[bytecodeNextByte(&iterator)]));
+			uint8_t argsSize = bytecodeNextByte(&iterator);
+			uint8_t varsSize = bytecodeNextByte(&iterator);
+			uint8_t flags = bytecodeNextByte(&iterator);
+			printf(" TO");
+			printOperand(bytecodeNextOperand(&iterator), literals);
+			printf(" BLOCKS");
+			for (uint8_t i = 0; i < argsSize; i++) {
+				printOperand(bytecodeNextOperand(&iterator), literals);
+				printf(",");
+			}
+			printf(" OF");
+			printOperand(bytecodeNextOperand(&iterator), literals);
+			if (varsSize > 0) {
+				printf(" VARIABLES");
+			}
+			for (uint8_t i = 0; i < varsSize; i++) {
+				printOperand(bytecodeNextOperand(&iterator), literals);
+				printf(",");
+			}
+			if (flags & FALLBACK_RETURNS) {
+				printf(" RETURNS");
+			}
+			if (flags & FALLBACK_OUTER) {
+				printf(" OUTER");
+			}
+			printf(" STORE IN");
+			printOperand(bytecodeNextOperand(&iterator), literals);
+			break;
+		}
+		case BYTECODE_DEOPTIMIZATION_STATE: {
+			printf("DEOPTIMIZATION STATE");
+			uint8_t operandsSize = bytecodeNextByte(&iterator);
+			for (uint8_t i = 0; i < operandsSize; i++) {
+				printOperand(bytecodeNextOperand(&iterator), literals);
+				printf(",");
+			}
+			break;
+		}
 		default:
 			FAIL();
 		}
@@ -7,6 +7,8 @@
 #include "Dictionary.h"
 #include "Iterator.h"
 #include "Compiler.h"
+#include "Optimizer.h"
+#include "CodeGenerator.h"
 #include "Assert.h"
 #include <string.h>
 #include <stdarg.h>
@@ -275,8 +277,18 @@ static Class *installClass(Class *class)
 		globalAtPut(name, getTaggedPtr(class));
 		return class;
 	} else {
+		// cached and inlined methods of redefined class are stale
+		deoptimizeMethods();
+		resetInlineCaches();
+		flushLookupCache();
 		// TODO: temporarily do memcpy() instead of #become:
+		uint8_t tags = currentClass->raw->tags;
 		memcpy(currentClass->raw, class->raw, sizeof(*class->raw));
+		// tags such as the mark of the garbage collector belong to the object, not to its new contents
+		currentClass->raw->tags = tags;
+		if (isOldObject(currentClass->raw)) {
+			markCards(currentClass->raw, sizeof(*class->raw));
+		}
 		return (Class *) currentClass;
 	}
 }
@@ -295,17 +307,20 @@ CompiledMethod *lookupSelector(Class *startClass, String *selector)
 	openHandleScope(&scope);
 
 	Class *class = startClass;
-	CompiledMethod *method = (CompiledMethod *) symbolDictObjectAt(classGetMethodDictionary(class), selector);
 
-	while (isNil(method)) {
-		class = classGetSuperClass(class);
-		if (isNil(class)) {
-			return closeHandleScope(&scope, NULL);
+	while (!isNil(class)) {
+		Dictionary *methods = classGetMethodDictionary(class);
+		// stub classes created during bootstrap have no method dictionary yet
+		if (!isNil(methods)) {
+			CompiledMethod *method = (CompiledMethod *) symbolDictObjectAt(methods, selector);
+			if (!isNil(method)) {
+				return closeHandleScope(&scope, method);
+			}
 		}
-		method = (CompiledMethod *) symbolDictObjectAt(classGetMethodDictionary(class), selector);
+		class = classGetSuperClass(class);
 	}
 
-	return closeHandleScope(&scope, method);
+	return closeHandleScope(&scope, NULL);
 }
 
 
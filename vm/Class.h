@@ -66,7 +66,7 @@ static RawClass *getClassOf(Value value)
 
 static void classSetMetaClass(Class *class, MetaClass *metaClass)
 {
-	class->raw->class = (RawClass *) metaClass->raw;
+	rawObjectSetClass((RawObject *) class->raw, (RawClass *) metaClass->raw);
 }
 
 
@@ -1,7 +1,13 @@
 #ifndef CLI_H
 #define CLI_H
 
+#include "Heap.h"
+#include "HeapPage.h"
+#include "WorkerPool.h"
 #include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 
 typedef struct {
 	char *error;
@@ -10,9 +16,14 @@ typedef struct {
 	char *snapshotFileName;
 	char *fileName;
 	char *eval;
+	long optimizationThreshold;
+	HeapSettings heapSettings;
 	_Bool printHelp;
 } CliArgs;
 
+static char *parseHeapSetting(HeapSettings *settings, char *name, char *value);
+static _Bool parseSize(char *value, size_t *size);
+
 
 static void parseCliArgs(CliArgs *cliArgs, int argc, char **args)
 {
@@ -22,11 +33,32 @@ static void parseCliArgs(CliArgs *cliArgs, int argc, char **args)
 	cliArgs->snapshotFileName = "snapshot";
 	cliArgs->fileName = NULL;
 	cliArgs->eval = NULL;
+	cliArgs->optimizationThreshold = -1;
+	cliArgs->heapSettings = DefaultHeapSettings;
 	cliArgs->printHelp = 0;
 
+	char *envNames[][2] = {
+		{ "ST_NEW_SPACE_SIZE", "newSpace" },
+		{ "ST_PAGE_SIZE", "pageSize" },
+		{ "ST_OLD_SPACE_SIZE", "oldSpace" },
+		{ "ST_GROWTH_RATIO", "growthRatio" },
+		{ "ST_GC_THREADS", "gcThreads" },
+		{ "ST_TENURING_AGE", "tenuringAge" },
+		{ "ST_CODE_CACHE_SIZE", "codeCacheSize" },
+	};
+	for (size_t i = 0; i < sizeof(envNames) / sizeof(*envNames); i++) {
+		char *env = getenv(envNames[i][0]);
+		char *error = env != NULL ? parseHeapSetting(&cliArgs->heapSettings, envNames[i][1], env) : NULL;
+		if (error != NULL) {
+			cliArgs->error = error;
+			cliArgs->operand = 'X';
+		}
+	}
+
 	int arg;
+	char *end;
 	opterr = 0;
-	while ((arg = getopt(argc, args, "hb:s:f:e:")) != -1) {
+	while ((arg = getopt(argc, args, "hb:s:f:e:O:X:")) != -1) {
 		switch (arg) {
 		case 'e':
 			cliArgs->eval = optarg;
@@ -40,6 +72,25 @@ static void parseCliArgs(CliArgs *cliArgs, int argc, char **args)
 		case 'b':
 			cliArgs->bootstrapDir = optarg;
 			break;
+		case 'O':
+			cliArgs->optimizationThreshold = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || cliArgs->optimizationThreshold < 0 || cliArgs->optimizationThreshold > INT32_MAX) {
+				cliArgs->error = "Option -%c requires a non-negative number";
+				cliArgs->operand = arg;
+			}
+			break;
+		case 'X': {
+			char *value = strchr(optarg, '=');
+			if (value == NULL) {
+				cliArgs->error = "Option -%c requires <name>=<value> operand";
+			} else {
+				*value = '\0';
+				char *error = parseHeapSetting(&cliArgs->heapSettings, optarg, value + 1);
+				cliArgs->error = error != NULL ? error : cliArgs->error;
+			}
+			cliArgs->operand = cliArgs->error != NULL ? arg : cliArgs->operand;
+			break;
+		}
 		case 'h':
 			cliArgs->printHelp = 1;
 			break;
@@ -50,6 +101,8 @@ static void parseCliArgs(CliArgs *cliArgs, int argc, char **args)
 			case 'f':
 			case 's':
 			case 'b':
+			case 'O':
+			case 'X':
 				cliArgs->error = "Option -%c requires an operand";
 				break;
 			default:
@@ -68,14 +121,97 @@ static void parseCliArgs(CliArgs *cliArgs, int argc, char **args)
 }
 
 
+static char *parseHeapSetting(HeapSettings *settings, char *name, char *value)
+{
+	// settings are left untouched on error, heap is initialized before errors are reported
+	if (strcmp(name, "newSpace") == 0) {
+		size_t size;
+		if (!parseSize(value, &size) || size < HEAP_PAGE_MIN_SIZE) {
+			return "Option -%c newSpace requires size of at least 256K";
+		}
+		settings->newSpaceSize = size;
+	} else if (strcmp(name, "pageSize") == 0) {
+		size_t size;
+		if (!parseSize(value, &size) || size < HEAP_PAGE_MIN_SIZE || size > INT32_MAX || (size & (size - 1)) != 0) {
+			return "Option -%c pageSize requires power of two size between 256K and 1G";
+		}
+		settings->pageSize = size;
+	} else if (strcmp(name, "oldSpace") == 0) {
+		size_t size;
+		if (!parseSize(value, &size)) {
+			return "Option -%c oldSpace requires size";
+		}
+		settings->oldSpaceSize = size;
+	} else if (strcmp(name, "growthRatio") == 0) {
+		char *end;
+		double ratio = strtod(value, &end);
+		if (*value == '\0' || *end != '\0' || !(ratio >= 1.0 && ratio <= 1000.0)) {
+			return "Option -%c growthRatio requires number between 1 and 1000";
+		}
+		settings->growthRatio = ratio;
+	} else if (strcmp(name, "gcThreads") == 0) {
+		char *end;
+		long count = strtol(value, &end, 10);
+		if (*value == '\0' || *end != '\0' || count < 1 || count > WORKER_POOL_MAX_SIZE) {
+			return "Option -%c gcThreads requires number between 1 and 64";
+		}
+		settings->gcThreads = count;
+	} else if (strcmp(name, "tenuringAge") == 0) {
+		char *end;
+		long age = strtol(value, &end, 10);
+		if (*value == '\0' || *end != '\0' || age < 1 || age > MAX_TENURING_AGE) {
+			return "Option -%c tenuringAge requires number between 1 and 15";
+		}
+		settings->tenuringAge = age;
+	} else if (strcmp(name, "codeCacheSize") == 0) {
+		size_t size;
+		if (!parseSize(value, &size)) {
+			return "Option -%c codeCacheSize requires size";
+		}
+		settings->codeCacheSize = size;
+	} else {
+		return "Option -%c requires one of newSpace, pageSize, oldSpace, growthRatio, gcThreads, tenuringAge or codeCacheSize";
+	}
+	return NULL;
+}
+
+
+// sizes are in bytes with optional K, M or G suffix
+static _Bool parseSize(char *value, size_t *size)
+{
+	char *end;
+	long long result = strtoll(value, &end, 10);
+	int shift = 0;
+	switch (*end) {
+	case 'K': case 'k': shift = 10; end++; break;
+	case 'M': case 'm': shift = 20; end++; break;
+	case 'G': case 'g': shift = 30; end++; break;
+	}
+	if (*value == '\0' || *end != '\0' || result < 0 || result > (INT64_MAX >> shift)) {
+		return 0;
+	}
+	*size = (size_t) result << shift;
+	return 1;
+}
+
+
 static void printCliHelp(void)
 {
 	printf(
-		"Usage:\t<executable> [-e <code>] [-f <file>] [-s <snapshot file>] [-b <kernel dir>]\n"
+		"Usage:\t<executable> [-e <code>] [-f <file>] [-s <snapshot file>] [-b <kernel dir>] [-O <threshold>] [-X <name>=<value>]\n"
 		"\t-e evaluate code\n"
 		"\t-f compile classes and evaluate code within specified file\n"
 		"\t-s path to snapshot file\n"
 		"\t-b bootstrap from kernel directory\n"
+		"\t-O optimize methods invoked <threshold> times, 0 disables optimizer\n"
+		"\t-X heap setting, also read from environment variables:\n"
+		"\t   newSpace=<size>     size of new space (ST_NEW_SPACE_SIZE, default 32M)\n"
+		"\t   pageSize=<size>     size of old space pages, power of two (ST_PAGE_SIZE, default 256K)\n"
+		"\t   oldSpace=<size>     initially reserved old space (ST_OLD_SPACE_SIZE, default 256K)\n"
+		"\t   growthRatio=<ratio> old space grows by ratio before it is collected (ST_GROWTH_RATIO, default 1)\n"
+		"\t   gcThreads=<count>   threads marking and sweeping old space (ST_GC_THREADS, default processors count)\n"
+		"\t   tenuringAge=<count> most scavenges survived before promotion (ST_TENURING_AGE, default 4)\n"
+		"\t   codeCacheSize=<size> native code kept before least used is evicted, 0 for unbounded (ST_CODE_CACHE_SIZE, default 0)\n"
 		"\t-h prints this help\n"
 	);
 }
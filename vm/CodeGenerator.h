@@ -9,28 +9,58 @@
 #include "String.h"
 #include "RegisterAllocator.h"
 
+#define POLYMORPHIC_CACHE_SIZE SEND_FEEDBACK_CLASSES
+#define NATIVE_CODE_REDIRECT_SIZE 13
+
 typedef struct {
 	CompiledCode code;
 	AssemblerBuffer buffer;
 	size_t frameSize;
 	size_t frameRawAreaSize;
+	// callee-saved registers stored in current frame, see generatePrologue
+	uint8_t savedRegs;
 	RegsAlloc regsAlloc;
 	uint8_t tmpVar;
 	ptrdiff_t bytecodeNumber;
-	OrderedCollection *stackmaps;
-	OrderedCollection *descriptors;
+	// stackmaps sets are resized to the largest one as they are added, so that they are copied to code as they are
+	uint16_t *stackmapsIcs;
+	uint8_t *stackmapsSets;
+	StackmapRegs *stackmapsRegs;
+	size_t stackmapsSize;
+	size_t stackmapsCapacity;
+	size_t stackmapSetSize;
+	// stubs do not have descriptors
+	NativeDescriptor *descriptors;
+	size_t descriptorsSize;
+	size_t descriptorsCapacity;
+	SendFeedback sendFeedback[512];
+	size_t sendFeedbackSize;
+	// sends of optimized code are followed by a nop, which deoptimizeNativeCode patches to call a trampoline
+	_Bool hasDeoptimizationState;
+	size_t deoptimizationSitesSize;
 } CodeGenerator;
 
 NativeCode *generateMethodCode(CompiledMethod *method);
 void generateLoadObject(AssemblerBuffer *buffer, RawObject *object, Register dst, _Bool tag);
 void generateLoadClass(AssemblerBuffer *buffer, Register src, Register dst);
-void generateStoreCheck(CodeGenerator *generator, Register object, Register value);
+void generateStoreCheck(CodeGenerator *generator, Register object, MemoryOperand field, Register value);
 void generateMethodLookup(CodeGenerator *generator);
+void updateInlineCache(NativeCode *code, uint8_t *cache, SendFeedback *feedback, Class *class, NativeCodeEntry entry);
+void resetInlineCaches(void);
+void iterateNativeCodeTargets(NativeCode *code, void (*callback)(NativeCode *target, void *arg), void *arg);
+void unlinkEvictedCode(void);
+size_t sendFeedbackGetClasses(NativeCode *code, SendFeedback *feedback, RawClass **classes);
+void redirectNativeCode(NativeCode *code, NativeCode *target);
+void deoptimizeNativeCode(NativeCode *code);
+void freeCodeGenerator(CodeGenerator *generator);
 void generateStackmap(CodeGenerator *generator);
+void generateDescriptor(CodeGenerator *generator);
 void generateCCall(CodeGenerator *generator, intptr_t cFunction, size_t argsSize, _Bool storeIp);
 void generateMethodContextAllocation(CodeGenerator *generator, size_t size);
 void generateBlockContextAllocation(CodeGenerator *generator);
 void generatePushDummyContext(AssemblerBuffer *buffer);
+void generateSavedRegsStore(AssemblerBuffer *buffer, uint8_t savedRegs);
+void generateSavedRegsLoad(AssemblerBuffer *buffer, Register frame, uint8_t savedRegs);
 NativeCode *generateDoesNotUnderstand(String *selector);
 NativeCode *buildNativeCode(CodeGenerator *generator);
 NativeCode *buildNativeCodeFromAssembler(AssemblerBuffer *buffer);
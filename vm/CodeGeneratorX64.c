@@ -12,39 +12,74 @@
 #include "Compiler.h"
 #include "CodeDescriptors.h"
 #include "Thread.h"
+#include "Optimizer.h"
 #include "Assert.h"
 #include <string.h>
 
+#define INLINE_CACHE_CODE_OFFSET 13
+#define INLINE_CACHE_MISS_OFFSET 46
+#define INLINE_CACHE_SIZE 57
+#define POLYMORPHIC_CACHE_CLASS_OFFSET 2
+#define POLYMORPHIC_CACHE_CODE_OFFSET 38
+#define POLYMORPHIC_CACHE_ENTRY_SIZE 47
+
 typedef struct {
-	ptrdiff_t offset;
+	ptrdiff_t offset; // of target bytecode
 	AssemblerLabel label;
 } BytecodeLabel;
 
 static NativeCode *generateBlockCode(CompiledBlock *block, CodeGenerator *parentGenerator);
 static void generateCode(CodeGenerator *generator);
 static void initCodeGenerator(CodeGenerator *generator);
-static void freeCodeGenerator(CodeGenerator *generator);
 static void generatePrologue(CodeGenerator *generator, size_t frameSize);
 static void generateEpilogue(CodeGenerator *generator);
+static void generateDeoptimizationSite(CodeGenerator *generator);
+static void generateDeoptimizationTrampoline(CodeGenerator *generator);
 static void generateContextDefinition(CodeGenerator *generator);
 static void generateContextRestore(CodeGenerator *generator);
+static void generateOptimizationCheck(CodeGenerator *generator);
 static void generateBody(CodeGenerator *generator);
+static size_t scanJumpTargets(CodeGenerator *generator, BytecodeLabel *labels);
+static _Bool bindBytecodeLabels(CodeGenerator *generator, BytecodeLabel *labels, size_t size, ptrdiff_t offset);
+static void mergeVars(CodeGenerator *generator);
+static void generateTempsInitialization(CodeGenerator *generator);
 static void generateCopy(CodeGenerator *generator, BytecodesIterator *iterator);
 static void generateSend(CodeGenerator *generator, BytecodesIterator *iterator);
+static _Bool generateSmallIntegerOperation(CodeGenerator *generator, RawObject *selector, Operand receiver, Operand arg, AssemblerLabel *notSmallInteger, AssemblerLabel *overflow);
+static _Bool isSmallIntegerOperand(Operand operand);
+static void generateInlineCache(CodeGenerator *generator, RawObject *selector);
+static NativeCode *generatePolymorphicCache(ptrdiff_t countsOffset);
+static void setPolymorphicCacheEntry(uint8_t *cache, size_t index, RawClass *class, NativeCodeEntry entry);
+static void rememberCachedClass(NativeCode *code, RawClass *class);
+static _Bool isInlineCacheEvicted(uint8_t *cache);
+static void resetInlineCache(uint8_t *cache, SendFeedback *feedback);
+static NativeCode *nativeCodeOfEntry(uint8_t *entry);
+static NativeCode *findRedirectTarget(NativeCode *code);
+static RawClass *getPolymorphicCacheClass(uint8_t *cache, size_t index);
+static _Bool isStubEntry(StubCode *stub, uint8_t *entry);
 static void generateOuterReturn(CodeGenerator *generator, BytecodesIterator *iterator);
+static void generateFallbackSend(CodeGenerator *generator, BytecodesIterator *iterator);
+static void generateBoxAllocation(CodeGenerator *generator, uint8_t index);
+static void generateLazyContextAllocation(CodeGenerator *generator);
 static void pushOperand(CodeGenerator *generator, Operand operand);
 static void movOperand(CodeGenerator *generator, Operand operand, Register reg);
 static void movToOperand(CodeGenerator *generator, Register reg, Operand operand);
 static void generateClassCheck(CodeGenerator *generator, Operand operand, RawClass *class, AssemblerLabel *label);
+static void generateValueClassCheck(CodeGenerator *generator, Register value, RawClass *class, AssemblerLabel *label);
+static void generateBooleanJump(CodeGenerator *generator, Operand operand, _Bool value, AssemblerLabel *label);
 static void generateLoadBlock(CodeGenerator *generator, Operand operand);
 static void fillContext(CodeGenerator *generator, uint8_t level);
 static void fillAssoc(CodeGenerator *generator, uint8_t index);
 static void fillVar(CodeGenerator *generator, Variable *var);
+static Register fillVarOrLoad(CodeGenerator *generator, Variable *var, Register scratch);
+static Register fillInstance(CodeGenerator *generator, Operand operand, Register scratch);
 static void spillVar(CodeGenerator *generator, Variable *var);
 static void movVar(CodeGenerator *generator, Variable *var, Register reg);
 static void movToVar(CodeGenerator *generator, Register reg, Variable *var);
 static Variable *variableAt(CodeGenerator *generator, ptrdiff_t index);
 static Variable *specialVariableAt(CodeGenerator *generator, uint8_t type, ptrdiff_t index);
+static uint8_t *addStackmap(CodeGenerator *generator, size_t ic, size_t setSize);
+static void initNativeCode(NativeCode *code, AssemblerBuffer *buffer);
 
 
 NativeCode *generateMethodCode(CompiledMethod *method)
@@ -52,6 +87,8 @@ NativeCode *generateMethodCode(CompiledMethod *method)
 	HandleScope scope;
 	openHandleScope(&scope);
 
+	// generator keeps raw pointers to literals and bytecodes, which must not be moved
+	disableScavenges(&CurrentThread.heap);
 	CodeGenerator generator;
 	initMethodCompiledCode(&generator.code, method);
 	initCodeGenerator(&generator);
@@ -60,6 +97,7 @@ NativeCode *generateMethodCode(CompiledMethod *method)
 	NativeCode *code = buildNativeCode(&generator);
 	closeHandleScope(&scope, NULL);
 	freeCodeGenerator(&generator);
+	enableScavenges(&CurrentThread.heap);
 	return code;
 }
 
@@ -87,12 +125,19 @@ static void generateCode(CodeGenerator *generator)
 		generator->regsAlloc.vars[0].flags |= VAR_DEFINED | VAR_ON_STACK;
 		generator->regsAlloc.vars[0].frameOffset = -2;
 		generator->regsAlloc.frameSize = generator->frameSize = 2;
+		generator->regsAlloc.savedRegs = 0;
 		generatePrimitive(generator, generator->code.header.primitive);
 	}
 	computeRegsAlloc(&generator->regsAlloc, &X64AvailableRegs, &generator->code);
 	if (!generator->regsAlloc.frameLess) {
 		generatePrologue(generator, generator->regsAlloc.frameSize);
 		generateContextDefinition(generator);
+		if (generator->regsAlloc.hasJumps) {
+			generateTempsInitialization(generator);
+		}
+		if (OptimizationThreshold > 0 && !generator->code.isBlock && generator->code.header.primitive == 0) {
+			generateOptimizationCheck(generator);
+		}
 	} else if (generator->code.isBlock) {
 		variableAt(generator, CONTEXT_INDEX)->flags |= VAR_IN_REG;
 	}
@@ -103,6 +148,7 @@ static void generateCode(CodeGenerator *generator)
 	} else {
 		asmRet(&generator->buffer);
 	}
+	generateDeoptimizationTrampoline(generator);
 }
 
 
@@ -110,36 +156,102 @@ static void initCodeGenerator(CodeGenerator *generator)
 {
 	asmInitBuffer(&generator->buffer, 256);
 	generator->frameRawAreaSize = 0;
+	generator->savedRegs = 0;
 	generator->tmpVar = 0;
 	generator->bytecodeNumber = 0;
-	generator->stackmaps = newOrdColl(32);
-	generator->descriptors = newOrdColl(32);
+	generator->stackmapsIcs = NULL;
+	generator->stackmapsSets = NULL;
+	generator->stackmapsRegs = NULL;
+	generator->stackmapsSize = 0;
+	generator->stackmapsCapacity = 0;
+	generator->stackmapSetSize = 0;
+	generator->descriptorsCapacity = 32;
+	generator->descriptors = malloc(generator->descriptorsCapacity * sizeof(*generator->descriptors));
+	ASSERT(generator->descriptors != NULL);
+	generator->descriptorsSize = 0;
+	generator->sendFeedbackSize = 0;
+	generator->hasDeoptimizationState = 0;
+	generator->deoptimizationSitesSize = 0;
 }
 
 
-static void freeCodeGenerator(CodeGenerator *generator)
+void freeCodeGenerator(CodeGenerator *generator)
 {
 	asmFreeBuffer(&generator->buffer);
+	free(generator->stackmapsIcs);
+	free(generator->stackmapsSets);
+	free(generator->stackmapsRegs);
+	free(generator->descriptors);
 }
 
 
+// callee-saved registers used by code are stored after context, so that its caller keeps its variables in them
 static void generatePrologue(CodeGenerator *generator, size_t frameSize)
 {
 	generator->frameSize = frameSize;
+	generator->savedRegs = generator->regsAlloc.savedRegs;
 	asmPushq(&generator->buffer, RBP);
 	asmMovq(&generator->buffer, RSP, RBP);
 	asmSubqImm(&generator->buffer, RSP, generator->frameSize * sizeof(intptr_t));
+	generateSavedRegsStore(&generator->buffer, generator->savedRegs);
 }
 
 
 static void generateEpilogue(CodeGenerator *generator)
 {
+	generateSavedRegsLoad(&generator->buffer, RBP, generator->savedRegs);
 	asmAddqImm(&generator->buffer, RSP, generator->frameSize * sizeof(intptr_t));
 	asmPopq(&generator->buffer, RBP);
 	asmRet(&generator->buffer);
 }
 
 
+void generateSavedRegsStore(AssemblerBuffer *buffer, uint8_t savedRegs)
+{
+	for (size_t i = 0; i < SAVED_REGS_SIZE; i++) {
+		if (savedRegs & (1 << i)) {
+			ptrdiff_t slot = stackFrameGetSavedRegSlot(savedRegs, i);
+			asmMovqToMem(buffer, SavedRegisters[i], asmMem(RBP, NO_REGISTER, SS_1, -(slot + 1) * sizeof(intptr_t)));
+		}
+	}
+}
+
+
+// frame pointer is given, as returns from blocks restore registers stored by their home method
+void generateSavedRegsLoad(AssemblerBuffer *buffer, Register frame, uint8_t savedRegs)
+{
+	for (size_t i = 0; i < SAVED_REGS_SIZE; i++) {
+		if (savedRegs & (1 << i)) {
+			ptrdiff_t slot = stackFrameGetSavedRegSlot(savedRegs, i);
+			asmMovqMem(buffer, asmMem(frame, NO_REGISTER, SS_1, -(slot + 1) * sizeof(intptr_t)), SavedRegisters[i]);
+		}
+	}
+}
+
+
+// deoptimized send returns into trampoline instead of the rest of optimized code, see deoptimizeFrame
+static void generateDeoptimizationSite(CodeGenerator *generator)
+{
+	if (generator->hasDeoptimizationState) {
+		asmNop5(&generator->buffer);
+		generator->deoptimizationSitesSize++;
+		generator->hasDeoptimizationState = 0;
+	}
+}
+
+
+// trampoline takes the last bytes of code, so that deoptimizeNativeCode finds it, stub is reached by any site
+static void generateDeoptimizationTrampoline(CodeGenerator *generator)
+{
+	if (generator->deoptimizationSitesSize > 0) {
+		ptrdiff_t start = asmOffset(&generator->buffer);
+		asmMovqImm(&generator->buffer, (int64_t) getStubNativeCode(&DeoptimizeStub)->insts, R11);
+		asmJmpq(&generator->buffer, R11);
+		ASSERT(asmOffset(&generator->buffer) - start == NATIVE_CODE_REDIRECT_SIZE);
+	}
+}
+
+
 static void generateContextDefinition(CodeGenerator *generator)
 {
 	AssemblerBuffer *buffer = &generator->buffer;
@@ -149,7 +261,7 @@ static void generateContextDefinition(CodeGenerator *generator)
 	// spill native code entry
 	asmMovqToMem(buffer, R11, asmMem(RBP, NO_REGISTER, SS_1, -sizeof(intptr_t)));
 
-	if (generator->code.isBlock) {
+	if (generator->code.isBlock && generator->code.header.hasContext) {
 		// setup RBP
 		asmMovqToMem(buffer, RBP, asmMem(context->reg, NO_REGISTER, SS_1, varOffset(RawContext, frame)));
 		spillVar(generator, context);
@@ -176,7 +288,7 @@ static void generateContextDefinition(CodeGenerator *generator)
 
 static void generateContextRestore(CodeGenerator *generator)
 {
-	if (generator->code.isBlock || generator->code.header.hasContext) {
+	if (generator->code.header.hasContext) {
 		Variable *context = variableAt(generator, CONTEXT_INDEX);
 		fillVar(generator, context);
 		asmMovqMem(&generator->buffer, asmMem(context->reg, NO_REGISTER, SS_1, varOffset(RawContext, parent)), context->reg);
@@ -184,29 +296,61 @@ static void generateContextRestore(CodeGenerator *generator)
 }
 
 
+// RDI: native code entry
+static void generateOptimizationCheck(CodeGenerator *generator)
+{
+	AssemblerBuffer *buffer = &generator->buffer;
+	ptrdiff_t counterOffset = offsetof(NativeCode, counter) - offsetof(NativeCode, insts);
+	AssemblerLabel cold;
+	asmInitLabel(&cold);
+
+	// entry is overwritten by redirectNativeCode
+	ASSERT(asmOffset(buffer) >= NATIVE_CODE_REDIRECT_SIZE);
+
+	// load native code entry
+	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, -sizeof(intptr_t)), RDI);
+	// test invocation counter
+	asmMovqMem(buffer, asmMem(RDI, NO_REGISTER, SS_1, counterOffset), TMP);
+	asmCmpqImm(buffer, TMP, OptimizationThreshold);
+	asmJ(buffer, COND_NOT_EQUAL, &cold);
+
+	// method is hot -> recompile it with optimizer
+	generateStubCall(generator, &OptimizeStub);
+	invalidateRegs(&generator->regsAlloc);
+
+	asmLabelBind(buffer, &cold, asmOffset(buffer));
+}
+
+
 static void generateBody(CodeGenerator *generator)
 {
 	BytecodesIterator iterator;
-	_Bool returns = 0;
-	BytecodeLabel labels[16];
-	BytecodeLabel *currentLabel = labels;
+	_Bool fallsThrough = 1;
+	size_t bytecodesSize = generator->code.bytecodesSize;
+	// every bytecode is at least 2 bytes long, labels of returns follow labels of jumps
+	BytecodeLabel *labels = malloc((bytecodesSize / 2 + 1) * sizeof(*labels));
+	if (labels == NULL) {
+		FAIL();
+	}
+	size_t labelsSize = scanJumpTargets(generator, labels);
+	BytecodeLabel *jump = labels;
+	BytecodeLabel *returnLabel = labels + labelsSize;
+	_Bool jumpsToEnd = 0;
 
-	bytecodeInitIterator(&iterator, generator->code.bytecodes, generator->code.bytecodesSize);
+	for (size_t i = 0; i < labelsSize; i++) {
+		jumpsToEnd |= labels[i].offset == (ptrdiff_t) bytecodesSize;
+	}
+
+	bytecodeInitIterator(&iterator, generator->code.bytecodes, bytecodesSize);
 	while (bytecodeHasNext(&iterator)) {
 		HandleScope scope;
 		openHandleScope(&scope);
 
-		ptrdiff_t offset = bytecodeOffset(&iterator);
-		BytecodeLabel *label = labels;
-		while (label < currentLabel) {
-			if (label->offset == offset) {
-				asmLabelBind(&generator->buffer, &label->label, asmOffset(&generator->buffer));
-			}
-			label++;
-		}
+		bindBytecodeLabels(generator, labels, labelsSize, bytecodeOffset(&iterator));
 
 		Bytecode bytecode = bytecodeNext(&iterator);
 		generator->bytecodeNumber = bytecodeNumber(&iterator);
+		fallsThrough = 1;
 
 		switch (bytecode) {
 		case BYTECODE_COPY:
@@ -222,44 +366,199 @@ static void generateBody(CodeGenerator *generator)
 			break;
 
 		case BYTECODE_RETURN:
-			movOperand(generator, bytecodeNextOperand(&iterator), RAX);
-			returns = 1;
-			break;
-
 		case BYTECODE_OUTER_RETURN:
-			returns = 1;
-			generateOuterReturn(generator, &iterator);
+			if (bytecode == BYTECODE_RETURN) {
+				movOperand(generator, bytecodeNextOperand(&iterator), RAX);
+			} else {
+				generateOuterReturn(generator, &iterator);
+				invalidateRegs(&generator->regsAlloc);
+			}
+			// returns in the middle of code jump to epilogue
+			if (bytecodeHasNext(&iterator) || jumpsToEnd) {
+				asmInitLabel(&returnLabel->label);
+				asmJmpLabel(&generator->buffer, &returnLabel->label);
+				returnLabel++;
+			}
+			fallsThrough = 0;
 			break;
 
 		case BYTECODE_JUMP:
-			currentLabel->offset = bytecodeNextInt32(&iterator);
-			asmInitLabel(&currentLabel->label);
-			asmJmpLabel(&generator->buffer, &currentLabel->label);
-			currentLabel++;
+			bytecodeNextInt32(&iterator);
+			asmJmpLabel(&generator->buffer, &jump->label);
+			jump++;
+			fallsThrough = 0;
 			break;
 
 		case BYTECODE_JUMP_NOT_MEMBER_OF: {
 			RawObject *class = compiledCodeLiteralAt(&generator->code, bytecodeNextByte(&iterator));
 			Operand receiver = bytecodeNextOperand(&iterator);
+			bytecodeNextInt32(&iterator);
+			generateClassCheck(generator, receiver, (RawClass *) class, &jump->label);
+			jump++;
+			break;
+		}
 
-			asmInt3(&generator->buffer);
-			currentLabel->offset = bytecodeNextInt32(&iterator);
-			asmInitLabel(&currentLabel->label);
-			generateClassCheck(generator, receiver, (RawClass *) class, &currentLabel->label);
-			currentLabel++;
+		case BYTECODE_JUMP_IF_TRUE:
+		case BYTECODE_JUMP_IF_FALSE: {
+			Operand operand = bytecodeNextOperand(&iterator);
+			bytecodeNextInt32(&iterator);
+			generateBooleanJump(generator, operand, bytecode == BYTECODE_JUMP_IF_TRUE, &jump->label);
+			jump++;
 			break;
 		}
 
+		case BYTECODE_FALLBACK_SEND:
+			generateFallbackSend(generator, &iterator);
+			break;
+
+		case BYTECODE_DEOPTIMIZATION_STATE:
+			bytecodeSkip(&iterator, bytecode);
+			generator->hasDeoptimizationState = 1;
+			break;
+
 		default:
 			FAIL();
 		}
 		closeHandleScope(&scope, NULL);
 	}
 
-	if (!returns) {
+	if (bindBytecodeLabels(generator, labels, labelsSize, bytecodesSize)) {
+		fallsThrough = 1;
+	}
+	if (fallsThrough) {
 		ASSERT(!generator->code.isBlock);
 		movVar(generator, variableAt(generator, SELF_INDEX), RAX);
 	}
+	for (BytecodeLabel *label = labels + labelsSize; label < returnLabel; label++) {
+		asmLabelBind(&generator->buffer, &label->label, asmOffset(&generator->buffer));
+	}
+	free(labels);
+}
+
+
+// collects targets of all jumps in order of their occurrence
+static size_t scanJumpTargets(CodeGenerator *generator, BytecodeLabel *labels)
+{
+	BytecodesIterator iterator;
+	size_t size = 0;
+
+	bytecodeInitIterator(&iterator, generator->code.bytecodes, generator->code.bytecodesSize);
+	while (bytecodeHasNext(&iterator)) {
+		Bytecode bytecode = bytecodeNext(&iterator);
+		switch (bytecode) {
+		case BYTECODE_COPY:
+			bytecodeNextOperand(&iterator);
+			bytecodeNextOperand(&iterator);
+			break;
+
+		case BYTECODE_SEND:
+		case BYTECODE_SEND_WITH_STORE: {
+			bytecodeNextByte(&iterator); // skip selector
+			uint8_t argsSize = bytecodeNextByte(&iterator);
+			for (uint8_t i = 0; i < argsSize + 1 + (bytecode == BYTECODE_SEND_WITH_STORE); i++) {
+				bytecodeNextOperand(&iterator);
+			}
+			break;
+		}
+
+		case BYTECODE_FALLBACK_SEND: {
+			bytecodeNextByte(&iterator); // skip selector
+			uint8_t blocksSize = bytecodeNextByte(&iterator);
+			uint8_t varsSize = bytecodeNextByte(&iterator);
+			bytecodeNextByte(&iterator); // skip flags
+			for (uint16_t i = 0; i < blocksSize + varsSize + 3; i++) {
+				bytecodeNextOperand(&iterator);
+			}
+			break;
+		}
+
+		case BYTECODE_RETURN:
+		case BYTECODE_OUTER_RETURN:
+			bytecodeNextOperand(&iterator);
+			break;
+
+		case BYTECODE_JUMP_NOT_MEMBER_OF:
+			bytecodeNextByte(&iterator); // skip class
+			// fall through
+
+		case BYTECODE_JUMP_IF_TRUE:
+		case BYTECODE_JUMP_IF_FALSE:
+			bytecodeNextOperand(&iterator);
+			// fall through
+
+		case BYTECODE_JUMP:
+			labels[size].offset = bytecodeNextJumpTarget(&iterator);
+			asmInitLabel(&labels[size].label);
+			size++;
+			break;
+
+		case BYTECODE_DEOPTIMIZATION_STATE:
+			bytecodeSkip(&iterator, bytecode);
+			break;
+
+		default:
+			FAIL();
+		}
+	}
+	return size;
+}
+
+
+// binds labels of all jumps to given bytecode offset including backward jumps which are not emitted yet
+static _Bool bindBytecodeLabels(CodeGenerator *generator, BytecodeLabel *labels, size_t size, ptrdiff_t offset)
+{
+	_Bool isBound = 0;
+	for (size_t i = 0; i < size; i++) {
+		if (labels[i].offset == offset) {
+			asmLabelBind(&generator->buffer, &labels[i].label, asmOffset(&generator->buffer));
+			isBound = 1;
+		}
+	}
+	if (isBound) {
+		mergeVars(generator);
+	}
+	return isBound;
+}
+
+
+// at merge points the frame is the only valid state, special variables are computed again
+static void mergeVars(CodeGenerator *generator)
+{
+	RegsAlloc *alloc = &generator->regsAlloc;
+	size_t specialVarsOffset = generator->code.header.argsSize + generator->code.header.tempsSize + 2;
+
+	invalidateRegs(alloc);
+	for (size_t i = specialVarsOffset; i < alloc->varsSize; i++) {
+		alloc->vars[i].flags &= ~VAR_ON_STACK;
+	}
+}
+
+
+// temporaries defined only in some branches must be nil when other branches are taken, those in callee-saved
+// registers hold them from prologue
+static void generateTempsInitialization(CodeGenerator *generator)
+{
+	size_t argsSize = generator->code.header.argsSize;
+	size_t end = argsSize + generator->code.header.tempsSize + 2;
+	_Bool isLoaded = 0;
+
+	for (size_t i = argsSize + 2; i < end; i++) {
+		Variable *var = variableAt(generator, i);
+		if ((var->flags & VAR_DEFINED) == 0) {
+			continue;
+		}
+		if (!isLoaded) {
+			generateLoadObject(&generator->buffer, Handles.nil->raw, TMP, 1);
+			isLoaded = 1;
+		}
+		if (var->flags & VAR_CALLEE_SAVED) {
+			asmMovq(&generator->buffer, TMP, var->reg);
+			var->flags |= VAR_IN_REG;
+			continue;
+		}
+		asmMovqToMem(&generator->buffer, TMP, asmMem(RBP, NO_REGISTER, SS_1, var->frameOffset * sizeof(intptr_t)));
+		var->flags |= VAR_ON_STACK;
+	}
 }
 
 
@@ -269,13 +568,7 @@ static void generateCopy(CodeGenerator *generator, BytecodesIterator *iterator)
 	Operand dst = bytecodeNextOperand(iterator);
 	if (src.type == OPERAND_TEMP_VAR || src.type == OPERAND_ARG_VAR) {
 		Variable *srcVar = variableAt(generator, src.index);
-		if (srcVar->flags & (VAR_IN_REG | VAR_ON_STACK)) {
-			fillVar(generator, srcVar);
-		} else {
-			generateLoadObject(&generator->buffer, Handles.nil->raw, srcVar->reg, 1);
-			srcVar->flags |= VAR_IN_REG;
-		}
-		movToOperand(generator, srcVar->reg, dst);
+		movToOperand(generator, fillVarOrLoad(generator, srcVar, RAX), dst);
 	} else if (dst.type == OPERAND_TEMP_VAR) {
 		Variable *dstVar = variableAt(generator, dst.index);
 		if (dstVar->reg == SPILLED_REG) {
@@ -307,6 +600,27 @@ static void generateSend(CodeGenerator *generator, BytecodesIterator *iterator)
 	RawObject *selector = compiledCodeLiteralAt(&generator->code, bytecodeNextByte(iterator));
 	uint8_t argsSize = bytecodeNextByte(iterator);
 	Operand receiver = bytecodeNextOperand(iterator);
+	AssemblerLabel notSmallInteger;
+	AssemblerLabel overflow;
+	AssemblerLabel done;
+	VariableFlags fastPathFlags[generator->regsAlloc.varsSize];
+	_Bool hasFastPath = 0;
+
+	asmInitLabel(&notSmallInteger);
+	asmInitLabel(&overflow);
+	asmInitLabel(&done);
+	if (argsSize == 1) {
+		BytecodesIterator argIterator = *iterator;
+		hasFastPath = generateSmallIntegerOperation(generator, selector, receiver, bytecodeNextOperand(&argIterator), &notSmallInteger, &overflow);
+	}
+	if (hasFastPath) {
+		asmJmpLabel(buffer, &done);
+		asmLabelBind(buffer, &notSmallInteger, asmOffset(buffer));
+		asmLabelBind(buffer, &overflow, asmOffset(buffer));
+		for (uint8_t i = 0; i < generator->regsAlloc.varsSize; i++) {
+			fastPathFlags[i] = generator->regsAlloc.vars[i].flags;
+		}
+	}
 
 	for (uint8_t i = 0; i < argsSize; i++) {
 		pushOperand(generator, bytecodeNextOperand(iterator));
@@ -317,7 +631,11 @@ static void generateSend(CodeGenerator *generator, BytecodesIterator *iterator)
 
 	RawClass *class = compiledCodeResolveOperandClass(&generator->code, receiver);
 	if (class != NULL) {
-		asmMovqImm(buffer, (int64_t) lookupNativeCode(class, (RawString *) selector), R11);
+		// native code of statically bound method is embedded as pointer, so that collections keep it
+		int64_t target = (int64_t) lookupNativeCode(class, (RawString *) selector) - offsetof(NativeCode, insts);
+		asmMovqImm(buffer, target, R11);
+		asmAddPointerOffset(buffer, asmOffset(buffer) - sizeof(int64_t));
+		asmAddqImm(buffer, R11, offsetof(NativeCode, insts));
 	} else {
 		if (receiver.type == OPERAND_TEMP_VAR || receiver.type == OPERAND_ARG_VAR) {
 			Variable *class = specialVariableAt(generator, VAR_CLASS, receiver.index);
@@ -347,38 +665,494 @@ static void generateSend(CodeGenerator *generator, BytecodesIterator *iterator)
 		} else {
 			generateLoadClass(buffer, TMP, RDI);
 		}
-		generateLoadObject(buffer, selector, RSI, 0);
-		generateMethodLookup(generator);
+		generateInlineCache(generator, selector);
+	}
+
+	generator->frameSize -= argsSize + 1;
+	asmCallq(buffer, R11);
+	generateStackmap(generator);
+	generateDescriptor(generator);
+	generateDeoptimizationSite(generator);
+	asmAddqImm(buffer, RSP, (argsSize + 1) * sizeof(intptr_t));
+	invalidateRegs(&generator->regsAlloc);
+
+	if (hasFastPath) {
+		// only variables spilled on both paths are on stack
+		asmLabelBind(buffer, &done, asmOffset(buffer));
+		for (uint8_t i = 0; i < generator->regsAlloc.varsSize; i++) {
+			generator->regsAlloc.vars[i].flags &= fastPathFlags[i];
+		}
+	}
+}
+
+
+// RAX: result
+// RSI, TMP: scratch
+// inline arithmetic and comparison of tagged integers, other receivers, arguments and overflows take slow path
+static _Bool generateSmallIntegerOperation(CodeGenerator *generator, RawObject *selector, Operand receiver, Operand arg, AssemblerLabel *notSmallInteger, AssemblerLabel *overflow)
+{
+	AssemblerBuffer *buffer = &generator->buffer;
+	String *name = scopeHandle(selector);
+	uint8_t condition = 0;
+	enum { ADD, SUB, MUL, COMPARE } operation;
+
+	if (stringEqualsC(name, "+")) {
+		operation = ADD;
+	} else if (stringEqualsC(name, "-")) {
+		operation = SUB;
+	} else if (stringEqualsC(name, "*")) {
+		operation = MUL;
+	} else if (stringEqualsC(name, "<")) {
+		operation = COMPARE;
+		condition = COND_LESS;
+	} else if (stringEqualsC(name, ">")) {
+		operation = COMPARE;
+		condition = COND_GREATER;
+	} else if (stringEqualsC(name, "<=")) {
+		operation = COMPARE;
+		condition = COND_LESS_EQUAL;
+	} else if (stringEqualsC(name, ">=")) {
+		operation = COMPARE;
+		condition = COND_GREATER_EQUAL;
+	} else if (stringEqualsC(name, "=")) {
+		operation = COMPARE;
+		condition = COND_EQUAL;
+	} else if (stringEqualsC(name, "~=")) {
+		operation = COMPARE;
+		condition = COND_NOT_EQUAL;
+	} else {
+		return 0;
+	}
+	if (!isSmallIntegerOperand(receiver) || !isSmallIntegerOperand(arg)) {
+		return 0;
+	}
+
+	// operands are loaded before the first jump so both paths see the same registers
+	movOperand(generator, receiver, RAX);
+	movOperand(generator, arg, RSI);
+	if (receiver.type == OPERAND_VALUE) {
+		asmTestqImm(buffer, RSI, 3);
+	} else if (arg.type == OPERAND_VALUE) {
+		asmTestqImm(buffer, RAX, 3);
+	} else {
+		asmMovq(buffer, RAX, TMP);
+		asmOrq(buffer, RSI, TMP);
+		asmTestqImm(buffer, TMP, 3);
+	}
+	asmJ(buffer, COND_NOT_ZERO, notSmallInteger);
+
+	switch (operation) {
+	case ADD:
+		asmAddq(buffer, RSI, RAX);
+		asmJ(buffer, COND_OVERFLOW, overflow);
+		break;
+
+	case SUB:
+		asmSubq(buffer, RSI, RAX);
+		asmJ(buffer, COND_OVERFLOW, overflow);
+		break;
+
+	case MUL:
+		asmSarqImm(buffer, RAX, 2);
+		asmImulq(buffer, RSI, RAX);
+		asmJ(buffer, COND_OVERFLOW, overflow);
+		break;
+
+	case COMPARE:
+		asmCmpq(buffer, RAX, RSI);
+		generateLoadObject(buffer, Handles.false->raw, RAX, 1);
+		generateLoadObject(buffer, Handles.true->raw, TMP, 1);
+		asmCmovq(buffer, condition, TMP, RAX);
+		break;
+	}
+	return 1;
+}
+
+
+// operand which may hold SmallInteger at runtime
+static _Bool isSmallIntegerOperand(Operand operand)
+{
+	switch (operand.type) {
+	case OPERAND_VALUE:
+		return valueTypeOf(operand.value, VALUE_INT);
+	case OPERAND_TEMP_VAR:
+	case OPERAND_ARG_VAR:
+	case OPERAND_CONTEXT_VAR:
+	case OPERAND_INST_VAR:
+	case OPERAND_INST_VAR_OF:
+	case OPERAND_ASSOC:
+	case OPERAND_BOUND_VAR:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+
+// RDI: class
+// RSI: selector (cache miss only)
+// RDX: inline cache (cache miss only)
+// R11: native code
+static void generateInlineCache(CodeGenerator *generator, RawObject *selector)
+{
+	AssemblerBuffer *buffer = &generator->buffer;
+	AssemblerLabel hit;
+	asmInitLabel(&hit);
+
+	asmDecq(buffer, RDI);
+
+	// check cached class, patched by updateInlineCache
+	asmMovqImm(buffer, 0, TMP);
+	ptrdiff_t cache = asmOffset(buffer) - sizeof(int64_t);
+	asmAddPointerOffset(buffer, cache);
+	asmCmpq(buffer, TMP, RDI);
+
+	// load cached code, flags are preserved
+	asmMovqImm(buffer, 0, R11);
+	ASSERT(asmOffset(buffer) - sizeof(int64_t) - cache == INLINE_CACHE_CODE_OFFSET);
+	asmJ(buffer, COND_EQUAL, &hit);
+
+	// cache miss -> call miss stub, polymorphic cache or megamorphic lookup
+	// caches are found through their feedback, sites beyond its capacity are never bound and always look up
+	_Bool hasFeedback = generator->sendFeedbackSize < sizeof(generator->sendFeedback) / sizeof(*generator->sendFeedback);
+	StubCode *missStub = hasFeedback ? &InlineCacheMissStub : &MegamorphicLookupStub;
+	generateLoadObject(buffer, selector, RSI, 0);
+	asmLeaq(buffer, asmMem(RIP, NO_REGISTER, SS_1, 0), RDX);
+	*(int32_t *) (buffer->p - sizeof(int32_t)) = cache - asmOffset(buffer);
+	asmMovqImm(buffer, (int64_t) getStubNativeCode(missStub)->insts, TMP);
+	ASSERT(asmOffset(buffer) - sizeof(int64_t) - cache == INLINE_CACHE_MISS_OFFSET);
+	asmCallq(buffer, TMP);
+	ASSERT(asmOffset(buffer) - cache == INLINE_CACHE_SIZE);
+	generateStackmap(generator);
+	generateDescriptor(generator);
+
+	if (hasFeedback) {
+		SendFeedback *feedback = &generator->sendFeedback[generator->sendFeedbackSize++];
+		memset(feedback, 0, sizeof(*feedback));
+		feedback->cache = cache;
+		feedback->bytecode = generator->bytecodeNumber;
+	}
+	asmLabelBind(buffer, &hit, asmOffset(buffer));
+}
+
+
+// RDI: class
+// R11: native code
+// counts are addressed relative to return address into code owning cache, which can be moved
+static NativeCode *generatePolymorphicCache(ptrdiff_t countsOffset)
+{
+	AssemblerBuffer buffer;
+	asmInitBuffer(&buffer, POLYMORPHIC_CACHE_SIZE * POLYMORPHIC_CACHE_ENTRY_SIZE + 16);
+
+	for (size_t i = 0; i < POLYMORPHIC_CACHE_SIZE; i++) {
+		AssemblerLabel next;
+		asmInitLabel(&next);
+
+		// check class, unused entries are zeroed
+		asmMovqImm(&buffer, 0, TMP);
+		asmAddPointerOffset(&buffer, asmOffset(&buffer) - sizeof(int64_t));
+		asmCmpq(&buffer, TMP, RDI);
+		asmJ(&buffer, COND_NOT_EQUAL, &next);
+
+		// count hit
+		asmMovqImm(&buffer, countsOffset + i * sizeof(uint32_t), TMP);
+		asmAddqMem(&buffer, asmMem(RSP, NO_REGISTER, SS_1, 0), TMP);
+		asmInclMem(&buffer, asmMem(TMP, NO_REGISTER, SS_1, 0));
+
+		// load code
+		asmMovqImm(&buffer, 0, R11);
+		asmRet(&buffer);
+
+		asmLabelBind(&buffer, &next, asmOffset(&buffer));
+		ASSERT(asmOffset(&buffer) == (i + 1) * POLYMORPHIC_CACHE_ENTRY_SIZE);
+	}
+
+	// cache miss -> lookup and extend cache
+	asmMovqImm(&buffer, (int64_t) getStubNativeCode(&InlineCacheMissStub)->insts, TMP);
+	asmJmpq(&buffer, TMP);
+
+	NativeCode *code = buildNativeCodeFromAssembler(&buffer);
+	asmFreeBuffer(&buffer);
+	return code;
+}
+
+
+static void setPolymorphicCacheEntry(uint8_t *cache, size_t index, RawClass *class, NativeCodeEntry entry)
+{
+	uint8_t *p = cache + index * POLYMORPHIC_CACHE_ENTRY_SIZE;
+	*(RawClass **) (p + POLYMORPHIC_CACHE_CLASS_OFFSET) = class;
+	*(NativeCodeEntry *) (p + POLYMORPHIC_CACHE_CODE_OFFSET) = entry;
+	rememberCachedClass((NativeCode *) (cache - offsetof(NativeCode, insts)), class);
+}
+
+
+// classes are embedded in code, which must be remembered if they are still in new space
+static void rememberCachedClass(NativeCode *code, RawClass *class)
+{
+	if (!isOldObject((RawObject *) class)) {
+		rememberNativeCode(&CurrentThread.heap, code);
+	}
+}
+
+
+static RawClass *getPolymorphicCacheClass(uint8_t *cache, size_t index)
+{
+	return *(RawClass **) (cache + index * POLYMORPHIC_CACHE_ENTRY_SIZE + POLYMORPHIC_CACHE_CLASS_OFFSET);
+}
+
+
+static _Bool isStubEntry(StubCode *stub, uint8_t *entry)
+{
+	return stub->nativeCode != NULL && stub->nativeCode->insts == entry;
+}
+
+
+void updateInlineCache(NativeCode *code, uint8_t *cache, SendFeedback *feedback, Class *class, NativeCodeEntry entry)
+{
+	RawClass **cachedClass = (RawClass **) cache;
+	NativeCodeEntry *cachedEntry = (NativeCodeEntry *) (cache + INLINE_CACHE_CODE_OFFSET);
+	uint8_t **miss = (uint8_t **) (cache + INLINE_CACHE_MISS_OFFSET);
+
+	if (isStubEntry(&MegamorphicLookupStub, *miss)) {
+		return;
+	}
+	if (isStubEntry(&InlineCacheMissStub, *miss)) {
+		if (*cachedClass == NULL) {
+			// unbound -> monomorphic
+			*cachedClass = class->raw;
+			rememberCachedClass(code, class->raw);
+			*cachedEntry = entry;
+			feedback->counts[0] = 1;
+			return;
+		}
+		// monomorphic -> polymorphic, all classes are checked within stub
+		// so it can count them
+		NativeCode *polymorphicCache = generatePolymorphicCache((uint8_t *) feedback->counts - (cache + INLINE_CACHE_SIZE));
+		setPolymorphicCacheEntry(polymorphicCache->insts, 0, *cachedClass, *cachedEntry);
+		*cachedClass = NULL;
+		*cachedEntry = NULL;
+		*miss = polymorphicCache->insts;
+	}
+
+	for (size_t i = 0; i < POLYMORPHIC_CACHE_SIZE; i++) {
+		if (getPolymorphicCacheClass(*miss, i) == NULL) {
+			setPolymorphicCacheEntry(*miss, i, class->raw, entry);
+			feedback->counts[i] = 1;
+			return;
+		}
+	}
+
+	// polymorphic -> megamorphic
+	*miss = getStubNativeCode(&MegamorphicLookupStub)->insts;
+}
+
+
+// unbinds inline caches of all methods, polymorphic caches are left for collection
+void resetInlineCaches(void)
+{
+	PageSpaceIterator iterator;
+	pageSpaceIteratorInit(&iterator, &CurrentThread.heap.execSpace);
+	NativeCode *code = (NativeCode *) pageSpaceIteratorNext(&iterator);
+	while (code != NULL) {
+		if ((code->tags & TAG_FREESPACE) == 0) {
+			SendFeedback *feedback = nativeCodeGetSendFeedback(code);
+			for (size_t i = 0; i < code->sendFeedbackSize; i++) {
+				resetInlineCache(code->insts + feedback[i].cache, &feedback[i]);
+			}
+		}
+		code = (NativeCode *) pageSpaceIteratorNext(&iterator);
+	}
+}
+
+
+// native code called through inline caches and redirected entry of code, it is live as long as code is
+void iterateNativeCodeTargets(NativeCode *code, void (*callback)(NativeCode *target, void *arg), void *arg)
+{
+	NativeCode *redirected = findRedirectTarget(code);
+	if (redirected != NULL) {
+		callback(redirected, arg);
+	}
+
+	SendFeedback *feedback = nativeCodeGetSendFeedback(code);
+	for (size_t i = 0; i < code->sendFeedbackSize; i++) {
+		uint8_t *cache = code->insts + feedback[i].cache;
+		uint8_t *cachedEntry = *(uint8_t **) (cache + INLINE_CACHE_CODE_OFFSET);
+		uint8_t *miss = *(uint8_t **) (cache + INLINE_CACHE_MISS_OFFSET);
+
+		if (cachedEntry != NULL) {
+			callback(nativeCodeOfEntry(cachedEntry), arg);
+		}
+		if (isStubEntry(&InlineCacheMissStub, miss) || isStubEntry(&MegamorphicLookupStub, miss)) {
+			continue;
+		}
+		callback(nativeCodeOfEntry(miss), arg);
+		for (size_t j = 0; j < POLYMORPHIC_CACHE_SIZE; j++) {
+			uint8_t *entry = *(uint8_t **) (miss + j * POLYMORPHIC_CACHE_ENTRY_SIZE + POLYMORPHIC_CACHE_CODE_OFFSET);
+			if (entry != NULL) {
+				callback(nativeCodeOfEntry(entry), arg);
+			}
+		}
+	}
+}
+
+
+// unbinds inline caches calling any evicted native code, so that it can be collected and its methods are
+// looked up again
+void unlinkEvictedCode(void)
+{
+	PageSpaceIterator iterator;
+	pageSpaceIteratorInit(&iterator, &CurrentThread.heap.execSpace);
+	NativeCode *code = (NativeCode *) pageSpaceIteratorNext(&iterator);
+	while (code != NULL) {
+		if ((code->tags & TAG_FREESPACE) == 0) {
+			SendFeedback *feedback = nativeCodeGetSendFeedback(code);
+			for (size_t i = 0; i < code->sendFeedbackSize; i++) {
+				if (isInlineCacheEvicted(code->insts + feedback[i].cache)) {
+					resetInlineCache(code->insts + feedback[i].cache, &feedback[i]);
+				}
+			}
+		}
+		code = (NativeCode *) pageSpaceIteratorNext(&iterator);
+	}
+}
+
+
+static _Bool isInlineCacheEvicted(uint8_t *cache)
+{
+	uint8_t *cachedEntry = *(uint8_t **) (cache + INLINE_CACHE_CODE_OFFSET);
+	uint8_t *miss = *(uint8_t **) (cache + INLINE_CACHE_MISS_OFFSET);
+
+	if (cachedEntry != NULL && (nativeCodeOfEntry(cachedEntry)->tags & TAG_EVICTED)) {
+		return 1;
+	}
+	if (isStubEntry(&InlineCacheMissStub, miss) || isStubEntry(&MegamorphicLookupStub, miss)) {
+		return 0;
+	}
+	for (size_t i = 0; i < POLYMORPHIC_CACHE_SIZE; i++) {
+		uint8_t *entry = *(uint8_t **) (miss + i * POLYMORPHIC_CACHE_ENTRY_SIZE + POLYMORPHIC_CACHE_CODE_OFFSET);
+		if (entry != NULL && (nativeCodeOfEntry(entry)->tags & TAG_EVICTED)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+static void resetInlineCache(uint8_t *cache, SendFeedback *feedback)
+{
+	*(RawClass **) cache = NULL;
+	*(NativeCodeEntry *) (cache + INLINE_CACHE_CODE_OFFSET) = NULL;
+	*(uint8_t **) (cache + INLINE_CACHE_MISS_OFFSET) = getStubNativeCode(&InlineCacheMissStub)->insts;
+	memset(feedback->counts, 0, sizeof(feedback->counts));
+}
+
+
+static NativeCode *nativeCodeOfEntry(uint8_t *entry)
+{
+	return (NativeCode *) (entry - offsetof(NativeCode, insts));
+}
+
+
+// entry overwritten by redirectNativeCode starts with movq imm64, %r11 and jmpq *%r11, which no generated code does
+static NativeCode *findRedirectTarget(NativeCode *code)
+{
+	static const uint8_t movq[] = { 0x49, 0xBB };
+	static const uint8_t jmpq[] = { 0x41, 0xFF, 0xE3 };
+	if (code->size < NATIVE_CODE_REDIRECT_SIZE
+			|| memcmp(code->insts, movq, sizeof(movq)) != 0
+			|| memcmp(code->insts + sizeof(movq) + sizeof(int64_t), jmpq, sizeof(jmpq)) != 0) {
+		return NULL;
+	}
+	return nativeCodeOfEntry(*(uint8_t **) (code->insts + sizeof(movq)));
+}
+
+
+size_t sendFeedbackGetClasses(NativeCode *code, SendFeedback *feedback, RawClass **classes)
+{
+	uint8_t *cache = code->insts + feedback->cache;
+	RawClass *cachedClass = *(RawClass **) cache;
+	uint8_t *miss = *(uint8_t **) (cache + INLINE_CACHE_MISS_OFFSET);
+
+	if (isStubEntry(&MegamorphicLookupStub, miss)) {
+		return 0;
+	}
+	if (isStubEntry(&InlineCacheMissStub, miss)) {
+		classes[0] = cachedClass;
+		return cachedClass == NULL ? 0 : 1;
+	}
+
+	size_t size = 0;
+	while (size < POLYMORPHIC_CACHE_SIZE && getPolymorphicCacheClass(miss, size) != NULL) {
+		classes[size] = getPolymorphicCacheClass(miss, size);
+		size++;
+	}
+	return size;
+}
+
+
+// redirects old entry to recompiled code, frames which are still executing old code are not affected
+void redirectNativeCode(NativeCode *code, NativeCode *target)
+{
+	AssemblerBuffer buffer;
+	asmInitBuffer(&buffer, 16);
+
+	asmMovqImm(&buffer, (int64_t) target->insts, R11);
+	asmJmpq(&buffer, R11);
+	ASSERT(asmOffset(&buffer) == NATIVE_CODE_REDIRECT_SIZE);
+	for (size_t i = 0; i < code->pointersOffsetsSize; i++) {
+		ASSERT(((uint16_t *) (code->insts + code->size))[i] >= NATIVE_CODE_REDIRECT_SIZE);
 	}
 
-	generator->frameSize -= argsSize + 1;
-	asmCallq(buffer, R11);
-	generateStackmap(generator);
-	ordCollAdd(generator->descriptors, createBytecodeDescriptor(asmOffset(&generator->buffer), generator->bytecodeNumber));
-	asmAddqImm(buffer, RSP, (argsSize + 1) * sizeof(intptr_t));
-	invalidateRegs(&generator->regsAlloc);
+	asmCopyBuffer(&buffer, code->insts, NATIVE_CODE_REDIRECT_SIZE);
+	asmFreeBuffer(&buffer);
+}
+
+
+// sends of optimized code return into deoptimization trampoline at its end from now on, frames are deoptimized once
+// they get control back
+void deoptimizeNativeCode(NativeCode *code)
+{
+	static const uint8_t nop[] = { 0x0F, 0x1F, 0x44, 0x00, 0x00 };
+	NativeDescriptor *descriptors = nativeCodeGetDescriptors(code);
+	uint8_t *trampoline = code->insts + code->size - NATIVE_CODE_REDIRECT_SIZE;
+
+	for (size_t i = 0; i < code->descriptorsSize; i++) {
+		uint8_t *site = code->insts + descriptors[i].pos;
+		if (descriptors[i].pos + sizeof(nop) > code->size || memcmp(site, nop, sizeof(nop)) != 0) {
+			continue;
+		}
+		AssemblerBuffer buffer;
+		asmInitBuffer(&buffer, 16);
+		asmCalldImm(&buffer, trampoline - (site + sizeof(nop)));
+		asmCopyBuffer(&buffer, site, sizeof(nop));
+		asmFreeBuffer(&buffer);
+	}
 }
 
 
-void generateStoreCheck(CodeGenerator *generator, Register object, Register value)
+void generateStoreCheck(CodeGenerator *generator, Register object, MemoryOperand field, Register value)
 {
 	ASSERT(object != TMP && value != TMP);
-	MemoryOperand tags = asmMem(object, NO_REGISTER, SS_1, varOffset(RawObject, tags));
 	AssemblerBuffer *buffer = &generator->buffer;
 	AssemblerLabel newObject;
-	AssemblerLabel alreadyInSet;
 	AssemblerLabel valueIsNotPtr;
-	AssemblerLabel valueIsOld;
-	AssemblerLabel dontGrow;
+	AssemblerLabel valueIsNew;
+	AssemblerLabel notMarking;
 
 	asmInitLabel(&newObject);
-	asmInitLabel(&alreadyInSet);
 	asmInitLabel(&valueIsNotPtr);
-	asmInitLabel(&valueIsOld);
-	asmInitLabel(&dontGrow);
-
-	ptrdiff_t rememberedSetOffset = offsetof(Thread, heap) + offsetof(Heap, rememberedSet);
-	ptrdiff_t blocksOffset = rememberedSetOffset + offsetof(RememberedSet, blocks);
+	asmInitLabel(&valueIsNew);
+	asmInitLabel(&notMarking);
+
+	// any register not used by operands can hold the card index
+	Register scratches[] = { RAX, RCX, RDX, RSI, RDI };
+	Register scratch = NO_REGISTER;
+	for (size_t i = 0; scratch == NO_REGISTER; i++) {
+		Register reg = scratches[i];
+		if (reg != object && reg != value && reg != field.base && reg != field.index) {
+			scratch = reg;
+		}
+	}
 
 	// test if object is new object
 	asmTestqImm(buffer, object, NEW_SPACE_TAG);
@@ -388,64 +1162,29 @@ void generateStoreCheck(CodeGenerator *generator, Register object, Register valu
 	asmTestqImm(buffer, value, VALUE_POINTER);
 	asmJ(buffer, COND_ZERO, &valueIsNotPtr);
 
-	// test if value is old object
+	// test if value is new object
 	asmTestqImm(buffer, value, NEW_SPACE_TAG);
-	asmJ(buffer, COND_ZERO, &valueIsOld);
-
-	// test if object is already remembered
-	asmTestbMemImm(buffer, tags, TAG_REMEMBERED);
-	asmJ(buffer, COND_NOT_ZERO, &alreadyInSet);
+	asmJ(buffer, COND_NOT_ZERO, &valueIsNew);
+
+	// old values are remembered only while old space is marked, native code belongs to the thread generating it
+	asmMovqImm(buffer, (int64_t) &CurrentThread.heap.isMarking, TMP);
+	asmTestbMemImm(buffer, asmMem(TMP, NO_REGISTER, SS_1, 0), 1);
+	asmJ(buffer, COND_ZERO, &notMarking);
+
+	// mark card of the field within object's page
+	asmLabelBind(buffer, &valueIsNew, asmOffset(buffer));
+	asmPushq(buffer, scratch);
+	asmLeaq(buffer, field, scratch);
+	asmMovq(buffer, object, TMP);
+	asmAndqImm(buffer, TMP, -(int32_t) HeapPageAlign);
+	asmSubq(buffer, TMP, scratch);
+	asmShrqImm(buffer, scratch, CARD_SIZE_LOG2);
+	asmMovbMemImm(buffer, 1, asmMem(TMP, scratch, SS_1, offsetof(HeapPage, cards)));
+	asmPopq(buffer, scratch);
 
-	// mark as remembered
-	asmOrbMemImm(buffer, tags, TAG_REMEMBERED);
-
-	// load thread
-	asmMovqMem(buffer, asmMem(CTX, NO_REGISTER, SS_1, varOffset(RawContext, thread)), TMP);
-	// load current block
-	asmMovqMem(buffer, asmMem(TMP, NO_REGISTER, SS_1, blocksOffset), TMP);
-
-	// store object in remembered set
-	asmAddqMemImm(buffer, asmMem(TMP, NO_REGISTER, SS_1, offsetof(RememberedSetBlock, current)), sizeof(intptr_t));
-	asmMovqMem(buffer, asmMem(TMP, NO_REGISTER, SS_1, offsetof(RememberedSetBlock, current)), TMP);
-	asmMovqToMem(buffer, object, asmMem(TMP, NO_REGISTER, SS_1, -sizeof(intptr_t)));
-
-	// test if remembered set block is full
-	asmPushq(buffer, object);
-	asmMovqMem(buffer, asmMem(TMP, NO_REGISTER, SS_1, offsetof(RememberedSetBlock, end)), object);
-	asmCmpqMem(buffer, asmMem(TMP, NO_REGISTER, SS_1, offsetof(RememberedSetBlock, current)), object);
-	asmPopq(buffer, object);
-	asmJ(buffer, COND_EQUAL, &dontGrow);
-
-	// grow remembered set
-	asmPushq(buffer, RAX);
-	asmPushq(buffer, RCX);
-	asmPushq(buffer, RDX);
-	asmPushq(buffer, RSI);
-	asmPushq(buffer, RDI);
-	asmPushq(buffer, R8);
-	asmPushq(buffer, R9);
-	asmPushq(buffer, R10);
-	asmPushq(buffer, R11);
-	// load thread
-	asmMovqMem(buffer, asmMem(CTX, NO_REGISTER, SS_1, varOffset(RawContext, thread)), TMP);
-	// load remembered set
-	asmLeaq(buffer, asmMem(TMP, NO_REGISTER, SS_1, rememberedSetOffset), RDI);
-	generateCCall(generator, (intptr_t) rememberedSetGrow, 1, 0);
-	asmPopq(buffer, R11);
-	asmPopq(buffer, R10);
-	asmPopq(buffer, R9);
-	asmPopq(buffer, R8);
-	asmPopq(buffer, RDI);
-	asmPopq(buffer, RSI);
-	asmPopq(buffer, RDX);
-	asmPopq(buffer, RCX);
-	asmPopq(buffer, RAX);
-
-	asmLabelBind(buffer, &dontGrow, asmOffset(buffer));
 	asmLabelBind(buffer, &newObject, asmOffset(buffer));
-	asmLabelBind(buffer, &alreadyInSet, asmOffset(buffer));
 	asmLabelBind(buffer, &valueIsNotPtr, asmOffset(buffer));
-	asmLabelBind(buffer, &valueIsOld, asmOffset(buffer));
+	asmLabelBind(buffer, &notMarking, asmOffset(buffer));
 }
 
 
@@ -497,9 +1236,8 @@ void generateLoadObject(AssemblerBuffer *buffer, RawObject *object, Register dst
 {
 	int64_t ptr = tag ? tagPtr(object) : (int64_t) object;
 	asmMovqImm(buffer, ptr, dst);
-	if (!isOldObject(object)) {
-		asmAddPointerOffset(buffer, asmOffset(buffer) - sizeof(int64_t));
-	}
+	// old objects are moved by evacuation of sparse pages, so they are updated as well
+	asmAddPointerOffset(buffer, asmOffset(buffer) - sizeof(int64_t));
 }
 
 
@@ -555,7 +1293,8 @@ static void generateOuterReturn(CodeGenerator *generator, BytecodesIterator *ite
 	asmCmpqMem(buffer, asmMem(TMP, NO_REGISTER, SS_1, -2 * sizeof(intptr_t)), context->reg);
 	asmJ(buffer, COND_NOT_EQUAL, &deathContext);
 
-	// context is a live so return
+	// context is a live so return, home method stores all callee-saved registers
+	generateSavedRegsLoad(buffer, TMP, SAVED_REGS_ALL);
 	asmMovq(buffer, TMP, RSP);
 	asmPopq(buffer, RBP);
 	asmRet(buffer);
@@ -577,6 +1316,246 @@ static void generateOuterReturn(CodeGenerator *generator, BytecodesIterator *ite
 }
 
 
+// RAX: result
+// receiver is sent blocks whose outer context is new context of the send holding boxes of bound variables and
+// values of readonly ones, blocks returning from home method of the sending code get its context as home context,
+// which is created for methods running without context, see compileFallbackSend
+static void generateFallbackSend(CodeGenerator *generator, BytecodesIterator *iterator)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	AssemblerBuffer *buffer = &generator->buffer;
+	RawObject *selector = compiledCodeLiteralAt(&generator->code, bytecodeNextByte(iterator));
+	uint8_t blocksSize = bytecodeNextByte(iterator);
+	uint8_t varsSize = bytecodeNextByte(iterator);
+	uint8_t flags = bytecodeNextByte(iterator);
+	Operand receiver = bytecodeNextOperand(iterator);
+	Operand blocks[blocksSize + 1];
+	Operand vars[varsSize + 1];
+	Variable *context = variableAt(generator, CONTEXT_INDEX);
+	ptrdiff_t varsOffset = varOffset(RawContext, vars);
+	ptrdiff_t compiledCodeOffset = offsetof(NativeCode, compiledCode) - offsetof(NativeCode, insts);
+	size_t homeSize = (flags & FALLBACK_RETURNS) ? 1 : 0;
+	MemoryOperand field;
+
+	for (uint8_t i = 0; i < blocksSize; i++) {
+		blocks[i] = bytecodeNextOperand(iterator);
+	}
+	Operand self = bytecodeNextOperand(iterator);
+	for (uint8_t i = 0; i < varsSize; i++) {
+		vars[i] = bytecodeNextOperand(iterator);
+	}
+	Operand result = bytecodeNextOperand(iterator);
+
+	// box bound variables captured for the first time
+	for (uint8_t i = 0; i < varsSize; i++) {
+		if (vars[i].type == OPERAND_BOUND_VAR) {
+			generateBoxAllocation(generator, vars[i].index);
+		}
+	}
+
+	// push home context of returning blocks
+	if (flags & FALLBACK_RETURNS) {
+		if (generator->code.isBlock) {
+			fillVar(generator, context);
+			asmPushqMem(buffer, asmMem(context->reg, NO_REGISTER, SS_1, varOffset(RawContext, home)));
+		} else {
+			if (!generator->code.header.hasContext) {
+				generateLazyContextAllocation(generator);
+			}
+			asmPushqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, context->frameOffset * sizeof(intptr_t)));
+		}
+		generator->frameSize++;
+	}
+
+	// allocate context of the send
+	generateLoadObject(buffer, (RawObject *) Handles.BlockContext->raw, RSI, 0);
+	asmMovqImm(buffer, varsSize, RDX);
+	generateStubCall(generator, &AllocateStub);
+	invalidateRegs(&generator->regsAlloc);
+
+	// setup RBP, thread and compiled code of the sending code
+	fillVar(generator, context);
+	asmMovqToMem(buffer, RBP, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawContext, frame)));
+	asmMovqMem(buffer, asmMem(context->reg, NO_REGISTER, SS_1, varOffset(RawContext, thread)), RSI);
+	asmMovqToMem(buffer, RSI, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawContext, thread)));
+	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, -sizeof(intptr_t)), RSI);
+	asmMovqMem(buffer, asmMem(RSI, NO_REGISTER, SS_1, compiledCodeOffset), RSI);
+	asmIncq(buffer, RSI);
+	field = asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawContext, code));
+	generateStoreCheck(generator, RAX, field, RSI);
+	asmMovqToMem(buffer, RSI, field);
+	// setup outer and home context
+	if (flags & FALLBACK_OUTER) {
+		field = asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawContext, outer));
+		generateStoreCheck(generator, RAX, field, context->reg);
+		asmMovqToMem(buffer, context->reg, field);
+	}
+	if (flags & FALLBACK_RETURNS) {
+		asmMovqMem(buffer, asmMem(RSP, NO_REGISTER, SS_1, 0), RSI);
+		field = asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawContext, home));
+		generateStoreCheck(generator, RAX, field, RSI);
+		asmMovqToMem(buffer, RSI, field);
+	}
+
+	asmPushq(buffer, RAX);
+	generator->frameSize++;
+
+	// store boxes and values of variables into context
+	for (uint8_t i = 0; i < varsSize; i++) {
+		Operand var = vars[i];
+		if (var.type == OPERAND_BOUND_VAR) {
+			var.type = OPERAND_TEMP_VAR;
+			var.index++;
+		}
+		movOperand(generator, var, RAX);
+		asmMovqMem(buffer, asmMem(RSP, NO_REGISTER, SS_1, 0), RDI);
+		field = asmMem(RDI, NO_REGISTER, SS_1, varsOffset + i * sizeof(Value));
+		generateStoreCheck(generator, RDI, field, RAX);
+		asmMovqToMem(buffer, RAX, field);
+	}
+
+	// push blocks in order of arguments of regular send
+	for (uint8_t i = 0; i < blocksSize; i++) {
+		CompiledBlock *block = scopeHandle(compiledCodeLiteralAt(&generator->code, blocks[i].index));
+		NativeCode *nativeBlock = generateBlockCode(block, generator);
+
+		generateLoadObject(buffer, (RawObject *) Handles.Block->raw, RSI, 0);
+		asmMovqImm(buffer, 0, RDX);
+		generateStubCall(generator, &AllocateStub);
+		invalidateRegs(&generator->regsAlloc);
+
+		// setup home and outer context
+		asmMovqMem(buffer, asmMem(RSP, NO_REGISTER, SS_1, i * sizeof(intptr_t)), TMP);
+		asmMovqToMem(buffer, TMP, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawBlock, outerContext)));
+		if (flags & FALLBACK_RETURNS) {
+			asmMovqMem(buffer, asmMem(RSP, NO_REGISTER, SS_1, (i + 1) * sizeof(intptr_t)), TMP);
+		}
+		asmMovqToMem(buffer, TMP, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawBlock, homeContext)));
+
+		// setup native code
+		asmMovqImm(buffer, (uint64_t) nativeBlock, TMP);
+		asmAddPointerOffset(buffer, asmOffset(buffer) - sizeof(int64_t));
+		asmMovqToMem(buffer, TMP, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawBlock, nativeCode)));
+
+		// setup compiled code
+		generateLoadObject(buffer, (RawObject *) block->raw, TMP, 1);
+		asmMovqToMem(buffer, TMP, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawBlock, compiledBlock)));
+
+		// setup receiver
+		movOperand(generator, self, TMP);
+		asmMovqToMem(buffer, TMP, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawBlock, receiver)));
+
+		asmPushq(buffer, RAX);
+		generator->frameSize++;
+	}
+
+	// lookup selector in class of receiver
+	movOperand(generator, receiver, TMP);
+	asmPushq(buffer, TMP);
+	generator->frameSize++;
+	generateLoadClass(buffer, TMP, RDI);
+	generateLoadObject(buffer, selector, RSI, 0);
+	generateMethodLookup(generator);
+
+	// send message with receiver and blocks as arguments
+	fillVar(generator, context);
+	generator->frameSize -= blocksSize + 1;
+	asmCallq(buffer, R11);
+	generateStackmap(generator);
+	generateDescriptor(generator);
+	generateDeoptimizationSite(generator);
+	asmAddqImm(buffer, RSP, (blocksSize + 2 + homeSize) * sizeof(intptr_t));
+	generator->frameSize -= 1 + homeSize;
+	invalidateRegs(&generator->regsAlloc);
+	movToOperand(generator, RAX, result);
+
+	closeHandleScope(&scope, NULL);
+}
+
+
+// box of bound variable is created once and keeps its value, see movOperand
+static void generateBoxAllocation(CodeGenerator *generator, uint8_t index)
+{
+	AssemblerBuffer *buffer = &generator->buffer;
+	Variable *box = variableAt(generator, index + 1);
+	VariableFlags flags[generator->regsAlloc.varsSize];
+	AssemblerLabel done;
+	asmInitLabel(&done);
+
+	Register reg = fillVarOrLoad(generator, box, TMP);
+	asmTestq(buffer, reg, reg);
+	asmJ(buffer, COND_NOT_ZERO, &done);
+	for (uint8_t i = 0; i < generator->regsAlloc.varsSize; i++) {
+		flags[i] = generator->regsAlloc.vars[i].flags;
+	}
+
+	generateLoadObject(buffer, (RawObject *) Handles.Association->raw, RSI, 0);
+	asmXorq(buffer, RDX, RDX);
+	generateStubCall(generator, &AllocateStub);
+	invalidateRegs(&generator->regsAlloc);
+	movVar(generator, variableAt(generator, index), RSI);
+	MemoryOperand field = asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawAssociation, value));
+	generateStoreCheck(generator, RAX, field, RSI);
+	asmMovqToMem(buffer, RSI, field);
+	movToVar(generator, RAX, box);
+
+	// only variables kept on both paths are known
+	asmLabelBind(buffer, &done, asmOffset(buffer));
+	for (uint8_t i = 0; i < generator->regsAlloc.varsSize; i++) {
+		generator->regsAlloc.vars[i].flags &= flags[i];
+	}
+}
+
+
+// method running without context gets one once its blocks return from it, like in stackFrameGetParentContext
+static void generateLazyContextAllocation(CodeGenerator *generator)
+{
+	AssemblerBuffer *buffer = &generator->buffer;
+	Variable *context = variableAt(generator, CONTEXT_INDEX);
+	ptrdiff_t frameOffset = context->frameOffset * sizeof(intptr_t);
+	ptrdiff_t compiledCodeOffset = offsetof(NativeCode, compiledCode) - offsetof(NativeCode, insts);
+	VariableFlags flags[generator->regsAlloc.varsSize];
+	AssemblerLabel done;
+	asmInitLabel(&done);
+
+	// compare context with dummy context of thread
+	fillVar(generator, context);
+	asmMovqMem(buffer, asmMem(context->reg, NO_REGISTER, SS_1, varOffset(RawContext, thread)), TMP);
+	asmCmpqMem(buffer, asmMem(TMP, NO_REGISTER, SS_1, offsetof(Thread, context)), context->reg);
+	asmJ(buffer, COND_NOT_EQUAL, &done);
+	for (uint8_t i = 0; i < generator->regsAlloc.varsSize; i++) {
+		flags[i] = generator->regsAlloc.vars[i].flags;
+	}
+
+	generateLoadObject(buffer, (RawObject *) Handles.MethodContext->raw, RSI, 0);
+	asmXorq(buffer, RDX, RDX);
+	generateStubCall(generator, &AllocateStub);
+	invalidateRegs(&generator->regsAlloc);
+
+	// setup RBP, thread and compiled code
+	asmMovqToMem(buffer, RBP, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawContext, frame)));
+	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, frameOffset), RSI);
+	asmMovqMem(buffer, asmMem(RSI, NO_REGISTER, SS_1, varOffset(RawContext, thread)), RSI);
+	asmMovqToMem(buffer, RSI, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawContext, thread)));
+	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, -sizeof(intptr_t)), RSI);
+	asmMovqMem(buffer, asmMem(RSI, NO_REGISTER, SS_1, compiledCodeOffset), RSI);
+	asmIncq(buffer, RSI);
+	MemoryOperand field = asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawContext, code));
+	generateStoreCheck(generator, RAX, field, RSI);
+	asmMovqToMem(buffer, RSI, field);
+	// frame reloads its context from slot
+	asmMovqToMem(buffer, RAX, asmMem(RBP, NO_REGISTER, SS_1, frameOffset));
+
+	asmLabelBind(buffer, &done, asmOffset(buffer));
+	for (uint8_t i = 0; i < generator->regsAlloc.varsSize; i++) {
+		generator->regsAlloc.vars[i].flags &= flags[i];
+	}
+	invalidateRegs(&generator->regsAlloc);
+}
+
+
 static void pushOperand(CodeGenerator *generator, Operand operand)
 {
 	AssemblerBuffer *buffer = &generator->buffer;
@@ -649,8 +1628,15 @@ static void pushOperand(CodeGenerator *generator, Operand operand)
 		Variable *self = variableAt(generator, SELF_INDEX);
 		InstanceShape shape = classGetInstanceShape(generator->code.ownerClass);
 		ptrdiff_t offset = varOffset(RawObject, body) + (shape.payloadSize + operand.index + shape.isIndexed) * sizeof(Value);
-		fillVar(generator, self);
-		asmPushqMem(buffer, asmMem(self->reg, NO_REGISTER, SS_1, offset));
+		Register instance = fillVarOrLoad(generator, self, RSI);
+		asmPushqMem(buffer, asmMem(instance, NO_REGISTER, SS_1, offset));
+		break;
+	}
+
+	case OPERAND_INST_VAR_OF: {
+		Register instance = fillInstance(generator, operand, RSI);
+		ptrdiff_t offset = varOffset(RawObject, body) + operand.index * sizeof(Value);
+		asmPushqMem(buffer, asmMem(instance, NO_REGISTER, SS_1, offset));
 		break;
 	}
 
@@ -669,6 +1655,11 @@ static void pushOperand(CodeGenerator *generator, Operand operand)
 		asmPushq(buffer, RAX);
 		break;
 
+	case OPERAND_BOUND_VAR:
+		movOperand(generator, operand, TMP);
+		asmPushq(buffer, TMP);
+		break;
+
 	default:
 		FAIL();
 	}
@@ -723,8 +1714,15 @@ static void movOperand(CodeGenerator *generator, Operand operand, Register reg)
 		Variable *self = variableAt(generator, SELF_INDEX);
 		InstanceShape shape = classGetInstanceShape(generator->code.ownerClass);
 		ptrdiff_t offset = varOffset(RawObject, body) + (shape.payloadSize + operand.index + shape.isIndexed) * sizeof(Value);
-		fillVar(generator, self);
-		asmMovqMem(buffer, asmMem(self->reg, NO_REGISTER, SS_1, offset), reg);
+		Register instance = fillVarOrLoad(generator, self, reg == RSI ? RDI : RSI);
+		asmMovqMem(buffer, asmMem(instance, NO_REGISTER, SS_1, offset), reg);
+		break;
+	}
+
+	case OPERAND_INST_VAR_OF: {
+		Register instance = fillInstance(generator, operand, reg == RSI ? RDI : RSI);
+		ptrdiff_t offset = varOffset(RawObject, body) + operand.index * sizeof(Value);
+		asmMovqMem(buffer, asmMem(instance, NO_REGISTER, SS_1, offset), reg);
 		break;
 	}
 
@@ -751,6 +1749,22 @@ static void movOperand(CodeGenerator *generator, Operand operand, Register reg)
 		asmMovq(buffer, RAX, reg);
 		break;
 
+	case OPERAND_BOUND_VAR: {
+		// variable holds its value until it is boxed
+		AssemblerLabel notBoxed;
+		asmInitLabel(&notBoxed);
+		Register value = fillVarOrLoad(generator, variableAt(generator, operand.index), reg);
+		Register box = fillVarOrLoad(generator, variableAt(generator, operand.index + 1), reg == RSI ? RDI : RSI);
+		if (value != reg) {
+			asmMovq(buffer, value, reg);
+		}
+		asmTestq(buffer, box, box);
+		asmJ(buffer, COND_ZERO, &notBoxed);
+		asmMovqMem(buffer, asmMem(box, NO_REGISTER, SS_1, varOffset(RawAssociation, value)), reg);
+		asmLabelBind(buffer, &notBoxed, asmOffset(buffer));
+		break;
+	}
+
 	default:
 		FAIL();
 	}
@@ -778,8 +1792,9 @@ static void movToOperand(CodeGenerator *generator, Register reg, Operand operand
 		Variable *context = specialVariableAt(generator, VAR_CONTEXT, operand.level);
 		ptrdiff_t offset = varOffset(RawContext, vars) + operand.index * sizeof(Value);
 		fillContext(generator, operand.level);
-		generateStoreCheck(generator, context->reg, reg);
-		asmMovqToMem(buffer, reg, asmMem(context->reg, NO_REGISTER, SS_1, offset));
+		MemoryOperand field = asmMem(context->reg, NO_REGISTER, SS_1, offset);
+		generateStoreCheck(generator, context->reg, field, reg);
+		asmMovqToMem(buffer, reg, field);
 		break;
 	}
 
@@ -788,17 +1803,42 @@ static void movToOperand(CodeGenerator *generator, Register reg, Operand operand
 		InstanceShape shape = classGetInstanceShape(generator->code.ownerClass);
 		ptrdiff_t offset = varOffset(RawObject, body) + (shape.payloadSize + operand.index + shape.isIndexed) * sizeof(Value);
 
-		fillVar(generator, self);
-		generateStoreCheck(generator, self->reg, reg);
-		asmMovqToMem(buffer, reg, asmMem(self->reg, NO_REGISTER, SS_1, offset));
+		Register instance = fillVarOrLoad(generator, self, reg == RSI ? RDI : RSI);
+		MemoryOperand field = asmMem(instance, NO_REGISTER, SS_1, offset);
+		generateStoreCheck(generator, instance, field, reg);
+		asmMovqToMem(buffer, reg, field);
+		break;
+	}
+
+	case OPERAND_INST_VAR_OF: {
+		Register instance = fillInstance(generator, operand, reg == RSI ? RDI : RSI);
+		MemoryOperand field = asmMem(instance, NO_REGISTER, SS_1, varOffset(RawObject, body) + operand.index * sizeof(Value));
+		generateStoreCheck(generator, instance, field, reg);
+		asmMovqToMem(buffer, reg, field);
 		break;
 	}
 
 	case OPERAND_ASSOC: {
 		Variable *variable = specialVariableAt(generator, VAR_ASSOC, operand.index);
 		fillAssoc(generator, operand.index);
-		asmMovqToMem(buffer, reg, asmMem(variable->reg, NO_REGISTER, SS_1, varOffset(RawAssociation, value)));
-		generateStoreCheck(generator, variable->reg, reg);
+		MemoryOperand field = asmMem(variable->reg, NO_REGISTER, SS_1, varOffset(RawAssociation, value));
+		asmMovqToMem(buffer, reg, field);
+		generateStoreCheck(generator, variable->reg, field, reg);
+		break;
+	}
+
+	case OPERAND_BOUND_VAR: {
+		// boxed variable is shared with fallback blocks through its box
+		AssemblerLabel notBoxed;
+		asmInitLabel(&notBoxed);
+		movToVar(generator, reg, variableAt(generator, operand.index));
+		Register box = fillVarOrLoad(generator, variableAt(generator, operand.index + 1), reg == RSI ? RDI : RSI);
+		asmTestq(buffer, box, box);
+		asmJ(buffer, COND_ZERO, &notBoxed);
+		MemoryOperand field = asmMem(box, NO_REGISTER, SS_1, varOffset(RawAssociation, value));
+		generateStoreCheck(generator, box, field, reg);
+		asmMovqToMem(buffer, reg, field);
+		asmLabelBind(buffer, &notBoxed, asmOffset(buffer));
 		break;
 	}
 
@@ -846,40 +1886,9 @@ static void generateClassCheck(CodeGenerator *generator, Operand operand, RawCla
 	}
 
 	case OPERAND_TEMP_VAR:
-	case OPERAND_ARG_VAR: {
-		Variable *var = variableAt(generator, operand.index);
-
-		if (class == Handles.SmallInteger->raw) {
-			fillVar(generator, var);
-			asmTestqImm(buffer, var->reg, 3);
-			asmJ(buffer, COND_NOT_ZERO, label);
-		} else if (class == Handles.Character->raw) {
-			fillVar(generator, var);
-			asmTestqImm(buffer, var->reg, VALUE_CHAR);
-			asmJ(buffer, COND_ZERO, label);
-		} else {
-			Variable *class = specialVariableAt(generator, VAR_CLASS, operand.index);
-
-			ASSERT(class->reg != SPILLED_REG);
-			generateLoadObject(buffer, (RawObject *) class, TMP, 1);
-
-			if ((class->flags & VAR_IN_REG) != 0) {
-				asmCmpq(buffer, class->reg, TMP);
-			} else if ((class->flags & VAR_ON_STACK) != 0) {
-				ptrdiff_t offset = class->frameOffset * sizeof(intptr_t);
-				asmCmpqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, offset), TMP);
-			} else {
-				fillVar(generator, var);
-				asmMovqMem(buffer, asmMem(var->reg, NO_REGISTER, SS_1, varOffset(RawObject, class)), class->reg);
-				asmIncq(buffer, class->reg);
-				class->flags |= VAR_IN_REG;
-				spillVar(generator, class);
-				asmCmpq(buffer, class->reg, TMP);
-			}
-			asmJ(buffer, COND_NOT_EQUAL, label);
-		}
+	case OPERAND_ARG_VAR:
+		generateValueClassCheck(generator, fillVarOrLoad(generator, variableAt(generator, operand.index), TMP), class, label);
 		break;
-	}
 
 	case OPERAND_SUPER:
 		if (class != (RawClass *) asObject(generator->code.ownerClass->raw->superClass)) {
@@ -887,47 +1896,13 @@ static void generateClassCheck(CodeGenerator *generator, Operand operand, RawCla
 		}
 		break;
 
-	case OPERAND_CONTEXT_VAR: {
-		Variable *context = specialVariableAt(generator, VAR_CONTEXT, operand.level);
-		ptrdiff_t offset = varOffset(RawContext, vars) + operand.index * sizeof(Value);
-		fillContext(generator, operand.level);
-		asmMovqMem(buffer, asmMem(context->reg, NO_REGISTER, SS_1, offset), TMP);
-
-		if (class == Handles.SmallInteger->raw) {
-			asmTestqImm(buffer, TMP, 3);
-			asmJ(buffer, COND_NOT_ZERO, label);
-		} else if (class == Handles.Character->raw) {
-			asmTestqImm(buffer, TMP, VALUE_CHAR);
-			asmJ(buffer, COND_ZERO, label);
-		} else {
-			generateLoadObject(buffer, (RawObject *) class, RAX, 0);
-			asmCmpqMem(buffer, asmMem(TMP, NO_REGISTER, SS_1, varOffset(RawObject, class)), RAX);
-			asmJ(buffer, COND_NOT_EQUAL, label);
-		}
-		break;
-	}
-
-	case OPERAND_INST_VAR: {
-		Variable *self = variableAt(generator, SELF_INDEX);
-		InstanceShape shape = classGetInstanceShape(generator->code.ownerClass);
-		ptrdiff_t offset = varOffset(RawObject, body) + (shape.payloadSize + operand.index + shape.isIndexed) * sizeof(Value);
-		fillVar(generator, self);
-
-		asmMovqMem(buffer, asmMem(self->reg, NO_REGISTER, SS_1, offset), TMP);
-
-		if (class == Handles.SmallInteger->raw) {
-			asmTestqImm(buffer, TMP, 3);
-			asmJ(buffer, COND_NOT_ZERO, label);
-		} else if (class == Handles.Character->raw) {
-			asmTestqImm(buffer, TMP, VALUE_CHAR);
-			asmJ(buffer, COND_ZERO, label);
-		} else {
-			generateLoadObject(buffer, (RawObject *) class, RAX, 0);
-			asmCmpqMem(buffer, asmMem(TMP, NO_REGISTER, SS_1, varOffset(RawObject, class)), RAX);
-			asmJ(buffer, COND_NOT_EQUAL, label);
-		}
+	case OPERAND_CONTEXT_VAR:
+	case OPERAND_INST_VAR:
+	case OPERAND_INST_VAR_OF:
+	case OPERAND_BOUND_VAR:
+		movOperand(generator, operand, TMP);
+		generateValueClassCheck(generator, TMP, class, label);
 		break;
-	}
 
 	case OPERAND_LITERAL:
 	case OPERAND_ASSOC: {
@@ -950,6 +1925,77 @@ static void generateClassCheck(CodeGenerator *generator, Operand operand, RawCla
 }
 
 
+// RAX: scratch
+static void generateValueClassCheck(CodeGenerator *generator, Register value, RawClass *class, AssemblerLabel *label)
+{
+	AssemblerBuffer *buffer = &generator->buffer;
+	ASSERT(value != RAX);
+
+	if (class == Handles.SmallInteger->raw) {
+		asmTestqImm(buffer, value, 3);
+		asmJ(buffer, COND_NOT_ZERO, label);
+	} else if (class == Handles.Character->raw) {
+		asmTestqImm(buffer, value, VALUE_CHAR);
+		asmJ(buffer, COND_ZERO, label);
+	} else {
+		// flags of failed pointer tag test are kept for the class test jump
+		AssemblerLabel notPointer;
+		asmInitLabel(&notPointer);
+		asmMovq(buffer, value, RAX);
+		asmAndqImm(buffer, RAX, 3);
+		asmCmpqImm(buffer, RAX, VALUE_POINTER);
+		asmJ(buffer, COND_NOT_EQUAL, &notPointer);
+		generateLoadObject(buffer, (RawObject *) class, RAX, 0);
+		asmCmpqMem(buffer, asmMem(value, NO_REGISTER, SS_1, varOffset(RawObject, class)), RAX);
+		asmLabelBind(buffer, &notPointer, asmOffset(buffer));
+		asmJ(buffer, COND_NOT_EQUAL, label);
+	}
+}
+
+
+// RAX: scratch
+static void generateBooleanJump(CodeGenerator *generator, Operand operand, _Bool value, AssemblerLabel *label)
+{
+	AssemblerBuffer *buffer = &generator->buffer;
+	Register reg;
+
+	switch (operand.type) {
+	case OPERAND_TRUE:
+	case OPERAND_FALSE:
+		if ((operand.type == OPERAND_TRUE) == value) {
+			asmJmpLabel(buffer, label);
+		}
+		return;
+
+	case OPERAND_TEMP_VAR:
+	case OPERAND_ARG_VAR:
+		reg = fillVarOrLoad(generator, variableAt(generator, operand.index), TMP);
+		break;
+
+	case OPERAND_SUPER:
+		reg = fillVarOrLoad(generator, variableAt(generator, SELF_INDEX), TMP);
+		break;
+
+	case OPERAND_CONTEXT_VAR:
+	case OPERAND_INST_VAR:
+	case OPERAND_INST_VAR_OF:
+	case OPERAND_ASSOC:
+	case OPERAND_BOUND_VAR:
+		movOperand(generator, operand, TMP);
+		reg = TMP;
+		break;
+
+	default:
+		// other operands are never booleans
+		return;
+	}
+
+	generateLoadObject(buffer, (value ? Handles.true : Handles.false)->raw, RAX, 1);
+	asmCmpq(buffer, RAX, reg);
+	asmJ(buffer, COND_EQUAL, label);
+}
+
+
 // RAX: block
 static void generateLoadBlock(CodeGenerator *generator, Operand operand)
 {
@@ -969,7 +2015,7 @@ static void generateLoadBlock(CodeGenerator *generator, Operand operand)
 
 	// setup home context
 	fillVar(generator, context);
-	if (generator->code.isBlock) {
+	if (generator->code.isBlock && generator->code.header.hasContext) {
 		asmMovqMem(buffer, asmMem(context->reg, NO_REGISTER, SS_1, varOffset(RawContext, home)), TMP);
 		asmMovqToMem(buffer, TMP, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawBlock, homeContext)));
 	} else {
@@ -977,7 +2023,8 @@ static void generateLoadBlock(CodeGenerator *generator, Operand operand)
 	}
 
 	// setup native code
-	asmMovqImm(buffer, (uint64_t) nativeBlock, TMP); // TODO: native code can be reallocated?
+	asmMovqImm(buffer, (uint64_t) nativeBlock, TMP);
+	asmAddPointerOffset(buffer, asmOffset(buffer) - sizeof(int64_t));
 	asmMovqToMem(buffer, TMP, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawBlock, nativeCode)));
 
 	// setup compiled code
@@ -1038,9 +2085,42 @@ static void fillVar(CodeGenerator *generator, Variable *var)
 }
 
 
+// loads spilled variable into scratch register
+static Register fillVarOrLoad(CodeGenerator *generator, Variable *var, Register scratch)
+{
+	if (var->reg == SPILLED_REG) {
+		movVar(generator, var, scratch);
+		return scratch;
+	}
+	if (var->flags & (VAR_IN_REG | VAR_ON_STACK)) {
+		fillVar(generator, var);
+	} else {
+		generateLoadObject(&generator->buffer, Handles.nil->raw, var->reg, 1);
+		var->flags |= VAR_IN_REG;
+	}
+	return var->reg;
+}
+
+
+// boxes of fallback blocks are in their outer context, see varAsOperand
+static Register fillInstance(CodeGenerator *generator, Operand operand, Register scratch)
+{
+	Operand instance = bytecodeInstanceOperand(&operand);
+	if (instance.type == OPERAND_CONTEXT_VAR) {
+		movOperand(generator, instance, scratch);
+		return scratch;
+	}
+	ASSERT(instance.type == OPERAND_TEMP_VAR || instance.type == OPERAND_ARG_VAR);
+	return fillVarOrLoad(generator, variableAt(generator, instance.index), scratch);
+}
+
+
 static void spillVar(CodeGenerator *generator, Variable *var)
 {
 	ASSERT(var->flags & VAR_IN_REG);
+	if (generator->regsAlloc.frameLess || (var->flags & VAR_CALLEE_SAVED)) {
+		return; // there is no frame or nothing can clobber the register
+	}
 	ptrdiff_t offset = var->frameOffset * sizeof(intptr_t);
 	asmMovqToMem(&generator->buffer, var->reg, asmMem(RBP, NO_REGISTER, SS_1, offset));
 	var->flags |= VAR_ON_STACK;
@@ -1096,33 +2176,95 @@ static Variable *specialVariableAt(CodeGenerator *generator, uint8_t type, ptrdi
 
 void generateStackmap(CodeGenerator *generator)
 {
-	HandleScope scope;
-	openHandleScope(&scope);
-
-	size_t size = (generator->frameSize + generator->frameRawAreaSize) / 8 + 1 + sizeof(Value);
-	Stackmap *stackmap = newObject(Handles.ByteArray, size);
-	stackmap->raw->ic = asmOffset(&generator->buffer);
+	size_t setSize = (generator->frameSize + generator->frameRawAreaSize) / 8 + 1;
+	uint8_t *set = addStackmap(generator, asmOffset(&generator->buffer), setSize);
 
 	size_t varsSize = generator->regsAlloc.varsSize;
+	size_t tempsOffset = generator->code.header.argsSize + 2;
+	size_t specialVarsOffset = tempsOffset + generator->code.header.tempsSize;
 	for (size_t i = 0; i < varsSize; i++) {
 		Variable *var = variableAt(generator, i);
-		if (i == CONTEXT_INDEX || (var->frameOffset < 0 && (var->flags & VAR_ON_STACK) && var->start <= generator->bytecodeNumber && generator->bytecodeNumber <= var->end)) {
+		_Bool isLive = var->start <= generator->bytecodeNumber && generator->bytecodeNumber <= var->end;
+		// with jumps temporaries can be live outside of their linear interval
+		isLive |= generator->regsAlloc.hasJumps && i >= tempsOffset && i < specialVarsOffset;
+		if (i == CONTEXT_INDEX || (var->frameOffset < 0 && (var->flags & VAR_ON_STACK) && isLive)) {
 			ASSERT(var->frameOffset < -1);
 			size_t index = -var->frameOffset - 1;
 			if (index > 1) {
 				index += generator->frameRawAreaSize;
 			}
-			stackmapAdd(stackmap->raw, index);
+			stackmapAdd(set, index);
 		}
 	}
 
 	size_t extraFrameSize = generator->frameSize;
 	for (size_t i = generator->regsAlloc.frameSize; i < extraFrameSize; i++) {
-		stackmapAdd(stackmap->raw, i + generator->frameRawAreaSize);
+		stackmapAdd(set, i + generator->frameRawAreaSize);
 	}
 
-	ordCollAddObject(generator->stackmaps, (Object *) stackmap);
-	closeHandleScope(&scope, NULL);
+	StackmapRegs *regs = &generator->stackmapsRegs[generator->stackmapsSize - 1];
+	regs->live = 0;
+	regs->saved = generator->savedRegs;
+	if (generator->regsAlloc.savedRegs == 0) {
+		return;
+	}
+	for (size_t i = 0; i < varsSize; i++) {
+		Variable *var = variableAt(generator, i);
+		_Bool isLive = var->start <= generator->bytecodeNumber && generator->bytecodeNumber <= var->end;
+		if ((var->flags & VAR_CALLEE_SAVED) && (var->flags & VAR_IN_REG) && isLive) {
+			regs->live |= 1 << findSavedReg(&X64AvailableRegs, var->reg);
+		}
+	}
+}
+
+
+// stackmaps are added in order of their instructions, so that they are sorted for binary search
+static uint8_t *addStackmap(CodeGenerator *generator, size_t ic, size_t setSize)
+{
+	ASSERT(ic <= UINT16_MAX);
+	ASSERT(generator->stackmapsSize == 0 || generator->stackmapsIcs[generator->stackmapsSize - 1] < ic);
+	size_t size = generator->stackmapsSize;
+	size_t oldSetSize = generator->stackmapSetSize;
+	size_t newSetSize = setSize > oldSetSize ? setSize : oldSetSize;
+
+	if (size == generator->stackmapsCapacity || newSetSize != oldSetSize) {
+		size_t capacity = size == generator->stackmapsCapacity ? (size == 0 ? 32 : size * 2) : generator->stackmapsCapacity;
+		uint8_t *sets = calloc(capacity, newSetSize);
+		ASSERT(sets != NULL);
+		for (size_t i = 0; i < size; i++) {
+			memcpy(sets + i * newSetSize, generator->stackmapsSets + i * oldSetSize, oldSetSize);
+		}
+		free(generator->stackmapsSets);
+		generator->stackmapsSets = sets;
+		generator->stackmapsIcs = realloc(generator->stackmapsIcs, capacity * sizeof(*generator->stackmapsIcs));
+		ASSERT(generator->stackmapsIcs != NULL);
+		generator->stackmapsRegs = realloc(generator->stackmapsRegs, capacity * sizeof(*generator->stackmapsRegs));
+		ASSERT(generator->stackmapsRegs != NULL);
+		generator->stackmapsCapacity = capacity;
+		generator->stackmapSetSize = newSetSize;
+	}
+
+	generator->stackmapsIcs[size] = ic;
+	generator->stackmapsSize++;
+	return generator->stackmapsSets + size * newSetSize;
+}
+
+
+void generateDescriptor(CodeGenerator *generator)
+{
+	if (generator->descriptors == NULL) {
+		return;
+	}
+	if (generator->descriptorsSize == generator->descriptorsCapacity) {
+		generator->descriptorsCapacity *= 2;
+		generator->descriptors = realloc(generator->descriptors, generator->descriptorsCapacity * sizeof(*generator->descriptors));
+		ASSERT(generator->descriptors != NULL);
+	}
+	size_t pos = asmOffset(&generator->buffer);
+	ASSERT(pos <= UINT16_MAX);
+	NativeDescriptor *descriptor = &generator->descriptors[generator->descriptorsSize++];
+	descriptor->pos = pos;
+	descriptor->bytecode = generator->bytecodeNumber;
 }
 
 
@@ -1139,6 +2281,10 @@ void generateCCall(CodeGenerator *generator, intptr_t cFunction, size_t argsSize
 	asmPushq(buffer, RBP);
 	asmMovq(buffer, RSP, RBP);
 	asmPushq(buffer, CTX); // spill current context
+	// spill callee-saved registers, so that collector can update variables they hold
+	for (size_t i = 0; i < SAVED_REGS_SIZE; i++) {
+		asmPushq(buffer, SavedRegisters[i]);
+	}
 	asmAndqImm(buffer, RSP, ~(16 - 1)); // ensure 16 bytes stack aligment
 
 	// load thread
@@ -1152,6 +2298,9 @@ void generateCCall(CodeGenerator *generator, intptr_t cFunction, size_t argsSize
 	asmCallq(buffer, TMP);
 
 	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, -sizeof(intptr_t)), CTX); // restore context
+	for (size_t i = 0; i < SAVED_REGS_SIZE; i++) {
+		asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, -(i + 2) * sizeof(intptr_t)), SavedRegisters[i]);
+	}
 	asmMovq(buffer, RBP, RSP); // restore maybe incorrectly aligned RSP
 	asmPopq(buffer, RBP);
 	if (storeIp) {
@@ -1183,8 +2332,9 @@ void generateMethodContextAllocation(CodeGenerator *generator, size_t size)
 	asmMovqToMem(buffer, RBP, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawContext, frame)));
 	// setup parent context
 	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, frameOffset), reg);
-	generateStoreCheck(generator, RAX, reg);
-	asmMovqToMem(buffer, reg, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawContext, parent)));
+	MemoryOperand field = asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawContext, parent));
+	generateStoreCheck(generator, RAX, field, reg);
+	asmMovqToMem(buffer, reg, field);
 	// load thread
 	asmMovqMem(buffer, asmMem(reg, NO_REGISTER, SS_1, varOffset(RawContext, thread)), reg);
 	// setup thread
@@ -1196,8 +2346,9 @@ void generateMethodContextAllocation(CodeGenerator *generator, size_t size)
 	// tag compiled code
 	asmIncq(buffer, reg);
 	// setup compiled code within new context
-	generateStoreCheck(generator, RAX, reg);
-	asmMovqToMem(buffer, reg, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawContext, code)));
+	field = asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawContext, code));
+	generateStoreCheck(generator, RAX, field, reg);
+	asmMovqToMem(buffer, reg, field);
 	// move context to designated context register
 	asmMovq(buffer, RAX, reg);
 	// spill context
@@ -1205,12 +2356,26 @@ void generateMethodContextAllocation(CodeGenerator *generator, size_t size)
 }
 
 
+// TMP: compiled block
 void generateBlockContextAllocation(CodeGenerator *generator)
 {
 	AssemblerBuffer *buffer = &generator->buffer;
 	ptrdiff_t ctxSizeOffset = offsetof(RawCompiledBlock, header) + offsetof(CompiledCodeHeader, contextSize) - 1;
+	ptrdiff_t hasCtxOffset = offsetof(RawCompiledBlock, header) + offsetof(CompiledCodeHeader, hasContext) - 1;
+	AssemblerLabel allocate;
+	AssemblerLabel end;
+	asmInitLabel(&allocate);
+	asmInitLabel(&end);
+
+	// block without context keeps context of its caller, a context is only created when stack frames are walked
+	asmCmpbMemImm(buffer, asmMem(TMP, NO_REGISTER, SS_1, hasCtxOffset), 0);
+	asmJ(buffer, COND_NOT_EQUAL, &allocate);
+	// load block
+	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, 2 * sizeof(intptr_t)), RDI);
+	asmJmpLabel(buffer, &end);
 
 	// allocate context
+	asmLabelBind(buffer, &allocate, asmOffset(buffer));
 	generateLoadObject(buffer, (RawObject *) Handles.BlockContext->raw, RSI, 0);
 	asmMovzxbMemq(buffer, asmMem(TMP, NO_REGISTER, SS_1, ctxSizeOffset), RDX);
 	generateStubCall(generator, &AllocateStub);
@@ -1234,6 +2399,8 @@ void generateBlockContextAllocation(CodeGenerator *generator)
 	// move outerContext from block to new context
 	asmMovqMem(buffer, asmMem(RDI, NO_REGISTER, SS_1, varOffset(RawBlock, outerContext)), TMP);
 	asmMovqToMem(buffer, TMP, asmMem(CTX, NO_REGISTER, SS_1, varOffset(RawContext, outer)));
+
+	asmLabelBind(buffer, &end, asmOffset(buffer));
 }
 
 
@@ -1265,33 +2432,48 @@ NativeCode *generateDoesNotUnderstand(String *selector)
 
 NativeCode *buildNativeCode(CodeGenerator *generator)
 {
-	NativeCode *code = buildNativeCodeFromAssembler(&generator->buffer);
+	AssemblerBuffer *buffer = &generator->buffer;
+	size_t size = asmOffset(buffer);
+	NativeCode *code = allocateNativeCode(
+		&CurrentThread.heap,
+		size,
+		buffer->pointersOffsetsSize,
+		generator->sendFeedbackSize,
+		generator->descriptorsSize,
+		generator->stackmapsSize,
+		generator->stackmapSetSize
+	);
+	initNativeCode(code, buffer);
+	memcpy(nativeCodeGetSendFeedback(code), generator->sendFeedback, generator->sendFeedbackSize * sizeof(SendFeedback));
+	memcpy(nativeCodeGetDescriptors(code), generator->descriptors, generator->descriptorsSize * sizeof(NativeDescriptor));
+	memcpy(nativeCodeGetStackmapsIcs(code), generator->stackmapsIcs, generator->stackmapsSize * sizeof(uint16_t));
+	memcpy(nativeCodeGetStackmapsSets(code), generator->stackmapsSets, generator->stackmapsSize * generator->stackmapSetSize);
+	memcpy(nativeCodeGetStackmapsRegs(code), generator->stackmapsRegs, generator->stackmapsSize * sizeof(StackmapRegs));
 	if (generator->code.methodOrBlock != NULL) {
 		code->compiledCode = ((Object *) generator->code.methodOrBlock)->raw;
 		code->argsSize = generator->code.header.argsSize;
 	}
-	if (generator->descriptors != NULL) {
-		code->descriptors = ordCollAsArray(generator->descriptors)->raw;
-	}
-	if (generator->stackmaps != NULL) {
-		code->stackmaps = ordCollAsArray(generator->stackmaps)->raw;
-	}
+	rememberNativeCodeIfNeeded(&CurrentThread.heap, code);
 	return code;
 }
 
 
 NativeCode *buildNativeCodeFromAssembler(AssemblerBuffer *buffer)
+{
+	NativeCode *code = allocateNativeCode(&CurrentThread.heap, asmOffset(buffer), buffer->pointersOffsetsSize, 0, 0, 0, 0);
+	initNativeCode(code, buffer);
+	rememberNativeCodeIfNeeded(&CurrentThread.heap, code);
+	return code;
+}
+
+
+static void initNativeCode(NativeCode *code, AssemblerBuffer *buffer)
 {
 	size_t size = asmOffset(buffer);
-	NativeCode *code = allocateNativeCode(&CurrentThread.heap, size, buffer->pointersOffsetsSize);
 	code->compiledCode = NULL;
 	code->argsSize = 0;
-	code->descriptors = NULL;
-	code->stackmaps = NULL;
-	code->typeFeedback = NULL;
 	code->counter = 0;
 	asmBindFixups(buffer, code->insts);
 	asmCopyBuffer(buffer, code->insts, size);
 	asmCopyPointersOffsets(buffer, (uint16_t *) (code->insts + size));
-	return code;
 }
@@ -36,12 +36,7 @@ OrderedCollection *arrayAsOrdColl(Array *array)
 	OrderedCollection *ordColl = newOrdColl(size);
 	RawArray *contents = ordCollGetContents(ordColl);
 	for (size_t i = 0; i < size; i++) {
-		Value value = array->raw->vars[i];
-		if (valueTypeOf(value, VALUE_POINTER)) {
-			rawObjectStorePtr((RawObject *) contents, &contents->vars[i], asObject(value));
-		} else {
-			contents->vars[i] = value;
-		}
+		rawObjectStoreValue((RawObject *) contents, &contents->vars[i], array->raw->vars[i]);
 	}
 	ordColl->raw->lastIndex += tagInt(size);
 	return ordColl;
@@ -62,6 +57,11 @@ OrderedCollection *newOrdColl(size_t size)
 void ordCollAdd(OrderedCollection *collection, Value value)
 {
 	ASSERT(collection->raw->class == Handles.OrderedCollection->raw);
+	if (valueTypeOf(value, VALUE_POINTER)) {
+		// growing contents could move the object
+		ordCollAddObject(collection, scopeHandle(asObject(value)));
+		return;
+	}
 	Array *contents = scopeHandle(ordCollGetContents(collection));
 	ASSERT(contents->raw->class == Handles.Array->raw);
 	size_t size = ordCollSize(collection);
@@ -73,7 +73,7 @@ void ordCollAdd(OrderedCollection *collection, Value value)
 		contents = newContents;
 	}
 	intptr_t lastIndex = ordCollGetLastIndex(collection);
-	contents->raw->vars[lastIndex] = value;
+	rawObjectStoreValue((RawObject *) contents->raw, &contents->raw->vars[lastIndex], value);
 	collection->raw->lastIndex = tagInt(lastIndex + 1);
 }
 
@@ -145,6 +145,13 @@ Value ordCollAt(OrderedCollection *collection, ptrdiff_t index)
 }
 
 
+void ordCollAtPut(OrderedCollection *collection, ptrdiff_t index, Value value)
+{
+	RawArray *contents = ordCollGetContents(collection);
+	rawObjectStoreValue((RawObject *) contents, &contents->vars[ordCollGetFirstIndex(collection) + index - 1], value);
+}
+
+
 Object *ordCollObjectAt(OrderedCollection *collection, Value index)
 {
 	return scopeHandle(asObject(ordCollAt(collection, index)));
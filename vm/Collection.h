@@ -22,6 +22,7 @@ void ordCollAddObject(OrderedCollection *collection, Object *object);
 ptrdiff_t ordCollAddObjectIfNotExists(OrderedCollection *collection, Object *object);
 void ordCollRemoveLast(OrderedCollection *collection);
 Value ordCollAt(OrderedCollection *collection, ptrdiff_t index);
+void ordCollAtPut(OrderedCollection *collection, ptrdiff_t index, Value value);
 Object *ordCollObjectAt(OrderedCollection *collection, Value index);
 RawArray *ordCollGetContents(OrderedCollection *collection);
 intptr_t ordCollGetFirstIndex(OrderedCollection *collection);
@@ -11,15 +11,18 @@
 
 NativeCode *findNativeCodeAtIc(uint8_t *ic)
 {
-	PageSpaceIterator iterator;
-	NativeCode *obj;
-	pageSpaceIteratorInit(&iterator, &CurrentThread.heap.execSpace);
-	obj = (NativeCode *) pageSpaceIteratorNext(&iterator);
-	while (obj != NULL) {
+	HeapPage *page = pageSpaceFindPage(&CurrentThread.heap.execSpace, ic);
+	if (page == NULL) {
+		return NULL;
+	}
+	uint8_t *p = page->body;
+	while (p < page->body + page->bodySize) {
+		NativeCode *obj = (NativeCode *) p;
+		size_t size = obj->tags & TAG_FREESPACE ? ((FreeSpace *) obj)->size : computeNativeCodeSize(obj);
 		if ((obj->tags & TAG_FREESPACE) == 0 && obj->insts <= ic && ic < obj->insts + obj->size) {
 			return obj;
 		}
-		obj = (NativeCode *) pageSpaceIteratorNext(&iterator);
+		p += align(size, HEAP_OBJECT_ALIGN);
 	}
 	return NULL;
 }
@@ -8,20 +8,46 @@
 #include "String.h"
 #include "Parser.h"
 
+#define SEND_FEEDBACK_CLASSES 4
+
 typedef Value (*NativeCodeEntry)();
 
+typedef struct {
+	uint16_t cache;
+	uint16_t bytecode;
+	uint32_t counts[SEND_FEEDBACK_CLASSES];
+} SendFeedback;
+
+// bytecode of instructions returned to from call
+typedef struct {
+	uint16_t pos;
+	uint16_t bytecode;
+} NativeDescriptor;
+
+// callee-saved registers holding live variables and those stored in frame, bit for each of them
+typedef struct {
+	uint8_t live;
+	uint8_t saved;
+} StackmapRegs;
+
 typedef struct NativeCode {
 	void *compiledCode;
 	uintptr_t size:56;
 	uint8_t tags;
 	size_t pointersOffsetsSize;
 	size_t argsSize;
-	RawArray *stackmaps;
-	RawArray *descriptors;
-	RawOrderedCollection *typeFeedback;
+	uint32_t stackmapsSize;
+	uint32_t stackmapSetSize;
+	size_t descriptorsSize;
+	size_t sendFeedbackSize;
 	size_t counter;
 	uint8_t insts[];
 	// uint16_t pointersOffsets;
+	// SendFeedback sendFeedback;
+	// NativeDescriptor descriptors;
+	// uint16_t stackmapsIcs;
+	// uint8_t stackmapsSets;
+	// StackmapRegs stackmapsRegs;
 } NativeCode;
 
 typedef struct {
@@ -297,9 +323,79 @@ static RawClass *compiledCodeResolveOperandClass(CompiledCode *code, Operand ope
 }
 
 
+static size_t computeSendFeedbackOffset(size_t size, size_t pointersOffsetsSize)
+{
+	size_t offset = sizeof(NativeCode) + size + pointersOffsetsSize * sizeof(uint16_t);
+	return (offset + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+}
+
+
+static SendFeedback *nativeCodeGetSendFeedback(NativeCode *code)
+{
+	return (SendFeedback *) ((uint8_t *) code + computeSendFeedbackOffset(code->size, code->pointersOffsetsSize));
+}
+
+
+static SendFeedback *nativeCodeFindSendFeedback(NativeCode *code, uint16_t bytecode)
+{
+	SendFeedback *feedback = nativeCodeGetSendFeedback(code);
+	for (size_t i = 0; i < code->sendFeedbackSize; i++) {
+		if (feedback[i].bytecode == bytecode) {
+			return &feedback[i];
+		}
+	}
+	return NULL;
+}
+
+
+static SendFeedback *nativeCodeFindSendFeedbackAtCache(NativeCode *code, uint8_t *cache)
+{
+	SendFeedback *feedback = nativeCodeGetSendFeedback(code);
+	for (size_t i = 0; i < code->sendFeedbackSize; i++) {
+		if (code->insts + feedback[i].cache == cache) {
+			return &feedback[i];
+		}
+	}
+	return NULL;
+}
+
+
+static NativeDescriptor *nativeCodeGetDescriptors(NativeCode *code)
+{
+	return (NativeDescriptor *) (nativeCodeGetSendFeedback(code) + code->sendFeedbackSize);
+}
+
+
+static uint16_t *nativeCodeGetStackmapsIcs(NativeCode *code)
+{
+	return (uint16_t *) (nativeCodeGetDescriptors(code) + code->descriptorsSize);
+}
+
+
+static uint8_t *nativeCodeGetStackmapsSets(NativeCode *code)
+{
+	return (uint8_t *) (nativeCodeGetStackmapsIcs(code) + code->stackmapsSize);
+}
+
+
+static StackmapRegs *nativeCodeGetStackmapsRegs(NativeCode *code)
+{
+	return (StackmapRegs *) (nativeCodeGetStackmapsSets(code) + code->stackmapsSize * code->stackmapSetSize);
+}
+
+
+static size_t computeNativeCodeTablesSize(size_t sendFeedbackSize, size_t descriptorsSize, size_t stackmapsSize, size_t stackmapSetSize)
+{
+	return sendFeedbackSize * sizeof(SendFeedback)
+		+ descriptorsSize * sizeof(NativeDescriptor)
+		+ stackmapsSize * (sizeof(uint16_t) + stackmapSetSize + sizeof(StackmapRegs));
+}
+
+
 static size_t computeNativeCodeSize(NativeCode *code)
 {
-	return sizeof(NativeCode) + code->size + code->pointersOffsetsSize * sizeof(uint16_t);
+	return computeSendFeedbackOffset(code->size, code->pointersOffsetsSize)
+		+ computeNativeCodeTablesSize(code->sendFeedbackSize, code->descriptorsSize, code->stackmapsSize, code->stackmapSetSize);
 }
 
 #endif
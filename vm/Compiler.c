@@ -10,6 +10,7 @@
 #include "Iterator.h"
 #include "Bytecodes.h"
 #include "CodeDescriptors.h"
+#include "Simplifier.h"
 #include "Assert.h"
 #include <stdlib.h>
 #include <string.h>
@@ -23,12 +24,23 @@ typedef struct Compiler {
 	OrderedCollection *literals;
 	OrderedCollection *descriptors;
 	uintptr_t startLine;
+	Operand booleanVar;
+	_Bool isFallback; // compiling blocks of fallback send, see compileFallbackSend
+	_Bool blocksReturn; // some block returns from this method
 } Compiler;
 
+// label which may be target of several jumps
+typedef struct {
+	AssemblerLabel labels[4];
+	size_t size;
+	_Bool isBound;
+	ptrdiff_t offset;
+} JumpLabel;
+
 static void compileMethodBody(Compiler *compiler, MethodNode *node);
 static void processPragmas(Compiler *compiler, MethodNode *node);
 static void processPrimitivePragma(Compiler *compiler, MessageExpressionNode *pragma);
-static CompiledBlock *compileBlock(Compiler *parent, BlockNode *block);
+static CompiledBlock *compileBlock(Compiler *parent, BlockNode *block, _Bool isFallback);
 static void initCompiler(Compiler *compiler, BlockNode *node);
 static void freeCompiler(Compiler *compiler);
 static void compileBody(Compiler *compiler, BlockNode *node, _Bool lastReturn);
@@ -39,6 +51,24 @@ static void createTmpVar(Compiler *compiler, Operand *operand);
 static void compileAssigments(Compiler *compiler, OrderedCollection *assigments, Operand *result);
 static _Bool compareOperands(Operand *a, Operand *b);
 static void compileMessageExpression(Compiler *compiler, Operand *receiver, MessageExpressionNode *node, Operand *result);
+static void compileInlinedMessage(Compiler *compiler, ExpressionNode *node, MessageExpressionNode *message, Operand *result);
+static void compileInlinedConditional(Compiler *compiler, MessageExpressionNode *message, Operand *condition, BlockNode *trueBlock, Operand *trueValue, BlockNode *falseBlock, Operand *falseValue, Operand *result);
+static _Bool compileFallbackSend(Compiler *compiler, MessageExpressionNode *message, Operand *condition, Operand *result, JumpLabel *falseLabel, JumpLabel *endLabel);
+static void compileInlinedBranch(Compiler *compiler, BlockNode *block, Operand *value, Operand *result);
+static void compileInlinedWhile(Compiler *compiler, MessageExpressionNode *message, BlockNode *conditionBlock, _Bool whileTrue, BlockNode *body, Operand *result);
+static void compileInlinedToDo(Compiler *compiler, MessageExpressionNode *message, LiteralNode *start, LiteralNode *stop, BlockNode *body, Operand *result);
+static void compileToDoStep(Compiler *compiler, MessageExpressionNode *message, Operand *start, Operand *step);
+static void compileInlinedBlock(Compiler *compiler, BlockNode *node, Operand *result);
+static void processInlinedVariables(Compiler *compiler);
+static void initBoundVar(Compiler *compiler, uint8_t boxIndex);
+static Operand inlinedArgument(Compiler *compiler, BlockNode *node, size_t index);
+static void compileConditionalJump(Compiler *compiler, MessageExpressionNode *message, Operand *condition, _Bool value, JumpLabel *target);
+static void compileSend(Compiler *compiler, MessageExpressionNode *message, char *selector, Operand *receiver, Operand *args, uint8_t argsSize, Operand *result);
+static void compileReturn(Compiler *compiler, Operand *result, _Bool isOuter);
+static void noteOuterReturn(Compiler *compiler);
+static void initJumpLabel(JumpLabel *label);
+static AssemblerLabel *jumpLabelUse(Compiler *compiler, JumpLabel *label);
+static void jumpLabelBind(Compiler *compiler, JumpLabel *label);
 static void compileLiteral(Compiler *compiler, LiteralNode *literal, Operand *operand);
 static Array *compileArray(LiteralNode *node);
 static void findVar(Compiler *compiler, LiteralNode *name, Operand *operand);
@@ -143,17 +173,20 @@ error:
 }
 
 
-static CompiledBlock *compileBlock(Compiler *parent, BlockNode *node)
+static CompiledBlock *compileBlock(Compiler *parent, BlockNode *node, _Bool isFallback)
 {
 	Compiler compiler;
 	CompiledBlock *block;
 
 	initCompiler(&compiler, node);
 	compiler.parent = parent;
+	compiler.isFallback = parent->isFallback || isFallback;
 	compiler.literals = parent->literals;
 	compiler.startLine = sourceCodeGetLine(blockNodeGetSourceCode(node));
 
 	compileBody(&compiler, node, 1);
+	// blocks without context are run in frame of their activation only, outer return needs home context
+	compiler.header.hasContext |= compiler.header.outerReturns;
 	block = createBlock(&compiler, node);
 	freeCompiler(&compiler);
 	return block;
@@ -167,6 +200,9 @@ static void initCompiler(Compiler *compiler, BlockNode *node)
 	compiler->scope = blockNodeGetScope(node);
 	compiler->header = blockScopeGetHeader(compiler->scope);
 	compiler->descriptors = newOrdColl(32);
+	compiler->booleanVar.isValid = 0;
+	compiler->isFallback = 0;
+	compiler->blocksReturn = 0;
 }
 
 
@@ -193,8 +229,7 @@ static void compileBody(Compiler *compiler, BlockNode *node, _Bool isBlock)
 		result.isValid = 0;
 		compileExpression(compiler, expr, returns, &result);
 		if (returns) {
-			compiler->header.outerReturns = isBlock && expressionNodeReturns(expr);
-			bytecodeReturn(&compiler->buffer, &result, compiler->header.outerReturns);
+			compileReturn(compiler, &result, isBlock && expressionNodeReturns(expr));
 		}
 
 		closeHandleScope(&scope, NULL);
@@ -227,6 +262,9 @@ static void processVariables(Compiler *compiler)
 		Value var = assoc->raw->value;
 		if (getVarType(var) == OPERAND_TEMP_VAR) {
 			setVarIndex(&assoc->raw->value, index++);
+			if (isVarBoxed(var)) {
+				initBoundVar(compiler, index++);
+			}
 		} else if (getVarType(var) == OPERAND_ARG_VAR && hasVarCtxCopy(var)) {
 			varAsOperand(var, &src);
 			dst.index = getVarCtxCopy(var);
@@ -255,18 +293,23 @@ static void compileExpression(Compiler *compiler, ExpressionNode *node, _Bool st
 			}
 		}
 
-		Operand receiver;
-		compileLiteral(compiler, expressionNodeGetReceiver(node), &receiver);
-
-		Iterator iterator;
-		initOrdCollIterator(&iterator, messages, 0, 0);
-		while (iteratorHasNext(&iterator)) {
-			HandleScope scope2;
-			openHandleScope(&scope2);
-			MessageExpressionNode *messageExpr = (MessageExpressionNode *) iteratorNextObject(&iterator);
-			Operand *messageExprResult = !iteratorHasNext(&iterator) && result->isValid ? result : NULL;
-			compileMessageExpression(compiler, &receiver, messageExpr, messageExprResult);
-			closeHandleScope(&scope2, NULL);
+		MessageExpressionNode *message = (MessageExpressionNode *) ordCollObjectAt(messages, 0);
+		if (isInlinedMessage(node, message)) {
+			compileInlinedMessage(compiler, node, message, result->isValid ? result : NULL);
+		} else {
+			Operand receiver;
+			compileLiteral(compiler, expressionNodeGetReceiver(node), &receiver);
+
+			Iterator iterator;
+			initOrdCollIterator(&iterator, messages, 0, 0);
+			while (iteratorHasNext(&iterator)) {
+				HandleScope scope2;
+				openHandleScope(&scope2);
+				MessageExpressionNode *messageExpr = (MessageExpressionNode *) iteratorNextObject(&iterator);
+				Operand *messageExprResult = !iteratorHasNext(&iterator) && result->isValid ? result : NULL;
+				compileMessageExpression(compiler, &receiver, messageExpr, messageExprResult);
+				closeHandleScope(&scope2, NULL);
+			}
 		}
 
 	} else {
@@ -364,6 +407,459 @@ static void compileMessageExpression(Compiler *compiler, Operand *receiver, Mess
 }
 
 
+static void compileInlinedMessage(Compiler *compiler, ExpressionNode *node, MessageExpressionNode *message, Operand *result)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	String *selector = messageExpressionNodeGetSelector(message);
+	OrderedCollection *args = messageExpressionNodeGetArgs(message);
+	LiteralNode *receiver = expressionNodeGetReceiver(node);
+	BlockNode *firstBlock = ordCollSize(args) > 0 ? (BlockNode *) ordCollObjectAt(args, 0) : NULL;
+	BlockNode *secondBlock = ordCollSize(args) > 1 ? (BlockNode *) ordCollObjectAt(args, 1) : NULL;
+	Operand nilOperand = { .isValid = 1, .type = OPERAND_NIL };
+	Operand trueOperand = { .isValid = 1, .type = OPERAND_TRUE };
+	Operand falseOperand = { .isValid = 1, .type = OPERAND_FALSE };
+	Operand condition;
+
+	if (stringEqualsC(selector, "whileTrue:") || stringEqualsC(selector, "whileTrue")) {
+		compileInlinedWhile(compiler, message, (BlockNode *) receiver, 1, firstBlock, result);
+	} else if (stringEqualsC(selector, "whileFalse:") || stringEqualsC(selector, "whileFalse")) {
+		compileInlinedWhile(compiler, message, (BlockNode *) receiver, 0, firstBlock, result);
+	} else if (stringEqualsC(selector, "to:do:")) {
+		compileInlinedToDo(compiler, message, receiver, (LiteralNode *) firstBlock, secondBlock, result);
+	} else {
+		compileLiteral(compiler, receiver, &condition);
+		if (stringEqualsC(selector, "ifTrue:")) {
+			compileInlinedConditional(compiler, message, &condition, firstBlock, NULL, NULL, &nilOperand, result);
+		} else if (stringEqualsC(selector, "ifFalse:")) {
+			compileInlinedConditional(compiler, message, &condition, NULL, &nilOperand, firstBlock, NULL, result);
+		} else if (stringEqualsC(selector, "ifTrue:ifFalse:")) {
+			compileInlinedConditional(compiler, message, &condition, firstBlock, NULL, secondBlock, NULL, result);
+		} else if (stringEqualsC(selector, "ifFalse:ifTrue:")) {
+			compileInlinedConditional(compiler, message, &condition, secondBlock, NULL, firstBlock, NULL, result);
+		} else if (stringEqualsC(selector, "and:")) {
+			compileInlinedConditional(compiler, message, &condition, firstBlock, NULL, NULL, &falseOperand, result);
+		} else if (stringEqualsC(selector, "or:")) {
+			compileInlinedConditional(compiler, message, &condition, NULL, &trueOperand, firstBlock, NULL, result);
+		} else {
+			FAIL();
+		}
+	}
+
+	closeHandleScope(&scope, NULL);
+}
+
+
+// each branch is either inlined block or value
+static void compileInlinedConditional(Compiler *compiler, MessageExpressionNode *message, Operand *condition, BlockNode *trueBlock, Operand *trueValue, BlockNode *falseBlock, Operand *falseValue, Operand *result)
+{
+	JumpLabel falseLabel;
+	JumpLabel endLabel;
+	initJumpLabel(&falseLabel);
+	initJumpLabel(&endLabel);
+
+	if (!compileFallbackSend(compiler, message, condition, result, &falseLabel, &endLabel)) {
+		compileConditionalJump(compiler, message, condition, 0, &falseLabel);
+	}
+	compileInlinedBranch(compiler, trueBlock, trueValue, result);
+	if (falseBlock != NULL || result != NULL) {
+		bytecodeJump(&compiler->buffer, jumpLabelUse(compiler, &endLabel));
+		jumpLabelBind(compiler, &falseLabel);
+		compileInlinedBranch(compiler, falseBlock, falseValue, result);
+	} else {
+		jumpLabelBind(compiler, &falseLabel);
+	}
+	jumpLabelBind(compiler, &endLabel);
+}
+
+
+// other receivers than booleans are sent the original message with its blocks compiled again as real blocks, their
+// outer context is context of the send holding boxes of bound variables, see analyzeFallbackBlocks
+static _Bool compileFallbackSend(Compiler *compiler, MessageExpressionNode *message, Operand *condition, Operand *result, JumpLabel *falseLabel, JumpLabel *endLabel)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	AssemblerBuffer *buffer = &compiler->buffer;
+	OrderedCollection *args = messageExpressionNodeGetArgs(message);
+	OrderedCollection *replacedScopes = newOrdColl(8);
+	size_t literalsSize = ordCollSize(compiler->literals);
+	BlockScope *fallbackScope = analyzeFallbackBlocks(compiler->scope, args, replacedScopes);
+	uint8_t blocksSize = ordCollSize(args);
+	Operand blocks[blocksSize];
+	Iterator iterator;
+
+	if (!blockScopeHasError(fallbackScope)) {
+		initOrdCollIterator(&iterator, args, 0, 0);
+		while (iteratorHasNext(&iterator)) {
+			ptrdiff_t index = iteratorIndex(&iterator);
+			CompiledBlock *block = compileBlock(compiler, (BlockNode *) iteratorNextObject(&iterator), 1);
+			blocks[index].isValid = 1;
+			blocks[index].type = OPERAND_BLOCK;
+			blocks[index].index = ordCollAddObjectIfNotExists(compiler->literals, (Object *) block);
+		}
+	}
+	restoreBlockScopes(replacedScopes);
+	uint8_t selector = ordCollAddObjectIfNotExists(compiler->literals, (Object *) asSymbol(messageExpressionNodeGetSelector(message)));
+
+	// variables of the sending code used by blocks are in context of the send, outer ones in its outer context
+	uint8_t varsSize = fallbackScope->raw->header.contextSize;
+	uint8_t flags = fallbackScope->raw->header.outerReturns ? FALLBACK_RETURNS : 0;
+	Operand vars[varsSize + 1];
+	_Bool isComplete = !blockScopeHasError(fallbackScope) && ordCollSize(compiler->literals) <= 256;
+
+	initDictIterator(&iterator, blockScopeGetVars(fallbackScope));
+	while (isComplete && iteratorHasNext(&iterator)) {
+		Association *assoc = (Association *) iteratorNextObject(&iterator);
+		if (isNil(assoc) || getVarType(assoc->raw->value) != OPERAND_CONTEXT_VAR) {
+			continue;
+		}
+		Value var = assoc->raw->value;
+		if (getVarLevel(var) > 0) {
+			flags |= isVarUsed(var) ? FALLBACK_OUTER : 0;
+			continue;
+		}
+		Operand *operand = &vars[getVarIndex(var)];
+		Value outerVar = lookupVariable(compiler->scope, scopeHandle(asObject(assoc->raw->key)));
+		if (isTaggedNil(outerVar)) {
+			isComplete = 0;
+			continue;
+		}
+		varAsOperand(outerVar, operand);
+		isComplete = isComplete && isVarBoxed(var) == (operand->type == OPERAND_BOUND_VAR);
+	}
+	if (!isComplete) {
+		while (ordCollSize(compiler->literals) > literalsSize) {
+			ordCollRemoveLast(compiler->literals);
+		}
+		closeHandleScope(&scope, NULL);
+		return 0;
+	}
+	if ((flags & FALLBACK_RETURNS) && compiler->parent != NULL) {
+		noteOuterReturn(compiler);
+	}
+
+	Operand self = { .isValid = 1, .type = OPERAND_ARG_VAR, .index = SELF_INDEX };
+	Operand sendResult;
+	JumpLabel trueLabel;
+	initJumpLabel(&trueLabel);
+
+	if (result != NULL) {
+		sendResult = *result;
+	} else {
+		if (!compiler->booleanVar.isValid) {
+			createTmpVar(compiler, &compiler->booleanVar);
+		}
+		sendResult = compiler->booleanVar;
+	}
+
+	bytecodeJumpIf(buffer, condition, 0, jumpLabelUse(compiler, falseLabel));
+	bytecodeJumpIf(buffer, condition, 1, jumpLabelUse(compiler, &trueLabel));
+	notePosition(compiler, messageExpressionNodeGetSourceCode(message));
+	bytecodeFallbackSend(buffer, selector, condition, blocks, blocksSize, &self, vars, varsSize, flags, &sendResult);
+	bytecodeJump(buffer, jumpLabelUse(compiler, endLabel));
+	jumpLabelBind(compiler, &trueLabel);
+
+	closeHandleScope(&scope, NULL);
+	return 1;
+}
+
+
+static void compileInlinedBranch(Compiler *compiler, BlockNode *block, Operand *value, Operand *result)
+{
+	if (block != NULL) {
+		compileInlinedBlock(compiler, block, result);
+	} else if (result != NULL) {
+		bytecodeCopy(&compiler->buffer, value, result);
+	}
+}
+
+
+// loops whose value is used answer their receiver block and are sent, see analyzeExpression
+static void compileInlinedWhile(Compiler *compiler, MessageExpressionNode *message, BlockNode *conditionBlock, _Bool whileTrue, BlockNode *body, Operand *result)
+{
+	ASSERT(result == NULL);
+	Operand condition = { .isValid = 0 };
+	JumpLabel loopLabel;
+	JumpLabel endLabel;
+	initJumpLabel(&loopLabel);
+	initJumpLabel(&endLabel);
+
+	jumpLabelBind(compiler, &loopLabel);
+	compileInlinedBlock(compiler, conditionBlock, &condition);
+	compileConditionalJump(compiler, message, &condition, !whileTrue, &endLabel);
+	if (body != NULL) {
+		compileInlinedBlock(compiler, body, NULL);
+	}
+	bytecodeJump(&compiler->buffer, jumpLabelUse(compiler, &loopLabel));
+	jumpLabelBind(compiler, &endLabel);
+}
+
+
+// stop and step are evaluated once, step is unity of receiver which is 1 for small integers, loop answers its receiver
+static void compileInlinedToDo(Compiler *compiler, MessageExpressionNode *message, LiteralNode *start, LiteralNode *stop, BlockNode *body, Operand *result)
+{
+	Operand startValue;
+	Operand stopValue;
+	Operand condition;
+	Operand step = { .isValid = 1, .type = OPERAND_VALUE, .value = tagInt(1) };
+	Operand counter = inlinedArgument(compiler, body, 0);
+	JumpLabel loopLabel;
+	JumpLabel endLabel;
+	initJumpLabel(&loopLabel);
+	initJumpLabel(&endLabel);
+
+	compileLiteral(compiler, start, &startValue);
+	if (startValue.type != OPERAND_VALUE) {
+		Operand tmp;
+		createTmpVar(compiler, &tmp);
+		bytecodeCopy(&compiler->buffer, &startValue, &tmp);
+		startValue = tmp;
+	}
+	if (startValue.type != OPERAND_VALUE || !valueTypeOf(startValue.value, VALUE_INT)) {
+		compileToDoStep(compiler, message, &startValue, &step);
+	}
+	compileLiteral(compiler, stop, &stopValue);
+	if (stopValue.type != OPERAND_VALUE) {
+		Operand tmp;
+		createTmpVar(compiler, &tmp);
+		bytecodeCopy(&compiler->buffer, &stopValue, &tmp);
+		stopValue = tmp;
+	}
+	createTmpVar(compiler, &condition);
+	bytecodeCopy(&compiler->buffer, &startValue, &counter);
+
+	jumpLabelBind(compiler, &loopLabel);
+	compileSend(compiler, message, "<=", &counter, &stopValue, 1, &condition);
+	compileConditionalJump(compiler, message, &condition, 0, &endLabel);
+	compileInlinedBlock(compiler, body, NULL);
+	compileSend(compiler, message, "+", &counter, &step, 1, &counter);
+	bytecodeJump(&compiler->buffer, jumpLabelUse(compiler, &loopLabel));
+	jumpLabelBind(compiler, &endLabel);
+
+	if (result != NULL) {
+		bytecodeCopy(&compiler->buffer, &startValue, result);
+	}
+}
+
+
+static void compileToDoStep(Compiler *compiler, MessageExpressionNode *message, Operand *start, Operand *step)
+{
+	Operand one = *step;
+	uint8_t smallInteger = ordCollAddObjectIfNotExists(compiler->literals, (Object *) Handles.SmallInteger);
+	JumpLabel unityLabel;
+	JumpLabel endLabel;
+	initJumpLabel(&unityLabel);
+	initJumpLabel(&endLabel);
+
+	createTmpVar(compiler, step);
+	bytecodeJumpNotMemberOf(&compiler->buffer, start, smallInteger, jumpLabelUse(compiler, &unityLabel));
+	bytecodeCopy(&compiler->buffer, &one, step);
+	bytecodeJump(&compiler->buffer, jumpLabelUse(compiler, &endLabel));
+	jumpLabelBind(compiler, &unityLabel);
+	compileSend(compiler, message, "unity", start, NULL, 0, step);
+	jumpLabelBind(compiler, &endLabel);
+}
+
+
+// valid result receives value of block, invalid one is set to operand holding it
+static void compileInlinedBlock(Compiler *compiler, BlockNode *node, Operand *result)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	BlockScope *outerScope = compiler->scope;
+	Operand value = { .isValid = 1, .type = OPERAND_NIL };
+	Iterator iterator;
+
+	compiler->scope = blockNodeGetScope(node);
+	processInlinedVariables(compiler);
+
+	initOrdCollIterator(&iterator, blockNodeGetExpressions(node), 0, 0);
+	while (iteratorHasNext(&iterator)) {
+		HandleScope scope2;
+		openHandleScope(&scope2);
+
+		ExpressionNode *expr = (ExpressionNode *) iteratorNextObject(&iterator);
+		_Bool returns = expressionNodeReturns(expr);
+		value.isValid = 0;
+		compileExpression(compiler, expr, returns || (result != NULL && !iteratorHasNext(&iterator)), &value);
+		if (returns) {
+			// return from inlined block of block is return from its home method
+			compileReturn(compiler, &value, compiler->parent != NULL);
+			value.isValid = 1;
+			value.type = OPERAND_NIL;
+		}
+
+		closeHandleScope(&scope2, NULL);
+	}
+
+	if (result != NULL) {
+		if (!result->isValid) {
+			*result = value;
+		} else if (!compareOperands(&value, result)) {
+			bytecodeCopy(&compiler->buffer, &value, result);
+		}
+	}
+	compiler->scope = outerScope;
+	closeHandleScope(&scope, NULL);
+}
+
+
+// temporaries of inlined block get frame slots of enclosing block and are nil on every evaluation
+static void processInlinedVariables(Compiler *compiler)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	Iterator iterator;
+	Operand nil = { .isValid = 1, .type = OPERAND_NIL };
+	Operand var;
+
+	initDictIterator(&iterator, blockScopeGetVars(compiler->scope));
+	while (iteratorHasNext(&iterator)) {
+		Association *assoc = (Association *) iteratorNextObject(&iterator);
+		if (isNil(assoc)) {
+			continue;
+		}
+		Value value = assoc->raw->value;
+		if (getVarType(value) == OPERAND_TEMP_VAR && getVarIndex(value) == 0) {
+			setVarIndex(&assoc->raw->value, compiler->header.tempsSize++);
+			if (isVarBoxed(value)) {
+				compiler->header.tempsSize++;
+			}
+		}
+		if (!isVarReadonly(value)) {
+			// bound variable gets fresh box as well
+			varAsOperand(assoc->raw->value, &var);
+			if (var.type == OPERAND_BOUND_VAR) {
+				initBoundVar(compiler, var.index + 1);
+				var.type = OPERAND_TEMP_VAR;
+			}
+			bytecodeCopy(&compiler->buffer, &nil, &var);
+		}
+	}
+
+	closeHandleScope(&scope, NULL);
+}
+
+
+// bound variable has no box until fallback blocks capture it
+static void initBoundVar(Compiler *compiler, uint8_t boxIndex)
+{
+	Operand noBox = { .isValid = 1, .type = OPERAND_VALUE, .value = tagInt(0) };
+	Operand box = { .isValid = 1, .type = OPERAND_TEMP_VAR, .index = boxIndex };
+	bytecodeCopy(&compiler->buffer, &noBox, &box);
+}
+
+
+static Operand inlinedArgument(Compiler *compiler, BlockNode *node, size_t index)
+{
+	LiteralNode *arg = (LiteralNode *) ordCollObjectAt(blockNodeGetArgs(node), index);
+	Dictionary *vars = blockScopeGetVars(blockNodeGetScope(node));
+	String *name = literalNodeGetStringValue(arg);
+	Value var = stringDictAt(vars, name);
+	Operand operand;
+
+	ASSERT(getVarType(var) == OPERAND_TEMP_VAR);
+	if (getVarIndex(var) == 0) {
+		setVarIndex(&var, compiler->header.tempsSize++);
+		stringDictAtPut(vars, name, var);
+	}
+	varAsOperand(var, &operand);
+	return operand;
+}
+
+
+// jumps when condition is given boolean and falls through when it is the other one,
+// other objects are sent #mustBeBoolean and its result is tested again
+static void compileConditionalJump(Compiler *compiler, MessageExpressionNode *message, Operand *condition, _Bool value, JumpLabel *target)
+{
+	AssemblerBuffer *buffer = &compiler->buffer;
+	JumpLabel testLabel;
+	JumpLabel endLabel;
+	initJumpLabel(&testLabel);
+	initJumpLabel(&endLabel);
+
+	if (!compiler->booleanVar.isValid) {
+		createTmpVar(compiler, &compiler->booleanVar);
+	}
+
+	bytecodeJumpIf(buffer, condition, value, jumpLabelUse(compiler, target));
+	bytecodeJumpIf(buffer, condition, !value, jumpLabelUse(compiler, &endLabel));
+	compileSend(compiler, message, "mustBeBoolean", condition, NULL, 0, &compiler->booleanVar);
+
+	jumpLabelBind(compiler, &testLabel);
+	bytecodeJumpIf(buffer, &compiler->booleanVar, value, jumpLabelUse(compiler, target));
+	bytecodeJumpIf(buffer, &compiler->booleanVar, !value, jumpLabelUse(compiler, &endLabel));
+	compileSend(compiler, message, "mustBeBoolean", &compiler->booleanVar, NULL, 0, &compiler->booleanVar);
+	bytecodeJump(buffer, jumpLabelUse(compiler, &testLabel));
+
+	jumpLabelBind(compiler, &endLabel);
+}
+
+
+static void compileSend(Compiler *compiler, MessageExpressionNode *message, char *selector, Operand *receiver, Operand *args, uint8_t argsSize, Operand *result)
+{
+	uint8_t literalIndex = ordCollAddObjectIfNotExists(compiler->literals, (Object *) asSymbol(asString(selector)));
+	notePosition(compiler, messageExpressionNodeGetSourceCode(message));
+	bytecodeSendWithStore(&compiler->buffer, literalIndex, receiver, result, args, argsSize);
+}
+
+
+static void compileReturn(Compiler *compiler, Operand *result, _Bool isOuter)
+{
+	if (isOuter) {
+		noteOuterReturn(compiler);
+	}
+	bytecodeReturn(&compiler->buffer, result, isOuter);
+}
+
+
+// home method of returning blocks needs context, fallback sends provide one to their blocks, see generateFallbackSend
+static void noteOuterReturn(Compiler *compiler)
+{
+	compiler->header.outerReturns = 1;
+	if (!compiler->isFallback) {
+		Compiler *method = compiler;
+		while (method->parent != NULL) {
+			method = method->parent;
+		}
+		method->blocksReturn = 1;
+	}
+}
+
+
+static void initJumpLabel(JumpLabel *label)
+{
+	label->size = 0;
+	label->isBound = 0;
+}
+
+
+static AssemblerLabel *jumpLabelUse(Compiler *compiler, JumpLabel *label)
+{
+	ASSERT(label->size < sizeof(label->labels) / sizeof(*label->labels));
+	AssemblerLabel *assemblerLabel = &label->labels[label->size++];
+	asmInitLabel(assemblerLabel);
+	if (label->isBound) {
+		asmLabelBind(&compiler->buffer, assemblerLabel, label->offset);
+	}
+	return assemblerLabel;
+}
+
+
+static void jumpLabelBind(Compiler *compiler, JumpLabel *label)
+{
+	label->isBound = 1;
+	label->offset = asmOffset(&compiler->buffer);
+	for (size_t i = 0; i < label->size; i++) {
+		asmLabelBind(&compiler->buffer, &label->labels[i], label->offset);
+	}
+}
+
+
 static void compileLiteral(Compiler *compiler, LiteralNode *literal, Operand *operand)
 {
 	operand->isValid = 1;
@@ -397,8 +893,13 @@ static void compileLiteral(Compiler *compiler, LiteralNode *literal, Operand *op
 		operand->index = ordCollAddObjectIfNotExists(compiler->literals, (Object *) compileArray(literal));
 
 	} else if (literal->raw->class == Handles.BlockNode->raw) {
+		CompiledBlock *block = compileBlock(compiler, (BlockNode *) literal, 0);
+		// nested block reads its home and outer context from context of enclosing block
+		if (compiler->parent != NULL && block->raw->header.hasContext) {
+			compiler->header.hasContext = 1;
+		}
 		operand->type = OPERAND_BLOCK;
-		operand->index = ordCollAddObjectIfNotExists(compiler->literals, (Object *) compileBlock(compiler, (BlockNode *) literal));
+		operand->index = ordCollAddObjectIfNotExists(compiler->literals, (Object *) block);
 
 	} else if (literal->raw->class == Handles.ExpressionNode->raw) {
 		compileExpression(compiler, (ExpressionNode *) literal, 1, operand);
@@ -432,7 +933,7 @@ static Array *compileArray(LiteralNode *node)
 		} else if (literal->raw->class == Handles.FalseNode->raw) {
 			arrayAtPutObject(array, index, Handles.false);
 		} else {
-			array->raw->vars[index] = literalNodeGetValue(literal);
+			rawObjectStoreValue((RawObject *) array->raw, &array->raw->vars[index], literalNodeGetValue(literal));
 		}
 		closeHandleScope(&scope2, NULL);
 	}
@@ -442,17 +943,27 @@ static Array *compileArray(LiteralNode *node)
 
 static void findVar(Compiler *compiler, LiteralNode *name, Operand *operand)
 {
-	Value var = stringDictAt(blockScopeGetVars(compiler->scope), literalNodeGetStringValue(name));
+	Value var = lookupVariable(compiler->scope, literalNodeGetStringValue(name));
 	varAsOperand(var, operand);
 }
 
 
+// boxed temporary of sending code is bound to its box, fallback blocks reach the box through context of the send
 static void varAsOperand(Value var, Operand *operand)
 {
 	operand->isValid = 1;
 	operand->type = getVarType(var);
 	operand->index = getVarIndex(var);
 	operand->level = getVarLevel(var);
+	if (isVarBoxed(var) && operand->type == OPERAND_TEMP_VAR) {
+		operand->type = OPERAND_BOUND_VAR;
+	} else if (isVarBoxed(var) && operand->type == OPERAND_CONTEXT_VAR) {
+		operand->type = OPERAND_INST_VAR_OF;
+		operand->index = (offsetof(RawAssociation, value) - offsetof(RawObject, body)) / sizeof(Value);
+		operand->instance.type = OPERAND_CONTEXT_VAR;
+		operand->instance.index = getVarIndex(var);
+		operand->instance.level = getVarLevel(var);
+	}
 }
 
 
@@ -470,8 +981,12 @@ static void notePosition(Compiler *compiler, SourceCode *sourceCode)
 
 static CompiledMethod *createMethod(Compiler *compiler, MethodNode *node, Class *class)
 {
+	simplifyBytecodes(&compiler->buffer, compiler->literals, compiler->descriptors);
 	size_t size = compiler->buffer.p - compiler->buffer.buffer;
 	CompiledMethod *method = (CompiledMethod *) newObject(Handles.CompiledMethod, size);
+	compiler->header.hasContext |= compiler->blocksReturn;
+	// returns of blocks unwind frames up to the method, see generateOuterReturn
+	compiler->header.outerReturns |= compiler->blocksReturn;
 	compiledMethodSetHeader(method, compiler->header);
 	compiledMethodSetSelector(method, asSymbol(methodNodeGetSelector(node)));
 	compiledMethodSetLiterals(method, ordCollAsArray(compiler->literals));
@@ -495,10 +1010,7 @@ static void setupMethodToBlocks(OrderedCollection *literals, CompiledMethod *met
 		Value value = iteratorNext(&iterator);
 		if (valueTypeOf(value, VALUE_POINTER) && asObject(value)->class == Handles.CompiledBlock->raw) {
 			RawCompiledBlock *block = (RawCompiledBlock *) asObject(value);
-			block->method = getTaggedPtr(method);
-			if (block->header.outerReturns) {
-				method->raw->header.hasContext = 1;
-			}
+			rawObjectStorePtr((RawObject *) block, &block->method, (RawObject *) method->raw);
 		}
 	}
 
@@ -508,6 +1020,7 @@ static void setupMethodToBlocks(OrderedCollection *literals, CompiledMethod *met
 
 static CompiledBlock *createBlock(Compiler *compiler, BlockNode *node)
 {
+	simplifyBytecodes(&compiler->buffer, compiler->literals, compiler->descriptors);
 	size_t size = compiler->buffer.p - compiler->buffer.buffer;
 	CompiledBlock *block = (CompiledBlock *) newObject(Handles.CompiledBlock, size);
 	compiledBlockSetHeader(block, compiler->header);
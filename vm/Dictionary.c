@@ -48,7 +48,7 @@ Association *dictAtPut(Dictionary *dict, DictComparator cmp, Object *key, Value
 	if (isNil(assoc)) {
 		assoc = newObject(Handles.Association, 0);
 		objectStorePtr((Object *) assoc, &assoc->raw->key, key);
-		assoc->raw->value = value;
+		rawObjectStoreValue((RawObject *) assoc->raw, &assoc->raw->value, value);
 
 		arrayAtPutObject(contents, index, (Object *) assoc);
 		dict->raw->tally += tagInt(1);
@@ -57,7 +57,7 @@ Association *dictAtPut(Dictionary *dict, DictComparator cmp, Object *key, Value
 		}
 	} else {
 		ASSERT(assoc->raw->class == Handles.Association->raw);
-		assoc->raw->value = value;
+		rawObjectStoreValue((RawObject *) assoc->raw, &assoc->raw->value, value);
 	}
 	return assoc;
 }
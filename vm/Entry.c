@@ -5,7 +5,6 @@
 #include "Lookup.h"
 #include "StubCode.h"
 #include "Compiler.h"
-#include "Iterator.h"
 #include "Heap.h"
 #include "Smalltalk.h"
 #include "Thread.h"
@@ -51,12 +50,13 @@ Value invokeInititalize(Object *object)
 Value sendMessage(String *selector, EntryArgs *args)
 {
 	NativeCodeEntry entry = (NativeCodeEntry) getStubNativeCode(&SmalltalkEntry)->insts;
+	// context is initialized first, its allocation could collect native code looked up before it
+	initThreadContext(&CurrentThread);
 	RawClass *class = args->values[0].isHandle ? args->values[0].handle->raw->class : getClassOf(args->values[0].value);
 	NativeCodeEntry nativeCodeEntry = cachedLookupNativeCode(class, selector->raw);
 	NativeCode *nativeCode = (NativeCode *) ((uint8_t *) nativeCodeEntry - offsetof(NativeCode, insts));
 	Value rawArgs[args->size];
 	initArgs(rawArgs, args);
-	initThreadContext(&CurrentThread);
 	return entry(nativeCode->compiledCode, nativeCodeEntry, rawArgs, &CurrentThread);
 }
 
@@ -141,15 +141,12 @@ _Bool parseFileAndInitialize(char *filename, Value *lastBlockResult)
 		return 0;
 	}
 
-	Iterator iterator;
-	initOrdCollIterator(&iterator, classes, 0, 0);
-	while (iteratorHasNext(&iterator)) {
-		invokeInititalize(iteratorNextObject(&iterator));
+	// iterators point into contents which could be moved by scavenges while evaluating
+	for (size_t i = 0; i < ordCollSize(classes); i++) {
+		invokeInititalize(ordCollObjectAt(classes, i));
 	}
-
-	initOrdCollIterator(&iterator, blocks, 0, 0);
-	while (iteratorHasNext(&iterator)) {
-		*lastBlockResult = evalBlockNode((BlockNode *) iteratorNextObject(&iterator));
+	for (size_t i = 0; i < ordCollSize(blocks); i++) {
+		*lastBlockResult = evalBlockNode((BlockNode *) ordCollObjectAt(blocks, i));
 	}
 
 	closeHandleScope(&scope, NULL);
@@ -16,11 +16,7 @@ static void freeSpacePrint(FreeSpace *freeSpace);
 
 void initFreeList(FreeList *freeList, struct HeapPage *page)
 {
-	for (size_t i = 0; i < FREE_LIST_SIZE; i++) {
-		freeList->freeSpaces[i] = NULL;
-	}
-	freeList->freeSpaces[FREE_LIST_SIZE] = createInitialFreeSpace(page);
-	memset(freeList->freeMap, 0, sizeof(freeList->freeMap));
+	resetFreeList(freeList);
 #if FREE_LIST_COLLECT_STATS
 	freeList->stats.exactAllocs = 0;
 	freeList->stats.nextAllocs = 0;
@@ -30,6 +26,17 @@ void initFreeList(FreeList *freeList, struct HeapPage *page)
 	freeList->stats.averageAddedSpaceSize = 0;
 	freeList->stats.expanded = 0;
 #endif
+	freeListAddFreeSpace(freeList, createInitialFreeSpace(page));
+}
+
+
+// forgets all free spaces, they are added again as pages are swept
+void resetFreeList(FreeList *freeList)
+{
+	for (size_t i = 0; i <= FREE_LIST_SIZE; i++) {
+		freeList->freeSpaces[i] = NULL;
+	}
+	memset(freeList->freeMap, 0, sizeof(freeList->freeMap));
 }
 
 
@@ -69,15 +76,21 @@ uint8_t *freeListTryAllocate(FreeList *freeList, size_t size)
 		}
 	}
 
-	FreeSpace *freeSpace = freeList->freeSpaces[FREE_LIST_SIZE];
-	while (freeSpace != NULL) {
+	// large free spaces have various sizes since sweeping coalesces them, the first one which fits is unlinked
+	FreeSpace **link = &freeList->freeSpaces[FREE_LIST_SIZE];
+	while (*link != NULL) {
+		FreeSpace *freeSpace = *link;
 		if (freeSpace->size >= size) {
 #if FREE_LIST_COLLECT_STATS
 			freeList->stats.fallbackAllocs++;
 #endif
-			return (uint8_t *) popAndSplitFreeSpace(freeList, FREE_LIST_SIZE, size);
+			*link = freeSpace->next;
+			if (freeList->freeSpaces[FREE_LIST_SIZE] == NULL) {
+				freeList->freeMap[FREE_LIST_SIZE / 8] &= ~(1 << (FREE_LIST_SIZE % 8));
+			}
+			return (uint8_t *) (freeSpace->size == size ? freeSpace : splitFreeSpace(freeList, freeSpace, size));
 		}
-		freeSpace = freeSpace->next;
+		link = &freeSpace->next;
 	}
 
 	return NULL;
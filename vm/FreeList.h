@@ -34,6 +34,7 @@ struct HeapPage;
 
 void initFreeList(FreeList *freeList, struct HeapPage *page);
 void expandFreeList(FreeList *freeList, struct HeapPage *page);
+void resetFreeList(FreeList *freeList);
 FreeSpace *createFreeSpace(uint8_t *p, size_t size);
 void freeListAddFreeSpace(FreeList *freeList, FreeSpace *freeSpace);
 uint8_t *freeListTryAllocate(FreeList *freeList, size_t size);
@@ -7,47 +7,256 @@
 #include "Entry.h"
 #include "StackFrame.h"
 #include "Thread.h"
+#include "Exception.h"
+#include "Lookup.h"
+#include "CodeGenerator.h"
+#include "WorkerPool.h"
 #include "Assert.h"
 #include <stdio.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
 
 #define QUEUE_INIT_SIZE 1024
+#define DEQUE_SIZE (64 * 1024)
+#define OVERFLOW_BATCH_SIZE 64
+// pages whose marked objects take less than this part of them are evacuated
+#define EVACUATION_LIVE_PERCENT 25
+#define EVACUATION_MIN_PAGES 2
+// number of sweeps a page has to stay empty before its memory is released
+#define PAGE_RELEASE_SWEEPS 2
+// number of collections after which classes are no longer pretenured unless their instances keep surviving
+#define PRETENURING_RESET_COLLECTIONS 2
+// code cache over its size is evicted down to this part of it
+#define CODE_CACHE_EVICTION_PERCENT 75
+
+// work-stealing deque of objects to be scanned, its worker pushes and pops at bottom while others steal at top
+typedef struct {
+	RawObject **objects;
+	ptrdiff_t top;
+	ptrdiff_t bottom;
+	size_t marked;
+} __attribute__((aligned(64))) MarkingQueue;
 
 typedef struct {
-	size_t size;
 	RawObject **objects;
-	ptrdiff_t index;
-} MarkingQueue;
+	size_t size;
+	size_t capacity;
+} ObjectList;
+
+// pages of last mark and sweep, claimed one at a time by allocations, workers and background sweeper
+typedef struct {
+	PageSpace *space;
+	HeapPage **pages;
+	size_t size;
+	size_t capacity;
+	size_t next;
+} SweepJob;
 
+static void drainMarkingQueues(Thread *thread);
+static void markWorker(size_t worker, void *arg);
+static _Bool hasMarkingWork(void);
 static void iterateStack(MarkingQueue *queue, Thread *thread);
 static void iterateHandles(MarkingQueue *queue, Thread *thread);
-static void iterateNativeCode(MarkingQueue *queue, Thread *thread);
+static void iterateNativeCodeRoots(MarkingQueue *queue, Thread *thread, _Bool isRemark);
+static void iterateNativeCode(MarkingQueue *queue, Thread *thread, NativeCode *code);
+static void markNativeCode(MarkingQueue *queue, NativeCode *code);
+static void markNativeCodeTarget(NativeCode *code, void *queue);
+static NativeCode *getNativeCodeOf(RawObject *object);
+static _Bool isNativeCode(RawObject *object);
+static _Bool isNativeCodeMarked(NativeCode *code);
+static void evictNativeCode(Thread *thread);
+static _Bool isEvictable(NativeCode *code);
+static int compareCounters(const void *a, const void *b);
+static int compareAddresses(const void *a, const void *b);
+static void sweepNativeCode(Thread *thread);
+static void iterateCards(MarkingQueue *queue, Thread *thread, HeapPage *page);
+static _Bool hasDirtyCard(uint8_t *object, size_t size);
 static void iterateObject(MarkingQueue *queue, Thread *thread, RawObject *root);
 static void markObject(MarkingQueue *queue, Thread *thread, RawObject *object);
-static void markingQueueAdd(MarkingQueue *queue, RawObject *object);
-static _Bool markingQueueIsEmpty(MarkingQueue *queue);
+static void markingQueuePush(MarkingQueue *queue, RawObject *object);
 static RawObject *markingQueuePop(MarkingQueue *queue);
-static _Bool hasFinalizer(RawObject *object);
+static RawObject *markingQueueSteal(MarkingQueue *queue);
+static RawObject *stealObject(size_t worker);
+static void collectMarkedStats(void);
+static size_t selectEvacuatedPages(PageSpace *space);
+static void evacuatePage(Thread *thread, HeapPage *page);
+static RawObject *evacuateObject(Thread *thread, RawObject *object, _Bool isLive);
+static void evacuateResurrected(Thread *thread);
+static _Bool isEvacuatedFinalizable(RawObject *object);
+static _Bool isEvacuatedClassObject(RawObject *object);
+static RawClass *classBeforeEvacuation(RawObject *object);
+static void updateObject(RawObject *object, _Bool isLive);
+static void updateStack(Thread *thread);
+static void updateHandles(Thread *thread);
+static void updateNativeCode(Thread *thread);
+static void updatePointer(RawObject **p);
+static void updateTaggedPointer(Value *p);
+static void updateClassTags(void);
+static void startSweeper(void);
+static void *runSweeper(void *arg);
+static void waitForSweeper(void);
+static void endSweep(PageSpace *space);
+static HeapPage *claimPage(void);
+static void sweepWorker(size_t worker, void *arg);
+static size_t sweepPage(HeapPage *page, ObjectList *freeSpaces);
+static size_t addFreeSpaces(PageSpace *space, ObjectList *freeSpaces);
+static void freeDeadClasses(PageSpace *space);
+static void sweepLargePages(PageSpace *space);
+static _Bool keepDeadObject(RawObject *object);
+static _Bool isClassObject(RawObject *object);
+static _Bool hasFinalizer(RawObject *class);
+static RawObject *popFinalizationQueue(void);
+static void objectListAdd(ObjectList *list, RawObject *object);
+static void objectListAddLocked(ObjectList *list, RawObject *object);
 
 GCStats LastGCStats = { 0 };
+static MarkingQueue Queues[WORKER_POOL_MAX_SIZE];
+static ObjectList Overflow = { NULL, 0, 0 };
+static ObjectList SweptSpaces[WORKER_POOL_MAX_SIZE];
+static ObjectList MarkedClasses = { NULL, 0, 0 };
+static ObjectList FinalizationQueue = { NULL, 0, 0 };
+static ObjectList DeadClasses = { NULL, 0, 0 };
+static ObjectList Resurrected = { NULL, 0, 0 };
+static _Bool MarksNewObjects = 0;
+static size_t IdleWorkers = 0;
+// guards lists shared by workers
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static SweepJob Sweep = { NULL, NULL, 0, 0, 0 };
+static ObjectList BackgroundSwept = { NULL, 0, 0 };
+static _Bool IsSweeperStarted = 0;
+static _Bool IsSweeperBusy = 0;
+static size_t SweeperPauses = 0;
+// guards background sweeper state and free spaces swept by it
+static pthread_mutex_t SweeperLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t SweeperResumed = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t SweeperIdle = PTHREAD_COND_INITIALIZER;
+
+
+// new objects move with every scavenge, so they are left to the remark and only old space is marked incrementally
+void gcStartMarking(Thread *thread)
+{
+	ASSERT(!thread->heap.isMarking);
+	for (size_t i = 0; i < workerPoolSize(); i++) {
+		if (Queues[i].objects == NULL) {
+			Queues[i].objects = malloc(DEQUE_SIZE * sizeof(RawObject *));
+			ASSERT(Queues[i].objects != NULL);
+		}
+	}
+	MarksNewObjects = 0;
+	MarkedClasses.size = 0;
+	// marks are kept until next marking, so that sweeping can tell live objects
+	for (HeapPage *page = thread->heap.oldSpace.pages; page != NULL; page = page->next) {
+		heapPageClearMarks(page);
+	}
+	for (HeapPage *page = thread->heap.oldSpace.largePages; page != NULL; page = page->next) {
+		heapPageClearMarks(page);
+	}
+	for (HeapPage *page = thread->heap.execSpace.pages; page != NULL; page = page->next) {
+		heapPageClearMarks(page);
+	}
+	for (size_t i = 0; i < FinalizationQueue.size; i++) {
+		markObject(&Queues[0], thread, FinalizationQueue.objects[i]);
+	}
+	iterateStack(&Queues[0], thread);
+	iterateHandles(&Queues[0], thread);
+	iterateNativeCodeRoots(&Queues[0], thread, 0);
+	evictNativeCode(thread);
+	thread->heap.isMarking = 1;
+}
 
 
-void gcMarkRoots(Thread *thread)
+// answers whether there is nothing left to mark before the remark, steps are done by single thread
+_Bool gcMarkStep(Thread *thread, size_t size)
 {
-	MarkingQueue queue = {
-		.size = QUEUE_INIT_SIZE,
-		.objects = malloc(QUEUE_INIT_SIZE * sizeof(RawObject *)),
-		.index = 0,
-	};
-	iterateStack(&queue, thread);
-	iterateHandles(&queue, thread);
-	iterateNativeCode(&queue, thread);
+	ASSERT(thread->heap.isMarking);
+	size_t marked = 0;
+	RawObject *object;
+	while (marked < size && (object = markingQueuePop(&Queues[0])) != NULL) {
+		iterateObject(&Queues[0], thread, object);
+		marked += isNativeCode(object) ? computeNativeCodeSize((NativeCode *) object) : computeRawObjectSize(object);
+	}
+	collectMarkedStats();
+	return !hasMarkingWork();
+}
+
 
-	while (!markingQueueIsEmpty(&queue)) {
-		iterateObject(&queue, thread, markingQueuePop(&queue));
+// stores into old space dirty cards while it is marked, so the remark rescans marked objects with dirty cards
+// along with roots and new space reachable from them
+void gcFinishMarking(Thread *thread)
+{
+	ASSERT(thread->heap.isMarking);
+	MarksNewObjects = 1;
+	heapPageClearMarks(thread->heap.newSpace.page);
+	for (HeapPage *page = thread->heap.oldSpace.pages; page != NULL; page = page->next) {
+		iterateCards(&Queues[0], thread, page);
+	}
+	for (HeapPage *page = thread->heap.oldSpace.largePages; page != NULL; page = page->next) {
+		iterateCards(&Queues[0], thread, page);
 	}
+	for (size_t i = 0; i < FinalizationQueue.size; i++) {
+		markObject(&Queues[0], thread, FinalizationQueue.objects[i]);
+	}
+	iterateStack(&Queues[0], thread);
+	iterateHandles(&Queues[0], thread);
+	iterateNativeCodeRoots(&Queues[0], thread, 1);
 
-	free(queue.objects);
+	drainMarkingQueues(thread);
+	collectMarkedStats();
+	updateClassTags();
+	sweepNativeCode(thread);
+	thread->heap.isMarking = 0;
+}
+
+
+static void drainMarkingQueues(Thread *thread)
+{
+	IdleWorkers = 0;
+	workerPoolRun(markWorker, thread);
+	ASSERT(!hasMarkingWork());
+}
+
+
+// workers finish when all of them are idle, idle workers have nothing left in their queues to be stolen
+static void markWorker(size_t worker, void *arg)
+{
+	Thread *thread = arg;
+	MarkingQueue *queue = &Queues[worker];
+	size_t workersCount = workerPoolSize();
+
+	while (1) {
+		RawObject *object;
+		while ((object = markingQueuePop(queue)) != NULL || (object = stealObject(worker)) != NULL) {
+			iterateObject(queue, thread, object);
+		}
+		if (workersCount == 1) {
+			return;
+		}
+		__atomic_add_fetch(&IdleWorkers, 1, __ATOMIC_SEQ_CST);
+		while (!hasMarkingWork()) {
+			if (__atomic_load_n(&IdleWorkers, __ATOMIC_SEQ_CST) == workersCount) {
+				return;
+			}
+			sched_yield();
+		}
+		__atomic_sub_fetch(&IdleWorkers, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+
+static _Bool hasMarkingWork(void)
+{
+	if (__atomic_load_n(&Overflow.size, __ATOMIC_SEQ_CST) > 0) {
+		return 1;
+	}
+	for (size_t i = 0; i < workerPoolSize(); i++) {
+		MarkingQueue *queue = &Queues[i];
+		if (__atomic_load_n(&queue->bottom, __ATOMIC_SEQ_CST) > __atomic_load_n(&queue->top, __ATOMIC_SEQ_CST)) {
+			return 1;
+		}
+	}
+	return 0;
 }
 
 
@@ -57,6 +266,8 @@ static void iterateStack(MarkingQueue *queue, Thread *thread)
 	while (entryFrame != NULL) {
 		StackFrame *prev = entryFrame->exit;
 		StackFrame *frame = stackFrameGetParent(prev, entryFrame);
+		RegisterMap map;
+		initRegisterMap(&map, prev);
 
 		Value value = stackFrameGetSlot	(prev, 0);
 		if (valueTypeOf(value, VALUE_POINTER)) {
@@ -65,6 +276,7 @@ static void iterateStack(MarkingQueue *queue, Thread *thread)
 
 		while (frame != NULL) {
 			NativeCode *code = stackFrameGetNativeCode(frame);
+			markNativeCode(queue, code);
 			size_t argsSize = code->argsSize + 1;
 			for (ptrdiff_t i = 0; i < argsSize; i++) {
 				Value value = stackFrameGetArg(frame, i);
@@ -73,17 +285,22 @@ static void iterateStack(MarkingQueue *queue, Thread *thread)
 				}
 			}
 
-			RawStackmap *stackmap = findStackmap(code, (ptrdiff_t) prev->parentIc);
-			ASSERT(stackmap != NULL);
-			size_t frameSize = (stackmap->size - sizeof(Value)) * 8;
-			for (size_t i = 0; i < frameSize; i++) {
-				if (stackmapIncludes(stackmap, i)) {
+			Stackmap stackmap = findStackmap(code, (ptrdiff_t) prev->parentIc);
+			ASSERT(stackmap.set != NULL);
+			for (size_t i = 0; i < stackmap.size; i++) {
+				if (stackmapIncludes(&stackmap, i)) {
 					Value value = stackFrameGetSlot(frame, i);
 					if (valueTypeOf(value, VALUE_POINTER)) {
 						markObject(queue, thread, asObject(value));
 					}
 				}
 			}
+			for (size_t i = 0; i < SAVED_REGS_SIZE; i++) {
+				if ((stackmap.regs.live & (1 << i)) && valueTypeOf(*map.regs[i], VALUE_POINTER)) {
+					markObject(queue, thread, asObject(*map.regs[i]));
+				}
+			}
+			registerMapUpdate(&map, frame, stackmap.regs.saved);
 
 			prev = frame;
 			frame = stackFrameGetParent(frame, entryFrame);
@@ -116,7 +333,10 @@ static void iterateHandles(MarkingQueue *queue, Thread *thread)
 }
 
 
-static void iterateNativeCode(MarkingQueue *queue, Thread *thread)
+// native code is live while it is executed, referenced by live objects or other live code, or pinned, the remark
+// rescans code marked so far since its inline caches are patched without barriers, and catches up with methods
+// whose native code was replaced after they were scanned
+static void iterateNativeCodeRoots(MarkingQueue *queue, Thread *thread, _Bool isRemark)
 {
 	PageSpaceIterator iterator;
 	pageSpaceIteratorInit(&iterator, &thread->heap.execSpace);
@@ -124,36 +344,291 @@ static void iterateNativeCode(MarkingQueue *queue, Thread *thread)
 
 	while (code != NULL) {
 		if ((code->tags & TAG_FREESPACE) == 0) {
-			if (code->compiledCode != NULL) {
-				markObject(queue, thread, (RawObject *) code->compiledCode);
-			}
-			if (code->stackmaps != NULL) {
-				markObject(queue, thread, (RawObject *) code->stackmaps);
+			RawObject *compiledCode = code->compiledCode;
+			if (isRemark && isNativeCodeMarked(code)) {
+				iterateNativeCode(queue, thread, code);
+			} else if (code->tags & TAG_PINNED) {
+				markNativeCode(queue, code);
+			} else if (isRemark && compiledCode != NULL && isOldObject(compiledCode)
+					&& heapPageIsMarked(heapPageOf(compiledCode), compiledCode) && getNativeCodeOf(compiledCode) == code) {
+				markNativeCode(queue, code);
 			}
-			if (code->descriptors != NULL) {
-				markObject(queue, thread, (RawObject *) code->descriptors);
+		}
+		code = (NativeCode *) pageSpaceIteratorNext(&iterator);
+	}
+}
+
+
+static void iterateNativeCode(MarkingQueue *queue, Thread *thread, NativeCode *code)
+{
+	if (code->compiledCode != NULL) {
+		markObject(queue, thread, (RawObject *) code->compiledCode);
+	}
+	for (size_t i = 0; i < code->pointersOffsetsSize; i++) {
+		uint16_t offset = ((uint16_t *) (code->insts + code->size))[i];
+		Value value = *(Value *) (code->insts + offset);
+		if (value == 0) {
+			continue; // unbound inline cache
+		}
+		if (valueTypeOf(value, VALUE_POINTER)) {
+			markObject(queue, thread, asObject(value));
+		} else if (isNativeCode((RawObject *) value)) {
+			markNativeCode(queue, (NativeCode *) value);
+		} else {
+			markObject(queue, thread, (RawObject *) value);
+		}
+	}
+	iterateNativeCodeTargets(code, markNativeCodeTarget, queue);
+}
+
+
+static void markNativeCode(MarkingQueue *queue, NativeCode *code)
+{
+	if (heapPageTryMark(heapPageOf(code), code)) {
+		markingQueuePush(queue, (RawObject *) code);
+	}
+}
+
+
+static void markNativeCodeTarget(NativeCode *code, void *queue)
+{
+	markNativeCode(queue, code);
+}
+
+
+// compiled methods, compiled blocks and blocks point to their native code from outside of their slots
+static NativeCode *getNativeCodeOf(RawObject *object)
+{
+	if (object->class == Handles.CompiledMethod->raw) {
+		return ((RawCompiledMethod *) object)->nativeCode;
+	} else if (object->class == Handles.CompiledBlock->raw) {
+		return ((RawCompiledBlock *) object)->nativeCode;
+	} else if (object->class == Handles.Block->raw) {
+		return ((RawBlock *) object)->nativeCode;
+	}
+	return NULL;
+}
+
+
+static _Bool isNativeCode(RawObject *object)
+{
+	return isOldObject(object) && heapPageOf(object)->isExecutable;
+}
+
+
+static _Bool isNativeCodeMarked(NativeCode *code)
+{
+	return heapPageIsMarked(heapPageOf(code), code);
+}
+
+
+// native code of methods outgrowing code cache is evicted starting with least called one, methods compile it
+// again on their next send, code called directly by other code or still running is kept
+static void evictNativeCode(Thread *thread)
+{
+	Heap *heap = &thread->heap;
+	if (heap->codeCacheSize == 0) {
+		return;
+	}
+	size_t used = 0;
+	size_t codesSize = 0;
+	size_t pointersSize = 0;
+	PageSpaceIterator iterator;
+	pageSpaceIteratorInit(&iterator, &heap->execSpace);
+	for (NativeCode *code = (NativeCode *) pageSpaceIteratorNext(&iterator); code != NULL; code = (NativeCode *) pageSpaceIteratorNext(&iterator)) {
+		if ((code->tags & TAG_FREESPACE) == 0) {
+			used += align(computeNativeCodeSize(code), HEAP_OBJECT_ALIGN);
+			codesSize++;
+			pointersSize += code->pointersOffsetsSize;
+		}
+	}
+	if (used <= heap->codeCacheSize) {
+		return;
+	}
+
+	NativeCode **candidates = malloc(codesSize * sizeof(NativeCode *));
+	NativeCode **targets = malloc(pointersSize * sizeof(NativeCode *));
+	ASSERT(candidates != NULL && (targets != NULL || pointersSize == 0));
+	size_t candidatesSize = 0;
+	size_t targetsSize = 0;
+	pageSpaceIteratorInit(&iterator, &heap->execSpace);
+	for (NativeCode *code = (NativeCode *) pageSpaceIteratorNext(&iterator); code != NULL; code = (NativeCode *) pageSpaceIteratorNext(&iterator)) {
+		if ((code->tags & TAG_FREESPACE) != 0) {
+			continue;
+		}
+		if (isEvictable(code)) {
+			candidates[candidatesSize++] = code;
+		}
+		for (size_t i = 0; i < code->pointersOffsetsSize; i++) {
+			uint16_t offset = ((uint16_t *) (code->insts + code->size))[i];
+			Value value = *(Value *) (code->insts + offset);
+			if (value != 0 && !valueTypeOf(value, VALUE_POINTER) && isNativeCode((RawObject *) value)) {
+				targets[targetsSize++] = (NativeCode *) value;
 			}
-			if (code->typeFeedback != NULL) {
-				markObject(queue, thread, (RawObject *) code->typeFeedback);
+		}
+	}
+	qsort(targets, targetsSize, sizeof(NativeCode *), compareAddresses);
+	qsort(candidates, candidatesSize, sizeof(NativeCode *), compareCounters);
+
+	size_t evicted = 0;
+	size_t limit = heap->codeCacheSize / 100 * CODE_CACHE_EVICTION_PERCENT;
+	for (size_t i = 0; i < candidatesSize && used > limit; i++) {
+		NativeCode *code = candidates[i];
+		if (bsearch(&code, targets, targetsSize, sizeof(NativeCode *), compareAddresses) != NULL) {
+			continue;
+		}
+		((RawCompiledMethod *) code->compiledCode)->nativeCode = NULL;
+		code->tags |= TAG_EVICTED;
+		used -= align(computeNativeCodeSize(code), HEAP_OBJECT_ALIGN);
+		evicted++;
+	}
+	free(candidates);
+	free(targets);
+
+	if (evicted > 0) {
+		unlinkEvictedCode();
+		flushLookupCache();
+	}
+	LastGCStats.evictedCode = evicted;
+}
+
+
+static _Bool isEvictable(NativeCode *code)
+{
+	RawObject *method = code->compiledCode;
+	return (code->tags & TAG_PINNED) == 0
+		&& !isNativeCodeMarked(code)
+		&& method != NULL
+		&& method->class == Handles.CompiledMethod->raw
+		&& ((RawCompiledMethod *) method)->nativeCode == code
+		// primitives call C without a frame of their own, so stack walks do not see them running
+		&& ((RawCompiledMethod *) method)->header.primitive == 0;
+}
+
+
+static int compareCounters(const void *a, const void *b)
+{
+	size_t counterA = (*(NativeCode **) a)->counter;
+	size_t counterB = (*(NativeCode **) b)->counter;
+	return counterA < counterB ? -1 : counterA > counterB;
+}
+
+
+static int compareAddresses(const void *a, const void *b)
+{
+	uintptr_t addressA = (uintptr_t) *(NativeCode **) a;
+	uintptr_t addressB = (uintptr_t) *(NativeCode **) b;
+	return addressA < addressB ? -1 : addressA > addressB;
+}
+
+
+// unmarked native code is freed during remark, so that it is never seen by evacuation, pages left empty are
+// unmapped right away
+static void sweepNativeCode(Thread *thread)
+{
+	Heap *heap = &thread->heap;
+	CodeRememberedSet *set = &heap->codeRememberedSet;
+	size_t size = 0;
+	for (size_t i = 0; i < set->size; i++) {
+		if (isNativeCodeMarked(set->codes[i])) {
+			set->codes[size++] = set->codes[i];
+		}
+	}
+	set->size = size;
+
+	PageSpace *space = &heap->execSpace;
+	size_t freed = 0;
+	resetFreeList(&space->freeList);
+	HeapPage **link = &space->pages;
+	while (*link != NULL) {
+		HeapPage *page = *link;
+		uint8_t *start = (uint8_t *) align((uintptr_t) page->body, HEAP_OBJECT_ALIGN);
+		uint8_t *end = page->body + page->bodySize;
+		uint8_t *freeStart = NULL;
+		uint8_t *p = start;
+
+		while (p < end) {
+			NativeCode *code = (NativeCode *) p;
+			_Bool isFree = (code->tags & TAG_FREESPACE) != 0;
+			size_t codeSize = isFree ? ((FreeSpace *) code)->size : align(computeNativeCodeSize(code), HEAP_OBJECT_ALIGN);
+			if (!isFree && !isNativeCodeMarked(code)) {
+				isFree = 1;
+				freed++;
+			} else if (!isFree) {
+				code->tags &= ~TAG_EVICTED;
 			}
-			for (size_t i = 0; i < code->pointersOffsetsSize; i++) {
-				uint16_t offset = ((uint16_t *) (code->insts + code->size))[i];
-				Value value = *(Value *) (code->insts + offset);
-				if (valueTypeOf(value, VALUE_POINTER)) {
-					markObject(queue, thread, asObject(value));
-				} else {
-					markObject(queue, thread, (RawObject *) value);
-				}
+			if (isFree && freeStart == NULL) {
+				freeStart = p;
+			} else if (!isFree && freeStart != NULL) {
+				freeListAddFreeSpace(&space->freeList, createFreeSpace(freeStart, p - freeStart));
+				freeStart = NULL;
 			}
+			p += codeSize;
 		}
-		code = (NativeCode *) pageSpaceIteratorNext(&iterator);
+
+		if (freeStart == start && (space->pages != page || page->next != NULL)) {
+			pageSpaceFreePage(space, link);
+			continue;
+		}
+		if (freeStart != NULL) {
+			freeListAddFreeSpace(&space->freeList, createFreeSpace(freeStart, p - freeStart));
+		}
+		link = &page->next;
+	}
+	LastGCStats.freedCode = freed;
+	if (freed > 0) {
+		flushLookupCache();
 	}
 }
 
 
+static void iterateCards(MarkingQueue *queue, Thread *thread, HeapPage *page)
+{
+	if (!heapPageHasDirtyCards(page)) {
+		return;
+	}
+	uint8_t *p = page->body;
+	uint8_t *end = page->body + page->bodySize;
+	while (p < end) {
+		RawObject *object = (RawObject *) p;
+		_Bool isFree = (object->tags & TAG_FREESPACE) != 0;
+		size_t size = isFree ? ((FreeSpace *) object)->size : align(computeRawObjectSize(object), HEAP_OBJECT_ALIGN);
+		// unmarked objects are either dead or reached by the remark itself
+		if (!isFree && heapPageIsMarked(page, object) && hasDirtyCard(p, size)) {
+			iterateObject(queue, thread, object);
+		}
+		p += size;
+	}
+}
+
+
+static _Bool hasDirtyCard(uint8_t *object, size_t size)
+{
+	uint8_t *card = cardAt(object, object);
+	uint8_t *last = cardAt(object, object + size - 1);
+	for (; card <= last; card++) {
+		if (*card != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
 static void iterateObject(MarkingQueue *queue, Thread *thread, RawObject *root)
 {
-	_Bool remember = isNewObject((RawObject *) root->class);
+	if (isNativeCode(root)) {
+		iterateNativeCode(queue, thread, (NativeCode *) root);
+		return;
+	}
+	NativeCode *code = getNativeCodeOf(root);
+	if (code != NULL) {
+		markNativeCode(queue, code);
+	}
+	// finalizers of instances are looked up once per marked class, workers cannot use handles
+	if (isClassObject(root)) {
+		objectListAddLocked(&MarkedClasses, root);
+	}
 	markObject(queue, thread, (RawObject *) root->class);
 
 	Value *vars = getRawObjectVars(root);
@@ -164,108 +639,809 @@ static void iterateObject(MarkingQueue *queue, Thread *thread, RawObject *root)
 
 	for (size_t i = 0; i < size; i++) {
 		if (valueTypeOf(vars[i], VALUE_POINTER)) {
-			RawObject *object = asObject(vars[i]);
-			remember = remember || isNewObject(object);
-			markObject(queue, thread, object);
+			markObject(queue, thread, asObject(vars[i]));
 		}
 	}
-
-	root->tags = root->tags & ~TAG_REMEMBERED;
-	if (remember && isOldObject(root)) {
-		rememberedSetAdd(&thread->heap.rememberedSet, root);
-	}
 }
 
 
 static void markObject(MarkingQueue *queue, Thread *thread, RawObject *object)
 {
-	ASSERT(isOldObject(object) || (thread->heap.newSpace.fromSpace <= (uint8_t *) object && (uint8_t *) object <= (thread->heap.newSpace.fromSpace + thread->heap.newSpace.size)));
-	if (object->tags & TAG_MARKED) {
+	if (isNewObject(object) && !MarksNewObjects) {
 		return;
 	}
-	// TODO: for now scavenge has to be called before mark&sweep to clear
-	// marked tag of new objects
-	object->tags |= TAG_MARKED;
-	markingQueueAdd(queue, object);
-	LastGCStats.marked++;
+	ASSERT(isOldObject(object) || (thread->heap.newSpace.fromSpace <= (uint8_t *) object && (uint8_t *) object <= (thread->heap.newSpace.fromSpace + thread->heap.newSpace.size)));
+	HeapPage *page = isNewObject(object) ? thread->heap.newSpace.page : heapPageOf(object);
+	if (heapPageTryMark(page, object)) {
+		markingQueuePush(queue, object);
+		queue->marked++;
+		if (isOldObject(object) && !page->isLarge) {
+			__atomic_add_fetch(&page->liveSize, align(computeRawObjectSize(object), HEAP_OBJECT_ALIGN), __ATOMIC_RELAXED);
+		}
+	}
 }
 
 
-static void markingQueueAdd(MarkingQueue *queue, RawObject *object)
+// full deques spill into overflow list shared by all workers
+static void markingQueuePush(MarkingQueue *queue, RawObject *object)
 {
-	if (queue->size == queue->index) {
-		queue->size += QUEUE_INIT_SIZE;
-		queue->objects = realloc(queue->objects, queue->size * sizeof(RawObject *));
+	ptrdiff_t bottom = queue->bottom;
+	ptrdiff_t top = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE);
+	if (bottom - top >= DEQUE_SIZE) {
+		objectListAddLocked(&Overflow, object);
+		return;
 	}
-	queue->objects[queue->index++] = object;
+	__atomic_store_n(&queue->objects[bottom % DEQUE_SIZE], object, __ATOMIC_RELAXED);
+	__atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELEASE);
 }
 
 
 static RawObject *markingQueuePop(MarkingQueue *queue)
 {
-	queue->index--;
-	return queue->objects[queue->index];
+	ptrdiff_t bottom = queue->bottom - 1;
+	__atomic_store_n(&queue->bottom, bottom, __ATOMIC_SEQ_CST);
+	ptrdiff_t top = __atomic_load_n(&queue->top, __ATOMIC_SEQ_CST);
+
+	if (top <= bottom) {
+		RawObject *object = __atomic_load_n(&queue->objects[bottom % DEQUE_SIZE], __ATOMIC_RELAXED);
+		if (top == bottom) {
+			// last object is raced for with thieves
+			if (!__atomic_compare_exchange_n(&queue->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+				object = NULL;
+			}
+			__atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_SEQ_CST);
+		}
+		if (object != NULL) {
+			return object;
+		}
+	} else {
+		__atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_SEQ_CST);
+	}
+
+	if (__atomic_load_n(&Overflow.size, __ATOMIC_SEQ_CST) == 0) {
+		return NULL;
+	}
+	// own deque is empty, so objects taken from overflow fit into it
+	RawObject *object = NULL;
+	pthread_mutex_lock(&Lock);
+	for (size_t i = 0; i < OVERFLOW_BATCH_SIZE && Overflow.size > 0; i++) {
+		if (object != NULL) {
+			markingQueuePush(queue, object);
+		}
+		object = Overflow.objects[Overflow.size - 1];
+		__atomic_store_n(&Overflow.size, Overflow.size - 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&Lock);
+	return object;
 }
 
 
-static _Bool markingQueueIsEmpty(MarkingQueue *queue)
+static RawObject *markingQueueSteal(MarkingQueue *queue)
 {
-	return queue->index == 0;
+	ptrdiff_t top = __atomic_load_n(&queue->top, __ATOMIC_SEQ_CST);
+	ptrdiff_t bottom = __atomic_load_n(&queue->bottom, __ATOMIC_SEQ_CST);
+	if (top >= bottom) {
+		return NULL;
+	}
+	RawObject *object = __atomic_load_n(&queue->objects[top % DEQUE_SIZE], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&queue->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		return NULL;
+	}
+	return object;
 }
 
 
-void gcSweep(PageSpace *space)
+static RawObject *stealObject(size_t worker)
+{
+	size_t workersCount = workerPoolSize();
+	for (size_t i = 1; i < workersCount; i++) {
+		RawObject *object = markingQueueSteal(&Queues[(worker + i) % workersCount]);
+		if (object != NULL) {
+			return object;
+		}
+	}
+	return NULL;
+}
+
+
+static void collectMarkedStats(void)
+{
+	for (size_t i = 0; i < workerPoolSize(); i++) {
+		LastGCStats.marked += Queues[i].marked;
+		Queues[i].marked = 0;
+	}
+}
+
+
+static void updateClassTags(void)
+{
+	for (size_t i = 0; i < MarkedClasses.size; i++) {
+		RawObject *class = MarkedClasses.objects[i];
+		if (hasFinalizer(class)) {
+			class->tags |= TAG_HAS_FINALIZER;
+		} else {
+			class->tags &= ~TAG_HAS_FINALIZER;
+		}
+		// pretenuring is decided again by following scavenges once in a while
+		if (LastGCStats.count % PRETENURING_RESET_COLLECTIONS == 0) {
+			class->tags &= ~TAG_PRETENURED;
+		}
+	}
+	MarkedClasses.size = 0;
+}
+
+
+// survivors of sparse pages are copied to other pages and all references to them are updated, so that the pages
+// can be unmapped, it runs between remark and sweep when marks tell live objects
+void gcEvacuate(Thread *thread)
+{
+	PageSpace *space = &thread->heap.oldSpace;
+	size_t count = selectEvacuatedPages(space);
+	if (count == 0) {
+		return;
+	}
+
+	// free spaces of kept pages are found again by sweeping, copies are placed into newly mapped pages
+	resetFreeList(&space->freeList);
+	for (HeapPage *page = space->pages; page != NULL; page = page->next) {
+		if (page->isEvacuated) {
+			evacuatePage(thread, page);
+		}
+	}
+	evacuateResurrected(thread);
+
+	for (HeapPage *page = space->pages; page != NULL; page = page->next) {
+		if (page->isEvacuated) {
+			continue;
+		}
+		uint8_t *p = page->body;
+		uint8_t *end = page->body + page->bodySize;
+		while (p < end) {
+			RawObject *object = (RawObject *) p;
+			_Bool isFree = (object->tags & TAG_FREESPACE) != 0;
+			size_t size = isFree ? ((FreeSpace *) object)->size : align(computeRawObjectSize(object), HEAP_OBJECT_ALIGN);
+			if (!isFree) {
+				updateObject(object, heapPageIsMarked(page, object));
+			}
+			p += size;
+		}
+	}
+	for (HeapPage *page = space->largePages; page != NULL; page = page->next) {
+		updateObject((RawObject *) page->body, heapPageIsMarked(page, page->body));
+	}
+	Scavenger *newSpace = &thread->heap.newSpace;
+	RawObject *object = (RawObject *) ((uintptr_t) newSpace->fromSpace | NEW_SPACE_TAG);
+	while ((uint8_t *) object < newSpace->top) {
+		updateObject(object, heapPageIsMarked(newSpace->page, object));
+		object = (RawObject *) ((uint8_t *) object + align(computeRawObjectSize(object), HEAP_OBJECT_ALIGN));
+	}
+	for (size_t i = 0; i < FinalizationQueue.size; i++) {
+		updatePointer(&FinalizationQueue.objects[i]);
+	}
+	updateStack(thread);
+	updateHandles(thread);
+	updateNativeCode(thread);
+	// lookup cache is hashed by addresses of classes and selectors
+	flushLookupCache();
+
+	HeapPage **link = &space->pages;
+	while (*link != NULL) {
+		if ((*link)->isEvacuated) {
+			pageSpaceFreePage(space, link);
+		} else {
+			link = &(*link)->next;
+		}
+	}
+	LastGCStats.evacuated += count;
+}
+
+
+static size_t selectEvacuatedPages(PageSpace *space)
+{
+	size_t count = 0;
+	size_t pagesCount = 0;
+	for (HeapPage *page = space->pages; page != NULL; page = page->next) {
+		// pages without survivors are left to sweeping
+		page->isEvacuated = page->liveSize > 0 && page->liveSize * 100 < page->bodySize * EVACUATION_LIVE_PERCENT;
+		count += page->isEvacuated;
+		pagesCount++;
+	}
+	// a page or two would be only traded for a newly mapped one
+	if (count < EVACUATION_MIN_PAGES) {
+		for (HeapPage *page = space->pages; page != NULL; page = page->next) {
+			page->isEvacuated = 0;
+		}
+		return 0;
+	}
+	if (count == pagesCount) {
+		pageSpaceAddPage(space);
+	}
+	return count;
+}
+
+
+// dead classes are copied as well, instances in pages not swept yet need them to compute their sizes,
+// so are dead objects to be finalized
+static void evacuatePage(Thread *thread, HeapPage *page)
+{
+	uint8_t *p = page->body;
+	uint8_t *end = page->body + page->bodySize;
+	while (p < end) {
+		RawObject *object = (RawObject *) p;
+		_Bool isFree = (object->tags & TAG_FREESPACE) != 0;
+		size_t size = isFree ? ((FreeSpace *) object)->size : align(computeRawObjectSize(object), HEAP_OBJECT_ALIGN);
+		if (!isFree && heapPageIsMarked(page, object)) {
+			evacuateObject(thread, object, 1);
+		} else if (!isFree && isEvacuatedClassObject(object)) {
+			evacuateObject(thread, object, 0);
+		} else if (!isFree && isEvacuatedFinalizable(object)) {
+			objectListAdd(&Resurrected, evacuateObject(thread, object, 0));
+		}
+		p += size;
+	}
+}
+
+
+static RawObject *evacuateObject(Thread *thread, RawObject *object, _Bool isLive)
+{
+	size_t size = align(computeRawObjectSize(object), HEAP_OBJECT_ALIGN);
+	RawObject *copy = (RawObject *) tryAllocateOld(&thread->heap, size, 1);
+	ASSERT(!heapPageOf(copy)->isEvacuated);
+	memcpy(copy, object, size);
+	// copy may point to new objects, its cards are scanned by next scavenge
+	markCards(copy, size);
+	if (isLive) {
+		heapPageMark(heapPageOf(copy), copy);
+	}
+	object->tags |= TAG_FORWARDED;
+	object->class = (RawClass *) copy;
+	return copy;
+}
+
+
+// objects to be finalized are not marked, so dead objects they point to in evacuated pages are copied along
+static void evacuateResurrected(Thread *thread)
+{
+	for (size_t i = 0; i < Resurrected.size; i++) {
+		RawObject *object = Resurrected.objects[i];
+		Value *vars = getRawObjectVars(object);
+		size_t size = classBeforeEvacuation(object)->instanceShape.varsSize;
+		if (classBeforeEvacuation(object)->instanceShape.isIndexed && !classBeforeEvacuation(object)->instanceShape.isBytes) {
+			size += rawObjectSize(object);
+		}
+		for (size_t j = 0; j < size; j++) {
+			if (!valueTypeOf(vars[j], VALUE_POINTER)) {
+				continue;
+			}
+			RawObject *var = asObject(vars[j]);
+			if (isOldObject(var) && heapPageOf(var)->isEvacuated && (var->tags & TAG_FORWARDED) == 0) {
+				objectListAdd(&Resurrected, evacuateObject(thread, var, 0));
+			}
+			updateTaggedPointer(&vars[j]);
+		}
+	}
+	Resurrected.size = 0;
+}
+
+
+static _Bool isEvacuatedFinalizable(RawObject *object)
+{
+	RawObject *class = (RawObject *) classBeforeEvacuation(object);
+	_Bool isClassLive = isOldObject(class) && heapPageIsMarked(heapPageOf(class), class);
+	return (object->tags & TAG_FINALIZED) == 0 && isClassLive && (class->tags & TAG_HAS_FINALIZER);
+}
+
+
+static _Bool isEvacuatedClassObject(RawObject *object)
+{
+	RawClass *class = classBeforeEvacuation(object);
+	return class == Handles.MetaClass->raw || classBeforeEvacuation((RawObject *) class) == Handles.MetaClass->raw;
+}
+
+
+// class pointers of forwarded objects are overwritten, but their copies are not updated yet
+static RawClass *classBeforeEvacuation(RawObject *object)
+{
+	return object->tags & TAG_FORWARDED ? ((RawObject *) object->class)->class : object->class;
+}
+
+
+// class pointers of dead objects are updated too, sweeping computes their sizes
+static void updateObject(RawObject *object, _Bool isLive)
+{
+	updatePointer((RawObject **) &object->class);
+	if (!isLive) {
+		return;
+	}
+	Value *vars = getRawObjectVars(object);
+	size_t size = object->class->instanceShape.varsSize;
+	if (object->class->instanceShape.isIndexed && !object->class->instanceShape.isBytes) {
+		size += rawObjectSize(object);
+	}
+	for (size_t i = 0; i < size; i++) {
+		if (valueTypeOf(vars[i], VALUE_POINTER)) {
+			updateTaggedPointer(&vars[i]);
+		}
+	}
+}
+
+
+static void updateStack(Thread *thread)
+{
+	EntryStackFrame *entryFrame = thread->stackFramesTail;
+	while (entryFrame != NULL) {
+		StackFrame *prev = entryFrame->exit;
+		StackFrame *frame = stackFrameGetParent(prev, entryFrame);
+		RegisterMap map;
+		initRegisterMap(&map, prev);
+
+		Value *value = stackFrameGetSlotPtr(prev, 0);
+		if (valueTypeOf(*value, VALUE_POINTER)) {
+			updateTaggedPointer(value);
+		}
+
+		while (frame != NULL) {
+			NativeCode *code = stackFrameGetNativeCode(frame);
+			size_t argsSize = code->argsSize + 1;
+			for (ptrdiff_t i = 0; i < argsSize; i++) {
+				Value *value = stackFrameGetArgPtr(frame, i);
+				if (valueTypeOf(*value, VALUE_POINTER)) {
+					updateTaggedPointer(value);
+				}
+			}
+
+			Stackmap stackmap = findStackmap(code, (ptrdiff_t) prev->parentIc);
+			ASSERT(stackmap.set != NULL);
+			for (size_t i = 0; i < stackmap.size; i++) {
+				if (stackmapIncludes(&stackmap, i)) {
+					Value *value = stackFrameGetSlotPtr(frame, i);
+					if (valueTypeOf(*value, VALUE_POINTER)) {
+						updateTaggedPointer(value);
+					}
+				}
+			}
+			for (size_t i = 0; i < SAVED_REGS_SIZE; i++) {
+				if ((stackmap.regs.live & (1 << i)) && valueTypeOf(*map.regs[i], VALUE_POINTER)) {
+					updateTaggedPointer(map.regs[i]);
+				}
+			}
+			registerMapUpdate(&map, frame, stackmap.regs.saved);
+
+			prev = frame;
+			frame = stackFrameGetParent(frame, entryFrame);
+		}
+		entryFrame = entryFrame->prev;
+	}
+	if (CurrentExceptionHandler != 0) {
+		updateTaggedPointer(&CurrentExceptionHandler);
+	}
+}
+
+
+static void updateHandles(Thread *thread)
+{
+	HandlesIterator handlesIterator;
+	initHandlesIterator(&handlesIterator, thread->handles);
+	while (handlesIteratorHasNext(&handlesIterator)) {
+		updatePointer(&handlesIteratorNext(&handlesIterator)->raw);
+	}
+
+	HandleScopeIterator handleScopeIterator;
+	initHandleScopeIterator(&handleScopeIterator, thread->handleScopes);
+	while (handleScopeIteratorHasNext(&handleScopeIterator)) {
+		HandleScope *scope = handleScopeIteratorNext(&handleScopeIterator);
+		for (ptrdiff_t i = 0; i < scope->size; i++) {
+			updatePointer(&scope->handles[i].raw);
+		}
+	}
+
+	if (thread->context != 0) {
+		updateTaggedPointer(&thread->context);
+	}
+}
+
+
+static void updateNativeCode(Thread *thread)
 {
 	PageSpaceIterator iterator;
-	pageSpaceIteratorInit(&iterator, space);
-	RawObject *object = pageSpaceIteratorNext(&iterator);
-	RawObject *prev = NULL;
+	pageSpaceIteratorInit(&iterator, &thread->heap.execSpace);
+	NativeCode *code = (NativeCode *) pageSpaceIteratorNext(&iterator);
+
+	while (code != NULL) {
+		if ((code->tags & TAG_FREESPACE) == 0) {
+			if (code->compiledCode != NULL) {
+				updatePointer((RawObject **) &code->compiledCode);
+			}
+			for (size_t i = 0; i < code->pointersOffsetsSize; i++) {
+				uint16_t offset = ((uint16_t *) (code->insts + code->size))[i];
+				Value *value = (Value *) (code->insts + offset);
+				if (*value == 0) {
+					continue; // unbound inline cache
+				}
+				if (valueTypeOf(*value, VALUE_POINTER)) {
+					updateTaggedPointer(value);
+				} else {
+					updatePointer((RawObject **) value);
+				}
+			}
+		}
+		code = (NativeCode *) pageSpaceIteratorNext(&iterator);
+	}
+}
 
-	RawObject *finalize[256] = { NULL };
-	size_t finalizeSize = 0;
 
-	while (object != NULL) {
-		LastGCStats.total++;
-		if ((object->tags & (TAG_MARKED | TAG_FREESPACE)) == 0) {
-			if ((object->tags & TAG_FINALIZED) == 0 && hasFinalizer(object)) {
-				ASSERT(finalizeSize < 256); // TODO: realloc instead
-				finalize[finalizeSize++] = object;
-				object->tags = (object->tags ^ TAG_MARKED) | TAG_FINALIZED;
-				prev = object;
-			/*} else if (prev != NULL && prev->tags & TAG_FREESPACE && heapPageIncludes(iterator.page, (uint8_t *) prev)) {
-				extendFreeSpace((FreeSpace *) prev, align(computeRawObjectSize(object), HEAP_OBJECT_ALIGN));
-				LastGCStats.extended++;
-				LastGCStats.sweeped++;*/
-			} else {
-				freeObject(space, object);
-				prev = object;
-				LastGCStats.freed++;
-				LastGCStats.sweeped++;
+static void updatePointer(RawObject **p)
+{
+	RawObject *object = *p;
+	if (isOldObject(object) && heapPageOf(object)->isEvacuated && (object->tags & TAG_FORWARDED)) {
+		*p = (RawObject *) object->class;
+	}
+}
+
+
+static void updateTaggedPointer(Value *p)
+{
+	RawObject *object = asObject(*p);
+	if (isOldObject(object) && heapPageOf(object)->isEvacuated && (object->tags & TAG_FORWARDED)) {
+		*p = tagPtr(object->class);
+	}
+}
+
+
+// large pages are swept right away, other pages are swept by background sweeper when there are several
+// workers and lazily by allocations, free list only gets free spaces of swept pages
+void gcSweep(PageSpace *space)
+{
+	ASSERT(Sweep.space == NULL);
+	sweepLargePages(space);
+	resetFreeList(&space->freeList);
+
+	pthread_mutex_lock(&SweeperLock);
+	Sweep.size = 0;
+	Sweep.next = 0;
+	for (HeapPage *page = space->pages; page != NULL; page = page->next) {
+		if (Sweep.size == Sweep.capacity) {
+			Sweep.capacity = Sweep.capacity == 0 ? 64 : Sweep.capacity * 2;
+			Sweep.pages = realloc(Sweep.pages, Sweep.capacity * sizeof(HeapPage *));
+			ASSERT(Sweep.pages != NULL);
+		}
+		page->needsSweep = 1;
+		Sweep.pages[Sweep.size++] = page;
+	}
+	Sweep.space = space;
+	pthread_cond_broadcast(&SweeperResumed);
+	pthread_mutex_unlock(&SweeperLock);
+
+	if (workerPoolSize() > 1 && !IsSweeperStarted) {
+		startSweeper();
+	}
+}
+
+
+_Bool gcIsSweeping(PageSpace *space)
+{
+	return Sweep.space == space;
+}
+
+
+// free spaces swept in background are taken first, then pages are swept by calling thread itself
+void gcSweepPages(PageSpace *space, size_t size)
+{
+	if (Sweep.space != space) {
+		return;
+	}
+	pthread_mutex_lock(&SweeperLock);
+	size_t freed = addFreeSpaces(space, &BackgroundSwept);
+	pthread_mutex_unlock(&SweeperLock);
+
+	HeapPage *page;
+	while (freed < size && (page = claimPage()) != NULL) {
+		sweepPage(page, &SweptSpaces[0]);
+		freed += addFreeSpaces(space, &SweptSpaces[0]);
+	}
+	if (freed < size) {
+		// every page is claimed, only page swept by background sweeper may be left
+		waitForSweeper();
+		endSweep(space);
+	}
+}
+
+
+// remaining pages are swept by all workers
+void gcFinishSweep(PageSpace *space)
+{
+	if (Sweep.space != space) {
+		return;
+	}
+	workerPoolRun(sweepWorker, NULL);
+	waitForSweeper();
+	for (size_t i = 0; i < workerPoolSize(); i++) {
+		addFreeSpaces(space, &SweptSpaces[i]);
+	}
+	endSweep(space);
+}
+
+
+// background sweeper does not touch pages while cards or objects of whole old space are iterated
+void gcPauseSweeping(void)
+{
+	pthread_mutex_lock(&SweeperLock);
+	SweeperPauses++;
+	while (IsSweeperBusy) {
+		pthread_cond_wait(&SweeperIdle, &SweeperLock);
+	}
+	pthread_mutex_unlock(&SweeperLock);
+}
+
+
+void gcResumeSweeping(void)
+{
+	pthread_mutex_lock(&SweeperLock);
+	ASSERT(SweeperPauses > 0);
+	if (--SweeperPauses == 0) {
+		pthread_cond_broadcast(&SweeperResumed);
+	}
+	pthread_mutex_unlock(&SweeperLock);
+}
+
+
+static void startSweeper(void)
+{
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, runSweeper, NULL) != 0) {
+		FAIL();
+	}
+	pthread_detach(thread);
+	IsSweeperStarted = 1;
+}
+
+
+// pages are swept one by one, so that pauses wait for a single page at most
+static void *runSweeper(void *arg)
+{
+	ObjectList freeSpaces = { NULL, 0, 0 };
+	pthread_mutex_lock(&SweeperLock);
+	while (1) {
+		while (Sweep.space == NULL || SweeperPauses > 0 || __atomic_load_n(&Sweep.next, __ATOMIC_RELAXED) >= Sweep.size) {
+			pthread_cond_wait(&SweeperResumed, &SweeperLock);
+		}
+		IsSweeperBusy = 1;
+		pthread_mutex_unlock(&SweeperLock);
+
+		HeapPage *page = claimPage();
+		if (page != NULL) {
+			sweepPage(page, &freeSpaces);
+		}
+
+		pthread_mutex_lock(&SweeperLock);
+		for (size_t i = 0; i < freeSpaces.size; i++) {
+			objectListAdd(&BackgroundSwept, freeSpaces.objects[i]);
+		}
+		freeSpaces.size = 0;
+		IsSweeperBusy = 0;
+		pthread_cond_broadcast(&SweeperIdle);
+	}
+	return NULL;
+}
+
+
+static void waitForSweeper(void)
+{
+	pthread_mutex_lock(&SweeperLock);
+	while (IsSweeperBusy) {
+		pthread_cond_wait(&SweeperIdle, &SweeperLock);
+	}
+	pthread_mutex_unlock(&SweeperLock);
+}
+
+
+// instances in pages not swept yet need their classes to compute sizes, so dead classes are freed last
+static void endSweep(PageSpace *space)
+{
+	pthread_mutex_lock(&SweeperLock);
+	ASSERT(!IsSweeperBusy && __atomic_load_n(&Sweep.next, __ATOMIC_RELAXED) >= Sweep.size);
+	addFreeSpaces(space, &BackgroundSwept);
+	Sweep.space = NULL;
+	pthread_mutex_unlock(&SweeperLock);
+	freeDeadClasses(space);
+}
+
+
+static HeapPage *claimPage(void)
+{
+	size_t i = __atomic_fetch_add(&Sweep.next, 1, __ATOMIC_RELAXED);
+	return i < Sweep.size ? Sweep.pages[i] : NULL;
+}
+
+
+static void sweepWorker(size_t worker, void *arg)
+{
+	HeapPage *page;
+	while ((page = claimPage()) != NULL) {
+		sweepPage(page, &SweptSpaces[worker]);
+	}
+}
+
+
+// contiguous dead objects and free spaces are coalesced into a single free space
+static size_t sweepPage(HeapPage *page, ObjectList *freeSpaces)
+{
+	uint8_t *p = page->body;
+	uint8_t *end = page->body + page->bodySize;
+	uint8_t *freeStart = NULL;
+	size_t freed = 0;
+	size_t total = 0;
+	size_t sweeped = 0;
+	size_t extended = 0;
+
+	while (p < end) {
+		RawObject *object = (RawObject *) p;
+		_Bool isFree = (object->tags & TAG_FREESPACE) != 0;
+		size_t size = isFree ? ((FreeSpace *) object)->size : align(computeRawObjectSize(object), HEAP_OBJECT_ALIGN);
+
+		if (!isFree) {
+			total++;
+			if (!heapPageIsMarked(page, object) && !keepDeadObject(object)) {
+				isFree = 1;
+				sweeped++;
 			}
+		}
+		if (isFree && freeStart == NULL) {
+			freeStart = p;
+		} else if (isFree) {
+			extended++;
+		} else if (freeStart != NULL) {
+			objectListAdd(freeSpaces, (RawObject *) createFreeSpace(freeStart, p - freeStart));
+			freed += p - freeStart;
+			freeStart = NULL;
+		}
+		p += size;
+	}
+	if (freeStart != NULL) {
+		objectListAdd(freeSpaces, (RawObject *) createFreeSpace(freeStart, p - freeStart));
+		freed += p - freeStart;
+	}
+
+	// pages staying empty for several collections are given back to system, so that short bursts of
+	// allocations do not keep paying for page faults
+	if (freed == page->bodySize) {
+		if (++page->emptySweeps == PAGE_RELEASE_SWEEPS) {
+			heapPageRelease(page);
+			__atomic_add_fetch(&LastGCStats.released, 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		page->emptySweeps = 0;
+	}
+	page->needsSweep = 0;
+	__atomic_add_fetch(&LastGCStats.total, total, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&LastGCStats.freed, sweeped, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&LastGCStats.sweeped, sweeped, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&LastGCStats.extended, extended, __ATOMIC_RELAXED);
+	return freed;
+}
+
+
+static size_t addFreeSpaces(PageSpace *space, ObjectList *freeSpaces)
+{
+	size_t freed = 0;
+	for (size_t i = 0; i < freeSpaces->size; i++) {
+		FreeSpace *freeSpace = (FreeSpace *) freeSpaces->objects[i];
+		freed += freeSpace->size;
+		freeListAddFreeSpace(&space->freeList, freeSpace);
+	}
+	freeSpaces->size = 0;
+	return freed;
+}
+
+
+static void freeDeadClasses(PageSpace *space)
+{
+	for (size_t i = 0; i < DeadClasses.size; i++) {
+		freeObject(space, DeadClasses.objects[i]);
+	}
+	DeadClasses.size = 0;
+}
+
+
+static void sweepLargePages(PageSpace *space)
+{
+	HeapPage **link = &space->largePages;
+	while (*link != NULL) {
+		HeapPage *page = *link;
+		LastGCStats.total++;
+		if (!heapPageIsMarked(page, page->body) && !keepDeadObject((RawObject *) page->body)) {
+			pageSpaceFreeLargePage(space, link);
+			LastGCStats.freed++;
+			LastGCStats.sweeped++;
 		} else {
-			object->tags = object->tags ^ TAG_MARKED;
-			prev = object;
+			link = &page->next;
 		}
-		object = pageSpaceIteratorNext(&iterator);
 	}
+}
+
+
+static _Bool keepDeadObject(RawObject *object)
+{
+	// method dictionaries of dead classes may be freed already, so their instances are not finalized
+	RawObject *class = (RawObject *) object->class;
+	_Bool isClassLive = isOldObject(class) && heapPageIsMarked(heapPageOf(class), class);
+	if ((object->tags & TAG_FINALIZED) == 0 && isClassLive && (class->tags & TAG_HAS_FINALIZER)) {
+		object->tags |= TAG_FINALIZED;
+		objectListAddLocked(&FinalizationQueue, object);
+		return 1;
+	}
+	if (isClassObject(object)) {
+		objectListAddLocked(&DeadClasses, object);
+		return 1;
+	}
+	return 0;
+}
 
-	for (size_t i = 0; i < finalizeSize; i++) {
+
+static _Bool isClassObject(RawObject *object)
+{
+	return object->class == Handles.MetaClass->raw || object->class->class == Handles.MetaClass->raw;
+}
+
+
+// finalizers are sent outside of sweeping, when allocations can run Smalltalk code
+void gcRunFinalizers(Thread *thread)
+{
+	static _Bool isRunning = 0;
+	if (isRunning || thread->heap.scavengesDisabled > 0) {
+		return;
+	}
+	isRunning = 1;
+	// background sweeper may queue more objects meanwhile
+	RawObject *object;
+	while ((object = popFinalizationQueue()) != NULL) {
 		HandleScope scope;
 		openHandleScope(&scope);
 		EntryArgs args = { .size = 0 };
-		entryArgsAddObject(&args, scopeHandle(finalize[i]));
+		entryArgsAddObject(&args, scopeHandle(object));
 		sendMessage(Handles.finalizeSymbol, &args);
 		closeHandleScope(&scope, NULL);
 	}
+	isRunning = 0;
+}
+
+
+static RawObject *popFinalizationQueue(void)
+{
+	pthread_mutex_lock(&Lock);
+	RawObject *object = FinalizationQueue.size > 0 ? FinalizationQueue.objects[--FinalizationQueue.size] : NULL;
+	pthread_mutex_unlock(&Lock);
+	return object;
+}
+
+
+static void objectListAdd(ObjectList *list, RawObject *object)
+{
+	if (list->size == list->capacity) {
+		list->capacity = list->capacity == 0 ? QUEUE_INIT_SIZE : list->capacity * 2;
+		list->objects = realloc(list->objects, list->capacity * sizeof(RawObject *));
+		ASSERT(list->objects != NULL);
+	}
+	list->objects[list->size] = object;
+	// size of overflow is checked by workers without lock
+	__atomic_store_n(&list->size, list->size + 1, __ATOMIC_RELEASE);
+}
+
+
+static void objectListAddLocked(ObjectList *list, RawObject *object)
+{
+	pthread_mutex_lock(&Lock);
+	objectListAdd(list, object);
+	pthread_mutex_unlock(&Lock);
 }
 
 
-static _Bool hasFinalizer(RawObject *object)
+static _Bool hasFinalizer(RawObject *class)
 {
 	HandleScope scope;
 	openHandleScope(&scope);
 	// TODO: maybe add empty implementation in Object and check if #finalize was overwritten in subclass
-	_Bool hasFinalizer = lookupSelector(scopeHandle(object->class), Handles.finalizeSymbol) != NULL;
+	_Bool hasFinalizer = lookupSelector(scopeHandle(class), Handles.finalizeSymbol) != NULL;
 	closeHandleScope(&scope, NULL);
 	return hasFinalizer;
 }
@@ -278,6 +1454,12 @@ void resetGcStats(void)
 	LastGCStats.sweeped = 0;
 	LastGCStats.freed = 0;
 	LastGCStats.extended = 0;
+	LastGCStats.evacuated = 0;
+	LastGCStats.released = 0;
+	LastGCStats.survived = 0;
+	LastGCStats.promoted = 0;
+	LastGCStats.freedCode = 0;
+	LastGCStats.evictedCode = 0;
 }
 
 
@@ -289,6 +1471,14 @@ void printGcStats(void)
 		" sweeped: %zu"
 		" freed: %zu"
 		" extended: %zu"
+		" evacuated: %zu"
+		" released: %zu"
+		" survived: %zu"
+		" promoted: %zu"
+		" tenuring age: %zu"
+		" pretenured: %zu"
+		" freed code: %zu"
+		" evicted code: %zu"
 		" time: %" PRIu64
 		" count: %zu\n",
 		LastGCStats.total,
@@ -296,6 +1486,14 @@ void printGcStats(void)
 		LastGCStats.sweeped,
 		LastGCStats.freed,
 		LastGCStats.extended,
+		LastGCStats.evacuated,
+		LastGCStats.released,
+		LastGCStats.survived,
+		LastGCStats.promoted,
+		LastGCStats.tenuringAge,
+		LastGCStats.pretenured,
+		LastGCStats.freedCode,
+		LastGCStats.evictedCode,
 		LastGCStats.totalTime,
 		LastGCStats.count
 	);
@@ -12,14 +12,34 @@ typedef struct {
 	size_t sweeped;
 	size_t freed;
 	size_t extended;
+	size_t evacuated;
+	size_t released;
+	// bytes copied by scavenges within new space and into old space
+	size_t survived;
+	size_t promoted;
+	size_t tenuringAge;
+	// times classes were pretenured since their new instances survived, never reset
+	size_t pretenured;
+	// native code freed by last collection and evicted by it from code cache
+	size_t freedCode;
+	size_t evictedCode;
 	int64_t time;
 	int64_t totalTime;
 } GCStats;
 
 extern GCStats LastGCStats;
 
-void gcMarkRoots(Thread *thread);
+void gcStartMarking(Thread *thread);
+_Bool gcMarkStep(Thread *thread, size_t size);
+void gcFinishMarking(Thread *thread);
+void gcEvacuate(Thread *thread);
 void gcSweep(PageSpace *space);
+_Bool gcIsSweeping(PageSpace *space);
+void gcSweepPages(PageSpace *space, size_t size);
+void gcFinishSweep(PageSpace *space);
+void gcPauseSweeping(void);
+void gcResumeSweeping(void);
+void gcRunFinalizers(Thread *thread);
 void resetGcStats(void);
 void printGcStats(void);
 
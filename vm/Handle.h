@@ -51,7 +51,6 @@ typedef struct {
 	Class *Dictionary;
 	Class *OrderedCollection;
 	Class *Class;
-	Class *TypeFeedback;
 	Class *CompiledMethod;
 	Class *CompiledBlock;
 	Class *SourceCode;
@@ -5,39 +5,85 @@
 #include "Os.h"
 #include "CompiledCode.h"
 #include "String.h"
+#include "WorkerPool.h"
 #include <string.h>
+#include <stdlib.h>
 
 #define KB 1024
 #define MB (1024 * 1024)
 
+#define CODE_REMEMBERED_SET_INIT_SIZE 256
+#define LARGE_OBJECTS_MIN_LIMIT (32 * MB)
+#define EXEC_SPACE_MIN_LIMIT (4 * MB)
+#define MARKING_STEP_RATIO 2
 #define SCAVENGE_EVERY_ALLOC 0
 #define VERIFY_HEAP_AFTER_GC 0
 
+HeapSettings DefaultHeapSettings = {
+	.newSpaceSize = 32 * MB,
+	.pageSize = 256 * KB,
+	.oldSpaceSize = 256 * KB,
+	.growthRatio = 1.0,
+	.gcThreads = 0,
+	.tenuringAge = 4,
+	.codeCacheSize = 0,
+};
+
 static void nilVars(Value *vars, size_t count);
+static _Bool nativeCodeHasNewPointers(NativeCode *code);
 static uint8_t *pageSpaceAllocate(PageSpace *pageSpace, size_t size);
-static void emptyRememberedSet(void);
+static uint8_t *allocateLarge(Heap *heap, size_t size);
+static uint8_t *allocateOld(Heap *heap, size_t size);
+static uint8_t *allocatePretenured(Heap *heap, size_t size);
+static void collectOldSpace(Heap *heap, size_t allocated, _Bool hasAllocationFailure);
+static void startMarking(Heap *heap);
+static void markAllocated(Heap *heap, uint8_t *p, size_t size);
+static void updateLimits(Heap *heap);
 static void verifyObject(Heap *heap, RawObject *object);
 static void verifyPointer(Heap *heap, RawObject *object);
+static void verifyCard(RawObject *object, void *field, RawObject *value);
+static void verifyNativeCode(NativeCode *code);
 static void printHeapPage(HeapPage *page);
 static void printFreeSpace(FreeSpace *freeSpace);
 static void printPageSpace(PageSpace *space);
 
 
-void initHeap(Heap *heap, struct Thread *thread)
+_Bool initHeap(Heap *heap, struct Thread *thread)
 {
+	HeapSettings *settings = &DefaultHeapSettings;
+	if (settings->pageSize < HEAP_PAGE_MIN_SIZE || (settings->pageSize & (settings->pageSize - 1)) != 0
+			|| settings->newSpaceSize < HEAP_PAGE_MIN_SIZE || !(settings->growthRatio >= 1.0)
+			|| settings->tenuringAge < 1 || settings->tenuringAge > MAX_TENURING_AGE) {
+		return 0;
+	}
+	HeapPageAlign = settings->pageSize;
+	// all processors are used by default
+	initWorkerPool(settings->gcThreads != 0 ? settings->gcThreads : osProcessorsCount());
+
 	heap->thread = thread;
-	initScavenger(&heap->newSpace, heap, 32 * MB);
-	initPageSpace(&heap->oldSpace, 256 * KB, 0);
-	initPageSpace(&heap->execSpace, 256 * KB, 1);
-	initRememberedSet(&heap->rememberedSet);
+	initScavenger(&heap->newSpace, heap, settings->newSpaceSize, settings->tenuringAge);
+	initPageSpace(&heap->oldSpace, settings->pageSize, settings->oldSpaceSize, 0);
+	initPageSpace(&heap->execSpace, settings->pageSize, 0, 1);
+	heap->codeRememberedSet.codes = malloc(CODE_REMEMBERED_SET_INIT_SIZE * sizeof(NativeCode *));
+	heap->codeRememberedSet.size = 0;
+	heap->codeRememberedSet.capacity = CODE_REMEMBERED_SET_INIT_SIZE;
+	heap->scavengesDisabled = 0;
+	heap->isMarking = 0;
+	heap->pretenuredSize = 0;
+	heap->growthRatio = settings->growthRatio;
+	heap->codeCacheSize = settings->codeCacheSize;
+	updateLimits(heap);
+	return 1;
 }
 
 
 void freeHeap(Heap *heap)
 {
+	gcFinishSweep(&heap->oldSpace);
 	freeScavenger(&heap->newSpace);
 	freePageSpace(&heap->oldSpace);
 	freePageSpace(&heap->execSpace);
+	free(heap->codeRememberedSet.codes);
 }
 
 
@@ -52,10 +98,11 @@ RawObject *allocateObject(Heap *heap, RawClass *class, size_t size)
 #if SCAVENGE_EVERY_ALLOC
 	scavengerScavenge(&heap->newSpace);
 #endif
-	RawObject *object = (RawObject *) allocate(heap, realSize);
+	RawObject *object = (RawObject *) (class->tags & TAG_PRETENURED ? allocatePretenured(heap, realSize) : allocate(heap, realSize));
 
 	object->class = classHandle->raw;
 	object->hash = (Value) object >> 2; // XXX: replace with random hash generator
+	object->age = 0;
 	object->payloadSize = shape.payloadSize;
 	object->varsSize = shape.varsSize;
 	object->tags = 0;
@@ -67,10 +114,10 @@ RawObject *allocateObject(Heap *heap, RawClass *class, size_t size)
 		memset(object->body, 0, shape.payloadSize * sizeof(Value));
 	}
 	if (shape.isBytes) {
-		nilVars(getRawObjectVars(object), class->instanceShape.varsSize);
+		nilVars(getRawObjectVars(object), shape.varsSize);
 		memset(getRawObjectIndexedVars(object), 0, size);
 	} else {
-		nilVars(getRawObjectVars(object), class->instanceShape.varsSize + size);
+		nilVars(getRawObjectVars(object), shape.varsSize + size);
 	}
 	closeHandleScope(&scope, NULL);
 	return object;
@@ -96,25 +143,73 @@ void freeObject(PageSpace *space, RawObject *object)
 }
 
 
-NativeCode *allocateNativeCode(Heap *heap, size_t size, size_t pointersOffsetsSize)
+NativeCode *allocateNativeCode(Heap *heap, size_t size, size_t pointersOffsetsSize, size_t sendFeedbackSize, size_t descriptorsSize, size_t stackmapsSize, size_t stackmapSetSize)
 {
-	size_t realSize = align(sizeof(NativeCode) + size + pointersOffsetsSize * sizeof(uint16_t), HEAP_OBJECT_ALIGN);
-	NativeCode *code = (NativeCode *) pageSpaceAllocate(&heap->execSpace, realSize);
+	size_t feedbackOffset = computeSendFeedbackOffset(size, pointersOffsetsSize);
+	size_t tablesSize = computeNativeCodeTablesSize(sendFeedbackSize, descriptorsSize, stackmapsSize, stackmapSetSize);
+	NativeCode *code = (NativeCode *) pageSpaceAllocate(&heap->execSpace, align(feedbackOffset + tablesSize, HEAP_OBJECT_ALIGN));
 	code->size = size;
 	code->pointersOffsetsSize = pointersOffsetsSize;
+	code->sendFeedbackSize = sendFeedbackSize;
+	code->descriptorsSize = descriptorsSize;
+	code->stackmapsSize = stackmapsSize;
+	code->stackmapSetSize = stackmapSetSize;
 	code->tags = 0;
+	// code allocated while old space is marked is live, remark scans it along with other marked code
+	if (heap->isMarking) {
+		heapPageMark(heapPageOf(code), code);
+	}
 	return code;
 }
 
 
+void rememberNativeCode(Heap *heap, NativeCode *code)
+{
+	if (code->tags & TAG_REMEMBERED) {
+		return;
+	}
+	CodeRememberedSet *set = &heap->codeRememberedSet;
+	if (set->size == set->capacity) {
+		set->capacity *= 2;
+		set->codes = realloc(set->codes, set->capacity * sizeof(NativeCode *));
+		ASSERT(set->codes != NULL);
+	}
+	code->tags |= TAG_REMEMBERED;
+	set->codes[set->size++] = code;
+}
+
+
+// must be called whenever pointers of native code are set without checking their space
+void rememberNativeCodeIfNeeded(Heap *heap, NativeCode *code)
+{
+	if (nativeCodeHasNewPointers(code)) {
+		rememberNativeCode(heap, code);
+	}
+}
+
+
+static _Bool nativeCodeHasNewPointers(NativeCode *code)
+{
+	if (!isOldObject(code->compiledCode)) {
+		return 1;
+	}
+	for (size_t i = 0; i < code->pointersOffsetsSize; i++) {
+		uint16_t offset = ((uint16_t *) (code->insts + code->size))[i];
+		Value value = *(Value *) (code->insts + offset);
+		// tagging does not change space bit, unbound inline caches are zero
+		if (!isOldObject((RawObject *) value)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
 static uint8_t *pageSpaceAllocate(PageSpace *pageSpace, size_t size)
 {
 	uint8_t *p = pageSpaceTryAllocate(pageSpace, size);
 	if (p == NULL) {
-		HeapPage *page = mapHeapPage(256 * KB, pageSpace->pagesTail->isExecutable);
-		pageSpace->pagesTail->next = page;
-		pageSpace->pagesTail = page;
-		expandFreeList(&pageSpace->freeList, page);
+		pageSpaceAddPage(pageSpace);
 		p = pageSpaceTryAllocate(pageSpace, size);
 		ASSERT(p != NULL);
 		return p;
@@ -126,21 +221,103 @@ static uint8_t *pageSpaceAllocate(PageSpace *pageSpace, size_t size)
 uint8_t *allocate(Heap *heap, size_t size)
 {
 	size_t realSize = align(size, HEAP_OBJECT_ALIGN);
+	if (realSize >= LARGE_OBJECT_SIZE) {
+		return allocateLarge(heap, realSize);
+	}
 	uint8_t *p = scavengerTryAllocate(&heap->newSpace, realSize);
-	if (p == NULL) {
+	if (p == NULL && heap->scavengesDisabled == 0) {
 		scavengerScavenge(&heap->newSpace);
-		if (heap->newSpace.hasPromotionFailure) {
-			markAndSweep(&CurrentThread);
-		}
+		collectOldSpace(heap, heap->newSpace.size, heap->newSpace.hasPromotionFailure);
+		gcRunFinalizers(heap->thread);
 		p = scavengerTryAllocate(&heap->newSpace, realSize);
 	}
 	if (p == NULL) {
-		p = tryAllocateOld(heap, realSize, 1);
+		// callers initialize objects without store checks, so their cards are scanned by next scavenge
+		p = allocateOld(heap, realSize);
+		markCards(p, realSize);
 	}
 	return p;
 }
 
 
+// instances of pretenured classes skip new space, old space is collected after each new space worth of them
+// as if they were promoted by a scavenge
+static uint8_t *allocatePretenured(Heap *heap, size_t size)
+{
+	size_t realSize = align(size, HEAP_OBJECT_ALIGN);
+	if (realSize >= LARGE_OBJECT_SIZE) {
+		return allocateLarge(heap, realSize);
+	}
+	if (heap->pretenuredSize >= heap->newSpace.size && heap->scavengesDisabled == 0) {
+		heap->pretenuredSize = 0;
+		collectOldSpace(heap, heap->newSpace.size, 1);
+		gcRunFinalizers(heap->thread);
+	}
+	uint8_t *p = allocateOld(heap, realSize);
+	markCards(p, realSize);
+	heap->pretenuredSize += realSize;
+	return p;
+}
+
+
+// promotion failures grow old space until it reaches limit set by growth ratio after last collection, then
+// it is marked a step after every scavenge, growing native code starts marking too
+static void collectOldSpace(Heap *heap, size_t allocated, _Bool hasAllocationFailure)
+{
+	size_t size = heap->oldSpace.size - heap->oldSpace.largeSize;
+	if (heap->isMarking) {
+		int64_t startTime = osCurrentMicroTime();
+		_Bool isDone = gcMarkStep(heap->thread, allocated * MARKING_STEP_RATIO);
+		LastGCStats.totalTime += osCurrentMicroTime() - startTime;
+		// marking which does not keep up with promotions is finished right away
+		if (isDone || size >= heap->oldSpaceLimit * 2) {
+			markAndSweep(heap->thread);
+		}
+	} else if ((hasAllocationFailure && size >= heap->oldSpaceLimit) || heap->execSpace.size > heap->execSpaceLimit) {
+		startMarking(heap);
+	}
+}
+
+
+// pages left by last mark and sweep are swept before old space grows
+static uint8_t *allocateOld(Heap *heap, size_t size)
+{
+	uint8_t *p = tryAllocateOld(heap, size, 0);
+	while (p == NULL && gcIsSweeping(&heap->oldSpace)) {
+		gcSweepPages(&heap->oldSpace, size);
+		p = tryAllocateOld(heap, size, 0);
+	}
+	return p != NULL ? p : tryAllocateOld(heap, size, 1);
+}
+
+
+// large objects are never copied by scavenges, they are allocated directly in old space
+static uint8_t *allocateLarge(Heap *heap, size_t size)
+{
+	if (heap->oldSpace.largeSize + size > heap->largeObjectsLimit && heap->scavengesDisabled == 0) {
+		collectGarbage(heap->thread);
+	}
+	uint8_t *p = pageSpaceAllocateLarge(&heap->oldSpace, size);
+	markCards(p, size);
+	markAllocated(heap, p, size);
+	return p;
+}
+
+
+// objects are allocated in old space instead while code holding raw pointers is running
+void disableScavenges(Heap *heap)
+{
+	heap->scavengesDisabled++;
+}
+
+
+void enableScavenges(Heap *heap)
+{
+	ASSERT(heap->scavengesDisabled > 0);
+	heap->scavengesDisabled--;
+}
+
+
 uint8_t *tryAllocateOld(Heap *heap, size_t size, _Bool grow)
 {
 	size_t realSize = align(size, HEAP_OBJECT_ALIGN);
@@ -149,26 +326,51 @@ uint8_t *tryAllocateOld(Heap *heap, size_t size, _Bool grow)
 		p = pageSpaceAllocate(&heap->oldSpace, realSize);
 	}
 	ASSERT(p == NULL || isOldObject((RawObject *) p));
+	if (p != NULL) {
+		markAllocated(heap, p, realSize);
+	}
 	return p;
 }
 
 
+// objects allocated while old space is marked are live, dirty cards make the remark scan their contents
+static void markAllocated(Heap *heap, uint8_t *p, size_t size)
+{
+	if (heap->isMarking) {
+		HeapPage *page = heapPageOf(p);
+		heapPageMark(page, p);
+		page->liveSize += size;
+		markCards(p, size);
+	}
+}
+
+
+void scavenge(Thread *thread)
+{
+	scavengerScavenge(&thread->heap.newSpace);
+}
+
+
 void collectGarbage(Thread *thread)
 {
 	scavengerScavenge(&thread->heap.newSpace);
 	markAndSweep(thread);
+	gcRunFinalizers(thread);
 }
 
 
+// finishes marking started by allocations, time of last collection is the pause of remark and sweep
 void markAndSweep(Thread *thread)
 {
-	resetGcStats();
-	LastGCStats.count++;
+	if (!thread->heap.isMarking) {
+		startMarking(&thread->heap);
+	}
 	int64_t startTime = osCurrentMicroTime();
 
-	rememberedSetReset(&thread->heap.rememberedSet);
-	gcMarkRoots(thread);
+	gcFinishMarking(thread);
+	gcEvacuate(thread);
 	gcSweep(&thread->heap.oldSpace);
+	updateLimits(&thread->heap);
 
 	LastGCStats.time = osCurrentMicroTime() - startTime;
 	LastGCStats.totalTime += LastGCStats.time;
@@ -179,6 +381,53 @@ void markAndSweep(Thread *thread)
 }
 
 
+// empty pages left by full collection are unmapped right away instead of waiting for sweeps to release them,
+// marking in progress keeps objects allocated since it started, so it is finished first
+void shrinkHeap(Thread *thread)
+{
+	Heap *heap = &thread->heap;
+	if (heap->isMarking) {
+		markAndSweep(thread);
+	}
+	collectGarbage(thread);
+	gcFinishSweep(&heap->oldSpace);
+	LastGCStats.released += pageSpaceFreeEmptyPages(&heap->oldSpace);
+	updateLimits(heap);
+}
+
+
+static void startMarking(Heap *heap)
+{
+	int64_t startTime = osCurrentMicroTime();
+	// stats are reset once background sweeper is done with previous sweep
+	gcFinishSweep(&heap->oldSpace);
+	resetGcStats();
+	LastGCStats.count++;
+	gcStartMarking(heap->thread);
+
+	LastGCStats.totalTime += osCurrentMicroTime() - startTime;
+}
+
+
+static void updateLimits(Heap *heap)
+{
+	size_t largeSize = heap->oldSpace.largeSize;
+	heap->oldSpaceLimit = (heap->oldSpace.size - largeSize) * heap->growthRatio;
+	heap->largeObjectsLimit = largeSize * (1.0 + heap->growthRatio);
+	if (heap->largeObjectsLimit < LARGE_OBJECTS_MIN_LIMIT) {
+		heap->largeObjectsLimit = LARGE_OBJECTS_MIN_LIMIT;
+	}
+	// native code is only freed by old space collections, which are started once it grows past limit
+	heap->execSpaceLimit = heap->execSpace.size * heap->growthRatio;
+	if (heap->execSpaceLimit < EXEC_SPACE_MIN_LIMIT) {
+		heap->execSpaceLimit = EXEC_SPACE_MIN_LIMIT;
+	}
+	if (heap->codeCacheSize != 0 && heap->execSpaceLimit > heap->codeCacheSize) {
+		heap->execSpaceLimit = heap->codeCacheSize > heap->execSpace.size ? heap->codeCacheSize : heap->execSpace.size;
+	}
+}
+
+
 void verifyHeap(Heap *heap)
 {
 	RawObject *object = (RawObject *) ((uintptr_t) heap->newSpace.fromSpace | NEW_SPACE_TAG);
@@ -188,22 +437,43 @@ void verifyHeap(Heap *heap)
 		object = (RawObject *) ((uint8_t *) object + align(computeRawObjectSize(object), HEAP_OBJECT_ALIGN));
 	}
 
+	gcPauseSweeping();
 	PageSpaceIterator iterator;
 	pageSpaceIteratorInit(&iterator, &heap->oldSpace);
 	object = pageSpaceIteratorNext(&iterator);
 
 	while (object != NULL) {
-		if ((object->tags & TAG_FREESPACE) == 0) {
+		// dead objects in pages not swept yet may point to freed objects
+		_Bool isDead = iterator.page->needsSweep && !heapPageIsMarked(iterator.page, object);
+		if ((object->tags & TAG_FREESPACE) == 0 && !isDead) {
 			verifyObject(heap, object);
 		}
 		object = pageSpaceIteratorNext(&iterator);
 	}
+	gcResumeSweeping();
+
+	pageSpaceIteratorInit(&iterator, &heap->execSpace);
+	NativeCode *code = (NativeCode *) pageSpaceIteratorNext(&iterator);
+
+	while (code != NULL) {
+		if ((code->tags & TAG_FREESPACE) == 0) {
+			verifyNativeCode(code);
+		}
+		code = (NativeCode *) pageSpaceIteratorNext(&iterator);
+	}
+}
+
+
+static void verifyNativeCode(NativeCode *code)
+{
+	ASSERT((code->tags & TAG_REMEMBERED) || !nativeCodeHasNewPointers(code));
 }
 
 
 static void verifyObject(Heap *heap, RawObject *object)
 {
 	verifyPointer(heap, (RawObject *) object->class);
+	verifyCard(object, &object->class, (RawObject *) object->class);
 
 	Value *vars = getRawObjectVars(object);
 	size_t size = object->class->instanceShape.varsSize;
@@ -214,6 +484,7 @@ static void verifyObject(Heap *heap, RawObject *object)
 	for (size_t i = 0; i < size; i++) {
 		if (valueTypeOf(vars[i], VALUE_POINTER)) {
 			verifyPointer(heap, asObject(vars[i]));
+			verifyCard(object, &vars[i], asObject(vars[i]));
 		}
 	}
 }
@@ -231,6 +502,12 @@ static void verifyPointer(Heap *heap, RawObject *object)
 }
 
 
+static void verifyCard(RawObject *object, void *field, RawObject *value)
+{
+	ASSERT(isNewObject(object) || isOldObject(value) || *cardAt(object, field) != 0);
+}
+
+
 void printHeap(Heap *heap)
 {
 	printf("Scavenger\n\t");
@@ -247,7 +524,7 @@ void printHeap(Heap *heap)
 
 static void printHeapPage(HeapPage *page)
 {
-	printf("page %p size %zi%s\n", page, page->size, page->isExecutable ? " executable" : "");
+	printf("page %p size %zi%s%s\n", page, page->size, page->isExecutable ? " executable" : "", page->isLarge ? " large" : "");
 }
 
 
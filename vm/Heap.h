@@ -4,28 +4,65 @@
 #include "Object.h"
 #include "HeapPage.h"
 #include "Scavenger.h"
-#include "RememberedSet.h"
+
+#define LARGE_OBJECT_SIZE (64 * 1024)
 
 struct Thread;
 struct NativeCode;
 
+// native code embedding pointers into new space, the only code visited by scavenges
+typedef struct {
+	struct NativeCode **codes;
+	size_t size;
+	size_t capacity;
+} CodeRememberedSet;
+
+typedef struct {
+	size_t newSpaceSize;
+	size_t pageSize;
+	size_t oldSpaceSize;
+	double growthRatio;
+	size_t gcThreads;
+	size_t tenuringAge;
+	// bytes of native code kept when it outgrows them, zero for unbounded code cache
+	size_t codeCacheSize;
+} HeapSettings;
+
 typedef struct Heap {
 	struct Thread *thread;
 	Scavenger newSpace;
 	PageSpace oldSpace;
 	PageSpace execSpace;
-	RememberedSet rememberedSet;
+	CodeRememberedSet codeRememberedSet;
+	size_t scavengesDisabled;
+	_Bool isMarking;
+	// bytes allocated directly in old space for pretenured classes since old space collection was last checked
+	size_t pretenuredSize;
+	size_t oldSpaceLimit;
+	size_t largeObjectsLimit;
+	size_t execSpaceLimit;
+	size_t codeCacheSize;
+	double growthRatio;
 } Heap;
 
-void initHeap(Heap *heap, struct Thread *thread);
+// used by initHeap, can be changed before first heap is initialized
+extern HeapSettings DefaultHeapSettings;
+
+_Bool initHeap(Heap *heap, struct Thread *thread);
 void freeHeap(Heap *heap);
 RawObject *allocateObject(Heap *heap, RawClass *class, size_t size);
 void freeObject(PageSpace *space, RawObject *object);
-struct NativeCode *allocateNativeCode(Heap *heap, size_t size, size_t pointersOffsetsSize);
+struct NativeCode *allocateNativeCode(Heap *heap, size_t size, size_t pointersOffsetsSize, size_t sendFeedbackSize, size_t descriptorsSize, size_t stackmapsSize, size_t stackmapSetSize);
+void rememberNativeCode(Heap *heap, struct NativeCode *code);
+void rememberNativeCodeIfNeeded(Heap *heap, struct NativeCode *code);
 uint8_t *allocate(Heap *heap, size_t size);
+void disableScavenges(Heap *heap);
+void enableScavenges(Heap *heap);
 uint8_t *tryAllocateOld(Heap *heap, size_t size, _Bool grow);
+void scavenge(struct Thread *thread);
 void collectGarbage(struct Thread *thread);
 void markAndSweep(struct Thread *thread);
+void shrinkHeap(struct Thread *thread);
 void verifyHeap(Heap *heap);
 void printHeap(Heap *heap);
 
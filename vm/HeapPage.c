@@ -1,19 +1,62 @@
 #include "HeapPage.h"
 #include "CompiledCode.h"
 #include "Assert.h"
+#include "Os.h"
 #include <sys/mman.h>
-#include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define PRINT_PAGE_ALLOC 0
+#define PAGE_TABLE_INIT_SIZE 1024
 
+// maps each aligned block of mapped pages to its page, so that addresses are looked up without walking page lists
+typedef struct {
+	uintptr_t block;
+	HeapPage *page;
+} PageTableEntry;
 
-void initPageSpace(PageSpace *pageSpace, size_t size, _Bool executable)
+typedef struct {
+	PageTableEntry *entries;
+	size_t size;
+	size_t capacity;
+} PageTable;
+
+static void pageTableAdd(HeapPage *page);
+static void pageTableRemove(HeapPage *page);
+static void pageTableInsert(PageTable *table, uintptr_t block, HeapPage *page);
+static size_t pageTableIndex(PageTable *table, uintptr_t block);
+static size_t pageTableHome(PageTable *table, uintptr_t block);
+static _Bool heapPageIsEmpty(HeapPage *page);
+
+size_t HeapPageAlign = HEAP_PAGE_MIN_SIZE;
+static PageTable HeapPageTable = { NULL, 0, 0 };
+
+
+void initPageSpace(PageSpace *pageSpace, size_t pageSize, size_t reservedSize, _Bool executable)
 {
-	HeapPage *page = mapHeapPage(size, executable);
+	HeapPage *page = mapHeapPage(pageSize, executable);
+	page->space = pageSpace;
 	pageSpace->pages = pageSpace->pagesTail = page;
+	pageSpace->pageSize = page->size;
+	pageSpace->size = page->size;
+	pageSpace->largePages = NULL;
+	pageSpace->largeSize = 0;
 	initFreeList(&pageSpace->freeList, page);
+	while (pageSpace->size < reservedSize) {
+		pageSpaceAddPage(pageSpace);
+	}
+}
+
+
+void pageSpaceAddPage(PageSpace *pageSpace)
+{
+	HeapPage *page = mapHeapPage(pageSpace->pageSize, pageSpace->pagesTail->isExecutable);
+	page->space = pageSpace;
+	pageSpace->pagesTail->next = page;
+	pageSpace->pagesTail = page;
+	pageSpace->size += page->size;
+	expandFreeList(&pageSpace->freeList, page);
 }
 
 
@@ -25,35 +68,62 @@ void freePageSpace(PageSpace *pageSpace)
 		unmapHeapPage(page);
 		page = next;
 	}
+	while (pageSpace->largePages != NULL) {
+		pageSpaceFreeLargePage(pageSpace, &pageSpace->largePages);
+	}
 }
 
 
 HeapPage *mapHeapPage(size_t size, _Bool executable)
 {
-	size_t alignedSize = align(size, getpagesize());
+	size_t alignedSize = align(size, HeapPageAlign);
 	int protection = PROT_READ | PROT_WRITE | (executable ? PROT_EXEC : 0);
-	HeapPage *page = mmap(NULL, alignedSize, protection, MAP_ANON | MAP_PRIVATE, -1, 0);
+	// map with some slack so that the page can be aligned and found by masking any object's address
+	uint8_t *start = mmap(NULL, alignedSize + HeapPageAlign, protection, MAP_ANON | MAP_PRIVATE, -1, 0);
 
-	if (page == MAP_FAILED) {
+	if (start == MAP_FAILED) {
 		FAIL();
 	}
 
+	HeapPage *page = (HeapPage *) align((uintptr_t) start, HeapPageAlign);
+	if ((uint8_t *) page != start && munmap(start, (uint8_t *) page - start) == -1) {
+		FAIL();
+	}
+	if (munmap((uint8_t *) page + alignedSize, start + HeapPageAlign - (uint8_t *) page) == -1) {
+		FAIL();
+	}
+
+	size_t headerSize = align(sizeof(*page) + (alignedSize >> CARD_SIZE_LOG2), HEAP_OBJECT_ALIGN);
 	page->next = NULL;
+	page->space = NULL;
 	page->isExecutable = executable;
+	page->isLarge = 0;
+	page->needsSweep = 0;
+	page->isEvacuated = 0;
+	page->liveSize = 0;
+	page->emptySweeps = 0;
+	page->markBits = calloc(alignedSize / HEAP_OBJECT_ALIGN / 8, 1);
+	if (page->markBits == NULL) {
+		FAIL();
+	}
 	page->size = alignedSize;
-	page->bodySize = alignedSize - sizeof(*page);
-	page->body = (uint8_t *) page + sizeof(*page);
+	page->bodySize = alignedSize - headerSize;
+	page->body = (uint8_t *) page + headerSize;
+	page->cardsSize = alignedSize >> CARD_SIZE_LOG2;
 	memset(page->body, executable ? 0xCC : 0, page->bodySize);
 	page->bodySize -= page->bodySize % HEAP_OBJECT_ALIGN;
 #if PRINT_PAGE_ALLOC
 	printf("Page %p %zu%s\n", page, size, executable ? " executable" : "");
 #endif
+	pageTableAdd(page);
 	return page;
 }
 
 
 void unmapHeapPage(HeapPage *page)
 {
+	pageTableRemove(page);
+	free(page->markBits);
 	if (munmap(page, page->size) == -1) {
 		FAIL();
 	}
@@ -75,37 +145,219 @@ uint8_t *pageSpaceTryAllocate(PageSpace *pageSpace, size_t size)
 }
 
 
+uint8_t *pageSpaceAllocateLarge(PageSpace *pageSpace, size_t size)
+{
+	ASSERT(size % HEAP_OBJECT_ALIGN == 0);
+	// object has to start within first aligned block, so that its page is found by masking its address
+	size_t headerSize = align(sizeof(HeapPage) + ((size + 2 * HeapPageAlign) >> CARD_SIZE_LOG2), HEAP_OBJECT_ALIGN);
+	ASSERT(headerSize < HeapPageAlign);
+
+	HeapPage *page = mapHeapPage(size + headerSize, pageSpace->pages->isExecutable);
+	ASSERT(page->body + size <= (uint8_t *) page + page->size && page->body < (uint8_t *) page + HeapPageAlign);
+	page->space = pageSpace;
+	page->isLarge = 1;
+	page->bodySize = size;
+	page->next = pageSpace->largePages;
+	pageSpace->largePages = page;
+	pageSpace->size += page->size;
+	pageSpace->largeSize += page->size;
+	return page->body;
+}
+
+
+void pageSpaceFreeLargePage(PageSpace *pageSpace, HeapPage **link)
+{
+	HeapPage *page = *link;
+	ASSERT(page->isLarge);
+	*link = page->next;
+	pageSpace->size -= page->size;
+	pageSpace->largeSize -= page->size;
+	unmapHeapPage(page);
+}
+
+
+// space always keeps at least one page
+void pageSpaceFreePage(PageSpace *pageSpace, HeapPage **link)
+{
+	HeapPage *page = *link;
+	ASSERT(!page->isLarge && (pageSpace->pages != page || page->next != NULL));
+	*link = page->next;
+	if (pageSpace->pagesTail == page) {
+		pageSpace->pagesTail = pageSpace->pages;
+		while (pageSpace->pagesTail->next != NULL) {
+			pageSpace->pagesTail = pageSpace->pagesTail->next;
+		}
+	}
+	pageSpace->size -= page->size;
+	unmapHeapPage(page);
+}
+
+
+// empty pages are unmapped and free list is rebuilt from free spaces of remaining pages, answers number of
+// unmapped pages
+size_t pageSpaceFreeEmptyPages(PageSpace *pageSpace)
+{
+	size_t count = 0;
+	resetFreeList(&pageSpace->freeList);
+	HeapPage **link = &pageSpace->pages;
+	while (*link != NULL) {
+		HeapPage *page = *link;
+		if (heapPageIsEmpty(page) && (pageSpace->pages != page || page->next != NULL)) {
+			pageSpaceFreePage(pageSpace, link);
+			count++;
+			continue;
+		}
+		uint8_t *p = page->body;
+		while (p < page->body + page->bodySize) {
+			FreeSpace *object = (FreeSpace *) p;
+			size_t size = object->tags & TAG_FREESPACE ? object->size : computeRawObjectSize((RawObject *) object);
+			if (object->tags & TAG_FREESPACE) {
+				freeListAddFreeSpace(&pageSpace->freeList, object);
+			}
+			p += align(size, HEAP_OBJECT_ALIGN);
+		}
+		link = &page->next;
+	}
+	return count;
+}
+
+
+static _Bool heapPageIsEmpty(HeapPage *page)
+{
+	uint8_t *p = page->body;
+	while (p < page->body + page->bodySize) {
+		FreeSpace *object = (FreeSpace *) p;
+		if ((object->tags & TAG_FREESPACE) == 0) {
+			return 0;
+		}
+		p += object->size;
+	}
+	return 1;
+}
+
+
+// page has to be a single free space, its body is given back to system except for the free space header,
+// it is mapped again by the first write into it
+void heapPageRelease(HeapPage *page)
+{
+	ASSERT(!page->isExecutable && !page->isLarge);
+	size_t osPage = osPageSize();
+	uint8_t *start = (uint8_t *) align((uintptr_t) page->body + sizeof(FreeSpace), osPage);
+	uint8_t *end = (uint8_t *) page + page->size;
+	if (start < end && madvise(start, end - start, MADV_DONTNEED) == -1) {
+		FAIL();
+	}
+}
+
+
 HeapPage *pageSpaceFindPage(PageSpace *pageSpace, uint8_t *addr)
 {
-	HeapPage *page = pageSpace->pages;
+	HeapPage *page = findHeapPage(addr);
+	return page != NULL && page->space == pageSpace && heapPageIncludes(page, addr) ? page : NULL;
+}
 
-	while (page != NULL) {
-		if (page->body <= addr && addr < page->body + page->bodySize) {
-			return page;
+
+HeapPage *findHeapPage(uint8_t *addr)
+{
+	PageTable *table = &HeapPageTable;
+	if (table->size == 0) {
+		return NULL;
+	}
+	size_t index = pageTableIndex(table, (uintptr_t) addr / HeapPageAlign);
+	return table->entries[index].page;
+}
+
+
+static void pageTableAdd(HeapPage *page)
+{
+	PageTable *table = &HeapPageTable;
+	size_t blocks = page->size / HeapPageAlign;
+
+	if ((table->size + blocks) * 2 > table->capacity) {
+		PageTable grown = { .size = 0, .capacity = table->capacity == 0 ? PAGE_TABLE_INIT_SIZE : table->capacity };
+		while ((table->size + blocks) * 2 > grown.capacity) {
+			grown.capacity *= 2;
 		}
-		page = page->next;
+		grown.entries = calloc(grown.capacity, sizeof(PageTableEntry));
+		ASSERT(grown.entries != NULL);
+		for (size_t i = 0; i < table->capacity; i++) {
+			if (table->entries[i].page != NULL) {
+				pageTableInsert(&grown, table->entries[i].block, table->entries[i].page);
+			}
+		}
+		free(table->entries);
+		*table = grown;
+	}
+
+	uintptr_t first = (uintptr_t) page / HeapPageAlign;
+	for (uintptr_t block = first; block < first + blocks; block++) {
+		pageTableInsert(table, block, page);
 	}
-	return NULL;
 }
 
 
-_Bool pageSpaceIncludes(PageSpace *PageSpace, uint8_t *addr)
+static void pageTableRemove(HeapPage *page)
 {
-	HeapPage *page = PageSpace->pages;
+	PageTable *table = &HeapPageTable;
+	size_t mask = table->capacity - 1;
+	uintptr_t first = (uintptr_t) page / HeapPageAlign;
 
-	while (page != NULL) {
-		if (page->body <= addr && addr < page->body + page->bodySize) {
-			return 1;
+	for (uintptr_t block = first; block < first + page->size / HeapPageAlign; block++) {
+		size_t i = pageTableIndex(table, block);
+		ASSERT(table->entries[i].page == page);
+		// entries following removed one are shifted back, so that no probe sequence is interrupted
+		for (size_t j = (i + 1) & mask; table->entries[j].page != NULL; j = (j + 1) & mask) {
+			size_t home = pageTableHome(table, table->entries[j].block);
+			if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+				table->entries[i] = table->entries[j];
+				i = j;
+			}
 		}
-		page = page->next;
+		table->entries[i].block = 0;
+		table->entries[i].page = NULL;
+		table->size--;
 	}
-	return 0;
+}
+
+
+static void pageTableInsert(PageTable *table, uintptr_t block, HeapPage *page)
+{
+	size_t index = pageTableIndex(table, block);
+	ASSERT(table->entries[index].page == NULL);
+	table->entries[index].block = block;
+	table->entries[index].page = page;
+	table->size++;
+}
+
+
+// index of block's entry or of empty entry where it belongs
+static size_t pageTableIndex(PageTable *table, uintptr_t block)
+{
+	size_t mask = table->capacity - 1;
+	size_t index = pageTableHome(table, block);
+	while (table->entries[index].page != NULL && table->entries[index].block != block) {
+		index = (index + 1) & mask;
+	}
+	return index;
+}
+
+
+static size_t pageTableHome(PageTable *table, uintptr_t block)
+{
+	return (block * 0x9E3779B97F4A7C15ull) >> (64 - __builtin_ctzll(table->capacity));
+}
+
+
+_Bool pageSpaceIncludes(PageSpace *PageSpace, uint8_t *addr)
+{
+	return pageSpaceFindPage(PageSpace, addr) != NULL;
 }
 
 
 void pageSpaceIteratorInit(PageSpaceIterator *iterator, PageSpace *space)
 {
 	iterator->page = space->pages;
+	iterator->largePages = space->largePages;
 	iterator->current = (FreeSpace *) align((uintptr_t) iterator->page->body, HEAP_OBJECT_ALIGN);
 }
 
@@ -114,10 +366,14 @@ RawObject *pageSpaceIteratorNext(PageSpaceIterator *iterator)
 {
 	FreeSpace *object = iterator->current;
 	if ((uint8_t *) object >= iterator->page->body + iterator->page->bodySize) {
-		if (iterator->page->next == NULL) {
+		// large pages are iterated after all other pages
+		if (iterator->page->next != NULL) {
+			iterator->page = iterator->page->next;
+		} else if (!iterator->page->isLarge && iterator->largePages != NULL) {
+			iterator->page = iterator->largePages;
+		} else {
 			return NULL;
 		}
-		iterator->page = iterator->page->next;
 		object = (FreeSpace *) align((uintptr_t) iterator->page->body, HEAP_OBJECT_ALIGN);
 	}
 
@@ -5,32 +5,67 @@
 #include "FreeList.h"
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+
+#define HEAP_PAGE_MIN_SIZE (256 * 1024)
+#define CARD_SIZE_LOG2 9
+#define CARD_SIZE (1 << CARD_SIZE_LOG2)
+
+struct PageSpace;
 
 typedef struct HeapPage {
 	struct HeapPage *next;
+	struct PageSpace *space;
 	_Bool isExecutable;
+	_Bool isLarge;
+	_Bool needsSweep;
+	_Bool isEvacuated;
 	size_t size;
 	size_t bodySize;
 	uint8_t *body;
+	// one bit for each HEAP_OBJECT_ALIGN bytes of page
+	uint8_t *markBits;
+	// bytes of objects marked by last marking
+	size_t liveSize;
+	// consecutive sweeps which found page empty
+	size_t emptySweeps;
+	size_t cardsSize;
+	uint8_t cards[];
 } HeapPage;
 
-typedef struct {
+typedef struct PageSpace {
 	HeapPage *pages;
 	HeapPage *pagesTail;
 	FreeList freeList;
+	size_t pageSize;
+	size_t size;
+	// objects too big for pages have a page of their own, freed by unmapping it
+	HeapPage *largePages;
+	size_t largeSize;
 } PageSpace;
 
 typedef struct {
 	HeapPage *page;
+	HeapPage *largePages;
 	FreeSpace *current;
 } PageSpaceIterator;
 
-void initPageSpace(PageSpace *pageSpace, size_t size, _Bool executable);
+// pages are aligned to their size, so that their header can be found by masking any object's address
+extern size_t HeapPageAlign;
+
+void initPageSpace(PageSpace *pageSpace, size_t pageSize, size_t reservedSize, _Bool executable);
+void pageSpaceAddPage(PageSpace *pageSpace);
 void freePageSpace(PageSpace *pageSpace);
 HeapPage *mapHeapPage(size_t size, _Bool executable);
 void unmapHeapPage(HeapPage *page);
+HeapPage *findHeapPage(uint8_t *addr);
 _Bool heapPageIncludes(HeapPage *page, uint8_t *addr);
 uint8_t *pageSpaceTryAllocate(PageSpace *pageSpace, size_t size);
+uint8_t *pageSpaceAllocateLarge(PageSpace *pageSpace, size_t size);
+void pageSpaceFreeLargePage(PageSpace *pageSpace, HeapPage **link);
+void pageSpaceFreePage(PageSpace *pageSpace, HeapPage **link);
+size_t pageSpaceFreeEmptyPages(PageSpace *pageSpace);
+void heapPageRelease(HeapPage *page);
 HeapPage *pageSpaceFindPage(PageSpace *PageSpace, uint8_t *addr);
 _Bool pageSpaceIncludes(PageSpace *PageSpace, uint8_t *addr);
 void pageSpaceIteratorInit(PageSpaceIterator *iterator, PageSpace *space);
@@ -42,4 +77,78 @@ static uintptr_t align(uintptr_t v, size_t align)
 	return (v + (align - 1)) & -align;
 }
 
+
+static inline HeapPage *heapPageOf(void *object)
+{
+	return (HeapPage *) ((uintptr_t) object & -HeapPageAlign);
+}
+
+
+static inline size_t markBitIndex(HeapPage *page, void *object)
+{
+	return ((uint8_t *) object - (uint8_t *) page) / HEAP_OBJECT_ALIGN;
+}
+
+
+static inline _Bool heapPageIsMarked(HeapPage *page, void *object)
+{
+	size_t index = markBitIndex(page, object);
+	return (page->markBits[index / 8] >> (index % 8)) & 1;
+}
+
+
+static inline void heapPageMark(HeapPage *page, void *object)
+{
+	size_t index = markBitIndex(page, object);
+	page->markBits[index / 8] |= 1 << (index % 8);
+}
+
+
+// answers whether object was not marked yet, objects can be marked by several threads at once
+static inline _Bool heapPageTryMark(HeapPage *page, void *object)
+{
+	size_t index = markBitIndex(page, object);
+	uint8_t mask = 1 << (index % 8);
+	return (__atomic_fetch_or(&page->markBits[index / 8], mask, __ATOMIC_RELAXED) & mask) == 0;
+}
+
+
+static inline void heapPageClearMarks(HeapPage *page)
+{
+	memset(page->markBits, 0, page->size / HEAP_OBJECT_ALIGN / 8);
+	page->liveSize = 0;
+}
+
+
+// object has to be in old space, field is any of its slots
+static inline uint8_t *cardAt(void *object, void *field)
+{
+	HeapPage *page = heapPageOf(object);
+	return &page->cards[((uint8_t *) field - (uint8_t *) page) >> CARD_SIZE_LOG2];
+}
+
+
+static inline void markCard(void *object, void *field)
+{
+	*cardAt(object, field) = 1;
+}
+
+
+static inline void markCards(void *object, size_t size)
+{
+	uint8_t *first = cardAt(object, object);
+	memset(first, 1, cardAt(object, (uint8_t *) object + size - 1) - first + 1);
+}
+
+
+static inline _Bool heapPageHasDirtyCards(HeapPage *page)
+{
+	uint64_t *cards = (uint64_t *) page->cards;
+	uint64_t *end = (uint64_t *) (page->cards + page->cardsSize);
+	while (cards < end && *cards == 0) {
+		cards++;
+	}
+	return cards < end;
+}
+
 #endif
@@ -6,8 +6,9 @@
 void initArrayIterator(Iterator *iterator, Array *array, ptrdiff_t from, ptrdiff_t to)
 {
 	ASSERT(array->raw->class == Handles.Array->raw);
-	iterator->start = array->raw->vars + from;
-	iterator->end = array->raw->vars + array->raw->size + to;
+	iterator->array = array;
+	iterator->start = from;
+	iterator->end = array->raw->size + to;
 	iterator->current = iterator->start;
 }
 
@@ -15,7 +16,8 @@ void initArrayIterator(Iterator *iterator, Array *array, ptrdiff_t from, ptrdiff
 void initOrdCollIterator(Iterator *iterator, OrderedCollection *ordColl, ptrdiff_t from, ptrdiff_t to)
 {
 	ASSERT(ordColl->raw->class == Handles.OrderedCollection->raw);
-	iterator->start = ordCollGetContents(ordColl)->vars + ordCollGetFirstIndex(ordColl) + from - 1;
+	iterator->array = (Array *) scopeHandle(ordCollGetContents(ordColl));
+	iterator->start = ordCollGetFirstIndex(ordColl) + from - 1;
 	iterator->end = iterator->start + ordCollSize(ordColl) + to;
 	iterator->current = iterator->start;
 }
@@ -42,7 +44,7 @@ _Bool iteratorHasNext(Iterator *iterator)
 
 Value iteratorNext(Iterator *iterator)
 {
-	return *iterator->current++;
+	return iterator->array->raw->vars[iterator->current++];
 }
 
 
@@ -5,10 +5,12 @@
 #include "Collection.h"
 #include "Dictionary.h"
 
+// indexes into handle of iterated array, so scavenges can move it while iterating
 typedef struct {
-	Value *start;
-	Value *end;
-	Value *current;
+	Array *array;
+	ptrdiff_t start;
+	ptrdiff_t end;
+	ptrdiff_t current;
 } Iterator;
 
 void initArrayIterator(Iterator *iterator, Array *array, ptrdiff_t from, ptrdiff_t to);
@@ -17,7 +17,6 @@ LookupTable LookupCache = {
 	.codes = { NULL },
 };
 
-static void feedbackType(Class *class);
 static NativeCodeEntry doesNotUnderstand(Class *class, String *selector);
 
 
@@ -35,7 +34,6 @@ NativeCodeEntry lookupNativeCode(RawClass *class, RawString *selector)
 		entry = doesNotUnderstand(classHandle, selectorHandle);
 	} else {
 		entry = (NativeCodeEntry) getNativeCode(classHandle, method)->insts;
-		feedbackType(classHandle);
 	}
 
 	intptr_t hash = lookupHash((intptr_t) classHandle->raw, (intptr_t) selectorHandle->raw);
@@ -48,31 +46,22 @@ NativeCodeEntry lookupNativeCode(RawClass *class, RawString *selector)
 }
 
 
-static void feedbackType(Class *class)
+NativeCodeEntry lookupInlineCache(RawClass *class, RawString *selector, uint8_t *cache)
 {
+	HandleScope scope;
+	openHandleScope(&scope);
+
 	EntryStackFrame *entryFrame = CurrentThread.stackFramesTail;
-	if (entryFrame == NULL) {
-		return;
-	}
+	NativeCode *code = stackFrameGetNativeCode(stackFrameGetParent(entryFrame->exit, entryFrame));
+	SendFeedback *feedback = nativeCodeFindSendFeedbackAtCache(code, cache);
+	ASSERT(feedback != NULL);
 
-	StackFrame *frame = stackFrameGetParent(entryFrame->exit, entryFrame);
-	NativeCode *code = stackFrameGetNativeCode(frame);
-	OrderedCollection *typeFeedback;
-	if (code->typeFeedback == NULL) {
-		typeFeedback = newOrdColl(8);
-		code->typeFeedback = typeFeedback->raw;
-	} else {
-		typeFeedback = scopeHandle(code->typeFeedback);
-		if (ordCollSize(typeFeedback) > 16) {
-			typeFeedback = newOrdColl(8);
-			code->typeFeedback = typeFeedback->raw;
-		}
-	}
+	Class *classHandle = scopeHandle(class);
+	NativeCodeEntry entry = cachedLookupNativeCode(class, selector);
+	updateInlineCache(code, cache, feedback, classHandle, entry);
 
-	TypeFeedback *type = newObject(Handles.TypeFeedback, 0);
-	type->raw->ic = tagInt(entryFrame->exit->parentIc - code->insts);
-	type->raw->hintedClass = getTaggedPtr(class);
-	ordCollAddObject(typeFeedback, (Object *) type);
+	closeHandleScope(&scope, NULL);
+	return entry;
 }
 
 
@@ -81,6 +70,7 @@ static NativeCodeEntry doesNotUnderstand(Class *class, String *selector)
 	intptr_t hash = lookupHash((intptr_t) class->raw, (intptr_t) selector->raw);
 	NativeCode *code = generateDoesNotUnderstand(selector);
 	code->compiledCode = lookupSelector(class, Handles.doesNotUnderstandSymbol)->raw;
+	rememberNativeCodeIfNeeded(&CurrentThread.heap, code);
 	return (NativeCodeEntry) code->insts;
 }
 
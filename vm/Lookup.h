@@ -24,6 +24,7 @@ typedef struct {
 extern LookupTable LookupCache;
 
 NativeCodeEntry lookupNativeCode(RawClass *class, RawString *selector);
+NativeCodeEntry lookupInlineCache(RawClass *class, RawString *selector, uint8_t *cache);
 NativeCode *getNativeCode(Class *class, CompiledMethod *method);
 
 
@@ -16,7 +16,7 @@
 #define OBJECT_HEADER \
 	struct RawClass *class; \
 	uint32_t hash; \
-	uint8_t unused; \
+	uint8_t age; \
 	uint8_t payloadSize; \
 	uint8_t varsSize; \
 	uint8_t tags
@@ -30,10 +30,13 @@ enum {
 
 enum {
 	TAG_FREESPACE = 1,
-	TAG_MARKED = 1 << 2,
+	TAG_PINNED = 1 << 1,
+	TAG_HAS_FINALIZER = 1 << 2,
 	TAG_FORWARDED = 1 << 3,
 	TAG_FINALIZED = 1 << 4,
 	TAG_REMEMBERED = 1 << 5,
+	TAG_PRETENURED = 1 << 6,
+	TAG_EVICTED = 1 << 7,
 } ObjectTag;
 
 typedef enum {
@@ -1,21 +1,120 @@
 #include "Optimizer.h"
+#include "CodeGenerator.h"
 #include "Bytecodes.h"
 #include "Class.h"
 #include "CodeDescriptors.h"
 #include "Collection.h"
+#include "Compiler.h"
+#include "Simplifier.h"
+#include "Lookup.h"
 #include "Iterator.h"
+#include "Heap.h"
+#include "Thread.h"
 #include "Assert.h"
+#include <stdlib.h>
+#include <string.h>
 
-#define MAX(a, b) (a > b ? a : b)
+#define MAX_VARS_SIZE 64
+#define MAX_LITERALS_SIZE 256
+#define MAX_INLINING_DEPTH 3
+#define MAX_INLINED_METHOD_SIZE 128
+#define MAX_OPTIMIZED_METHOD_SIZE 4096
+
+size_t OptimizationThreshold = 10000;
 
 typedef struct {
 	AssemblerBuffer buffer;
 	OrderedCollection *literals;
+	OrderedCollection *descriptors;
+	Array *sourceDescriptors;
 	CompiledCodeHeader header;
+	Value position;
+	ptrdiff_t notedPosition;
+	size_t inlinedSends;
 } Optimizer;
 
-static void inlineSend(Optimizer *optimizer, CompiledMethod *method, Operand *arguments, Operand result);
-static void adjustOperand(Optimizer *optimizer, Array *literals, Operand *arguments, Operand *operand);
+// snapshot of optimizer used to undo inlining which could not be finished
+typedef struct {
+	ptrdiff_t offset;
+	ptrdiff_t instOffset;
+	uint8_t tempsSize;
+	size_t literalsSize;
+	size_t descriptorsSize;
+	ptrdiff_t notedPosition;
+	size_t inlinedSends;
+} OptimizerState;
+
+typedef struct InlinedMethod {
+	struct InlinedMethod *caller;
+	CompiledMethod *method;
+	Array *literals;
+	Class *receiverClass;
+	NativeCode *feedback;
+	Operand *arguments;
+	Operand result;
+	uint8_t argsSize;
+	uint8_t tempsOffset;
+	size_t depth;
+	ptrdiff_t callSite; // bytecode number of send in caller
+} InlinedMethod;
+
+typedef struct {
+	ptrdiff_t target;
+	AssemblerLabel label;
+} CodeLabel;
+
+typedef struct {
+	NativeCode *code;
+	NativeCode *optimizedCode;
+	uint8_t entry[NATIVE_CODE_REDIRECT_SIZE];
+} OptimizedMethod;
+
+// baseline frame of method inlined at send of deoptimized frame, the outermost one is its original method
+typedef struct {
+	CompiledMethod *method;
+	NativeCode *code;
+	ptrdiff_t bytecodeNumber;
+	Operand *vars;
+	Value *values;
+	_Bool isPinned;
+	size_t frameSize;
+	size_t framePointer; // slots between frame pointers of deoptimized frame and this one
+	uint8_t *ic; // of send in this frame
+} DeoptimizedMethod;
+
+static OptimizedMethod *OptimizedMethods = NULL;
+static size_t OptimizedMethodsSize = 0;
+
+static _Bool inlineCode(Optimizer *optimizer, InlinedMethod *inlined);
+static _Bool optimizeSend(Optimizer *optimizer, InlinedMethod *inlined, Bytecode bytecode, BytecodesIterator *iterator);
+static _Bool emitSend(Optimizer *optimizer, InlinedMethod *inlined, ptrdiff_t bytecodeNumber, String *selector, Operand *args, uint8_t argsSize, Operand result);
+static _Bool emitDeoptimizationState(Optimizer *optimizer, InlinedMethod *inlined, ptrdiff_t bytecodeNumber);
+static _Bool inlineMethod(Optimizer *optimizer, InlinedMethod *caller, CompiledMethod *method, Class *class, Operand *arguments, Operand result, ptrdiff_t callSite);
+static _Bool canInlineMethod(InlinedMethod *caller, CompiledMethod *method);
+static _Bool canInlineOperand(Operand operand);
+static Class *resolveReceiverClass(Optimizer *optimizer, InlinedMethod *inlined, Operand receiver);
+static size_t getFeedbackClasses(InlinedMethod *inlined, ptrdiff_t bytecodeNumber, Class **classes);
+static NativeCode *findBaselineCode(CompiledMethod *method);
+static void adjustOperand(Optimizer *optimizer, InlinedMethod *inlined, Operand *operand);
+static Operand stableOperand(Optimizer *optimizer, Operand operand, _Bool isReceiver);
+static uint8_t addLiteral(Optimizer *optimizer, Object *object);
+static uint8_t allocateTemps(Optimizer *optimizer, uint8_t size);
+static AssemblerLabel *addJumpLabel(Optimizer *optimizer, CodeLabel *labels, size_t *size, ptrdiff_t *offsets, ptrdiff_t target, ptrdiff_t offset);
+static void bindJumpLabels(Optimizer *optimizer, CodeLabel *labels, size_t size, ptrdiff_t target);
+static void noteSourcePosition(Optimizer *optimizer, ptrdiff_t bytecodeNumber);
+static void noteSendPosition(Optimizer *optimizer);
+static OptimizerState saveState(Optimizer *optimizer);
+static void restoreState(Optimizer *optimizer, OptimizerState state);
+static _Bool isWithinBudget(Optimizer *optimizer);
+static void registerOptimizedMethod(NativeCode *code, NativeCode *optimizedCode);
+static size_t decodeDeoptimizationState(CompiledMethod *method, ptrdiff_t sendNumber, Operand *operands);
+static size_t computePushedSize(CompiledMethod *method, ptrdiff_t sendNumber);
+static NativeCode *ensureBaselineCode(CompiledMethod *method, _Bool *isPinned);
+static void readDeoptimizedValues(StackFrame *frame, uint8_t *ic, CompiledMethod *optimized, DeoptimizedMethod *methods, size_t size, Value *regs);
+static Value readFrameOperand(StackFrame *frame, RegsAlloc *alloc, CompiledCodeHeader header, Stackmap *stackmap, ptrdiff_t bytecodeNumber, Array *literals, Operand operand, Value *regs);
+static void writeBaselineFrame(StackFrame *frame, StackFrame *deoptimizedFrame, DeoptimizedMethod *method, DeoptimizedMethod *caller, Value *regs);
+static _Bool isVarInFrame(RegsAlloc *alloc, CompiledCodeHeader header, Variable *var, ptrdiff_t bytecodeNumber, Stackmap *stackmap);
+static uint8_t *findSendIc(NativeCode *code, ptrdiff_t bytecodeNumber);
 
 
 CompiledMethod *optimizeMethod(CompiledMethod *method)
@@ -23,92 +122,280 @@ CompiledMethod *optimizeMethod(CompiledMethod *method)
 	HandleScope scope;
 	openHandleScope(&scope);
 
+	CompiledCodeHeader header = compiledMethodGetHeader(method);
+	if (header.primitive > 0) {
+		return closeHandleScope(&scope, NULL);
+	}
+
 	Optimizer optimizer = {
 		.literals = arrayAsOrdColl(compiledMethodGetLiterals(method)),
-		.header = compiledMethodGetHeader(method),
+		.descriptors = newOrdColl(32),
+		.sourceDescriptors = compiledMethodGetDescriptors(method),
+		.header = header,
+		.position = 0,
+		.notedPosition = -1,
+		.inlinedSends = 0,
+	};
+	InlinedMethod inlined = {
+		.caller = NULL,
+		.method = method,
+		.literals = compiledMethodGetLiterals(method),
+		.receiverClass = NULL,
+		.feedback = findBaselineCode(method),
+		.arguments = NULL,
+		.result = { .isValid = 0 },
+		.argsSize = header.argsSize,
+		.tempsOffset = header.argsSize + 2,
+		.depth = 0,
+		.callSite = -1,
 	};
-	CompiledCodeHeader newHeader = compiledMethodGetHeader(method);
-	Array *descriptors = scopeHandle(compiledMethodGetNativeCode(method)->descriptors);
-	OrderedCollection *typeFeedback = scopeHandle(compiledMethodGetNativeCode(method)->typeFeedback);
-	BytecodesIterator iterator;
 
-	bytecodeInitIterator(&iterator, compiledMethodGetBytes(method), method->raw->size);
 	asmInitBuffer(&optimizer.buffer, 256);
+	if (!inlineCode(&optimizer, &inlined) || optimizer.inlinedSends == 0 || !isWithinBudget(&optimizer)) {
+		asmFreeBuffer(&optimizer.buffer);
+		return closeHandleScope(&scope, NULL);
+	}
+
+	simplifyBytecodes(&optimizer.buffer, optimizer.literals, optimizer.descriptors);
+	CompiledMethod *newMethod = newObject(Handles.CompiledMethod, asmOffset(&optimizer.buffer));
+	asmCopyBuffer(&optimizer.buffer, newMethod->raw->bytes, newMethod->raw->size);
+	compiledMethodSetHeader(newMethod, optimizer.header);
+	compiledMethodSetLiterals(newMethod, ordCollAsArray(optimizer.literals));
+	compiledMethodSetSelector(newMethod, compiledMethodGetSelector(method));
+	compiledMethodSetOwnerClass(newMethod, compiledMethodGetOwnerClass(method));
+	compiledMethodSetSourceCode(newMethod, compiledMethodGetSourceCode(method));
+	compiledMethodSetDescriptors(newMethod, ordCollAsArray(optimizer.descriptors));
+	asmFreeBuffer(&optimizer.buffer);
 
-	printBytecodes(method->raw->bytes, method->raw->size, compiledMethodGetLiterals(method)->raw);
-	printf("\n");
+	return closeHandleScope(&scope, newMethod);
+}
+
+
+void optimizeHotMethod(uint8_t *entry)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	NativeCode *code = (NativeCode *) (entry - offsetof(NativeCode, insts));
+	CompiledMethod *method = scopeHandle(code->compiledCode);
+	Class *class = compiledMethodGetOwnerClass(method);
+
+	// optimized or redefined methods are not installed anymore
+	CompiledMethod *installed = lookupSelector(class, compiledMethodGetSelector(method));
+	if (installed == NULL || installed->raw != method->raw || compiledMethodGetNativeCode(method) != code) {
+		closeHandleScope(&scope, NULL);
+		return;
+	}
+
+	// feedback is read from native code of inlined methods, which must not be collected meanwhile
+	disableScavenges(&CurrentThread.heap);
+	CompiledMethod *optimized = optimizeMethod(method);
+	enableScavenges(&CurrentThread.heap);
+	if (optimized != NULL) {
+		NativeCode *optimizedCode = generateMethodCode(optimized);
+		compiledMethodSetNativeCode(optimized, optimizedCode);
+		compiledMethodSetNativeCode(method, optimizedCode);
+		registerOptimizedMethod(code, optimizedCode);
+		redirectNativeCode(code, optimizedCode);
+		flushLookupCache();
+	}
+
+	closeHandleScope(&scope, NULL);
+}
+
+
+// inlined methods could be redefined so every optimized method is reverted to its original code,
+// frames which are still executing optimized code continue in original code once their sends return
+void deoptimizeMethods(void)
+{
+	if (OptimizedMethodsSize == 0) {
+		return;
+	}
+
+	for (size_t i = 0; i < OptimizedMethodsSize; i++) {
+		OptimizedMethod *optimized = &OptimizedMethods[i];
+		RawCompiledMethod *method = optimized->code->compiledCode;
+
+		memcpy(optimized->code->insts, optimized->entry, NATIVE_CODE_REDIRECT_SIZE);
+		optimized->code->counter = 0;
+		optimized->code->tags &= ~TAG_PINNED;
+		optimized->optimizedCode->tags &= ~TAG_PINNED;
+		method->nativeCode = optimized->code;
+		// inline caches could still point to optimized code
+		redirectNativeCode(optimized->optimizedCode, optimized->code);
+		deoptimizeNativeCode(optimized->optimizedCode);
+	}
+	OptimizedMethodsSize = 0;
+	flushLookupCache();
+}
+
+
+// frame returned to from send of deoptimized code is replaced by baseline frames of original method and methods
+// inlined at the send, they are built in a buffer, which the stub copies below frame pointer of the replaced frame
+DeoptimizedFrames *deoptimizeFrame(uint8_t *ic, StackFrame *frame, Value result)
+{
+	static DeoptimizedFrames frames;
+	static Value *slots = NULL;
+	static size_t slotsCapacity = 0;
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	NativeCode *code = stackFrameGetNativeCode(frame);
+	NativeDescriptor *descriptor = findNativeDescriptor(code, ic - code->insts);
+	ASSERT(descriptor != NULL);
+	CompiledMethod *optimized = scopeHandle(code->compiledCode);
+	Object *resultObject = valueTypeOf(result, VALUE_POINTER) ? scopeHandle(asObject(result)) : NULL;
+	Operand operands[UINT8_MAX];
+	size_t operandsSize = decodeDeoptimizationState(optimized, descriptor->bytecode, operands);
+	Value values[UINT8_MAX];
+	DeoptimizedMethod methods[MAX_INLINING_DEPTH + 1];
+	size_t methodsSize = 0;
+
+	// baseline code is generated for methods which have none, it must stay until frames reference it
+	for (size_t i = 0; i < operandsSize; methodsSize++) {
+		DeoptimizedMethod *method = &methods[methodsSize];
+		method->method = (CompiledMethod *) arrayObjectAt(compiledMethodGetLiterals(optimized), operands[i].index);
+		method->bytecodeNumber = asCInt(operands[i + 1].value);
+		method->vars = &operands[i + 2];
+		method->values = &values[i + 2];
+		method->code = ensureBaselineCode(method->method, &method->isPinned);
+		CompiledCodeHeader header = compiledMethodGetHeader(method->method);
+		i += header.argsSize + header.tempsSize + 3;
+	}
+
+	// nothing is allocated from now on
+	readDeoptimizedValues(frame, ic, optimized, methods, methodsSize, frames.regs);
+	size_t size = 0;
+	for (size_t i = 0; i < methodsSize; i++) {
+		DeoptimizedMethod *method = &methods[i];
+		RegsAlloc *alloc = &(RegsAlloc) { 0 };
+		CompiledCode compiledCode;
+		initMethodCompiledCode(&compiledCode, method->method);
+		computeRegsAlloc(alloc, &X64AvailableRegs, &compiledCode);
+		ASSERT(!alloc->frameLess);
+		if (i > 0) {
+			// arguments of send, return address and saved frame pointer
+			size += compiledCode.header.argsSize + 3;
+		}
+		method->frameSize = alloc->frameSize;
+		method->framePointer = size;
+		method->ic = findSendIc(method->code, method->bytecodeNumber);
+		size += alloc->frameSize;
+	}
+	size += computePushedSize(methods[methodsSize - 1].method, methods[methodsSize - 1].bytecodeNumber);
+
+	if (size > slotsCapacity) {
+		slots = realloc(slots, size * sizeof(*slots));
+		if (slots == NULL) {
+			FAIL();
+		}
+		slotsCapacity = size;
+	}
+	for (size_t i = 0; i < size; i++) {
+		slots[i] = getTaggedPtr(Handles.nil);
+	}
+	for (size_t i = 0; i < methodsSize; i++) {
+		StackFrame *baselineFrame = (StackFrame *) (slots + size - methods[i].framePointer);
+		writeBaselineFrame(baselineFrame, frame, &methods[i], i == 0 ? NULL : &methods[i - 1], frames.regs);
+	}
+
+	// context of original method could be already created by optimized code
+	RawContext *context = stackFrameGetContext(frame);
+	if (tagPtr(context) != CurrentThread.context && context->frame == frame) {
+		rawObjectStorePtr((RawObject *) context, &context->code, (RawObject *) methods[0].method->raw);
+	}
+
+	DeoptimizedMethod *innermost = &methods[methodsSize - 1];
+	frames.rsp = (uint8_t *) frame - size * sizeof(Value);
+	frames.rbp = (uint8_t *) frame - innermost->framePointer * sizeof(Value);
+	frames.ic = innermost->ic;
+	frames.result = resultObject == NULL ? result : getTaggedPtr(resultObject);
+	frames.size = size;
+	frames.slots = slots;
+	for (size_t i = 0; i < methodsSize; i++) {
+		if (methods[i].isPinned) {
+			methods[i].code->tags &= ~TAG_PINNED;
+		}
+	}
+	closeHandleScope(&scope, NULL);
+	return &frames;
+}
+
+
+static _Bool inlineCode(Optimizer *optimizer, InlinedMethod *inlined)
+{
+	AssemblerBuffer *buffer = &optimizer->buffer;
+	size_t size = inlined->method->raw->size;
+	// every bytecode is at least 2 bytes long and adds at most one label
+	CodeLabel *labels = malloc((size / 2 + 1) * sizeof(*labels));
+	ptrdiff_t *offsets = malloc((size + 1) * sizeof(*offsets));
+	if (labels == NULL || offsets == NULL) {
+		FAIL();
+	}
+	size_t labelsSize = 0;
+	_Bool fallsThrough = 1;
+	_Bool success = 1;
+	BytecodesIterator iterator;
+
+	bytecodeInitIterator(&iterator, compiledMethodGetBytes(inlined->method), size);
+	while (success && bytecodeHasNext(&iterator)) {
+		HandleScope scope;
+		openHandleScope(&scope);
+
+		ptrdiff_t offset = bytecodeOffset(&iterator);
+		offsets[offset] = asmOffset(buffer);
+		bindJumpLabels(optimizer, labels, labelsSize, offset);
 
-	while (bytecodeHasNext(&iterator)) {
 		Bytecode bytecode = bytecodeNext(&iterator);
+		if (inlined->caller == NULL) {
+			noteSourcePosition(optimizer, bytecodeNumber(&iterator));
+		}
+		fallsThrough = 1;
 
 		switch (bytecode) {
 		case BYTECODE_COPY: {
 			Operand src = bytecodeNextOperand(&iterator);
 			Operand dst = bytecodeNextOperand(&iterator);
-			bytecodeCopy(&optimizer.buffer, &src, &dst);
+			adjustOperand(optimizer, inlined, &src);
+			adjustOperand(optimizer, inlined, &dst);
+			bytecodeCopy(buffer, &src, &dst);
 			break;
 		}
 
 		case BYTECODE_SEND:
-		case BYTECODE_SEND_WITH_STORE: {
-			ptrdiff_t bytecodeOff = bytecodeNumber(&iterator);
-			//ptrdiff_t ic = descriptorGetPos(descriptorsAtBytecode(descriptors->raw, bytecodeNumber(&iterator)));
-			uint8_t selectorIndex = bytecodeNextByte(&iterator);
-			uint8_t argsSize = bytecodeNextByte(&iterator);
+		case BYTECODE_SEND_WITH_STORE:
+			success = optimizeSend(optimizer, inlined, bytecode, &iterator);
+			break;
+
+		case BYTECODE_FALLBACK_SEND: {
+			uint8_t selector = addLiteral(optimizer, arrayObjectAt(inlined->literals, bytecodeNextByte(&iterator)));
+			uint8_t blocksSize = bytecodeNextByte(&iterator);
+			uint8_t varsSize = bytecodeNextByte(&iterator);
+			uint8_t flags = bytecodeNextByte(&iterator);
 			Operand receiver = bytecodeNextOperand(&iterator);
-			Operand result = { .isValid = 0 };
-			String *selector = (String *) ordCollObjectAt(optimizer.literals, selectorIndex);
-			AssemblerLabel exitLabels[16];
-			ptrdiff_t exitLabelsSize = 0;
-
-			Operand args[argsSize + 2];
-			args[1] = receiver;
-			for (uint8_t i = 0; i < argsSize; i++) {
-				args[i + 2] = bytecodeNextOperand(&iterator);
+			Operand blocks[blocksSize];
+			for (uint8_t i = 0; i < blocksSize; i++) {
+				blocks[blocksSize - i - 1] = bytecodeNextOperand(&iterator);
 			}
-
-			if (bytecode == BYTECODE_SEND_WITH_STORE) {
-				result = bytecodeNextOperand(&iterator);
+			Operand self = bytecodeNextOperand(&iterator);
+			Operand vars[varsSize];
+			for (uint8_t i = 0; i < varsSize; i++) {
+				vars[i] = bytecodeNextOperand(&iterator);
 			}
-
-			Iterator typesIterator;
-			initOrdCollIterator(&typesIterator, typeFeedback, 0, 0);
-			while (iteratorHasNext(&typesIterator)) {
-				TypeFeedback *feedback = (TypeFeedback *) iteratorNextObject(&typesIterator);
-				Value descriptor = descriptorsAtPosition(descriptors->raw, asCInt(feedback->raw->ic));
-				if (descriptorGetBytecode(descriptor) == bytecodeOff) {
-					Class *class = typeFeedbackGetHintedClass(feedback);
-					ptrdiff_t classIndex = ordCollAddObjectIfNotExists(optimizer.literals, (Object *) class);
-					AssemblerLabel miss;
-
-					asmInitLabel(&miss);
-					bytecodeJumpNotMemberOf(&optimizer.buffer, &receiver, classIndex, &miss);
-
-					CompiledMethod *callee = lookupSelector(class, selector);
-					printBytecodes(callee->raw->bytes, callee->raw->size, compiledMethodGetLiterals(callee)->raw);
-					printf("\n");
-
-					CompiledCodeHeader calleeHeader = compiledMethodGetHeader(callee);
-					newHeader.tempsSize = MAX(newHeader.tempsSize, optimizer.header.tempsSize + calleeHeader.tempsSize);
-					newHeader.contextSize = MAX(newHeader.contextSize, optimizer.header.contextSize + calleeHeader.contextSize);
-					inlineSend(&optimizer, callee, args, result);
-
-					ASSERT(exitLabelsSize < 16);
-					asmInitLabel(&exitLabels[exitLabelsSize]);
-					bytecodeJump(&optimizer.buffer, &exitLabels[exitLabelsSize++]);
-
-					asmLabelBind(&optimizer.buffer, &miss, asmOffset(&optimizer.buffer));
-				}
+			Operand result = bytecodeNextOperand(&iterator);
+			adjustOperand(optimizer, inlined, &receiver);
+			for (uint8_t i = 0; i < blocksSize; i++) {
+				adjustOperand(optimizer, inlined, &blocks[i]);
 			}
-
-			if (bytecode == BYTECODE_SEND_WITH_STORE) {
-				bytecodeSendWithStore(&optimizer.buffer, selectorIndex, &receiver, &result, args + 2, argsSize);
-			} else {
-				bytecodeSend(&optimizer.buffer, selectorIndex, &receiver, args + 2, argsSize);
+			adjustOperand(optimizer, inlined, &self);
+			for (uint8_t i = 0; i < varsSize; i++) {
+				adjustOperand(optimizer, inlined, &vars[i]);
 			}
-
-			for (ptrdiff_t i = 0; i < exitLabelsSize; i++) {
-				asmLabelBind(&optimizer.buffer, &exitLabels[i], asmOffset(&optimizer.buffer));
+			adjustOperand(optimizer, inlined, &result);
+			success = emitDeoptimizationState(optimizer, inlined, bytecodeNumber(&iterator));
+			if (success) {
+				noteSendPosition(optimizer);
+				bytecodeFallbackSend(buffer, selector, &receiver, blocks, blocksSize, &self, vars, varsSize, flags, &result);
 			}
 			break;
 		}
@@ -116,157 +403,860 @@ CompiledMethod *optimizeMethod(CompiledMethod *method)
 		case BYTECODE_RETURN:
 		case BYTECODE_OUTER_RETURN: {
 			Operand operand = bytecodeNextOperand(&iterator);
-			asmEmitUint8(&optimizer.buffer, bytecode);
-			bytecodeOperand(&optimizer.buffer, &operand);
+			adjustOperand(optimizer, inlined, &operand);
+			if (inlined->caller == NULL) {
+				bytecodeReturn(buffer, &operand, bytecode == BYTECODE_OUTER_RETURN);
+			} else {
+				if (inlined->result.isValid) {
+					bytecodeCopy(buffer, &operand, &inlined->result);
+				}
+				if (bytecodeHasNext(&iterator)) {
+					bytecodeJump(buffer, addJumpLabel(optimizer, labels, &labelsSize, offsets, -1, offset));
+				}
+			}
+			fallsThrough = 0;
+			break;
+		}
+
+		case BYTECODE_JUMP: {
+			ptrdiff_t target = bytecodeNextJumpTarget(&iterator);
+			bytecodeJump(buffer, addJumpLabel(optimizer, labels, &labelsSize, offsets, target, offset));
+			fallsThrough = 0;
+			break;
+		}
+
+		case BYTECODE_JUMP_NOT_MEMBER_OF: {
+			uint8_t class = addLiteral(optimizer, arrayObjectAt(inlined->literals, bytecodeNextByte(&iterator)));
+			Operand operand = bytecodeNextOperand(&iterator);
+			ptrdiff_t target = bytecodeNextJumpTarget(&iterator);
+			adjustOperand(optimizer, inlined, &operand);
+			bytecodeJumpNotMemberOf(buffer, &operand, class, addJumpLabel(optimizer, labels, &labelsSize, offsets, target, offset));
+			break;
+		}
+
+		case BYTECODE_JUMP_IF_TRUE:
+		case BYTECODE_JUMP_IF_FALSE: {
+			Operand operand = bytecodeNextOperand(&iterator);
+			ptrdiff_t target = bytecodeNextJumpTarget(&iterator);
+			adjustOperand(optimizer, inlined, &operand);
+			bytecodeJumpIf(buffer, &operand, bytecode == BYTECODE_JUMP_IF_TRUE, addJumpLabel(optimizer, labels, &labelsSize, offsets, target, offset));
 			break;
 		}
 
 		default:
 			FAIL();
 		}
+
+		closeHandleScope(&scope, NULL);
 	}
 
-	printBytecodes(optimizer.buffer.buffer, asmOffset(&optimizer.buffer), ordCollAsArray(optimizer.literals)->raw);
+	if (success && inlined->caller != NULL) {
+		// inlined method which falls off its end answers self
+		_Bool jumpsToEnd = 0;
+		for (size_t i = 0; i < labelsSize; i++) {
+			jumpsToEnd |= labels[i].target == (ptrdiff_t) size;
+		}
+		if (!fallsThrough && jumpsToEnd) {
+			bytecodeJump(buffer, addJumpLabel(optimizer, labels, &labelsSize, offsets, -1, size));
+		}
+		bindJumpLabels(optimizer, labels, labelsSize, size);
+		if ((fallsThrough || jumpsToEnd) && inlined->result.isValid) {
+			bytecodeCopy(buffer, &inlined->arguments[SELF_INDEX], &inlined->result);
+		}
+		bindJumpLabels(optimizer, labels, labelsSize, -1);
+	} else if (success) {
+		bindJumpLabels(optimizer, labels, labelsSize, size);
+	}
 
-	CompiledMethod *newMethod = newObject(Handles.CompiledMethod, asmOffset(&optimizer.buffer));
-	asmCopyBuffer(&optimizer.buffer, newMethod->raw->bytes, newMethod->raw->size);
-	compiledMethodSetHeader(newMethod, newHeader);
-	compiledMethodSetLiterals(newMethod, ordCollAsArray(optimizer.literals));
-	compiledMethodSetOwnerClass(newMethod, compiledMethodGetOwnerClass(method));
+	free(labels);
+	free(offsets);
+	return success;
+}
 
-	return closeHandleScope(&scope, newMethod);
+
+static _Bool optimizeSend(Optimizer *optimizer, InlinedMethod *inlined, Bytecode bytecode, BytecodesIterator *iterator)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	uint8_t selectorIndex = bytecodeNextByte(iterator);
+	uint8_t argsSize = bytecodeNextByte(iterator);
+	ptrdiff_t number = bytecodeNumber(iterator);
+	String *selector = (String *) arrayObjectAt(inlined->literals, selectorIndex);
+	Operand result = { .isValid = 0 };
+
+	// arguments are encoded in reverse order, self and arguments are indexed from 1
+	Operand args[argsSize + 2];
+	args[SELF_INDEX] = bytecodeNextOperand(iterator);
+	for (uint8_t i = 0; i < argsSize; i++) {
+		args[argsSize - i + 1] = bytecodeNextOperand(iterator);
+	}
+	if (bytecode == BYTECODE_SEND_WITH_STORE) {
+		result = bytecodeNextOperand(iterator);
+	}
+
+	_Bool isSuper = args[SELF_INDEX].type == OPERAND_SUPER;
+	Class *staticClass = resolveReceiverClass(optimizer, inlined, args[SELF_INDEX]);
+	for (uint8_t i = SELF_INDEX; i < argsSize + 2; i++) {
+		adjustOperand(optimizer, inlined, &args[i]);
+	}
+	if (result.isValid) {
+		adjustOperand(optimizer, inlined, &result);
+	}
+
+	Class *classes[SEND_FEEDBACK_CLASSES];
+	size_t classesSize;
+	if (staticClass != NULL) {
+		classes[0] = staticClass;
+		classesSize = 1;
+	} else {
+		classesSize = getFeedbackClasses(inlined, number, classes);
+	}
+
+	OptimizerState state = saveState(optimizer);
+	Operand stableArgs[argsSize + 2];
+	for (uint8_t i = SELF_INDEX; i < argsSize + 2 && classesSize > 0; i++) {
+		stableArgs[i] = stableOperand(optimizer, args[i], i == SELF_INDEX);
+	}
+
+	// inlined methods are guarded by class of receiver unless it is known statically:
+	// JUMP_NOT_MEMBER_OF class receiver next; inlined method; JUMP exit; next: ... send; exit:
+	AssemblerLabel exits[SEND_FEEDBACK_CLASSES];
+	size_t exitsSize = 0;
+	for (size_t i = 0; i < classesSize; i++) {
+		CompiledMethod *method = lookupSelector(classes[i], selector);
+		if (method == NULL || !canInlineMethod(inlined, method)) {
+			continue;
+		}
+
+		OptimizerState guardState = saveState(optimizer);
+		AssemblerLabel next;
+		asmInitLabel(&next);
+		if (staticClass == NULL) {
+			uint8_t class = addLiteral(optimizer, (Object *) classes[i]);
+			bytecodeJumpNotMemberOf(&optimizer->buffer, &stableArgs[SELF_INDEX], class, &next);
+		}
+		if (!inlineMethod(optimizer, inlined, method, classes[i], stableArgs, result, number)) {
+			restoreState(optimizer, guardState);
+			continue;
+		}
+		optimizer->inlinedSends++;
+
+		if (staticClass != NULL) {
+			closeHandleScope(&scope, NULL);
+			return 1;
+		}
+		asmInitLabel(&exits[exitsSize]);
+		bytecodeJump(&optimizer->buffer, &exits[exitsSize++]);
+		asmLabelBind(&optimizer->buffer, &next, asmOffset(&optimizer->buffer));
+	}
+
+	_Bool success;
+	if (exitsSize == 0) {
+		restoreState(optimizer, state);
+		// super sends of inlined method would be looked up from a wrong class
+		if (isSuper && inlined->caller != NULL) {
+			closeHandleScope(&scope, NULL);
+			return 0;
+		}
+		success = emitSend(optimizer, inlined, number, selector, args, argsSize, result);
+	} else {
+		success = emitSend(optimizer, inlined, number, selector, stableArgs, argsSize, result);
+		for (size_t i = 0; i < exitsSize; i++) {
+			asmLabelBind(&optimizer->buffer, &exits[i], asmOffset(&optimizer->buffer));
+		}
+	}
+
+	closeHandleScope(&scope, NULL);
+	return success;
 }
 
 
-static void inlineSend(Optimizer *optimizer, CompiledMethod *method, Operand *arguments, Operand result)
+static _Bool emitSend(Optimizer *optimizer, InlinedMethod *inlined, ptrdiff_t bytecodeNumber, String *selector, Operand *args, uint8_t argsSize, Operand result)
 {
-	Array *literals = compiledMethodGetLiterals(method);
-	AssemblerBuffer *buffer = &optimizer->buffer;
-	BytecodesIterator iterator;
-	bytecodeInitIterator(&iterator, method->raw->bytes, method->raw->size);
+	uint8_t selectorIndex = addLiteral(optimizer, (Object *) selector);
+	if (!emitDeoptimizationState(optimizer, inlined, bytecodeNumber)) {
+		return 0;
+	}
+	noteSendPosition(optimizer);
+	if (result.isValid) {
+		bytecodeSendWithStore(&optimizer->buffer, selectorIndex, &args[SELF_INDEX], &result, args + 2, argsSize);
+	} else {
+		bytecodeSend(&optimizer->buffer, selectorIndex, &args[SELF_INDEX], args + 2, argsSize);
+	}
+	return 1;
+}
+
 
+// variables of every inlined method at send, so that its frame can continue in baseline code of each of them,
+// method of outer one is at send of the inner one, see deoptimizeFrame
+static _Bool emitDeoptimizationState(Optimizer *optimizer, InlinedMethod *inlined, ptrdiff_t bytecodeNumber)
+{
+	InlinedMethod *methods[MAX_INLINING_DEPTH + 1];
+	Operand operands[UINT8_MAX];
+	size_t size = 0;
+
+	for (InlinedMethod *method = inlined; method != NULL; method = method->caller) {
+		methods[method->depth] = method;
+	}
+	for (size_t i = 0; i <= inlined->depth; i++) {
+		InlinedMethod *method = methods[i];
+		CompiledCodeHeader header = compiledMethodGetHeader(method->method);
+		ptrdiff_t number = i == inlined->depth ? bytecodeNumber : methods[i + 1]->callSite;
+		if (size + header.argsSize + header.tempsSize + 3 > UINT8_MAX) {
+			return 0;
+		}
+
+		operands[size++] = (Operand) { .isValid = 1, .type = OPERAND_LITERAL, .index = addLiteral(optimizer, (Object *) method->method) };
+		operands[size++] = (Operand) { .isValid = 1, .type = OPERAND_VALUE, .value = tagInt(number) };
+		for (uint8_t j = SELF_INDEX; j <= header.argsSize + 1; j++) {
+			if (method->caller == NULL) {
+				operands[size++] = (Operand) { .isValid = 1, .type = OPERAND_ARG_VAR, .index = j };
+			} else {
+				operands[size++] = method->arguments[j];
+			}
+		}
+		for (uint8_t j = 0; j < header.tempsSize; j++) {
+			operands[size++] = (Operand) { .isValid = 1, .type = OPERAND_TEMP_VAR, .index = method->tempsOffset + j };
+		}
+	}
+	bytecodeDeoptimizationState(&optimizer->buffer, operands, size);
+	return 1;
+}
+
+
+static _Bool inlineMethod(Optimizer *optimizer, InlinedMethod *caller, CompiledMethod *method, Class *class, Operand *arguments, Operand result, ptrdiff_t callSite)
+{
+	CompiledCodeHeader header = compiledMethodGetHeader(method);
+	InlinedMethod inlined = {
+		.caller = caller,
+		.method = method,
+		.literals = compiledMethodGetLiterals(method),
+		.receiverClass = class,
+		.feedback = findBaselineCode(method),
+		.arguments = arguments,
+		.result = result,
+		.argsSize = header.argsSize,
+		.tempsOffset = allocateTemps(optimizer, header.tempsSize),
+		.depth = caller->depth + 1,
+		.callSite = callSite,
+	};
+
+	// temporaries are nil on every invocation, even within loop of caller
+	for (uint8_t i = 0; i < header.tempsSize; i++) {
+		Operand nil = { .isValid = 1, .type = OPERAND_NIL };
+		Operand temp = { .isValid = 1, .type = OPERAND_TEMP_VAR, .index = inlined.tempsOffset + i };
+		bytecodeCopy(&optimizer->buffer, &nil, &temp);
+	}
+
+	return inlineCode(optimizer, &inlined) && isWithinBudget(optimizer);
+}
+
+
+static _Bool canInlineMethod(InlinedMethod *caller, CompiledMethod *method)
+{
+	if (method->raw->class != Handles.CompiledMethod->raw) {
+		return 0;
+	}
+
+	CompiledCodeHeader header = compiledMethodGetHeader(method);
+	if (header.primitive > 0 || header.hasContext || header.outerReturns) {
+		return 0;
+	}
+	if (caller->depth >= MAX_INLINING_DEPTH || method->raw->size > MAX_INLINED_METHOD_SIZE) {
+		return 0;
+	}
+	for (InlinedMethod *inlined = caller; inlined != NULL; inlined = inlined->caller) {
+		if (inlined->method->raw == method->raw) {
+			return 0;
+		}
+	}
+
+	BytecodesIterator iterator;
+	bytecodeInitIterator(&iterator, compiledMethodGetBytes(method), method->raw->size);
 	while (bytecodeHasNext(&iterator)) {
 		Bytecode bytecode = bytecodeNext(&iterator);
 		switch (bytecode) {
 		case BYTECODE_COPY: {
 			Operand src = bytecodeNextOperand(&iterator);
 			Operand dst = bytecodeNextOperand(&iterator);
-			adjustOperand(optimizer, literals, arguments, &src);
-			adjustOperand(optimizer, literals, arguments, &dst);
-			bytecodeCopy(buffer, &src, &dst);
+			if (!canInlineOperand(src) || !canInlineOperand(dst)) {
+				return 0;
+			}
 			break;
 		}
 
 		case BYTECODE_SEND:
 		case BYTECODE_SEND_WITH_STORE: {
-			uint8_t selectorIndex = bytecodeNextByte(&iterator);
-			uint8_t argsSize = bytecodeNextByte(&iterator);
-			Operand receiver = bytecodeNextOperand(&iterator);
-			adjustOperand(optimizer, literals, arguments, &receiver);
-
-			Object *selector = arrayObjectAt(literals, selectorIndex);
-			selectorIndex = ordCollAddObjectIfNotExists(optimizer->literals, selector);
+			bytecodeNextByte(&iterator); // skip selector
+			uint8_t operandsSize = bytecodeNextByte(&iterator) + 1 + (bytecode == BYTECODE_SEND_WITH_STORE);
+			for (uint8_t i = 0; i < operandsSize; i++) {
+				if (!canInlineOperand(bytecodeNextOperand(&iterator))) {
+					return 0;
+				}
+			}
+			break;
+		}
 
-			Operand args[argsSize];
-			for (uint8_t i = 0; i < argsSize; i++) {
-				args[i] = bytecodeNextOperand(&iterator);
-				adjustOperand(optimizer, literals, arguments, &args[i]);
+		case BYTECODE_FALLBACK_SEND: {
+			// fallback blocks reach variables of method only through context of fallback send unless they reach
+			// its context or return from it
+			bytecodeNextByte(&iterator); // skip selector
+			uint8_t blocksSize = bytecodeNextByte(&iterator);
+			uint8_t operandsSize = blocksSize + bytecodeNextByte(&iterator) + 3;
+			if (bytecodeNextByte(&iterator) != 0) {
+				return 0;
 			}
-			if (bytecode == BYTECODE_SEND_WITH_STORE) {
-				Operand result = bytecodeNextOperand(&iterator);
-				adjustOperand(optimizer, literals, arguments, &result);
-				bytecodeSendWithStore(buffer, selectorIndex, &receiver, &result, args, argsSize);
-			} else {
-				bytecodeSend(buffer, selectorIndex, &receiver, args, argsSize);
+			for (uint8_t i = 0; i < operandsSize; i++) {
+				Operand operand = bytecodeNextOperand(&iterator);
+				if (operand.type != OPERAND_BLOCK && !canInlineOperand(operand)) {
+					return 0;
+				}
 			}
 			break;
 		}
 
-		case BYTECODE_RETURN: {
-			Operand source = bytecodeNextOperand(&iterator);
-			bytecodeCopy(buffer, &source, &result);
+		case BYTECODE_RETURN:
+			if (!canInlineOperand(bytecodeNextOperand(&iterator))) {
+				return 0;
+			}
+			break;
+
+		case BYTECODE_JUMP:
+			bytecodeNextJumpTarget(&iterator);
+			break;
+
+		case BYTECODE_JUMP_NOT_MEMBER_OF:
+			bytecodeNextByte(&iterator); // skip class
+			if (!canInlineOperand(bytecodeNextOperand(&iterator))) {
+				return 0;
+			}
+			bytecodeNextJumpTarget(&iterator);
+			break;
+
+		case BYTECODE_JUMP_IF_TRUE:
+		case BYTECODE_JUMP_IF_FALSE:
+			if (!canInlineOperand(bytecodeNextOperand(&iterator))) {
+				return 0;
+			}
+			bytecodeNextJumpTarget(&iterator);
 			break;
-		}
 
-		case BYTECODE_OUTER_RETURN:
 		default:
-			FAIL();
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+static _Bool canInlineOperand(Operand operand)
+{
+	switch (operand.type) {
+	case OPERAND_VALUE:
+	case OPERAND_NIL:
+	case OPERAND_TRUE:
+	case OPERAND_FALSE:
+	case OPERAND_TEMP_VAR:
+	case OPERAND_ARG_VAR:
+	case OPERAND_SUPER:
+	case OPERAND_INST_VAR:
+	case OPERAND_LITERAL:
+	case OPERAND_ASSOC:
+	case OPERAND_BOUND_VAR:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+
+static Class *resolveReceiverClass(Optimizer *optimizer, InlinedMethod *inlined, Operand receiver)
+{
+	if (receiver.type == OPERAND_SUPER) {
+		return classGetSuperClass(compiledMethodGetOwnerClass(inlined->method));
+	}
+	// self of inlined method is already guarded
+	if (receiver.type == OPERAND_ARG_VAR && receiver.index == SELF_INDEX && inlined->receiverClass != NULL) {
+		return inlined->receiverClass;
+	}
+
+	adjustOperand(optimizer, inlined, &receiver);
+	switch (receiver.type) {
+	case OPERAND_VALUE:
+		return scopeHandle(getClassOf(receiver.value));
+	case OPERAND_NIL:
+		return Handles.UndefinedObject;
+	case OPERAND_TRUE:
+		return Handles.True;
+	case OPERAND_FALSE:
+		return Handles.False;
+	case OPERAND_LITERAL:
+		return scopeHandle(ordCollObjectAt(optimizer->literals, receiver.index)->raw->class);
+	case OPERAND_BLOCK:
+		return Handles.Block;
+	default:
+		return NULL;
+	}
+}
+
+
+// classes seen at send site by baseline code, the most frequent first
+static size_t getFeedbackClasses(InlinedMethod *inlined, ptrdiff_t bytecodeNumber, Class **classes)
+{
+	if (inlined->feedback == NULL) {
+		return 0;
+	}
+	SendFeedback *feedback = nativeCodeFindSendFeedback(inlined->feedback, bytecodeNumber);
+	if (feedback == NULL) {
+		return 0;
+	}
+
+	RawClass *rawClasses[SEND_FEEDBACK_CLASSES];
+	uint32_t counts[SEND_FEEDBACK_CLASSES];
+	size_t size = sendFeedbackGetClasses(inlined->feedback, feedback, rawClasses);
+	memcpy(counts, feedback->counts, sizeof(counts));
+
+	for (size_t i = 0; i < size; i++) {
+		size_t max = i;
+		for (size_t j = i + 1; j < size; j++) {
+			if (counts[j] > counts[max]) {
+				max = j;
+			}
 		}
+		RawClass *class = rawClasses[max];
+		uint32_t count = counts[max];
+		rawClasses[max] = rawClasses[i];
+		counts[max] = counts[i];
+		rawClasses[i] = class;
+		counts[i] = count;
+		classes[i] = scopeHandle(class);
 	}
+	return size;
 }
 
 
-static void adjustOperand(Optimizer *optimizer, Array *literals, Operand *arguments, Operand *operand)
+// feedback of optimized methods is kept by their original code
+static NativeCode *findBaselineCode(CompiledMethod *method)
 {
+	NativeCode *code = compiledMethodGetNativeCode(method);
+	if (code == NULL || code->compiledCode == method->raw) {
+		return code;
+	}
+	for (size_t i = 0; i < OptimizedMethodsSize; i++) {
+		if (OptimizedMethods[i].optimizedCode == code) {
+			return OptimizedMethods[i].code;
+		}
+	}
+	return NULL;
+}
+
+
+static void adjustOperand(Optimizer *optimizer, InlinedMethod *inlined, Operand *operand)
+{
+	if (inlined->caller == NULL) {
+		return;
+	}
+
 	switch (operand->type) {
 	case OPERAND_VALUE:
 	case OPERAND_NIL:
 	case OPERAND_TRUE:
 	case OPERAND_FALSE:
-	case OPERAND_THIS_CONTEXT:
 		break;
 
 	case OPERAND_TEMP_VAR:
-		operand->index += optimizer->header.tempsSize;
+	case OPERAND_BOUND_VAR:
+		operand->index += inlined->tempsOffset - inlined->argsSize - 2;
 		break;
 
 	case OPERAND_ARG_VAR:
-		*operand = arguments[operand->index];
+		*operand = inlined->arguments[operand->index];
 		break;
 
 	case OPERAND_SUPER:
-		// TODO:
-		FAIL();
-		break;
-
-	case OPERAND_CONTEXT_VAR:
-		operand->index += optimizer->header.contextSize;
+		*operand = inlined->arguments[SELF_INDEX];
 		break;
 
-	case OPERAND_INST_VAR:
+	case OPERAND_INST_VAR: {
+		// receiver of inlined method is not self of optimized method
+		Operand receiver = inlined->arguments[SELF_INDEX];
+		InstanceShape shape = classGetInstanceShape(compiledMethodGetOwnerClass(inlined->method));
+		ASSERT(receiver.type == OPERAND_TEMP_VAR || receiver.type == OPERAND_ARG_VAR);
 		operand->type = OPERAND_INST_VAR_OF;
-		// TODO:
+		operand->index = shape.payloadSize + operand->index + shape.isIndexed;
+		operand->instance.type = receiver.type;
+		operand->instance.index = receiver.index;
+		operand->instance.level = 0;
 		break;
+	}
 
 	case OPERAND_LITERAL:
 	case OPERAND_ASSOC:
-	case OPERAND_BLOCK: {
-		Object *object = arrayObjectAt(literals, operand->index);
-		operand->index = ordCollAddObjectIfNotExists(optimizer->literals, object);
+	case OPERAND_BLOCK:
+		operand->index = addLiteral(optimizer, arrayObjectAt(inlined->literals, operand->index));
 		break;
+
+	default:
+		FAIL();
 	}
+}
 
+
+// arguments which could change during inlined method or evaluate to a new object are copied into temporary,
+// receiver has to be a variable so that its instance variables are accessible
+static Operand stableOperand(Optimizer *optimizer, Operand operand, _Bool isReceiver)
+{
+	switch (operand.type) {
+	case OPERAND_TEMP_VAR:
+	case OPERAND_ARG_VAR:
+		return operand;
+
+	case OPERAND_SUPER:
+		operand.type = OPERAND_ARG_VAR;
+		operand.index = SELF_INDEX;
+		return operand;
+
+	case OPERAND_VALUE:
+	case OPERAND_NIL:
+	case OPERAND_TRUE:
+	case OPERAND_FALSE:
+	case OPERAND_LITERAL:
+		if (!isReceiver) {
+			return operand;
+		}
+		// fall through
+
+	default: {
+		Operand temp = { .isValid = 1, .type = OPERAND_TEMP_VAR, .index = allocateTemps(optimizer, 1) };
+		bytecodeCopy(&optimizer->buffer, &operand, &temp);
+		return temp;
+	}
+	}
+}
+
+
+// literals over MAX_LITERALS_SIZE are truncated, inlining which added them is undone
+static uint8_t addLiteral(Optimizer *optimizer, Object *object)
+{
+	return ordCollAddObjectIfNotExists(optimizer->literals, object);
+}
+
+
+static uint8_t allocateTemps(Optimizer *optimizer, uint8_t size)
+{
+	uint8_t index = optimizer->header.argsSize + optimizer->header.tempsSize + 2;
+	optimizer->header.tempsSize += size;
+	return index;
+}
+
+
+static AssemblerLabel *addJumpLabel(Optimizer *optimizer, CodeLabel *labels, size_t *size, ptrdiff_t *offsets, ptrdiff_t target, ptrdiff_t offset)
+{
+	CodeLabel *label = &labels[(*size)++];
+	label->target = target;
+	asmInitLabel(&label->label);
+	if (0 <= target && target <= offset) {
+		asmLabelBind(&optimizer->buffer, &label->label, offsets[target]);
+	}
+	return &label->label;
+}
+
+
+static void bindJumpLabels(Optimizer *optimizer, CodeLabel *labels, size_t size, ptrdiff_t target)
+{
+	for (size_t i = 0; i < size; i++) {
+		if (labels[i].target == target && !labels[i].label.isBound) {
+			asmLabelBind(&optimizer->buffer, &labels[i].label, asmOffset(&optimizer->buffer));
+		}
+	}
+}
+
+
+// bytecodes of optimized method keep source code positions of original method
+static void noteSourcePosition(Optimizer *optimizer, ptrdiff_t bytecodeNumber)
+{
+	if (isNil(optimizer->sourceDescriptors)) {
+		return;
+	}
+	Value descriptor = descriptorsAtPosition(optimizer->sourceDescriptors->raw, bytecodeNumber);
+	if (descriptor != 0) {
+		optimizer->position = descriptor;
+		noteSendPosition(optimizer);
+	}
+}
+
+
+// sends of inlined methods are reported at send site of optimized method
+static void noteSendPosition(Optimizer *optimizer)
+{
+	ptrdiff_t pos = optimizer->buffer.instOffset;
+	if (optimizer->position == 0 || optimizer->notedPosition == pos) {
+		return;
+	}
+	uint16_t line = descriptorGetLine(optimizer->position);
+	uint16_t column = descriptorGetColumn(optimizer->position);
+	ordCollAdd(optimizer->descriptors, createSouceCodeDescriptor(pos, line, column));
+	optimizer->notedPosition = pos;
+}
+
+
+static OptimizerState saveState(Optimizer *optimizer)
+{
+	OptimizerState state = {
+		.offset = asmOffset(&optimizer->buffer),
+		.instOffset = optimizer->buffer.instOffset,
+		.tempsSize = optimizer->header.tempsSize,
+		.literalsSize = ordCollSize(optimizer->literals),
+		.descriptorsSize = ordCollSize(optimizer->descriptors),
+		.notedPosition = optimizer->notedPosition,
+		.inlinedSends = optimizer->inlinedSends,
+	};
+	return state;
+}
+
+
+static void restoreState(Optimizer *optimizer, OptimizerState state)
+{
+	optimizer->buffer.p = optimizer->buffer.buffer + state.offset;
+	optimizer->buffer.instOffset = state.instOffset;
+	optimizer->header.tempsSize = state.tempsSize;
+	while (ordCollSize(optimizer->literals) > state.literalsSize) {
+		ordCollRemoveLast(optimizer->literals);
+	}
+	while (ordCollSize(optimizer->descriptors) > state.descriptorsSize) {
+		ordCollRemoveLast(optimizer->descriptors);
+	}
+	optimizer->notedPosition = state.notedPosition;
+	optimizer->inlinedSends = state.inlinedSends;
+}
+
+
+static _Bool isWithinBudget(Optimizer *optimizer)
+{
+	size_t varsSize = optimizer->header.argsSize + optimizer->header.tempsSize + 2;
+	return varsSize <= MAX_VARS_SIZE
+		&& ordCollSize(optimizer->literals) <= MAX_LITERALS_SIZE
+		&& asmOffset(&optimizer->buffer) <= MAX_OPTIMIZED_METHOD_SIZE;
+}
+
+
+// state is the instruction right before send returning to deoptimized frame
+static size_t decodeDeoptimizationState(CompiledMethod *method, ptrdiff_t sendNumber, Operand *operands)
+{
+	BytecodesIterator iterator;
+	bytecodeInitIterator(&iterator, compiledMethodGetBytes(method), method->raw->size);
+	while (bytecodeNumber(&iterator) < sendNumber - 2) {
+		bytecodeSkip(&iterator, bytecodeNext(&iterator));
+	}
+	Bytecode bytecode = bytecodeNext(&iterator);
+	ASSERT(bytecode == BYTECODE_DEOPTIMIZATION_STATE);
+
+	size_t size = bytecodeNextByte(&iterator);
+	for (size_t i = 0; i < size; i++) {
+		operands[i] = bytecodeNextOperand(&iterator);
+	}
+	return size;
+}
+
+
+// receiver and arguments of send stay on stack until it returns, fallback send pushes contexts too,
+// see generateSend and generateFallbackSend
+static size_t computePushedSize(CompiledMethod *method, ptrdiff_t sendNumber)
+{
+	BytecodesIterator iterator;
+	bytecodeInitIterator(&iterator, compiledMethodGetBytes(method), method->raw->size);
+	while (bytecodeNumber(&iterator) < sendNumber - 1) {
+		bytecodeSkip(&iterator, bytecodeNext(&iterator));
+	}
+
+	Bytecode bytecode = bytecodeNext(&iterator);
+	bytecodeNextByte(&iterator); // skip selector
+	uint8_t argsSize = bytecodeNextByte(&iterator);
+	if (bytecode == BYTECODE_FALLBACK_SEND) {
+		bytecodeNextByte(&iterator); // skip variables
+		return argsSize + 2 + ((bytecodeNextByte(&iterator) & FALLBACK_RETURNS) ? 1 : 0);
+	}
+	ASSERT(bytecode == BYTECODE_SEND || bytecode == BYTECODE_SEND_WITH_STORE);
+	return argsSize + 1;
+}
+
+
+static NativeCode *ensureBaselineCode(CompiledMethod *method, _Bool *isPinned)
+{
+	NativeCode *code = findBaselineCode(method);
+	if (code == NULL) {
+		code = generateMethodCode(method);
+		if (compiledMethodGetNativeCode(method) == NULL) {
+			compiledMethodSetNativeCode(method, code);
+		}
+	}
+	*isPinned = (code->tags & TAG_PINNED) == 0;
+	code->tags |= TAG_PINNED;
+	return code;
+}
+
+
+// values of variables are read at send with stackmap of optimized code, variables not in frame are nil, callee-saved
+// registers are stored by exit frame of deoptimization stub, regs are set to values seen by caller of frame
+static void readDeoptimizedValues(StackFrame *frame, uint8_t *ic, CompiledMethod *optimized, DeoptimizedMethod *methods, size_t size, Value *regs)
+{
+	static RegsAlloc alloc;
+	NativeCode *code = stackFrameGetNativeCode(frame);
+	Stackmap stackmap = findStackmap(code, (ptrdiff_t) ic);
+	ptrdiff_t bytecodeNumber = findNativeDescriptor(code, ic - code->insts)->bytecode;
+	Array *literals = compiledMethodGetLiterals(optimized);
+	CompiledCode compiledCode;
+	RegisterMap map;
+
+	initRegisterMap(&map, CurrentThread.stackFramesTail->exit);
+	for (size_t i = 0; i < SAVED_REGS_SIZE; i++) {
+		regs[i] = *map.regs[i];
+	}
+	initMethodCompiledCode(&compiledCode, optimized);
+	computeRegsAlloc(&alloc, &X64AvailableRegs, &compiledCode);
+	for (size_t i = 0; i < size; i++) {
+		CompiledCodeHeader header = compiledMethodGetHeader(methods[i].method);
+		for (size_t j = 0; j < header.argsSize + header.tempsSize + 1U; j++) {
+			methods[i].values[j] = readFrameOperand(frame, &alloc, compiledCode.header, &stackmap, bytecodeNumber, literals, methods[i].vars[j], regs);
+		}
+	}
+	registerMapUpdate(&map, frame, stackmap.regs.saved);
+	for (size_t i = 0; i < SAVED_REGS_SIZE; i++) {
+		regs[i] = *map.regs[i];
+	}
+}
+
+
+static Value readFrameOperand(StackFrame *frame, RegsAlloc *alloc, CompiledCodeHeader header, Stackmap *stackmap, ptrdiff_t bytecodeNumber, Array *literals, Operand operand, Value *regs)
+{
+	switch (operand.type) {
+	case OPERAND_VALUE:
+		return operand.value;
+	case OPERAND_NIL:
+		return getTaggedPtr(Handles.nil);
+	case OPERAND_TRUE:
+		return getTaggedPtr(Handles.true);
+	case OPERAND_FALSE:
+		return getTaggedPtr(Handles.false);
+	case OPERAND_LITERAL:
+		return literals->raw->vars[operand.index];
+	case OPERAND_ARG_VAR:
+		return stackFrameGetArg(frame, operand.index - 1);
+	case OPERAND_TEMP_VAR: {
+		Variable *var = &alloc->vars[operand.index];
+		if (var->flags & VAR_CALLEE_SAVED) {
+			ptrdiff_t reg = findSavedReg(&X64AvailableRegs, var->reg);
+			return stackmap->regs.live & (1 << reg) ? regs[reg] : getTaggedPtr(Handles.nil);
+		}
+		if (!isVarInFrame(alloc, header, var, bytecodeNumber, stackmap)) {
+			return getTaggedPtr(Handles.nil);
+		}
+		return stackFrameGetSlot(frame, -var->frameOffset - 1);
+	}
 	default:
 		FAIL();
 	}
 }
 
 
-/*
+// frame is written to buffer of slots, deoptimized frame is at its end, see deoptimizeFrame, regs seen by caller
+// are stored in frame and replaced by those seen by its callee
+static void writeBaselineFrame(StackFrame *frame, StackFrame *deoptimizedFrame, DeoptimizedMethod *method, DeoptimizedMethod *caller, Value *regs)
+{
+	static RegsAlloc alloc;
+	CompiledCode compiledCode;
+	initMethodCompiledCode(&compiledCode, method->method);
+	computeRegsAlloc(&alloc, &X64AvailableRegs, &compiledCode);
+	CompiledCodeHeader header = compiledCode.header;
+	Stackmap stackmap = findStackmap(method->code, (ptrdiff_t) method->ic);
+	size_t varsSize = header.argsSize + header.tempsSize + 2;
 
-(receiver isKindOf: SmallInteger)
-	ifTrue: [ ... ]
-	ifFalse: [
-		(receiver isKindOf: LargeInteger) ifTrue: [ ... ]]
+	stackFrameSetSlot(frame, FRAME_CODE_OFFSET, (Value) method->code->insts);
+	if (caller == NULL) {
+		stackFrameSetSlot(frame, CONTEXT_SLOT, stackFrameGetSlot(deoptimizedFrame, CONTEXT_SLOT));
+	} else {
+		// inlined methods have no context
+		stackFrameSetSlot(frame, CONTEXT_SLOT, CurrentThread.context);
+		frame->parent = (StackFrame *) ((Value *) deoptimizedFrame - caller->framePointer);
+		frame->parentIc = caller->ic;
+		for (uint8_t i = 0; i <= header.argsSize; i++) {
+			stackFrameSetArg(frame, i, method->values[i]);
+		}
+	}
 
+	for (size_t i = header.argsSize + 2; i < varsSize; i++) {
+		Variable *var = &alloc.vars[i];
+		if (isVarInFrame(&alloc, header, var, method->bytecodeNumber, &stackmap)) {
+			stackFrameSetSlot(frame, -var->frameOffset - 1, method->values[i - 1]);
+		}
+	}
+	// classes of receivers are kept in frame as tagged pointers, see generateLoadClass
+	for (size_t i = 1; i < varsSize; i++) {
+		Variable *class = alloc.specialVars[VAR_CLASS][i];
+		if (class != NULL && isVarInFrame(&alloc, header, class, method->bytecodeNumber, &stackmap)) {
+			stackFrameSetSlot(frame, -class->frameOffset - 1, tagPtr(getClassOf(method->values[i - 1])));
+		}
+	}
+
+	for (size_t i = 0; i < SAVED_REGS_SIZE; i++) {
+		if (stackmap.regs.saved & (1 << i)) {
+			stackFrameSetSlot(frame, stackFrameGetSavedRegSlot(stackmap.regs.saved, i), regs[i]);
+		}
+	}
+	for (size_t i = header.argsSize + 2; i < varsSize; i++) {
+		Variable *var = &alloc.vars[i];
+		ptrdiff_t reg = findSavedReg(&X64AvailableRegs, var->reg);
+		if ((var->flags & VAR_CALLEE_SAVED) && (stackmap.regs.live & (1 << reg))) {
+			regs[reg] = method->values[i - 1];
+		}
+	}
+}
+
+
+// slots of variable are mapped at send while it is live, temporaries of code with jumps all the time,
+// see generateStackmap
+static _Bool isVarInFrame(RegsAlloc *alloc, CompiledCodeHeader header, Variable *var, ptrdiff_t bytecodeNumber, Stackmap *stackmap)
+{
+	size_t tempsOffset = header.argsSize + 2;
+	size_t specialVarsOffset = tempsOffset + header.tempsSize;
+	_Bool isLive = (ptrdiff_t) var->start <= bytecodeNumber && bytecodeNumber <= (ptrdiff_t) var->end;
+	isLive |= alloc->hasJumps && var->index >= tempsOffset && var->index < specialVarsOffset;
+	return (var->flags & VAR_DEFINED) != 0
+		&& var->frameOffset < 0
+		&& isLive
+		&& stackmap->set != NULL
+		&& stackmapIncludes(stackmap, -var->frameOffset - 1);
+}
+
+
+// the last call of send, inline cache misses and allocations come before it
+static uint8_t *findSendIc(NativeCode *code, ptrdiff_t bytecodeNumber)
+{
+	NativeDescriptor *descriptors = nativeCodeGetDescriptors(code);
+	uint8_t *ic = NULL;
+	for (size_t i = 0; i < code->descriptorsSize; i++) {
+		if (descriptors[i].bytecode == bytecodeNumber) {
+			ic = code->insts + descriptors[i].pos;
+		}
+	}
+	ASSERT(ic != NULL);
+	return ic;
+}
 
-:smi
-	cmp r10, $SmallInteger		# test if receiver is SmallInteger
-	jne	largeInt
-		...
-	jmp sendExit
-:largeInt
-	cmp r10, $LargeInteger		# test if receiver is LargeInteger
-	jne char
-		...
-	jmp sendExit
-:char
-	cmp r10, $Character			# test if receiver is Character
-	jne lookup
-		...
-	jmp sendExit
-:lookup
-	...							# do normal lookup here
-:sendExit						# message was send continue
 
-*/
+static void registerOptimizedMethod(NativeCode *code, NativeCode *optimizedCode)
+{
+	OptimizedMethods = realloc(OptimizedMethods, (OptimizedMethodsSize + 1) * sizeof(*OptimizedMethods));
+	if (OptimizedMethods == NULL) {
+		FAIL();
+	}
+	OptimizedMethod *optimized = &OptimizedMethods[OptimizedMethodsSize++];
+	optimized->code = code;
+	optimized->optimizedCode = optimizedCode;
+	// original code is only referenced from here until it is deoptimized
+	code->tags |= TAG_PINNED;
+	optimizedCode->tags |= TAG_PINNED;
+	memcpy(optimized->entry, code->insts, NATIVE_CODE_REDIRECT_SIZE);
+}
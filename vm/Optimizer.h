@@ -2,7 +2,25 @@
 #define OPTIMIZER_H
 
 #include "CompiledCode.h"
+#include "StackFrame.h"
+
+// baseline frames replacing deoptimized frame, slots are copied below its frame pointer, callee-saved registers
+// are loaded with values of the innermost frame
+typedef struct {
+	uint8_t *rsp;
+	uint8_t *rbp;
+	uint8_t *ic;
+	Value result;
+	size_t size;
+	Value *slots;
+	Value regs[SAVED_REGS_SIZE];
+} DeoptimizedFrames;
+
+extern size_t OptimizationThreshold;
 
 CompiledMethod *optimizeMethod(CompiledMethod *method);
+void optimizeHotMethod(uint8_t *entry);
+void deoptimizeMethods(void);
+DeoptimizedFrames *deoptimizeFrame(uint8_t *ic, StackFrame *frame, Value result);
 
 #endif
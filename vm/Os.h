@@ -2,7 +2,10 @@
 #define OS_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 int64_t osCurrentMicroTime(void);
+size_t osProcessorsCount(void);
+size_t osPageSize(void);
 
 #endif
@@ -1,6 +1,7 @@
 #include "Os.h"
 #include "Assert.h"
 #include <sys/time.h>
+#include <unistd.h>
 #include <stddef.h>
 
 
@@ -13,3 +14,17 @@ int64_t osCurrentMicroTime(void)
 	}
 	return time.tv_sec * 1000000 + time.tv_usec;
 }
+
+
+size_t osProcessorsCount(void)
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (size_t) count : 1;
+}
+
+
+size_t osPageSize(void)
+{
+	long size = sysconf(_SC_PAGESIZE);
+	return size > 0 ? (size_t) size : 4096;
+}
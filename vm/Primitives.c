@@ -71,6 +71,8 @@ static PrimitiveResult parserAtEndPrimitive(Value receiver);
 static PrimitiveResult buildClassPrimitive(Value receiver, Value vNode);
 static PrimitiveResult compileMethodPrimitive(Value receiver, Value vNode, Value class);
 static PrimitiveResult collectGarbagePrimitive(Value receiver);
+static PrimitiveResult scavengePrimitive(Value receiver);
+static PrimitiveResult shrinkHeapPrimitive(Value receiver);
 static PrimitiveResult printHeapPrimitive(Value receiver);
 static PrimitiveResult lastGcStatsPrimitive(Value receiver);
 
@@ -146,6 +148,8 @@ Primitive Primitives[] = {
 	{"CurrentMicroTimePrimitive", CCALL, .cFunction = currentMicroTimePrimitive, 1},
 
 	{"GCPrimitive", CCALL, .cFunction = collectGarbagePrimitive, 1},
+	{"ScavengePrimitive", CCALL, .cFunction = scavengePrimitive, 1},
+	{"ShrinkHeapPrimitive", CCALL, .cFunction = shrinkHeapPrimitive, 1},
 	{"LastGCStatsPrimitive", CCALL, .cFunction = lastGcStatsPrimitive, 1},
 	{"PrintHeapPrimitive", CCALL, .cFunction = printHeapPrimitive, 1},
 	{"InterruptPrimitive", GEN, generateInterruptPrimitive},
@@ -555,6 +559,20 @@ static PrimitiveResult collectGarbagePrimitive(Value receiver)
 }
 
 
+static PrimitiveResult scavengePrimitive(Value receiver)
+{
+	scavenge(&CurrentThread);
+	return primSuccess(receiver);
+}
+
+
+static PrimitiveResult shrinkHeapPrimitive(Value receiver)
+{
+	shrinkHeap(&CurrentThread);
+	return primSuccess(receiver);
+}
+
+
 static PrimitiveResult printHeapPrimitive(Value receiver)
 {
 	printHeap(&CurrentThread.heap);
@@ -573,6 +591,14 @@ static PrimitiveResult lastGcStatsPrimitive(Value receiver)
 	stringDictAtPut(stats, asString("sweeped"), tagInt(LastGCStats.sweeped));
 	stringDictAtPut(stats, asString("freed"), tagInt(LastGCStats.freed));
 	stringDictAtPut(stats, asString("extended"), tagInt(LastGCStats.extended));
+	stringDictAtPut(stats, asString("evacuated"), tagInt(LastGCStats.evacuated));
+	stringDictAtPut(stats, asString("released"), tagInt(LastGCStats.released));
+	stringDictAtPut(stats, asString("survived"), tagInt(LastGCStats.survived));
+	stringDictAtPut(stats, asString("promoted"), tagInt(LastGCStats.promoted));
+	stringDictAtPut(stats, asString("tenuringAge"), tagInt(LastGCStats.tenuringAge));
+	stringDictAtPut(stats, asString("pretenured"), tagInt(LastGCStats.pretenured));
+	stringDictAtPut(stats, asString("freedCode"), tagInt(LastGCStats.freedCode));
+	stringDictAtPut(stats, asString("evictedCode"), tagInt(LastGCStats.evictedCode));
 	Value result = getTaggedPtr(stats);
 	closeHandleScope(&scope, NULL);
 	return primSuccess(result);
@@ -16,13 +16,15 @@ static void generateCCallPrimitive(CodeGenerator *generator, PrimitiveResult (*c
 	for (size_t i = 0; i < argsSize; i++) {
 		movArg(buffer, i, ArgumentsRegisters[i]);
 	}
-	asmMovq(buffer, R11, R13);
 	generateCCall(generator, (intptr_t) cFunction, argsSize, 0);
 	asmTestq(buffer, RDX, RDX);
 	asmJ(buffer, COND_NOT_ZERO, &failed);
 	asmRet(buffer);
 	asmLabelBind(buffer, &failed, asmOffset(buffer));
-	asmMovq(buffer, R13, R11);
+	// native code is reloaded from instruction pointer, callee-saved registers belong to caller
+	size_t offset = asmOffset(buffer);
+	asmLeaq(buffer, asmMem(RIP, NO_REGISTER, SS_1, -(offset + 7)), R11);
+	ASSERT(asmOffset(buffer) == offset + 7);
 }
 
 
@@ -119,8 +121,9 @@ static void generateInstVarAtPutPrimitive(CodeGenerator *generator)
 
 	asmAddbMem(buffer, asmMem(RCX, NO_REGISTER, SS_1, isIndexedOffset), SIL);
 	asmAddbMem(buffer, asmMem(RCX, NO_REGISTER, SS_1, payloadSizeOffset), SIL);
-	asmMovqToMem(buffer, RAX, asmMem(RDI, RSI, SS_8, HEADER_SIZE - 1));
-	generateStoreCheck(generator, RDI, RAX);
+	MemoryOperand field = asmMem(RDI, RSI, SS_8, HEADER_SIZE - 1);
+	asmMovqToMem(buffer, RAX, field);
+	generateStoreCheck(generator, RDI, field, RAX);
 	asmRet(buffer);
 
 	asmLabelBind(buffer, &outOfBounds, asmOffset(buffer));
@@ -245,23 +248,24 @@ static void generateAtPutPrimitive(CodeGenerator *generator)
 	asmAddbMem(buffer, asmMem(RCX, NO_REGISTER, SS_1, sizeOffset), SIL);
 
 	// set the value
-	asmMovqToMem(buffer, RDX, asmMem(RDI, RSI, SS_8, HEADER_SIZE + sizeof(Value) - 1));
-	generateStoreCheck(generator, RDI, RDX);
+	MemoryOperand field = asmMem(RDI, RSI, SS_8, HEADER_SIZE + sizeof(Value) - 1);
+	asmMovqToMem(buffer, RDX, field);
+	generateStoreCheck(generator, RDI, field, RDX);
 	asmRet(buffer);
 
 	// bytes
 	asmLabelBind(buffer, &bytes, asmOffset(buffer));
 
 	// compute offset
-	asmXorq(buffer, RBX, RBX);
+	asmXorq(buffer, R8, R8);
 	asmAddbMem(buffer, asmMem(RCX, NO_REGISTER, SS_1, payloadSizeOffset), AL);
 	asmAddbMem(buffer, asmMem(RCX, NO_REGISTER, SS_1, sizeOffset), AL);
-	asmLeaq(buffer, asmMem(RSI, RBX, SS_8, sizeof(Value)), RBX);
+	asmLeaq(buffer, asmMem(RSI, R8, SS_8, sizeof(Value)), R8);
 
 	// TODO: valueTypeOf(RDX) == RCX->instanceShape.valueType
 	// untag and set the value
 	asmShrqImm(buffer, RDX, 2);
-	asmMovbToMem(buffer, DL, asmMem(RDI, RBX, SS_1, HEADER_SIZE - 1));
+	asmMovbToMem(buffer, DL, asmMem(RDI, R8, SS_1, HEADER_SIZE - 1));
 	asmRet(buffer);
 
 	asmLabelBind(buffer, &outOfBounds, asmOffset(buffer));
@@ -528,19 +532,19 @@ static void generateMethodSendArgsPrimitive(CodeGenerator *generator)
 	// load arguments array
 	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, 4 * sizeof(intptr_t)), RDI);
 	// load arguments array size
-	asmMovqMem(buffer, asmMem(RDI, NO_REGISTER, SS_1, varOffset(RawArray, size)), RBX);
+	asmMovqMem(buffer, asmMem(RDI, NO_REGISTER, SS_1, varOffset(RawArray, size)), RCX);
 	// load compiled method
 	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, 2 * sizeof(intptr_t)), TMP);
 	// check arguments size
-	asmCmpbMem(buffer, asmMem(TMP, NO_REGISTER, SS_1, argsOffset), BL);
+	asmCmpbMem(buffer, asmMem(TMP, NO_REGISTER, SS_1, argsOffset), CL);
 	asmJ(buffer, COND_NOT_EQUAL, &invalidArgs);
 
 	// push arguments on stack
-	asmTestq(buffer, RBX, RBX);
+	asmTestq(buffer, RCX, RCX);
 	asmJ(buffer, COND_ZERO, &zeroArgs);
 	asmLabelBind(buffer, &loop, asmOffset(buffer));
-	asmDecq(buffer, RBX);
-	asmPushqMem(buffer, asmMem(RDI, RBX, SS_8, varOffset(RawArray, vars)));
+	asmDecq(buffer, RCX);
+	asmPushqMem(buffer, asmMem(RDI, RCX, SS_8, varOffset(RawArray, vars)));
 	asmJ(buffer, COND_NOT_ZERO, &loop);
 	asmLabelBind(buffer, &zeroArgs, asmOffset(buffer));
 
@@ -655,7 +659,7 @@ static void generateIntMulPrimitive(CodeGenerator *generator)
 	testInt(generator, AL);
 	asmJ(buffer, COND_NOT_ZERO, &notInt);
 
-	asmShrqImm(buffer, RAX, 2);
+	asmSarqImm(buffer, RAX, 2);
 	asmImulqMem(buffer, arg(0), RAX);
 	asmJ(buffer, COND_OVERFLOW, &overflow);
 	asmRet(buffer);
@@ -931,35 +935,36 @@ static void generateBlockValueArgsPrimitive(CodeGenerator *generator)
 	asmPushq(buffer, CTX);
 
 	// load block and arguments array
-	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, 2 * sizeof(intptr_t)), R13);
+	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, 2 * sizeof(intptr_t)), RDI);
 	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, 3 * sizeof(intptr_t)), RSI);
 
 	// load compiled block
-	asmMovqMem(buffer, asmMem(R13, NO_REGISTER, SS_1, varOffset(RawBlock, compiledBlock)), TMP);
+	asmMovqMem(buffer, asmMem(RDI, NO_REGISTER, SS_1, varOffset(RawBlock, compiledBlock)), TMP);
 
 	// load array arguments size
-	asmMovqMem(buffer, asmMem(RSI, NO_REGISTER, SS_1, varOffset(RawArray, size)), RBX);
+	asmMovqMem(buffer, asmMem(RSI, NO_REGISTER, SS_1, varOffset(RawArray, size)), RCX);
 
 	// check arguments size
-	asmCmpbMem(buffer, asmMem(TMP, NO_REGISTER, SS_1, argsOffset), BL);
+	asmCmpbMem(buffer, asmMem(TMP, NO_REGISTER, SS_1, argsOffset), CL);
 	asmJ(buffer, COND_NOT_EQUAL, &invalidArgs);
 
 	// push arguments on stack
-	asmTestq(buffer, RBX, RBX);
+	asmTestq(buffer, RCX, RCX);
 	asmJ(buffer, COND_ZERO, &zeroArgs);
 	asmLabelBind(buffer, &loop, asmOffset(buffer));
-	asmDecq(buffer, RBX);
-	asmPushqMem(buffer, asmMem(RSI, RBX, SS_8, varOffset(RawArray, vars)));
+	asmDecq(buffer, RCX);
+	asmPushqMem(buffer, asmMem(RSI, RCX, SS_8, varOffset(RawArray, vars)));
 	asmJ(buffer, COND_NOT_ZERO, &loop);
 	asmLabelBind(buffer, &zeroArgs, asmOffset(buffer));
 
 	// push receiver
-	asmPushqMem(buffer, asmMem(R13, NO_REGISTER, SS_1, varOffset(RawBlock, receiver)));
+	asmPushqMem(buffer, asmMem(RDI, NO_REGISTER, SS_1, varOffset(RawBlock, receiver)));
 
+	// block is reloaded in RDI, as allocation of context can move it
 	generateBlockContextAllocation(generator);
 
 	// call block
-	asmMovqMem(buffer, asmMem(R13, NO_REGISTER, SS_1, varOffset(RawBlock, nativeCode)), RAX);
+	asmMovqMem(buffer, asmMem(RDI, NO_REGISTER, SS_1, varOffset(RawBlock, nativeCode)), RAX);
 	asmAddqImm(buffer, RAX, offsetof(NativeCode, insts));
 	asmCallq(buffer, RAX);
 
@@ -1101,13 +1106,18 @@ static void generateBlockOnExceptionPrimitive(CodeGenerator *generator)
 	AssemblerBuffer *buffer = &generator->buffer;
 	ptrdiff_t compiledCodeOffset = offsetof(NativeCode, compiledCode) - offsetof(NativeCode, insts);
 	AssemblerFixup *ip;
-	generator->frameSize = 2;
+	// native code + context + callee-saved registers
+	generator->regsAlloc.frameSize = generator->frameSize = FRAME_VARS_OFFSET + SAVED_REGS_SIZE;
 
 	// prologue
 	asmPushq(buffer, RBP);
 	asmMovq(buffer, RSP, RBP);
 	asmSubqImm(buffer, RSP, generator->frameSize * sizeof(intptr_t));
 
+	// signal jumps to handler from frames not restoring callee-saved registers, they are all restored here
+	generator->savedRegs = SAVED_REGS_ALL;
+	generateSavedRegsStore(buffer, generator->savedRegs);
+
 	// save native code
 	asmMovqToMem(buffer, R11, asmMem(RBP, NO_REGISTER, SS_1, -sizeof(intptr_t)));
 	generateMethodContextAllocation(generator, 0);
@@ -1144,21 +1154,23 @@ static void generateBlockOnExceptionPrimitive(CodeGenerator *generator)
 	generateStackmap(generator);
 
 	// unregister exception handler
-	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, -3 * sizeof(intptr_t)), TMP);
+	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, -(FRAME_VARS_OFFSET + SAVED_REGS_SIZE + 1) * sizeof(intptr_t)), TMP);
 	asmMovqMem(buffer, asmMem(TMP, NO_REGISTER, SS_1, varOffset(RawExceptionHandler, parent)), TMP);
 	asmMovqImm(buffer, (int64_t) &CurrentExceptionHandler, RDI);
 	asmMovqToMem(buffer, TMP, asmMem(RDI, NO_REGISTER, SS_1, 0));
 
 	// epilogue
 	asmMovqMem(&generator->buffer, asmMem(CTX, NO_REGISTER, SS_1, varOffset(RawContext, parent)), CTX);
-	asmAddqImm(buffer, RSP, 4 * sizeof(intptr_t));
+	generateSavedRegsLoad(buffer, RBP, generator->savedRegs);
+	asmAddqImm(buffer, RSP, (FRAME_VARS_OFFSET + SAVED_REGS_SIZE + 2) * sizeof(intptr_t));
 	asmPopq(buffer, RBP);
 	asmRet(buffer);
 
 	// jumped from exception signal
 	// RBP, RSP are restored by exception signal
 	ip->value = asmOffset(buffer) - ip->offset;
-	generator->frameSize = 5; // native code + context + backtrace + exception + block
+	// native code + context + callee-saved registers + backtrace + exception + block
+	generator->frameSize = FRAME_VARS_OFFSET + SAVED_REGS_SIZE + 3;
 
 	// restore context
 	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, -2 * sizeof(intptr_t)), CTX);
@@ -1173,7 +1185,8 @@ static void generateBlockOnExceptionPrimitive(CodeGenerator *generator)
 
 	// epilogue
 	asmMovqMem(&generator->buffer, asmMem(CTX, NO_REGISTER, SS_1, varOffset(RawContext, parent)), CTX);
-	asmAddqImm(buffer, RSP, 5 * sizeof(intptr_t));
+	generateSavedRegsLoad(buffer, RBP, generator->savedRegs);
+	asmAddqImm(buffer, RSP, (FRAME_VARS_OFFSET + SAVED_REGS_SIZE + 3) * sizeof(intptr_t));
 	asmPopq(buffer, RBP);
 	asmRet(buffer);
 }
@@ -1195,8 +1208,6 @@ static void generateExceptionSignalPrimitive(CodeGenerator *generator)
 	asmPushq(buffer, R11);
 	generatePushDummyContext(buffer);
 
-	asmMovq(buffer, R11, R13);
-
 	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, 2 * sizeof(intptr_t)), RDI);
 	asmDecq(buffer, RDI);
 
@@ -1241,7 +1252,7 @@ static void generateExceptionSignalPrimitive(CodeGenerator *generator)
 	asmMovqMem(buffer, asmMem(RDI, NO_REGISTER, SS_1, varOffset(RawExceptionHandler, context)), CTX);
 	// restore SP and BP
 	asmMovqMem(buffer, asmMem(CTX, NO_REGISTER, SS_1, varOffset(RawContext, frame)), RBP);
-	asmLeaq(buffer, asmMem(RBP, NO_REGISTER, SS_1, -2 * sizeof(intptr_t)), RSP);
+	asmLeaq(buffer, asmMem(RBP, NO_REGISTER, SS_1, -(FRAME_VARS_OFFSET + SAVED_REGS_SIZE) * sizeof(intptr_t)), RSP);
 	asmPushq(buffer, RAX); // push generated backtrace
 	asmPushq(buffer, R9); // push signaled exception
 	// load #value:value: as backtrace is not passed to the handler block
@@ -1256,7 +1267,7 @@ static void generateExceptionSignalPrimitive(CodeGenerator *generator)
 	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, 2 * sizeof(intptr_t)), R9);
 	// restore SP and BP
 	asmMovqMem(buffer, asmMem(CTX, NO_REGISTER, SS_1, varOffset(RawContext, frame)), RBP);
-	asmLeaq(buffer, asmMem(RBP, NO_REGISTER, SS_1, -2 * sizeof(intptr_t)), RSP);
+	asmLeaq(buffer, asmMem(RBP, NO_REGISTER, SS_1, -(FRAME_VARS_OFFSET + SAVED_REGS_SIZE) * sizeof(intptr_t)), RSP);
 	asmPushq(buffer, R9); // not used argument
 	asmPushq(buffer, R9); // push signaled exception
 	// load #value: as backtrace is not passed to the handler block
@@ -1267,9 +1278,9 @@ static void generateExceptionSignalPrimitive(CodeGenerator *generator)
 
 	// return to smalltalk code
 	asmLabelBind(buffer, &handlerNotFound, asmOffset(buffer));
+	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, -sizeof(intptr_t)), R11);
 	asmAddqImm(buffer, RSP, 2 * sizeof(intptr_t));
 	asmPopq(buffer, RBP);
-	asmMovq(buffer, R13, R11);
 }
 
 
@@ -1321,9 +1332,10 @@ static PrimitiveResult contextTemporaryAt(Value vContext, Value vIndex)
 	} else if (context->ic == getTaggedPtr(Handles.nil)) {
 		return primSuccess(getTaggedPtr(Handles.nil));
 	} else {
-		RawStackmap *stackmap = findStackmap(code->nativeCode, (ptrdiff_t) asCInt(context->ic));
-		index = index - context->size + FRAME_VARS_OFFSET - 1;
-		if (stackmapIncludes(stackmap, index)) {
+		Stackmap stackmap = findStackmap(code->nativeCode, (ptrdiff_t) asCInt(context->ic));
+		// temporaries follow callee-saved registers stored by frame
+		index = index - context->size + stackFrameGetSavedRegSlot(stackmap.regs.saved, SAVED_REGS_SIZE) - 1;
+		if (stackmap.set != NULL && stackmapIncludes(&stackmap, index)) {
 			return primSuccess(stackFrameGetSlot(context->frame, index));
 		} else {
 			return primSuccess(getTaggedPtr(Handles.nil));
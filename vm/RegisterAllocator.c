@@ -8,6 +8,12 @@
 
 #define PRINT_ALLOCATION 0
 
+// numbers of target and of backward jump
+typedef struct {
+	size_t start;
+	size_t end;
+} Loop;
+
 typedef struct {
 	uint8_t varsSize;
 	Variable *vars;
@@ -16,16 +22,25 @@ typedef struct {
 	Variable **last;
 	size_t maxOffset;
 	_Bool frameLess;
+	_Bool hasJumps;
+	_Bool isUnwound;
 	ptrdiff_t frameSize;
+	uint8_t savedRegs;
+	// offsets of bytecodes by their numbers, numbers of sends and loops
+	ptrdiff_t *offsets;
+	size_t *sends;
+	size_t sendsSize;
+	Loop *loops;
+	size_t loopsSize;
 } Vars;
 
-#define SORTED_VARS_SIZE 256
+#define ACTIVE_VARS_SIZE 256
 
+// variables holding registers or frame slots sorted by ends of their intervals
 typedef struct {
-	Variable *vars[SORTED_VARS_SIZE];
-	Variable **first;
-	Variable **last;
-} SortedVars;
+	Variable *vars[ACTIVE_VARS_SIZE];
+	size_t size;
+} ActiveVars;
 
 typedef struct {
 	/*AvailableRegs *available;*/
@@ -36,23 +51,25 @@ typedef struct {
 
 static void printAllocation(Vars *vars);
 static void scanCode(Vars *vars, CompiledCode *code);
+static void noteJump(Vars *vars, ptrdiff_t target, size_t number);
 static void examineCopyOperands(Vars *vars, Operand src, Operand dst, size_t offset);
 static void examineOperandClass(Vars *vars, Operand operand, size_t offset);
 static void examineOperand(Vars *vars, Operand operand, size_t offset);
 static void defineTmpVar(Vars *vars, uint8_t index, size_t offset);
 static Variable *defineSpecialVar(Vars *vars, uint8_t type, uint8_t index, size_t offset);
 static Variable *defineVar(Vars *vars, uint8_t type, uint8_t index, size_t offset);
+static void scanSavedVars(Vars *vars, CompiledCode *code);
+static _Bool isLiveAcrossSend(Vars *vars, Variable *var);
+static void sortVars(Vars *vars);
 static void scanRegisters(Vars *vars, AvailableRegs *regs);
-static void initSortedVars(SortedVars *sortedVars);
-static Variable *getFirstVar(SortedVars *sortedVars);
-static void addFirstVar(SortedVars *sortedVars, Variable *var);
-static void addLastVar(SortedVars *sortedVars, Variable *var);
-static void removeDeadVars(SortedVars *sortedVars, RegsPool *regsPool, size_t offset);
-static void reuseVarReg(RegsPool *regsPool, Variable *var);
-static void removeVar(SortedVars *sortedVars, Variable **var);
+static void scanFrameSlots(Vars *vars);
+static _Bool isSpillable(Variable *var);
+static _Bool isSlotShared(Variable *var, _Bool hasJumps);
+static void addActiveVar(ActiveVars *active, Variable *var);
+static void removeActiveVar(ActiveVars *active, size_t index);
+static ptrdiff_t findSpilledVar(ActiveVars *active);
 static Variable *defineCtxVar(Vars *vars, uint8_t index, size_t offset);
-static Variable *removeFirstVar(SortedVars *sortedVars);
-static void initRegsPool(RegsPool *regsPool, AvailableRegs *regs);
+static void initRegsPool(RegsPool *regsPool, uint8_t *regs, size_t size);
 static uint8_t nextReg(RegsPool *regsPool);
 
 /*
@@ -74,7 +91,7 @@ v        a msg.		a
 
 void computeRegsAlloc(RegsAlloc *alloc, AvailableRegs *regs, CompiledCode *code)
 {
-	ASSERT(SORTED_VARS_SIZE / 2 >= code->header.tempsSize);
+	ASSERT(ACTIVE_VARS_SIZE / 2 >= code->header.tempsSize);
 
 	Vars vars;
 	memset(&vars, 0, sizeof(vars));
@@ -87,6 +104,14 @@ void computeRegsAlloc(RegsAlloc *alloc, AvailableRegs *regs, CompiledCode *code)
 	vars.maxOffset = 0;
 	vars.frameLess = 1;
 	vars.frameSize = code->header.argsSize;
+	// every bytecode is at least 2 bytes long
+	size_t capacity = code->bytecodesSize / 2 + 1;
+	vars.offsets = malloc(capacity * sizeof(*vars.offsets));
+	vars.sends = malloc(capacity * sizeof(*vars.sends));
+	vars.loops = malloc(capacity * sizeof(*vars.loops));
+	if (vars.offsets == NULL || vars.sends == NULL || vars.loops == NULL) {
+		FAIL();
+	}
 	for (int16_t i = code->header.argsSize; i >= 0 ; i--) {
 		Variable *arg = defineVar(&vars, VAR_TMP, i + 1, 0);
 		arg->flags |= VAR_ON_STACK;
@@ -95,7 +120,23 @@ void computeRegsAlloc(RegsAlloc *alloc, AvailableRegs *regs, CompiledCode *code)
 	vars.specialVars[VAR_CONTEXT][0] = defineVar(&vars, VAR_CONTEXT, CONTEXT_INDEX, 0);
 
 	scanCode(&vars, code);
+	scanSavedVars(&vars, code);
 	scanRegisters(&vars, regs);
+	// frames of blocks returning from method are unwound by its epilogue, see generateOuterReturn
+	if (!code->isBlock && (code->header.outerReturns || vars.isUnwound) && !vars.frameLess) {
+		vars.savedRegs = (1 << regs->savedRegsSize) - 1;
+	}
+	scanFrameSlots(&vars);
+	free(vars.offsets);
+	free(vars.sends);
+	free(vars.loops);
+
+	// spilled temporaries need a frame
+	for (uint8_t i = code->header.argsSize + 2; i < code->header.argsSize + code->header.tempsSize + 2; i++) {
+		if ((alloc->vars[i].flags & VAR_DEFINED) && alloc->vars[i].reg == SPILLED_REG) {
+			vars.frameLess = 0;
+		}
+	}
 
 	for (int16_t i = code->header.argsSize; i >= 0 ; i--) {
 		alloc->vars[i + 1].frameOffset += (vars.frameLess ? 0 : 1) + 1; // +2 for return IC and saved BP
@@ -109,6 +150,8 @@ void computeRegsAlloc(RegsAlloc *alloc, AvailableRegs *regs, CompiledCode *code)
 	alloc->varsSize = vars.varsSize;
 	alloc->frameSize = -vars.frameSize - 1;
 	alloc->frameLess = vars.frameLess;
+	alloc->hasJumps = vars.hasJumps;
+	alloc->savedRegs = vars.savedRegs;
 }
 
 
@@ -150,7 +193,10 @@ static void scanCode(Vars *vars, CompiledCode *code)
 
 	bytecodeInitIterator(&iterator, code->bytecodes, code->bytecodesSize);
 	while (bytecodeHasNext(&iterator)) {
-		switch (bytecode = bytecodeNext(&iterator)) {
+		ptrdiff_t offset = bytecodeOffset(&iterator);
+		bytecode = bytecodeNext(&iterator);
+		vars->offsets[bytecodeNumber(&iterator)] = offset;
+		switch (bytecode) {
 		case BYTECODE_COPY:;
 			Operand src = bytecodeNextOperand(&iterator);
 			Operand dst = bytecodeNextOperand(&iterator);
@@ -160,6 +206,7 @@ static void scanCode(Vars *vars, CompiledCode *code)
 		case BYTECODE_SEND:
 		case BYTECODE_SEND_WITH_STORE:;
 			vars->frameLess = 0;
+			vars->sends[vars->sendsSize++] = bytecodeNumber(&iterator);
 			bytecodeNextByte(&iterator); // skip selector
 			uint8_t argsSize = bytecodeNextByte(&iterator);
 
@@ -175,6 +222,22 @@ static void scanCode(Vars *vars, CompiledCode *code)
 			}
 			break;
 
+		case BYTECODE_FALLBACK_SEND:;
+			vars->frameLess = 0;
+			vars->sends[vars->sendsSize++] = bytecodeNumber(&iterator);
+			bytecodeNextByte(&iterator); // skip selector
+			uint8_t blocksSize = bytecodeNextByte(&iterator);
+			uint8_t varsSize = bytecodeNextByte(&iterator);
+			vars->isUnwound |= (bytecodeNextByte(&iterator) & FALLBACK_RETURNS) != 0;
+			defineSpecialVar(vars, VAR_CONTEXT, 0, bytecodeNumber(&iterator));
+
+			// receiver, blocks, their self and variables stored into context of the send
+			for (uint16_t i = 0; i < blocksSize + varsSize + 2; i++) {
+				examineOperand(vars, bytecodeNextOperand(&iterator), bytecodeNumber(&iterator));
+			}
+			examineOperand(vars, bytecodeNextOperand(&iterator), bytecodeNumber(&iterator) + 1);
+			break;
+
 		case BYTECODE_RETURN:
 			returns = 1;
 			examineOperand(vars, bytecodeNextOperand(&iterator), bytecodeNumber(&iterator));
@@ -187,13 +250,33 @@ static void scanCode(Vars *vars, CompiledCode *code)
 			break;
 
 		case BYTECODE_JUMP:
-			bytecodeNextInt32(&iterator); // skip destination
+			vars->frameLess = 0;
+			vars->hasJumps = 1;
+			noteJump(vars, bytecodeNextJumpTarget(&iterator), bytecodeNumber(&iterator));
 			break;
 
 		case BYTECODE_JUMP_NOT_MEMBER_OF:
+			vars->frameLess = 0;
+			vars->hasJumps = 1;
 			bytecodeNextByte(&iterator); // skip literal
 			examineOperand(vars, bytecodeNextOperand(&iterator), bytecodeNumber(&iterator));
-			bytecodeNextInt32(&iterator); // skip destination
+			noteJump(vars, bytecodeNextJumpTarget(&iterator), bytecodeNumber(&iterator));
+			break;
+
+		case BYTECODE_JUMP_IF_TRUE:
+		case BYTECODE_JUMP_IF_FALSE:
+			vars->frameLess = 0;
+			vars->hasJumps = 1;
+			examineOperand(vars, bytecodeNextOperand(&iterator), bytecodeNumber(&iterator));
+			noteJump(vars, bytecodeNextJumpTarget(&iterator), bytecodeNumber(&iterator));
+			break;
+
+		case BYTECODE_DEOPTIMIZATION_STATE:;
+			// variables are read once the following send returns, see deoptimizeFrame
+			uint8_t operandsSize = bytecodeNextByte(&iterator);
+			for (uint8_t i = 0; i < operandsSize; i++) {
+				examineOperand(vars, bytecodeNextOperand(&iterator), bytecodeNumber(&iterator) + 1);
+			}
 			break;
 
 		default:
@@ -201,13 +284,35 @@ static void scanCode(Vars *vars, CompiledCode *code)
 		}
 	}
 
-	if (!returns) {
+	// branches can fall through to the end of method which answers self
+	if (!returns || vars->hasJumps) {
 		ptrdiff_t offset = bytecodeNumber(&iterator);
 		defineTmpVar(vars, SELF_INDEX, offset == -1 ? 0 : offset);
 	}
 }
 
 
+// backward jumps close loops, their targets are already numbered
+static void noteJump(Vars *vars, ptrdiff_t target, size_t number)
+{
+	if (target > vars->offsets[number]) {
+		return;
+	}
+	size_t low = 0;
+	size_t high = number;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (vars->offsets[middle] < target) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	ASSERT(vars->offsets[low] == target);
+	vars->loops[vars->loopsSize++] = (Loop) { .start = low, .end = number };
+}
+
+
 static void examineCopyOperands(Vars *vars, Operand src, Operand dst, size_t offset)
 {
 	examineOperand(vars, src, offset);
@@ -253,6 +358,13 @@ static void examineOperand(Vars *vars, Operand operand, size_t offset)
 	case OPERAND_INST_VAR:
 		defineTmpVar(vars, SELF_INDEX, offset);
 		break;
+	case OPERAND_INST_VAR_OF:
+		examineOperand(vars, bytecodeInstanceOperand(&operand), offset);
+		break;
+	case OPERAND_BOUND_VAR:
+		defineTmpVar(vars, operand.index, offset);
+		defineTmpVar(vars, operand.index + 1, offset);
+		break;
 	default:
 		;
 	}
@@ -294,6 +406,7 @@ static Variable *defineVar(Vars *vars, uint8_t type, uint8_t index, size_t offse
 	Variable *var = &vars->vars[index];
 	var->flags = VAR_DEFINED;
 	var->index = index;
+	var->type = type;
 	var->reg = SPILLED_REG;
 	var->start = var->end = offset;
 	if (type == VAR_TMP || type == VAR_CONTEXT || type == VAR_CLASS) {
@@ -305,14 +418,79 @@ static Variable *defineVar(Vars *vars, uint8_t type, uint8_t index, size_t offse
 }
 
 
+// temporaries live across sends are given callee-saved registers, so that code does not reload them from frame
+// after each send, their intervals cover loops around them and with jumps they are initialized in prologue
+static void scanSavedVars(Vars *vars, CompiledCode *code)
+{
+	size_t tempsOffset = code->header.argsSize + 2;
+	size_t tempsEnd = tempsOffset + code->header.tempsSize;
+	if (vars->frameLess || vars->sendsSize == 0) {
+		return;
+	}
+
+	for (size_t i = tempsOffset; i < tempsEnd; i++) {
+		Variable *var = &vars->vars[i];
+		if ((var->flags & VAR_DEFINED) == 0 || !isLiveAcrossSend(vars, var)) {
+			continue;
+		}
+		var->flags |= VAR_CALLEE_SAVED;
+		_Bool isExtended = 1;
+		while (isExtended) {
+			isExtended = 0;
+			for (size_t j = 0; j < vars->loopsSize; j++) {
+				Loop *loop = &vars->loops[j];
+				if (var->start <= loop->end && loop->start <= var->end && var->end < loop->end) {
+					var->end = loop->end;
+					isExtended = 1;
+				}
+			}
+		}
+		if (vars->hasJumps) {
+			var->start = 0;
+		}
+	}
+	sortVars(vars);
+}
+
+
+static _Bool isLiveAcrossSend(Vars *vars, Variable *var)
+{
+	for (size_t i = 0; i < vars->sendsSize; i++) {
+		if (var->start < vars->sends[i] && vars->sends[i] < var->end) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+// keeps variables ordered by starts of their intervals, which could be moved to prologue
+static void sortVars(Vars *vars)
+{
+	for (Variable **pVar = vars->order + 1; pVar < vars->last; pVar++) {
+		Variable *var = *pVar;
+		Variable **p = pVar;
+		for (; p > vars->order && p[-1]->start > var->start; p--) {
+			p[0] = p[-1];
+		}
+		*p = var;
+	}
+}
+
+
+// linear scan over intervals ordered by their starts, when registers run out the active variable ending last is
+// spilled, so that registers are given to variables needed sooner, variables live across sends take callee-saved
+// registers first, others take them once caller-saved ones run out in code with frame, which stores them
 static void scanRegisters(Vars *vars, AvailableRegs *regs)
 {
-	SortedVars sortedVars;
+	ActiveVars active;
 	RegsPool regsPool;
+	RegsPool savedRegsPool;
 	Variable *var;
 
-	initSortedVars(&sortedVars);
-	initRegsPool(&regsPool, regs);
+	active.size = 0;
+	initRegsPool(&regsPool, regs->regs, regs->regsSize);
+	initRegsPool(&savedRegsPool, regs->savedRegs, regs->savedRegsSize);
 
 	var = vars->specialVars[VAR_CONTEXT][0];
 	var->reg = 12; // TODO: use regs->contextReg
@@ -322,93 +500,138 @@ static void scanRegisters(Vars *vars, AvailableRegs *regs)
 		if (var->reg != SPILLED_REG) {
 			continue;
 		}
-		removeDeadVars(&sortedVars, &regsPool, var->start);
+		// expire variables whose intervals ended
+		size_t size = 0;
+		for (size_t i = 0; i < active.size; i++) {
+			if (active.vars[i]->end < var->start) {
+				RegsPool *pool = findSavedReg(regs, active.vars[i]->reg) == -1 ? &regsPool : &savedRegsPool;
+				*--pool->tmp = active.vars[i]->reg;
+			} else {
+				active.vars[size++] = active.vars[i];
+			}
+		}
+		active.size = size;
 
-		if (getFirstVar(&sortedVars) == NULL || var->end >= getFirstVar(&sortedVars)->end) {
-			addFirstVar(&sortedVars, var);
+		if (var->flags & VAR_CALLEE_SAVED) {
+			var->reg = nextReg(&savedRegsPool);
+			var->reg = var->reg == SPILLED_REG ? nextReg(&regsPool) : var->reg;
 		} else {
-			addLastVar(&sortedVars, var);
+			var->reg = nextReg(&regsPool);
+			var->reg = var->reg == SPILLED_REG && !vars->frameLess ? nextReg(&savedRegsPool) : var->reg;
 		}
-
-		var->reg = nextReg(&regsPool);
 		if (var->reg == SPILLED_REG) {
-			Variable *spilledVar = removeFirstVar(&sortedVars);
-			var->reg = spilledVar->reg;
-			spilledVar->reg = SPILLED_REG;
+			ptrdiff_t spilled = findSpilledVar(&active);
+			if (spilled == -1 || (isSpillable(var) && active.vars[spilled]->end <= var->end)) {
+				var->flags &= ~VAR_CALLEE_SAVED;
+				continue;
+			}
+			var->reg = active.vars[spilled]->reg;
+			active.vars[spilled]->reg = SPILLED_REG;
+			active.vars[spilled]->flags &= ~VAR_CALLEE_SAVED;
+			removeActiveVar(&active, spilled);
+		}
+		ptrdiff_t savedReg = findSavedReg(regs, var->reg);
+		if (savedReg == -1) {
+			var->flags &= ~VAR_CALLEE_SAVED;
+		} else {
+			vars->savedRegs |= 1 << savedReg;
 		}
+		addActiveVar(&active, var);
 	}
 }
 
 
-static void initSortedVars(SortedVars *sortedVars)
-{
-	memset(sortedVars, 0, sizeof(*sortedVars));
-	sortedVars->first = sortedVars->last = sortedVars->vars + SORTED_VARS_SIZE / 2;
-}
-
-
-static Variable *getFirstVar(SortedVars *sortedVars)
+// variables with disjoint intervals share frame slots, context of activation keeps its slot, temporaries of code
+// with jumps may be live outside of their intervals and are initialized in prologue, so they keep their slots too
+static void scanFrameSlots(Vars *vars)
 {
-	return *sortedVars->first;
+	ActiveVars active;
+	ptrdiff_t freeSlots[256];
+	size_t freeSlotsSize = 0;
+	ptrdiff_t contextOffset = vars->specialVars[VAR_CONTEXT][0]->frameOffset;
+
+	active.size = 0;
+	vars->frameSize = contextOffset - 1;
+	// callee-saved registers are stored right after context, see stackFrameGetSavedRegSlot
+	for (uint8_t savedRegs = vars->savedRegs; savedRegs != 0; savedRegs &= savedRegs - 1) {
+		vars->frameSize--;
+	}
+	for (Variable **pVar = vars->order; pVar < vars->last; pVar++) {
+		Variable *var = *pVar;
+		if (var->frameOffset >= contextOffset || var->type == VAR_ASSOC) {
+			continue;
+		}
+		if (var->flags & VAR_CALLEE_SAVED) {
+			var->frameOffset = 0;
+			continue;
+		}
+		if (!isSlotShared(var, vars->hasJumps)) {
+			var->frameOffset = vars->frameSize--;
+			continue;
+		}
+		size_t size = 0;
+		for (size_t i = 0; i < active.size; i++) {
+			if (active.vars[i]->end < var->start) {
+				freeSlots[freeSlotsSize++] = active.vars[i]->frameOffset;
+			} else {
+				active.vars[size++] = active.vars[i];
+			}
+		}
+		active.size = size;
+		var->frameOffset = freeSlotsSize > 0 ? freeSlots[--freeSlotsSize] : vars->frameSize--;
+		addActiveVar(&active, var);
+	}
 }
 
 
-static void addFirstVar(SortedVars *sortedVars, Variable *var)
+// generated code expects receiver, contexts and associations in registers
+static _Bool isSpillable(Variable *var)
 {
-	ASSERT(sortedVars->first >= sortedVars->vars);
-	*--sortedVars->first = var;
+	return var->type == VAR_CLASS || (var->type == VAR_TMP && var->index != SELF_INDEX);
 }
 
 
-static void addLastVar(SortedVars *sortedVars, Variable *var)
+static _Bool isSlotShared(Variable *var, _Bool hasJumps)
 {
-	ASSERT(sortedVars->last < (sortedVars->vars + SORTED_VARS_SIZE));
-	*sortedVars->last++ = var;
+	return var->type != VAR_TMP || !hasJumps;
 }
 
 
-static void removeDeadVars(SortedVars *sortedVars, RegsPool *regsPool, size_t offset)
+static void addActiveVar(ActiveVars *active, Variable *var)
 {
-	Variable *var;
-
-	for (Variable **pVar = sortedVars->first; pVar < sortedVars->last; pVar++) {
-		var = *pVar;
-		if (var->end < offset) {
-			reuseVarReg(regsPool, var);
-			removeVar(sortedVars, pVar);
-		}
+	ASSERT(active->size < ACTIVE_VARS_SIZE);
+	size_t i = active->size++;
+	for (; i > 0 && active->vars[i - 1]->end > var->end; i--) {
+		active->vars[i] = active->vars[i - 1];
 	}
+	active->vars[i] = var;
 }
 
 
-static void reuseVarReg(RegsPool *regsPool, Variable *var)
+static void removeActiveVar(ActiveVars *active, size_t index)
 {
-	*--regsPool->tmp = var->reg;
+	active->size--;
+	memmove(&active->vars[index], &active->vars[index + 1], (active->size - index) * sizeof(*active->vars));
 }
 
 
-static void removeVar(SortedVars *sortedVars, Variable **var)
+// answers index of spillable variable ending last or -1
+static ptrdiff_t findSpilledVar(ActiveVars *active)
 {
-	memmove(var, var + 1, (int8_t *) sortedVars->last - (int8_t *) var);
-	sortedVars->last--;
-}
-
-
-static Variable *removeFirstVar(SortedVars *sortedVars)
-{
-	Variable **pVar = sortedVars->first;
-	Variable *var = *pVar;
-	removeVar(sortedVars, pVar);
-	return var;
+	for (ptrdiff_t i = active->size - 1; i >= 0; i--) {
+		if (isSpillable(active->vars[i])) {
+			return i;
+		}
+	}
+	return -1;
 }
 
 
-static void initRegsPool(RegsPool *regsPool, AvailableRegs *regs)
+static void initRegsPool(RegsPool *regsPool, uint8_t *regs, size_t size)
 {
-	// regsPool->available = regs;
-	memcpy(regsPool->regs, regs->regs, regs->regsSize);
+	memcpy(regsPool->regs, regs, size);
 	regsPool->tmp = regsPool->regs;
-	regsPool->end = regsPool->tmp + regs->regsSize;
+	regsPool->end = regsPool->tmp + size;
 }
 
 
@@ -421,9 +644,24 @@ static uint8_t nextReg(RegsPool *regsPool)
 }
 
 
+// variables in callee-saved registers keep them, others are refilled from their frame slots
 void invalidateRegs(RegsAlloc *alloc)
 {
 	for (uint8_t i = 0; i < alloc->varsSize; i++) {
-		alloc->vars[i].flags = alloc->vars[i].flags & ~VAR_IN_REG;
+		if ((alloc->vars[i].flags & VAR_CALLEE_SAVED) == 0) {
+			alloc->vars[i].flags = alloc->vars[i].flags & ~VAR_IN_REG;
+		}
+	}
+}
+
+
+// answers index of callee-saved register or -1
+ptrdiff_t findSavedReg(AvailableRegs *regs, int8_t reg)
+{
+	for (size_t i = 0; i < regs->savedRegsSize; i++) {
+		if (regs->savedRegs[i] == reg) {
+			return i;
+		}
 	}
+	return -1;
 }
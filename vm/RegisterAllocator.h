@@ -18,6 +18,8 @@ typedef enum {
 	VAR_DEFINED = 1,
 	VAR_IN_REG = 1 << 1,
 	VAR_ON_STACK = 1 << 2,
+	// variable keeps its callee-saved register across sends and has no frame slot, see scanSavedVars
+	VAR_CALLEE_SAVED = 1 << 3,
 } VariableFlags;
 
 typedef struct {
@@ -37,9 +39,13 @@ typedef struct {
 	Variable *specialVars[3][256];
 	size_t frameSize;
 	_Bool frameLess;
+	_Bool hasJumps;
+	// callee-saved registers stored in frame, bit for each of available ones
+	uint8_t savedRegs;
 } RegsAlloc;
 
 void computeRegsAlloc(RegsAlloc *alloc, AvailableRegs *regs, CompiledCode *code);
 void invalidateRegs(RegsAlloc *alloc);
+ptrdiff_t findSavedReg(AvailableRegs *regs, int8_t reg);
 
 #endif
@@ -1,26 +1,59 @@
 #include "Scavenger.h"
 #include "Heap.h"
+#include "GarbageCollector.h"
 #include "StackFrame.h"
 #include "CodeDescriptors.h"
 #include "Thread.h"
 #include "Exception.h"
 #include <string.h>
+#include <stdlib.h>
 
 #define SCAVENGER_ALIGN 8
-
+// tenuring age is lowered once survivors would take more than this part of semi space
+#define TARGET_SURVIVOR_PERCENT 50
+// classes whose new instances mostly survive their first scavenge are allocated in old space
+#define PRETENURING_MIN_INSTANCES 1000
+#define PRETENURING_SURVIVAL_PERCENT 90
+
+typedef struct {
+	RawClass *class;
+	size_t allocated;
+	size_t survived;
+} ClassCensus;
+
+// instances allocated since last scavenge counted by class, open addressing by class address
+typedef struct {
+	ClassCensus *entries;
+	size_t size;
+	size_t capacity;
+} CensusTable;
+
+static void updateTenuringAge(Scavenger *scavenger);
+static void takeCensus(uint8_t *start, uint8_t *end);
+static void censusAdd(RawClass *class, _Bool survived);
+static ClassCensus *censusEntry(CensusTable *table, RawClass *class);
+static void growCensus(CensusTable *table);
+static void updatePretenuredClasses(void);
 static void iterateStack(Scavenger *scavenger);
 static void iterateExceptionHandlers(Scavenger *scavenger);
 static void iterateHandles(Scavenger *scavenger);
-static void iterateRememberedSet(Scavenger *scavenger);
+static void iterateCards(Scavenger *scavenger);
+static void iteratePageCards(Scavenger *scavenger, HeapPage *page);
+static void iterateDirtyCards(Scavenger *scavenger, HeapPage *page);
+static size_t objectSizeAt(uint8_t *p);
 static void iterateNativeCode(Scavenger *scavenger);
 static RawObject *processPointer(Scavenger *scavenger, RawObject **p);
 static RawObject *processTaggedPointer(Scavenger *scavenger, Value *p);
 static void forwardObject(Scavenger *scavenger, RawObject *object);
 static void iterateObject(Scavenger *scavenger, RawObject *root);
+static _Bool iterateObjectRange(Scavenger *scavenger, RawObject *root, uint8_t *start, uint8_t *end);
+
+static CensusTable Census = { NULL, 0, 0 };
 
 
-void initScavenger(Scavenger *scavenger, Heap *heap, size_t size)
+void initScavenger(Scavenger *scavenger, Heap *heap, size_t size, size_t tenuringAge)
 {
+	ASSERT(tenuringAge >= 1 && tenuringAge <= MAX_TENURING_AGE);
 	scavenger->heap = heap;
 	scavenger->page = mapHeapPage(size, 0);
 	size_t semiSpaceSize = scavenger->page->bodySize / 2;
@@ -33,6 +66,10 @@ void initScavenger(Scavenger *scavenger, Heap *heap, size_t size)
 
 	scavenger->top = (uint8_t *) ((uintptr_t) start | NEW_SPACE_TAG);
 	scavenger->end = start + semiSpaceSize;
+	scavenger->tenuringAge = tenuringAge;
+	scavenger->maxTenuringAge = tenuringAge;
+	LastGCStats.tenuringAge = tenuringAge;
+	memset(scavenger->ageSizes, 0, sizeof(scavenger->ageSizes));
 	scavenger->survivorEnd = scavenger->top;
 }
 
@@ -61,6 +98,11 @@ uint8_t *scavengerTryAllocate(Scavenger *scavenger, size_t size)
 
 void scavengerScavenge(Scavenger *scavenger)
 {
+	// old space is not swept while cards are iterated, enough of it is swept for promotions beforehand
+	gcSweepPages(&scavenger->heap->oldSpace, scavenger->size);
+	gcPauseSweeping();
+	uint8_t *allocatedStart = scavenger->survivorEnd;
+	uint8_t *allocatedEnd = scavenger->top;
 	scavenger->hasPromotionFailure = 0;
 	scavenger->top = (uint8_t *) ((uintptr_t) scavenger->toSpace | NEW_SPACE_TAG);
 	scavenger->end = scavenger->toSpace + scavenger->size;
@@ -69,14 +111,19 @@ void scavengerScavenge(Scavenger *scavenger)
 	uint8_t *toSpace = scavenger->fromSpace;
 	scavenger->fromSpace = fromSpace;
 	scavenger->toSpace = toSpace;
+	memset(scavenger->ageSizes, 0, sizeof(scavenger->ageSizes));
 
-	iterateRememberedSet(scavenger);
+	iterateCards(scavenger);
 	iterateStack(scavenger);
 	iterateExceptionHandlers(scavenger);
 	iterateHandles(scavenger);
 	iterateNativeCode(scavenger);
+	updateTenuringAge(scavenger);
+	takeCensus(allocatedStart, allocatedEnd);
+	updatePretenuredClasses();
 	scavenger->survivorEnd = scavenger->top;
 	memset(scavenger->toSpace, scavenger->size, 0);
+	gcResumeSweeping();
 
 #if VERIFY_HEAP_AFTER_GC
 	verifyHeap();
@@ -91,12 +138,116 @@ _Bool scavengerIncludes(Scavenger *scavenger, uint8_t *addr)
 }
 
 
+// survivors of the youngest ages are kept in new space as long as they fit into target part of it, so that
+// objects living across a few scavenges die there instead of being promoted
+static void updateTenuringAge(Scavenger *scavenger)
+{
+	size_t target = scavenger->size * TARGET_SURVIVOR_PERCENT / 100;
+	size_t size = 0;
+	size_t age = 1;
+	while (age < scavenger->maxTenuringAge && (size += scavenger->ageSizes[age]) <= target) {
+		age++;
+	}
+	scavenger->tenuringAge = age;
+	LastGCStats.tenuringAge = age;
+}
+
+
+// objects allocated since last scavenge are left in from space, forwarded ones survived
+static void takeCensus(uint8_t *start, uint8_t *end)
+{
+	uint8_t *p = start;
+	while (p < end) {
+		RawObject *object = (RawObject *) p;
+		_Bool survived = (object->tags & TAG_FORWARDED) != 0;
+		RawObject *copy = survived ? (RawObject *) object->class : object;
+		RawClass *class = copy->class;
+		p += align(computeRawObjectSize(copy), HEAP_OBJECT_ALIGN);
+
+		// classes of dead objects may have moved or died too
+		if (!survived && isNewObject((RawObject *) class)) {
+			if ((class->tags & TAG_FORWARDED) == 0) {
+				continue;
+			}
+			class = class->class;
+		}
+		censusAdd(class, survived);
+	}
+}
+
+
+static void censusAdd(RawClass *class, _Bool survived)
+{
+	CensusTable *table = &Census;
+	if ((table->size + 1) * 2 > table->capacity) {
+		growCensus(table);
+	}
+	ClassCensus *entry = censusEntry(table, class);
+	if (entry->class == NULL) {
+		entry->class = class;
+		table->size++;
+	}
+	entry->allocated++;
+	entry->survived += survived;
+}
+
+
+static ClassCensus *censusEntry(CensusTable *table, RawClass *class)
+{
+	size_t mask = table->capacity - 1;
+	size_t index = ((uintptr_t) class * 0x9E3779B97F4A7C15ull) >> (64 - __builtin_ctzll(table->capacity));
+	while (table->entries[index].class != NULL && table->entries[index].class != class) {
+		index = (index + 1) & mask;
+	}
+	return &table->entries[index];
+}
+
+
+static void growCensus(CensusTable *table)
+{
+	CensusTable grown = { .size = table->size, .capacity = table->capacity == 0 ? 64 : table->capacity * 2 };
+	grown.entries = calloc(grown.capacity, sizeof(ClassCensus));
+	ASSERT(grown.entries != NULL);
+	for (size_t i = 0; i < table->capacity; i++) {
+		if (table->entries[i].class != NULL) {
+			*censusEntry(&grown, table->entries[i].class) = table->entries[i];
+		}
+	}
+	free(table->entries);
+	*table = grown;
+}
+
+
+// pretenured classes are reset by every few markings of old space, so that classes whose instances stop
+// surviving are allocated in new space again
+static void updatePretenuredClasses(void)
+{
+	CensusTable *table = &Census;
+	for (size_t i = 0; i < table->capacity; i++) {
+		ClassCensus *entry = &table->entries[i];
+		if (entry->class != NULL
+				&& entry->allocated >= PRETENURING_MIN_INSTANCES
+				&& entry->survived * 100 >= entry->allocated * PRETENURING_SURVIVAL_PERCENT
+				&& (entry->class->tags & TAG_PRETENURED) == 0) {
+			entry->class->tags |= TAG_PRETENURED;
+			LastGCStats.pretenured++;
+		}
+	}
+	if (table->size > 0) {
+		memset(table->entries, 0, table->capacity * sizeof(ClassCensus));
+		table->size = 0;
+	}
+}
+
+
 static void iterateStack(Scavenger *scavenger)
 {
 	EntryStackFrame *entryFrame = scavenger->heap->thread->stackFramesTail;
 	while (entryFrame != NULL) {
 		StackFrame *prev = entryFrame->exit;
 		StackFrame *frame = stackFrameGetParent(prev, entryFrame);
+		RegisterMap map;
+		initRegisterMap(&map, prev);
 		processTaggedPointer(scavenger, stackFrameGetSlotPtr(prev, 0));
 
 		while (frame != NULL) {
@@ -111,12 +262,11 @@ static void iterateStack(Scavenger *scavenger)
 				}
 			}
 
-			RawStackmap *stackmap = findStackmap(code, (ptrdiff_t) prev->parentIc);
-			ASSERT(stackmap != NULL);
-			size_t frameSize = (stackmap->size - sizeof(Value)) * 8;
-			for (size_t i = 0; i < frameSize; i++) {
-				//ASSERT(i != 0 || stackmapIncludes(stackmap, i));
-				if (stackmapIncludes(stackmap, i)) {
+			Stackmap stackmap = findStackmap(code, (ptrdiff_t) prev->parentIc);
+			ASSERT(stackmap.set != NULL);
+			for (size_t i = 0; i < stackmap.size; i++) {
+				//ASSERT(i != 0 || stackmapIncludes(&stackmap, i));
+				if (stackmapIncludes(&stackmap, i)) {
 					Value *value = stackFrameGetSlotPtr(frame, i);
 					if (valueTypeOf(*value, VALUE_POINTER)) {
 						//ASSERT(pageSpaceIncludes(&_Heap.space, (uint8_t *) asObject(value)));
@@ -124,6 +274,12 @@ static void iterateStack(Scavenger *scavenger)
 					}
 				}
 			}
+			for (size_t i = 0; i < SAVED_REGS_SIZE; i++) {
+				if ((stackmap.regs.live & (1 << i)) && valueTypeOf(*map.regs[i], VALUE_POINTER)) {
+					processTaggedPointer(scavenger, map.regs[i]);
+				}
+			}
+			registerMapUpdate(&map, frame, stackmap.regs.saved);
 
 			prev = frame;
 			frame = stackFrameGetParent(frame, entryFrame);
@@ -177,48 +333,96 @@ static void iterateHandles(Scavenger *scavenger)
 }
 
 
-static void iterateRememberedSet(Scavenger *scavenger)
+static void iterateCards(Scavenger *scavenger)
 {
-	RememberedSetIterator iterator;
-	initRememberedSetIterator(&iterator, &scavenger->heap->rememberedSet);
-	while (rememberedSetIteratorHasNext(&iterator)) {
-		iterateObject(scavenger, rememberedSetIteratorNext(&iterator));
+	// pages mapped for promoted objects are appended and visited as well
+	for (HeapPage *page = scavenger->heap->oldSpace.pages; page != NULL; page = page->next) {
+		iteratePageCards(scavenger, page);
+	}
+	for (HeapPage *page = scavenger->heap->oldSpace.largePages; page != NULL; page = page->next) {
+		iteratePageCards(scavenger, page);
 	}
 }
 
 
-static void iterateNativeCode(Scavenger *scavenger)
+static void iteratePageCards(Scavenger *scavenger, HeapPage *page)
 {
-	PageSpaceIterator iterator;
-	pageSpaceIteratorInit(&iterator, &scavenger->heap->execSpace);
-	NativeCode *code = (NativeCode *) pageSpaceIteratorNext(&iterator);
-
-	while (code != NULL) {
-		if ((code->tags & TAG_FREESPACE) == 0) {
-			if (code->compiledCode != NULL) {
-				processPointer(scavenger, (RawObject **) &code->compiledCode);
-			}
-			if (code->stackmaps != NULL) {
-				processPointer(scavenger, (RawObject **) &code->stackmaps);
-			}
-			if (code->descriptors != NULL) {
-				processPointer(scavenger, (RawObject **) &code->descriptors);
-			}
-			if (code->typeFeedback != NULL) {
-				processPointer(scavenger, (RawObject **) &code->typeFeedback);
+	if (heapPageHasDirtyCards(page)) {
+		iterateDirtyCards(scavenger, page);
+	}
+}
+
+
+static void iterateDirtyCards(Scavenger *scavenger, HeapPage *page)
+{
+	uint8_t *object = page->body;
+	uint8_t *objectEnd = object + objectSizeAt(object);
+	uint8_t *bodyEnd = page->body + page->bodySize;
+
+	for (size_t i = (page->body - (uint8_t *) page) >> CARD_SIZE_LOG2; i < page->cardsSize; i++) {
+		if (page->cards[i] == 0) {
+			continue;
+		}
+
+		// the card stays dirty only if it still points to new space after the scan, or until remark of old space
+		page->cards[i] = scavenger->heap->isMarking;
+		uint8_t *cardStart = (uint8_t *) page + (i << CARD_SIZE_LOG2);
+		uint8_t *cardEnd = cardStart + CARD_SIZE;
+		while (objectEnd <= cardStart) {
+			object = objectEnd;
+			objectEnd = object + objectSizeAt(object);
+		}
+
+		uint8_t *p = object;
+		while (p < cardEnd && p < bodyEnd) {
+			// promotions may split free spaces, so sizes are read as the card is walked
+			if ((((RawObject *) p)->tags & TAG_FREESPACE) == 0 && iterateObjectRange(scavenger, (RawObject *) p, cardStart, cardEnd)) {
+				page->cards[i] = 1;
 			}
-			for (size_t i = 0; i < code->pointersOffsetsSize; i++) {
-				uint16_t offset = ((uint16_t *) (code->insts + code->size))[i];
-				Value *ptr = (Value *) (code->insts + offset);
-				if (valueTypeOf(*ptr, VALUE_POINTER)) {
-					processTaggedPointer(scavenger, ptr);
-				} else {
-					processPointer(scavenger, (RawObject **) ptr);
-				}
+			p += objectSizeAt(p);
+		}
+	}
+}
+
+
+static size_t objectSizeAt(uint8_t *p)
+{
+	FreeSpace *freeSpace = (FreeSpace *) p;
+	if (freeSpace->tags & TAG_FREESPACE) {
+		return freeSpace->size;
+	}
+	return align(computeRawObjectSize((RawObject *) p), HEAP_OBJECT_ALIGN);
+}
+
+
+static void iterateNativeCode(Scavenger *scavenger)
+{
+	CodeRememberedSet *set = &scavenger->heap->codeRememberedSet;
+	size_t size = 0;
+
+	for (size_t i = 0; i < set->size; i++) {
+		NativeCode *code = set->codes[i];
+		_Bool hasNewPointers = 0;
+		if (code->compiledCode != NULL) {
+			hasNewPointers |= isNewObject(processPointer(scavenger, (RawObject **) &code->compiledCode));
+		}
+		for (size_t j = 0; j < code->pointersOffsetsSize; j++) {
+			uint16_t offset = ((uint16_t *) (code->insts + code->size))[j];
+			Value *ptr = (Value *) (code->insts + offset);
+			if (valueTypeOf(*ptr, VALUE_POINTER)) {
+				hasNewPointers |= isNewObject(processTaggedPointer(scavenger, ptr));
+			} else {
+				hasNewPointers |= isNewObject(processPointer(scavenger, (RawObject **) ptr));
 			}
 		}
-		code = (NativeCode *) pageSpaceIteratorNext(&iterator);
+		// code whose objects were all promoted is forgotten
+		if (hasNewPointers) {
+			set->codes[size++] = code;
+		} else {
+			code->tags &= ~TAG_REMEMBERED;
+		}
 	}
+	set->size = size;
 }
 
 
@@ -228,6 +432,10 @@ static RawObject *processPointer(Scavenger *scavenger, RawObject **p)
 	if (((uintptr_t) object & SPACE_TAG) == OLD_SPACE_TAG) {
 		return object;
 	}
+	if (scavengerIncludes(scavenger, (uint8_t *) object)) {
+		// already copied, slots of objects promoted during card scanning could be visited twice
+		return object;
+	}
 	if (object->tags & TAG_FORWARDED) {
 		ASSERT(isOldObject((RawObject *) object->class) || scavenger->fromSpace <= (uint8_t *) object->class && (uint8_t *) object->class <= scavenger->top);
 		ASSERT((object->class->tags & TAG_FORWARDED) == 0);
@@ -250,6 +458,9 @@ static RawObject *processTaggedPointer(Scavenger *scavenger, Value *p)
 	if (((uintptr_t) object & SPACE_TAG) == OLD_SPACE_TAG) {
 		return object;
 	}
+	if (scavengerIncludes(scavenger, (uint8_t *) object)) {
+		return object;
+	}
 	if (object->tags & TAG_FORWARDED) {
 		ASSERT(isOldObject((RawObject *) object->class) || scavenger->fromSpace <= (uint8_t *) object->class && (uint8_t *) object->class < scavenger->top);
 		*p = tagPtr(object->class);
@@ -272,9 +483,7 @@ static void forwardObject(Scavenger *scavenger, RawObject *object)
 	size_t size = align(computeRawObjectSize(object), HEAP_OBJECT_ALIGN);
 	RawObject *newObject;
 
-	object->tags &= ~TAG_MARKED;
-
-	if ((uint8_t *) object < scavenger->survivorEnd) {
+	if (object->age >= scavenger->tenuringAge) {
 		newObject = (RawObject *) tryAllocateOld(scavenger->heap, size, scavenger->hasPromotionFailure);
 		if (newObject == NULL) {
 			scavenger->hasPromotionFailure = 1;
@@ -282,11 +491,22 @@ static void forwardObject(Scavenger *scavenger, RawObject *object)
 		}
 	} else {
 		newObject = (RawObject *) scavengerTryAllocate(scavenger, size);
-		ASSERT(scavenger->fromSpace <= (uint8_t *) newObject && (uint8_t *) newObject <= (scavenger->fromSpace + scavenger->size));
+		if (newObject == NULL) {
+			// survivors overflow semi space, rest of them is promoted
+			newObject = (RawObject *) tryAllocateOld(scavenger->heap, size, 1);
+		}
+		ASSERT(isOldObject(newObject) || scavenger->fromSpace <= (uint8_t *) newObject && (uint8_t *) newObject <= (scavenger->fromSpace + scavenger->size));
 	}
 
 	ASSERT(newObject != NULL);
 	memcpy(newObject, object, size);
+	if (isNewObject(newObject)) {
+		newObject->age++;
+		scavenger->ageSizes[newObject->age] += size;
+		LastGCStats.survived += size;
+	} else {
+		LastGCStats.promoted += size;
+	}
 	object->tags |= TAG_FORWARDED;
 	object->class = (RawClass *) newObject;
 }
@@ -294,8 +514,11 @@ static void forwardObject(Scavenger *scavenger, RawObject *object)
 
 static void iterateObject(Scavenger *scavenger, RawObject *root)
 {
+	_Bool isOld = isOldObject(root);
 	RawObject *object = processPointer(scavenger, (RawObject **) &root->class);
-	_Bool remember = isNewObject(object);
+	if (isOld && isNewObject(object)) {
+		markCard(root, &root->class);
+	}
 
 	Value *vars = getRawObjectVars(root);
 	size_t size = root->class->instanceShape.varsSize;
@@ -306,11 +529,34 @@ static void iterateObject(Scavenger *scavenger, RawObject *root)
 	for (size_t i = 0; i < size; i++) {
 		if (valueTypeOf(vars[i], VALUE_POINTER)) {
 			RawObject *object = processTaggedPointer(scavenger, &vars[i]);
-			remember = remember || isNewObject(object);
+			if (isOld && isNewObject(object)) {
+				markCard(root, &vars[i]);
+			}
 		}
 	}
+}
 
-	if (remember && isOldObject(root) && (root->tags & TAG_REMEMBERED) == 0) {
-		rememberedSetAdd(&scavenger->heap->rememberedSet, root);
+
+// scans only the slots of root within start and end, answers whether any still points to new space
+static _Bool iterateObjectRange(Scavenger *scavenger, RawObject *root, uint8_t *start, uint8_t *end)
+{
+	_Bool remember = 0;
+	if (start <= (uint8_t *) root) {
+		remember = isNewObject(processPointer(scavenger, (RawObject **) &root->class));
+	}
+
+	Value *vars = getRawObjectVars(root);
+	size_t size = root->class->instanceShape.varsSize;
+	if (root->class->instanceShape.isIndexed && !root->class->instanceShape.isBytes) {
+		size += rawObjectSize(root);
+	}
+
+	Value *var = (uint8_t *) vars < start ? (Value *) start : vars;
+	Value *varsEnd = (uint8_t *) (vars + size) > end ? (Value *) end : vars + size;
+	for (; var < varsEnd; var++) {
+		if (valueTypeOf(*var, VALUE_POINTER)) {
+			remember |= isNewObject(processTaggedPointer(scavenger, var));
+		}
 	}
+	return remember;
 }
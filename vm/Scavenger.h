@@ -3,6 +3,8 @@
 
 #include "HeapPage.h"
 
+#define MAX_TENURING_AGE 15
+
 struct Heap;
 
 typedef struct {
@@ -14,10 +16,16 @@ typedef struct {
 	uint8_t *toSpace;
 	uint8_t *top;
 	uint8_t *end;
+	// objects above it were allocated since last scavenge
 	uint8_t *survivorEnd;
+	// survivors which reach tenuring age are promoted, it is adjusted after each scavenge up to max tenuring age
+	size_t tenuringAge;
+	size_t maxTenuringAge;
+	// bytes of survivors kept in new space by their age
+	size_t ageSizes[MAX_TENURING_AGE + 1];
 } Scavenger;
 
-void initScavenger(Scavenger *scavenger, struct Heap *heap, size_t size);
+void initScavenger(Scavenger *scavenger, struct Heap *heap, size_t size, size_t tenuringAge);
 void freeScavenger(Scavenger *scavenger);
 uint8_t *scavengerTryAllocate(Scavenger *scavenger, size_t size);
 void scavengerScavenge(Scavenger *scavenger);
@@ -18,22 +18,49 @@
 	}
 
 static void analyzeInstanceVars(BlockScope *blockScope, Array *instVars);
-static void analyzeBlock(BlockScope *blockScope, BlockNode *node);
+static void analyzeBlock(BlockScope *blockScope, BlockNode *node, _Bool isValueUsed);
 static void analyzeDefinitions(BlockScope *blockScope, BlockNode *node);
+static void analyzeInlinedDefinitions(BlockScope *blockScope, BlockNode *node);
 static _Bool isDuplicateVariable(Dictionary *vars, String *name);
-static void analyzeExpression(BlockScope *blockScope, ExpressionNode *node);
+static void analyzeExpression(BlockScope *blockScope, ExpressionNode *node, _Bool isValueUsed);
 static void analyzeAssigments(BlockScope *blockScope, ExpressionNode *node);
 static void analyzeAssigment(BlockScope *blockScope, LiteralNode *literal);
 static CompileError *createReadonlyVariableError(LiteralNode *node);
 static void analyzeMessageExpression(BlockScope *blockScope, MessageExpressionNode *node);
+static void analyzeInlinedMessage(BlockScope *blockScope, ExpressionNode *node, MessageExpressionNode *message, _Bool isValueUsed);
+static void analyzeInlinedBlocks(BlockScope *blockScope, Object *receiver, MessageExpressionNode *message, _Bool isValueUsed);
+static void analyzeBoundVars(BlockScope *blockScope, MessageExpressionNode *message);
+static void bindVar(BlockScope *blockScope, String *name);
+static _Bool isInlinableMessage(ExpressionNode *expression, MessageExpressionNode *message);
+static _Bool isInlinedArgument(MessageExpressionNode *message, size_t index);
+static _Bool isLoopMessage(MessageExpressionNode *message);
+static _Bool isWhileMessage(MessageExpressionNode *message);
+static _Bool isLiteralBlock(Object *node, size_t argsSize);
 static void analyzeLiteral(BlockScope *blockScope, Object *literal);
+static void analyzeBlockLiteral(BlockScope *blockScope, BlockNode *node, _Bool isInlined, _Bool isValueUsed);
 static void analyzeVar(BlockScope *blockScope, LiteralNode *name);
 static _Bool analyzeContextVar(BlockScope *blockScope, String *name);
+static BlockScope *findHomeScope(BlockScope *blockScope);
+static void captureInlinedVar(BlockScope *blockScope);
 static void setupBlockMetasAsContexts(BlockScope *blockScope, BlockScope *upTo);
 static _Bool analyzeGlobalVar(BlockScope *blockScope, String *name);
 static _Bool analyzeDictionaryVar(BlockScope *blockScope, Dictionary *dict, String *name);
+static void defineFallbackVars(Dictionary *vars, Dictionary *outerVars, uint8_t level);
+static BlockScope *findRootScope(BlockScope *blockScope);
 static BlockScope *createBlockScope(BlockScope *parent);
 
+// loops being analyzed as inlined, the innermost one defining a captured variable is not inlined
+typedef struct InlinedLoop {
+	struct InlinedLoop *parent;
+	BlockScope *blockScope;
+	_Bool hasCaptures;
+} InlinedLoop;
+
+static InlinedLoop *CurrentInlinedLoop = NULL;
+
+// nodes and their previous scopes while fallback blocks are analyzed, which inline nothing
+static OrderedCollection *ReplacedBlockScopes = NULL;
+
 
 BlockScope *analyzeMethod(MethodNode *node, Class *class)
 {
@@ -54,11 +81,58 @@ BlockScope *analyzeMethod(MethodNode *node, Class *class)
 	if (!isNil(instVars)) {
 		analyzeInstanceVars(blockScope, instVars);
 	}
-	analyzeBlock(blockScope, methodNodeGetBody(node));
+	analyzeBlock(blockScope, methodNodeGetBody(node), 0);
 	return closeHandleScope(&scope, blockScope);
 }
 
 
+// blocks of inlined conditional are analyzed again as real blocks to be sent with its selector to other objects
+// than booleans, their root scope is context of the send holding variables of the sending code they use: boxes
+// of its bound temporaries and values of readonly ones, its context variables are reached through outer context
+BlockScope *analyzeFallbackBlocks(BlockScope *blockScope, OrderedCollection *blocks, OrderedCollection *replacedScopes)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	BlockScope *fallbackScope = createBlockScope((BlockScope *) Handles.nil);
+	Dictionary *vars = blockScopeGetVars(fallbackScope);
+	Iterator iterator;
+
+	blockScopeSetOwnerClass(fallbackScope, blockScopeGetOwnerClass(blockScope));
+	blockScopeSetLiterals(fallbackScope, blockScopeGetLiterals(blockScope));
+	uint8_t level = 0;
+	for (BlockScope *outer = blockScope; !isNil(outer); outer = blockScopeGetParent(outer)) {
+		defineFallbackVars(vars, blockScopeGetVars(outer), level);
+		if (!blockScopeIsInlined(outer)) {
+			level++;
+		}
+	}
+
+	ReplacedBlockScopes = replacedScopes;
+	initOrdCollIterator(&iterator, blocks, 0, 0);
+	while (iteratorHasNext(&iterator) && !blockScopeHasError(fallbackScope)) {
+		analyzeBlockLiteral(fallbackScope, (BlockNode *) iteratorNextObject(&iterator), 0, 1);
+	}
+	ReplacedBlockScopes = NULL;
+
+	return closeHandleScope(&scope, fallbackScope);
+}
+
+
+void restoreBlockScopes(OrderedCollection *replacedScopes)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	for (size_t i = 0; i < ordCollSize(replacedScopes); i += 2) {
+		BlockNode *node = (BlockNode *) ordCollObjectAt(replacedScopes, i);
+		blockNodeSetScope(node, (BlockScope *) ordCollObjectAt(replacedScopes, i + 1));
+	}
+
+	closeHandleScope(&scope, NULL);
+}
+
+
 static void analyzeInstanceVars(BlockScope *blockScope, Array *instVars)
 {
 	HandleScope scope;
@@ -77,10 +151,19 @@ static void analyzeInstanceVars(BlockScope *blockScope, Array *instVars)
 }
 
 
-static void analyzeBlock(BlockScope *blockScope, BlockNode *node)
+// value of block is value of its last expression, whose value is used when value of block is
+static void analyzeBlock(BlockScope *blockScope, BlockNode *node, _Bool isValueUsed)
 {
+	if (ReplacedBlockScopes != NULL) {
+		ordCollAddObject(ReplacedBlockScopes, (Object *) node);
+		ordCollAddObject(ReplacedBlockScopes, (Object *) blockNodeGetScope(node));
+	}
 	blockNodeSetScope(node, blockScope);
-	analyzeDefinitions(blockScope, node);
+	if (blockScopeIsInlined(blockScope)) {
+		analyzeInlinedDefinitions(blockScope, node);
+	} else {
+		analyzeDefinitions(blockScope, node);
+	}
 	if (blockScopeHasError(blockScope)) {
 		return;
 	}
@@ -91,7 +174,10 @@ static void analyzeBlock(BlockScope *blockScope, BlockNode *node)
 	while (iteratorHasNext(&iterator)) {
 		HandleScope scope;
 		openHandleScope(&scope);
-		analyzeExpression(blockScope, (ExpressionNode *) iteratorNextObject(&iterator));
+		ExpressionNode *expression = (ExpressionNode *) iteratorNextObject(&iterator);
+		_Bool isUsed = expressionNodeReturns(expression) || ordCollSize(expressionNodeGetAssigments(expression)) > 0
+			|| (isValueUsed && !iteratorHasNext(&iterator));
+		analyzeExpression(blockScope, expression, isUsed);
 		RETURN_IF_ERROR();
 		closeHandleScope(&scope, NULL);
 	}
@@ -137,6 +223,42 @@ static void analyzeDefinitions(BlockScope *blockScope, BlockNode *node)
 }
 
 
+// inlined blocks have no self and thisContext, their arguments are readonly temporaries of enclosing block
+static void analyzeInlinedDefinitions(BlockScope *blockScope, BlockNode *node)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	Dictionary *vars = blockScopeGetVars(blockScope);
+	Iterator iterator;
+	Value var;
+
+	initOrdCollIterator(&iterator, blockNodeGetArgs(node), 0, 0);
+	while (iteratorHasNext(&iterator)) {
+		LiteralNode *arg = (LiteralNode *) iteratorNextObject(&iterator);
+		String *name = literalNodeGetStringValue(arg);
+		if (isDuplicateVariable(vars, name)) {
+			blockScopeSetError(blockScope, createRedefinitionError(arg));
+		}
+		var = defineVariable(OPERAND_TEMP_VAR, 0, 0);
+		setVarReadonly(&var);
+		stringDictAtPut(vars, name, var);
+	}
+
+	initOrdCollIterator(&iterator, blockNodeGetTempVars(node), 0, 0);
+	while (iteratorHasNext(&iterator)) {
+		LiteralNode *arg = (LiteralNode *) iteratorNextObject(&iterator);
+		String *name = literalNodeGetStringValue(arg);
+		if (isDuplicateVariable(vars, name)) {
+			blockScopeSetError(blockScope, createRedefinitionError(arg));
+		}
+		stringDictAtPut(vars, name, defineVariable(OPERAND_TEMP_VAR, 0, 0));
+	}
+
+	closeHandleScope(&scope, NULL);
+}
+
+
 static _Bool isDuplicateVariable(Dictionary *vars, String *name)
 {
 	Value var = stringDictAt(vars, name);
@@ -156,16 +278,31 @@ static _Bool isDuplicateVariable(Dictionary *vars, String *name)
 }
 
 
-static void analyzeExpression(BlockScope *blockScope, ExpressionNode *node)
+static void analyzeExpression(BlockScope *blockScope, ExpressionNode *node, _Bool isValueUsed)
 {
+	OrderedCollection *messages = expressionNodeGetMessageExpressions(node);
+
 	analyzeAssigments(blockScope, node);
+	// fallback blocks return from home method of the sending code, see compileFallbackSend
+	if (ReplacedBlockScopes != NULL && expressionNodeReturns(node)) {
+		findRootScope(blockScope)->raw->header.outerReturns = 1;
+	}
+	if (ordCollSize(messages) == 1) {
+		MessageExpressionNode *message = (MessageExpressionNode *) ordCollObjectAt(messages, 0);
+		// loops answer their receiver block, which exists only when they are sent
+		if (ReplacedBlockScopes == NULL && isInlinableMessage(node, message) && !(isValueUsed && isWhileMessage(message))) {
+			analyzeInlinedMessage(blockScope, node, message, isValueUsed);
+			return;
+		}
+	}
+
 	analyzeLiteral(blockScope, (Object *) expressionNodeGetReceiver(node));
 	if (blockScopeHasError(blockScope)) {
 		return;
 	}
 
 	Iterator iterator;
-	initOrdCollIterator(&iterator, expressionNodeGetMessageExpressions(node), 0, 0);
+	initOrdCollIterator(&iterator, messages, 0, 0);
 	while (iteratorHasNext(&iterator)) {
 		HandleScope scope;
 		openHandleScope(&scope);
@@ -200,8 +337,8 @@ static void analyzeAssigment(BlockScope *blockScope, LiteralNode *literal)
 		blockScopeSetError(blockScope, createReadonlyVariableError(literal));
 	} else {
 		analyzeVar(blockScope, literal);
-		var = stringDictAt(blockScopeGetVars(blockScope), literalNodeGetStringValue(literal));
-		if (!isTaggedNil(var) && (getVarType(var) == OPERAND_ARG_VAR || getVarType(var) == OPERAND_SUPER || hasVarCtxCopy(var))) {
+		var = lookupVariable(blockScope, literalNodeGetStringValue(literal));
+		if (!isTaggedNil(var) && (getVarType(var) == OPERAND_ARG_VAR || getVarType(var) == OPERAND_SUPER || hasVarCtxCopy(var) || isVarReadonly(var))) {
 			blockScopeSetError(blockScope, createReadonlyVariableError(literal));
 		}
 	}
@@ -232,35 +369,236 @@ static void analyzeMessageExpression(BlockScope *blockScope, MessageExpressionNo
 }
 
 
+// control structures with literal blocks are compiled into jumps, blocks share frame of enclosing block
+static void analyzeInlinedMessage(BlockScope *blockScope, ExpressionNode *node, MessageExpressionNode *message, _Bool isValueUsed)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	Object *receiver = (Object *) expressionNodeGetReceiver(node);
+	InlinedLoop loop = { .parent = CurrentInlinedLoop, .blockScope = blockScope, .hasCaptures = 0 };
+
+	if (isLoopMessage(message)) {
+		CurrentInlinedLoop = &loop;
+		analyzeInlinedBlocks(blockScope, receiver, message, isValueUsed);
+		CurrentInlinedLoop = loop.parent;
+		RETURN_IF_ERROR();
+	} else {
+		analyzeInlinedBlocks(blockScope, receiver, message, isValueUsed);
+		RETURN_IF_ERROR();
+		analyzeBoundVars(blockScope, message);
+		RETURN_IF_ERROR();
+	}
+
+	// captured temporaries must be fresh in every iteration, such loops are sent as messages
+	if (loop.hasCaptures) {
+		analyzeLiteral(blockScope, receiver);
+		RETURN_IF_ERROR();
+		analyzeMessageExpression(blockScope, message);
+	}
+
+	closeHandleScope(&scope, NULL);
+}
+
+
+// branches of conditional are its value, values of loop bodies are not used
+static void analyzeInlinedBlocks(BlockScope *blockScope, Object *receiver, MessageExpressionNode *message, _Bool isValueUsed)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	_Bool isLoop = isLoopMessage(message);
+	if (isLoop && receiver->raw->class == Handles.BlockNode->raw) {
+		analyzeBlockLiteral(blockScope, (BlockNode *) receiver, 1, 1);
+	} else {
+		analyzeLiteral(blockScope, receiver);
+	}
+	RETURN_IF_ERROR();
+
+	Iterator iterator;
+	initOrdCollIterator(&iterator, messageExpressionNodeGetArgs(message), 0, 0);
+	while (iteratorHasNext(&iterator)) {
+		_Bool isInlined = isInlinedArgument(message, iteratorIndex(&iterator));
+		Object *arg = iteratorNextObject(&iterator);
+		if (isInlined) {
+			analyzeBlockLiteral(blockScope, (BlockNode *) arg, 1, !isLoop && isValueUsed);
+		} else {
+			analyzeLiteral(blockScope, arg);
+		}
+		RETURN_IF_ERROR();
+	}
+
+	closeHandleScope(&scope, NULL);
+}
+
+
+// temporaries captured by fallback blocks of conditional are bound to boxes shared with them, see compileFallbackSend
+static void analyzeBoundVars(BlockScope *blockScope, MessageExpressionNode *message)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	OrderedCollection *replacedScopes = newOrdColl(8);
+	BlockScope *fallbackScope = analyzeFallbackBlocks(blockScope, messageExpressionNodeGetArgs(message), replacedScopes);
+	Iterator iterator;
+
+	restoreBlockScopes(replacedScopes);
+	// such blocks are never sent, see compileFallbackSend
+	if (blockScopeHasError(fallbackScope)) {
+		closeHandleScope(&scope, NULL);
+		return;
+	}
+	initDictIterator(&iterator, blockScopeGetVars(fallbackScope));
+	while (iteratorHasNext(&iterator)) {
+		Association *assoc = (Association *) iteratorNextObject(&iterator);
+		if (isNil(assoc)) {
+			continue;
+		}
+		Value var = assoc->raw->value;
+		if (getVarType(var) == OPERAND_CONTEXT_VAR && getVarLevel(var) == 0) {
+			bindVar(blockScope, scopeHandle(asObject(assoc->raw->key)));
+		}
+	}
+
+	closeHandleScope(&scope, NULL);
+}
+
+
+static void bindVar(BlockScope *blockScope, String *name)
+{
+	Dictionary *vars = blockScopeGetVars(blockScope);
+	Value var = stringDictAt(vars, name);
+
+	while (isTaggedNil(var) && blockScopeIsInlined(blockScope)) {
+		blockScope = blockScopeGetParent(blockScope);
+		vars = blockScopeGetVars(blockScope);
+		var = stringDictAt(vars, name);
+	}
+	if (!isTaggedNil(var) && getVarType(var) == OPERAND_TEMP_VAR && !isVarReadonly(var)) {
+		setVarBoxed(&var, 1);
+		stringDictAtPut(vars, name, var);
+	}
+}
+
+
+_Bool isInlinedMessage(ExpressionNode *expression, MessageExpressionNode *message)
+{
+	if (!isInlinableMessage(expression, message)) {
+		return 0;
+	}
+	OrderedCollection *args = messageExpressionNodeGetArgs(message);
+	BlockNode *block = (BlockNode *) (ordCollSize(args) == 0
+		? (Object *) expressionNodeGetReceiver(expression)
+		: ordCollObjectAt(args, ordCollSize(args) - 1));
+	return blockScopeIsInlined(blockNodeGetScope(block));
+}
+
+
+static _Bool isInlinableMessage(ExpressionNode *expression, MessageExpressionNode *message)
+{
+	Object *receiver = (Object *) expressionNodeGetReceiver(expression);
+	OrderedCollection *args = messageExpressionNodeGetArgs(message);
+	String *selector = messageExpressionNodeGetSelector(message);
+
+	if (ordCollSize(expressionNodeGetMessageExpressions(expression)) != 1) {
+		return 0;
+	}
+	if (receiver->raw->class == Handles.VariableNode->raw && stringEqualsC(literalNodeGetStringValue((LiteralNode *) receiver), "super")) {
+		return 0;
+	}
+
+	if (stringEqualsC(selector, "ifTrue:") || stringEqualsC(selector, "ifFalse:")
+			|| stringEqualsC(selector, "and:") || stringEqualsC(selector, "or:")) {
+		return isLiteralBlock(ordCollObjectAt(args, 0), 0);
+
+	} else if (stringEqualsC(selector, "ifTrue:ifFalse:") || stringEqualsC(selector, "ifFalse:ifTrue:")) {
+		return isLiteralBlock(ordCollObjectAt(args, 0), 0) && isLiteralBlock(ordCollObjectAt(args, 1), 0);
+
+	} else if (stringEqualsC(selector, "whileTrue:") || stringEqualsC(selector, "whileFalse:")) {
+		return isLiteralBlock(receiver, 0) && isLiteralBlock(ordCollObjectAt(args, 0), 0);
+
+	} else if (stringEqualsC(selector, "whileTrue") || stringEqualsC(selector, "whileFalse")) {
+		return isLiteralBlock(receiver, 0);
+
+	} else if (stringEqualsC(selector, "to:do:")) {
+		return isLiteralBlock(ordCollObjectAt(args, 1), 1);
+	}
+	return 0;
+}
+
+
+static _Bool isInlinedArgument(MessageExpressionNode *message, size_t index)
+{
+	return !stringEqualsC(messageExpressionNodeGetSelector(message), "to:do:") || index == 1;
+}
+
+
+static _Bool isLoopMessage(MessageExpressionNode *message)
+{
+	String *selector = messageExpressionNodeGetSelector(message);
+	return stringEqualsC(selector, "whileTrue:") || stringEqualsC(selector, "whileFalse:")
+		|| stringEqualsC(selector, "whileTrue") || stringEqualsC(selector, "whileFalse")
+		|| stringEqualsC(selector, "to:do:");
+}
+
+
+static _Bool isWhileMessage(MessageExpressionNode *message)
+{
+	String *selector = messageExpressionNodeGetSelector(message);
+	return stringEqualsC(selector, "whileTrue:") || stringEqualsC(selector, "whileFalse:")
+		|| stringEqualsC(selector, "whileTrue") || stringEqualsC(selector, "whileFalse");
+}
+
+
+static _Bool isLiteralBlock(Object *node, size_t argsSize)
+{
+	return node->raw->class == Handles.BlockNode->raw && ordCollSize(blockNodeGetArgs((BlockNode *) node)) == argsSize;
+}
+
+
 static void analyzeLiteral(BlockScope *blockScope, Object *literal)
 {
 	if (literal->raw->class == Handles.VariableNode->raw) {
 		analyzeVar(blockScope, (LiteralNode *) literal);
 
 	} else if (literal->raw->class == Handles.ExpressionNode->raw) {
-		analyzeExpression(blockScope, (ExpressionNode *) literal);
+		analyzeExpression(blockScope, (ExpressionNode *) literal, 1);
 
 	} else if (literal->raw->class == Handles.BlockNode->raw) {
-		BlockScope *blockMeta = createBlockScope(blockScope);
-		blockScopeSetOwnerClass(blockMeta, blockScopeGetOwnerClass(blockScope));
-		blockScopeSetLiterals(blockMeta, blockScopeGetLiterals(blockScope));
-		analyzeBlock(blockMeta, (BlockNode *) literal);
-		blockScopeSetError(blockScope, blockScopeGetError(blockMeta));
+		analyzeBlockLiteral(blockScope, (BlockNode *) literal, 0, 1);
 	}
 }
 
 
+static void analyzeBlockLiteral(BlockScope *blockScope, BlockNode *node, _Bool isInlined, _Bool isValueUsed)
+{
+	BlockScope *blockMeta = createBlockScope(blockScope);
+	blockScopeSetOwnerClass(blockMeta, blockScopeGetOwnerClass(blockScope));
+	blockScopeSetLiterals(blockMeta, blockScopeGetLiterals(blockScope));
+	blockScopeSetInlined(blockMeta, isInlined);
+	analyzeBlock(blockMeta, node, isValueUsed);
+	blockScopeSetError(blockScope, blockScopeGetError(blockMeta));
+}
+
+
 static void analyzeVar(BlockScope *blockScope, LiteralNode *literal)
 {
 	String *name = literalNodeGetStringValue(literal);
 	Value var = stringDictAt(blockScopeGetVars(blockScope), name);
 
 	if (!isTaggedNil(var)) {
-		if (getVarIndex(var) == CONTEXT_INDEX) {
+		if (getVarType(var) == OPERAND_THIS_CONTEXT) {
 			blockScope->raw->header.hasContext = 1;
 		}
 		return;
 	}
+	// inlined block resolves other variables in its enclosing block
+	if (blockScopeIsInlined(blockScope)) {
+		BlockScope *parent = blockScopeGetParent(blockScope);
+		analyzeVar(parent, literal);
+		blockScopeSetError(blockScope, blockScopeGetError(parent));
+		return;
+	}
 	if (analyzeContextVar(blockScope, name)) {
 		return;
 	}
@@ -284,12 +622,18 @@ static void analyzeVar(BlockScope *blockScope, LiteralNode *literal)
 
 static _Bool analyzeContextVar(BlockScope *blockScope, String *name)
 {
-	uint8_t level = 1;
+	uint8_t level = 0;
 	BlockScope *ctx = blockScope;
 	Value var;
 
-	while (!isNil(ctx = blockScopeGetParent(ctx))) {
+	while (!isNil(blockScopeGetParent(ctx))) {
+		// inlined blocks live in context of their enclosing block
+		if (!blockScopeIsInlined(ctx)) {
+			level++;
+		}
+		ctx = blockScopeGetParent(ctx);
 		Dictionary *vars = blockScopeGetVars(ctx);
+		BlockScope *home = findHomeScope(ctx);
 		var = stringDictAt(vars, name);
 		if (!isTaggedNil(var)) {
 			if (getVarType(var) == OPERAND_ARG_VAR) {
@@ -301,21 +645,56 @@ static _Bool analyzeContextVar(BlockScope *blockScope, String *name)
 				setVarIndex(&var, getVarCtxCopy(var));
 			} else if (getVarType(var) == OPERAND_TEMP_VAR) {
 				setVarType(&var, OPERAND_CONTEXT_VAR);
-				setVarIndex(&var, ctx->raw->header.contextSize++);
+				setVarIndex(&var, home->raw->header.contextSize++);
+				// context variables are shared with fallback blocks through outer context, see compileFallbackSend
+				if (ReplacedBlockScopes == NULL) {
+					setVarBoxed(&var, 0);
+				}
+				stringDictAtPut(vars, name, var);
+				if (blockScopeIsInlined(ctx)) {
+					captureInlinedVar(ctx);
+				}
+			} else if (getVarType(var) == OPERAND_CONTEXT_VAR && getVarLevel(var) > 0 && isNil(blockScopeGetParent(ctx))) {
+				// only root scope of fallback blocks defines variables of outer contexts
+				setVarUsed(&var);
 				stringDictAtPut(vars, name, var);
 			}
 			setVarLevel(&var, level + getVarLevel(var));
 			stringDictAtPut(blockScopeGetVars(blockScope), name, var);
-			setupBlockMetasAsContexts(blockScope, ctx);
+			setupBlockMetasAsContexts(blockScope, home);
 			return 1;
 		}
-		level++;
 	}
 
 	return 0;
 }
 
 
+static void captureInlinedVar(BlockScope *blockScope)
+{
+	for (InlinedLoop *loop = CurrentInlinedLoop; loop != NULL; loop = loop->parent) {
+		// variables of scopes enclosing the loop are not its own
+		BlockScope *enclosing = loop->blockScope;
+		while (!isNil(enclosing) && enclosing->raw != blockScope->raw) {
+			enclosing = blockScopeGetParent(enclosing);
+		}
+		if (isNil(enclosing)) {
+			loop->hasCaptures = 1;
+			return;
+		}
+	}
+}
+
+
+static BlockScope *findHomeScope(BlockScope *blockScope)
+{
+	while (blockScopeIsInlined(blockScope)) {
+		blockScope = blockScopeGetParent(blockScope);
+	}
+	return blockScope;
+}
+
+
 static void setupBlockMetasAsContexts(BlockScope *blockScope, BlockScope *upTo)
 {
 	do {
@@ -358,11 +737,85 @@ static _Bool analyzeDictionaryVar(BlockScope *blockScope, Dictionary *dict, Stri
 }
 
 
+Value lookupVariable(BlockScope *blockScope, String *name)
+{
+	Value var = stringDictAt(blockScopeGetVars(blockScope), name);
+	while (isTaggedNil(var) && blockScopeIsInlined(blockScope)) {
+		blockScope = blockScopeGetParent(blockScope);
+		var = stringDictAt(blockScopeGetVars(blockScope), name);
+	}
+	return var;
+}
+
+
+// variables of inner blocks shadow those of outer ones, globals are looked up again, level is number of contexts
+// between the sending code and the outer block whose frame variables are reachable only when they are in its context
+static void defineFallbackVars(Dictionary *vars, Dictionary *outerVars, uint8_t level)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	Iterator iterator;
+	initDictIterator(&iterator, outerVars);
+	while (iteratorHasNext(&iterator)) {
+		Association *assoc = (Association *) iteratorNextObject(&iterator);
+		if (isNil(assoc)) {
+			continue;
+		}
+		String *name = scopeHandle(asObject(assoc->raw->key));
+		Value var = assoc->raw->value;
+		if (!isTaggedNil(stringDictAt(vars, name)) || stringEqualsC(name, "self")) {
+			continue;
+		}
+		Value fallbackVar = defineVariable(OPERAND_TEMP_VAR, 0, 0);
+		switch (getVarType(var)) {
+		case OPERAND_TEMP_VAR:
+			if (level > 0) {
+				break;
+			}
+			setVarBoxed(&fallbackVar, !isVarReadonly(var));
+			stringDictAtPut(vars, name, fallbackVar);
+			break;
+		case OPERAND_ARG_VAR:
+			if (level == 0) {
+				stringDictAtPut(vars, name, fallbackVar);
+			} else if (hasVarCtxCopy(var)) {
+				stringDictAtPut(vars, name, defineVariable(OPERAND_CONTEXT_VAR, getVarCtxCopy(var), level + 1));
+			}
+			break;
+		case OPERAND_CONTEXT_VAR:
+			// boxed variable of enclosing fallback block stays boxed
+			fallbackVar = defineVariable(OPERAND_CONTEXT_VAR, getVarIndex(var), getVarLevel(var) + level + 1);
+			setVarBoxed(&fallbackVar, isVarBoxed(var));
+			stringDictAtPut(vars, name, fallbackVar);
+			break;
+		case OPERAND_INST_VAR:
+			stringDictAtPut(vars, name, var);
+			break;
+		default:
+			break;
+		}
+	}
+
+	closeHandleScope(&scope, NULL);
+}
+
+
+static BlockScope *findRootScope(BlockScope *blockScope)
+{
+	while (!isNil(blockScopeGetParent(blockScope))) {
+		blockScope = blockScopeGetParent(blockScope);
+	}
+	return blockScope;
+}
+
+
 static BlockScope *createBlockScope(BlockScope *parent)
 {
 	BlockScope *blockScope = (BlockScope *) newObject(Handles.BlockScope, 0);
 	memset(&blockScope->raw->header, 0, sizeof(blockScope->raw->header));
 	blockScopeSetParent(blockScope, parent);
 	blockScopeSetVars(blockScope, newDictionary(32));
+	blockScopeSetInlined(blockScope, 0);
 	return blockScope;
 }
@@ -5,6 +5,7 @@
 #include "Parser.h"
 #include "CompiledCode.h"
 #include "Compiler.h"
+#include "Smalltalk.h"
 
 typedef struct RawBlockScope {
 	OBJECT_HEADER;
@@ -14,10 +15,16 @@ typedef struct RawBlockScope {
 	Value ownerClass;
 	Value literals;
 	Value error;
+	Value isInlined;
 } RawBlockScope;
 OBJECT_HANDLE(BlockScope);
 
+
 BlockScope *analyzeMethod(MethodNode *node, Class *class);
+BlockScope *analyzeFallbackBlocks(BlockScope *blockScope, OrderedCollection *blocks, OrderedCollection *replacedScopes);
+void restoreBlockScopes(OrderedCollection *replacedScopes);
+Value lookupVariable(BlockScope *blockScope, String *name);
+_Bool isInlinedMessage(ExpressionNode *expression, MessageExpressionNode *message);
 
 
 static void blockScopeSetHeader(BlockScope *blockScope, CompiledCodeHeader header)
@@ -97,4 +104,16 @@ static _Bool blockScopeHasError(BlockScope *blockScope)
 	return !isTaggedNil(blockScope->raw->error);
 }
 
+
+static void blockScopeSetInlined(BlockScope *blockScope, _Bool isInlined)
+{
+	objectStorePtr((Object *) blockScope,  &blockScope->raw->isInlined, asBool(isInlined));
+}
+
+
+static _Bool blockScopeIsInlined(BlockScope *blockScope)
+{
+	return isTaggedTrue(blockScope->raw->isInlined);
+}
+
 #endif
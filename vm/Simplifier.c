@@ -0,0 +1,884 @@
+#include "Simplifier.h"
+#include "String.h"
+#include "Class.h"
+#include "Bytecodes.h"
+#include "CodeDescriptors.h"
+#include "Handle.h"
+#include "Assert.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SIMPLIFICATION_ROUNDS 4
+#define MAX_CLASS_FACTS 16
+
+typedef struct {
+	Bytecode bytecode;
+	uint8_t literal; // selector of send or class of class check
+	uint8_t argsSize;
+	uint8_t varsSize; // variables stored into context of fallback send
+	uint8_t flags; // flags of fallback send
+	_Bool isRemoved;
+	// receiver, arguments and result of send, source and destination of copy, tested operand of jump, variables of
+	// deoptimization state
+	Operand *operands;
+	size_t operandsSize;
+	ptrdiff_t target;
+} Instruction;
+
+// temporaries read before they are written, set has a bit for each temporary
+typedef struct {
+	uint64_t set[4];
+} LiveVars;
+
+// variable which passed class check
+typedef struct {
+	Operand var;
+	Value class;
+} ClassFact;
+
+// values of temporaries and classes of variables known in straight-line code
+typedef struct {
+	Operand copies[256];
+	ClassFact facts[MAX_CLASS_FACTS];
+	size_t factsSize;
+} KnownValues;
+
+typedef struct {
+	OrderedCollection *literals;
+	Instruction *insts;
+	size_t size;
+	Operand *operands;
+	_Bool *isTarget;
+	LiveVars *live;
+} Simplifier;
+
+static void decodeInstructions(Simplifier *simplifier, uint8_t *bytecodes, size_t size);
+static void encodeInstructions(Simplifier *simplifier, AssemblerBuffer *buffer, ptrdiff_t *numbers);
+static void remapDescriptors(OrderedCollection *descriptors, ptrdiff_t *numbers, size_t size);
+static _Bool propagateValues(Simplifier *simplifier);
+static _Bool substituteOperand(KnownValues *known, Operand *operand, _Bool allowConstant);
+static _Bool substituteInstance(KnownValues *known, Operand *operand);
+static _Bool propagateCopy(KnownValues *known, Instruction *inst);
+static _Bool foldSend(Simplifier *simplifier, KnownValues *known, Instruction *inst);
+static _Bool foldSmallIntegerOperation(String *selector, Value receiver, Value arg, Operand *result);
+static void removeDeoptimizationState(Simplifier *simplifier, ptrdiff_t index);
+static _Bool knownSmallInteger(KnownValues *known, Operand operand, Value *value);
+static _Bool resolveBooleanJump(Instruction *inst);
+static _Bool resolveClassCheck(Simplifier *simplifier, KnownValues *known, Instruction *inst);
+static Value knownClass(Simplifier *simplifier, KnownValues *known, Operand operand);
+static void forgetValues(KnownValues *known);
+static void forgetVar(KnownValues *known, uint8_t index);
+static _Bool removeUnreachableCode(Simplifier *simplifier);
+static _Bool removeDeadStores(Simplifier *simplifier);
+static void computeLiveVars(Simplifier *simplifier);
+static LiveVars liveVarsAfter(Simplifier *simplifier, ptrdiff_t index);
+static void addUsedVar(LiveVars *live, Operand operand);
+static _Bool isLiveVar(LiveVars *live, uint8_t index);
+static _Bool removeRedundantJumps(Simplifier *simplifier);
+static void markJumpTargets(Simplifier *simplifier);
+static ptrdiff_t nextInstruction(Simplifier *simplifier, ptrdiff_t index);
+static Operand *instructionResult(Instruction *inst);
+static _Bool isJump(Instruction *inst);
+static _Bool fallsThrough(Instruction *inst);
+static _Bool isLocalOperand(Operand operand);
+static _Bool isConstantOperand(Operand operand);
+
+
+// copies are propagated and sends of literal integers folded in straight-line code, dead stores and unreachable
+// code are removed from the whole code, source code descriptors are moved to renumbered instructions
+void simplifyBytecodes(AssemblerBuffer *buffer, OrderedCollection *literals, OrderedCollection *descriptors)
+{
+	HandleScope scope;
+	openHandleScope(&scope);
+
+	size_t size = asmOffset(buffer);
+	if (size == 0) {
+		closeHandleScope(&scope, NULL);
+		return;
+	}
+
+	// every instruction and operand takes at least one byte
+	Simplifier simplifier = {
+		.literals = literals,
+		.insts = malloc(size * sizeof(Instruction)),
+		.size = 0,
+		.operands = malloc(size * sizeof(Operand)),
+	};
+	decodeInstructions(&simplifier, buffer->buffer, size);
+	simplifier.isTarget = malloc((simplifier.size + 1) * sizeof(_Bool));
+	simplifier.live = malloc((simplifier.size + 1) * sizeof(LiveVars));
+
+	_Bool changed = 1;
+	for (size_t i = 0; changed && i < MAX_SIMPLIFICATION_ROUNDS; i++) {
+		changed = propagateValues(&simplifier);
+		changed |= removeUnreachableCode(&simplifier);
+		changed |= removeDeadStores(&simplifier);
+		changed |= removeRedundantJumps(&simplifier);
+	}
+
+	ptrdiff_t *numbers = malloc((simplifier.size + 1) * sizeof(ptrdiff_t));
+	encodeInstructions(&simplifier, buffer, numbers);
+	remapDescriptors(descriptors, numbers, simplifier.size);
+
+	free(numbers);
+	free(simplifier.insts);
+	free(simplifier.operands);
+	free(simplifier.isTarget);
+	free(simplifier.live);
+	closeHandleScope(&scope, NULL);
+}
+
+
+static void decodeInstructions(Simplifier *simplifier, uint8_t *bytecodes, size_t size)
+{
+	BytecodesIterator iterator;
+	ptrdiff_t *indexes = malloc((size + 1) * sizeof(ptrdiff_t));
+	Operand *operands = simplifier->operands;
+
+	bytecodeInitIterator(&iterator, bytecodes, size);
+	while (bytecodeHasNext(&iterator)) {
+		indexes[bytecodeOffset(&iterator)] = simplifier->size;
+		Instruction *inst = &simplifier->insts[simplifier->size++];
+		inst->bytecode = bytecodeNext(&iterator);
+		inst->isRemoved = 0;
+		inst->operands = operands;
+		inst->target = -1;
+
+		switch (inst->bytecode) {
+		case BYTECODE_COPY:
+			inst->operandsSize = 2;
+			break;
+		case BYTECODE_SEND:
+		case BYTECODE_SEND_WITH_STORE:
+			inst->literal = bytecodeNextByte(&iterator);
+			inst->argsSize = bytecodeNextByte(&iterator);
+			inst->operandsSize = inst->argsSize + 1 + (inst->bytecode == BYTECODE_SEND_WITH_STORE);
+			break;
+		case BYTECODE_FALLBACK_SEND:
+			inst->literal = bytecodeNextByte(&iterator);
+			inst->argsSize = bytecodeNextByte(&iterator);
+			inst->varsSize = bytecodeNextByte(&iterator);
+			inst->flags = bytecodeNextByte(&iterator);
+			inst->operandsSize = inst->argsSize + inst->varsSize + 3;
+			break;
+		case BYTECODE_RETURN:
+		case BYTECODE_OUTER_RETURN:
+		case BYTECODE_JUMP_IF_TRUE:
+		case BYTECODE_JUMP_IF_FALSE:
+			inst->operandsSize = 1;
+			break;
+		case BYTECODE_JUMP:
+			inst->operandsSize = 0;
+			break;
+		case BYTECODE_JUMP_NOT_MEMBER_OF:
+			inst->literal = bytecodeNextByte(&iterator);
+			inst->operandsSize = 1;
+			break;
+		case BYTECODE_DEOPTIMIZATION_STATE:
+			inst->operandsSize = bytecodeNextByte(&iterator);
+			break;
+		default:
+			FAIL();
+		}
+
+		for (size_t i = 0; i < inst->operandsSize; i++) {
+			*operands++ = bytecodeNextOperand(&iterator);
+		}
+		if (isJump(inst)) {
+			inst->target = bytecodeNextJumpTarget(&iterator);
+		}
+	}
+	indexes[size] = simplifier->size;
+
+	for (size_t i = 0; i < simplifier->size; i++) {
+		Instruction *inst = &simplifier->insts[i];
+		if (isJump(inst)) {
+			inst->target = indexes[inst->target];
+		}
+	}
+	free(indexes);
+}
+
+
+// jumps are bound after all instructions are emitted, removed instructions answer number of the next one
+static void encodeInstructions(Simplifier *simplifier, AssemblerBuffer *buffer, ptrdiff_t *numbers)
+{
+	AssemblerLabel *labels = malloc(simplifier->size * sizeof(AssemblerLabel));
+	ptrdiff_t *offsets = malloc((simplifier->size + 1) * sizeof(ptrdiff_t));
+
+	buffer->p = buffer->buffer;
+	buffer->instOffset = 0;
+	for (size_t i = 0; i < simplifier->size; i++) {
+		Instruction *inst = &simplifier->insts[i];
+		offsets[i] = asmOffset(buffer);
+		if (inst->isRemoved) {
+			numbers[i] = -1;
+			continue;
+		}
+		numbers[i] = buffer->instOffset;
+
+		asmEnsureCapacity(buffer);
+		asmEmitUint8(buffer, inst->bytecode);
+		if (inst->bytecode == BYTECODE_SEND || inst->bytecode == BYTECODE_SEND_WITH_STORE) {
+			asmEmitUint8(buffer, inst->literal);
+			asmEmitUint8(buffer, inst->argsSize);
+		} else if (inst->bytecode == BYTECODE_FALLBACK_SEND) {
+			asmEmitUint8(buffer, inst->literal);
+			asmEmitUint8(buffer, inst->argsSize);
+			asmEmitUint8(buffer, inst->varsSize);
+			asmEmitUint8(buffer, inst->flags);
+		} else if (inst->bytecode == BYTECODE_JUMP_NOT_MEMBER_OF) {
+			asmEmitUint8(buffer, inst->literal);
+		} else if (inst->bytecode == BYTECODE_DEOPTIMIZATION_STATE) {
+			asmEmitUint8(buffer, inst->operandsSize);
+		}
+		for (size_t j = 0; j < inst->operandsSize; j++) {
+			asmEnsureCapacity(buffer);
+			bytecodeOperand(buffer, &inst->operands[j]);
+		}
+		if (isJump(inst)) {
+			asmInitLabel(&labels[i]);
+			asmEmitLabel32(buffer, &labels[i]);
+		}
+		buffer->instOffset++;
+	}
+	offsets[simplifier->size] = asmOffset(buffer);
+	numbers[simplifier->size] = buffer->instOffset;
+
+	for (size_t i = 0; i < simplifier->size; i++) {
+		Instruction *inst = &simplifier->insts[i];
+		if (!inst->isRemoved && isJump(inst)) {
+			asmLabelBind(buffer, &labels[i], offsets[nextInstruction(simplifier, inst->target)]);
+		}
+	}
+
+	free(labels);
+	free(offsets);
+}
+
+
+static void remapDescriptors(OrderedCollection *descriptors, ptrdiff_t *numbers, size_t size)
+{
+	size_t descriptorsSize = ordCollSize(descriptors);
+	size_t kept = 0;
+
+	for (size_t i = 0; i < descriptorsSize; i++) {
+		Value descriptor = ordCollAt(descriptors, i);
+		uint16_t pos = descriptorGetPos(descriptor);
+		if (pos <= size && numbers[pos] != -1) {
+			Value moved = createSouceCodeDescriptor(numbers[pos], descriptorGetLine(descriptor), descriptorGetColumn(descriptor));
+			ordCollAtPut(descriptors, kept++, moved);
+		}
+	}
+	while (ordCollSize(descriptors) > kept) {
+		ordCollRemoveLast(descriptors);
+	}
+}
+
+
+// values are known until the next jump target, sends do not change temporaries nor classes of objects
+static _Bool propagateValues(Simplifier *simplifier)
+{
+	KnownValues known;
+	_Bool changed = 0;
+
+	markJumpTargets(simplifier);
+	forgetValues(&known);
+
+	for (size_t i = 0; i < simplifier->size; i++) {
+		Instruction *inst = &simplifier->insts[i];
+		if (inst->isRemoved) {
+			continue;
+		}
+		if (simplifier->isTarget[i]) {
+			forgetValues(&known);
+		}
+
+		switch (inst->bytecode) {
+		case BYTECODE_COPY:
+			changed |= substituteOperand(&known, &inst->operands[0], 1);
+			changed |= substituteInstance(&known, &inst->operands[1]);
+			changed |= propagateCopy(&known, inst);
+			break;
+
+		case BYTECODE_SEND:
+		case BYTECODE_SEND_WITH_STORE: {
+			// receivers are not replaced by constants, which would bind them statically
+			changed |= substituteOperand(&known, &inst->operands[0], 0);
+			for (size_t j = 1; j <= inst->argsSize; j++) {
+				changed |= substituteOperand(&known, &inst->operands[j], 1);
+			}
+			Operand *result = instructionResult(inst);
+			if (result != NULL) {
+				changed |= substituteInstance(&known, result);
+			}
+			if (foldSend(simplifier, &known, inst)) {
+				changed = 1;
+				removeDeoptimizationState(simplifier, i);
+				if (!inst->isRemoved) {
+					propagateCopy(&known, inst);
+				}
+			} else if (result != NULL && (result->type == OPERAND_TEMP_VAR || result->type == OPERAND_BOUND_VAR)) {
+				forgetVar(&known, result->index);
+			}
+			break;
+		}
+
+		case BYTECODE_FALLBACK_SEND: {
+			// boxes of bound variables are written by the send as well as its result
+			changed |= substituteOperand(&known, &inst->operands[0], 0);
+			for (size_t j = 0; j < inst->varsSize; j++) {
+				Operand *var = &inst->operands[inst->argsSize + 2 + j];
+				if (var->type == OPERAND_BOUND_VAR) {
+					forgetVar(&known, var->index + 1);
+				}
+			}
+			Operand *result = instructionResult(inst);
+			if (result->type == OPERAND_TEMP_VAR || result->type == OPERAND_BOUND_VAR) {
+				forgetVar(&known, result->index);
+			}
+			break;
+		}
+
+		case BYTECODE_RETURN:
+		case BYTECODE_OUTER_RETURN:
+			changed |= substituteOperand(&known, &inst->operands[0], 1);
+			forgetValues(&known);
+			break;
+
+		case BYTECODE_JUMP:
+			forgetValues(&known);
+			break;
+
+		case BYTECODE_JUMP_NOT_MEMBER_OF:
+			changed |= substituteOperand(&known, &inst->operands[0], 1);
+			changed |= resolveClassCheck(simplifier, &known, inst);
+			if (inst->bytecode == BYTECODE_JUMP) {
+				forgetValues(&known);
+			}
+			break;
+
+		case BYTECODE_JUMP_IF_TRUE:
+		case BYTECODE_JUMP_IF_FALSE:
+			changed |= substituteOperand(&known, &inst->operands[0], 1);
+			changed |= resolveBooleanJump(inst);
+			if (inst->bytecode == BYTECODE_JUMP) {
+				forgetValues(&known);
+			}
+			break;
+
+		case BYTECODE_DEOPTIMIZATION_STATE:
+			for (size_t j = 0; j < inst->operandsSize; j++) {
+				changed |= substituteOperand(&known, &inst->operands[j], 1);
+			}
+			break;
+
+		default:
+			FAIL();
+		}
+	}
+	return changed;
+}
+
+
+static _Bool substituteOperand(KnownValues *known, Operand *operand, _Bool allowConstant)
+{
+	if (operand->type == OPERAND_INST_VAR_OF) {
+		return substituteInstance(known, operand);
+	}
+	if (operand->type != OPERAND_TEMP_VAR) {
+		return 0;
+	}
+	Operand copy = known->copies[operand->index];
+	if (!copy.isValid || (!allowConstant && !isLocalOperand(copy))) {
+		return 0;
+	}
+	*operand = copy;
+	return 1;
+}
+
+
+// instances of slots have to be variables
+static _Bool substituteInstance(KnownValues *known, Operand *operand)
+{
+	if (operand->type != OPERAND_INST_VAR_OF || operand->instance.type != OPERAND_TEMP_VAR) {
+		return 0;
+	}
+	Operand copy = known->copies[operand->instance.index];
+	if (!copy.isValid || !isLocalOperand(copy)) {
+		return 0;
+	}
+	operand->instance.type = copy.type;
+	operand->instance.index = copy.index;
+	operand->instance.level = copy.level;
+	return 1;
+}
+
+
+static _Bool propagateCopy(KnownValues *known, Instruction *inst)
+{
+	Operand source = inst->operands[0];
+	Operand dest = inst->operands[1];
+
+	// values of bound variables are not known, fallback blocks may change them
+	if (dest.type == OPERAND_BOUND_VAR) {
+		forgetVar(known, dest.index);
+	}
+	if (dest.type != OPERAND_TEMP_VAR) {
+		return 0;
+	}
+	if (source.type == OPERAND_TEMP_VAR && source.index == dest.index) {
+		inst->isRemoved = 1;
+		return 1;
+	}
+	forgetVar(known, dest.index);
+	if (isLocalOperand(source) || isConstantOperand(source)) {
+		known->copies[dest.index] = source;
+	}
+	return 0;
+}
+
+
+// folded send with store becomes copy of its result, send without store is removed
+static _Bool foldSend(Simplifier *simplifier, KnownValues *known, Instruction *inst)
+{
+	Value receiver;
+	Value arg;
+	Operand result;
+
+	if (inst->argsSize != 1
+			|| !knownSmallInteger(known, inst->operands[0], &receiver)
+			|| !knownSmallInteger(known, inst->operands[1], &arg)) {
+		return 0;
+	}
+	String *selector = (String *) ordCollObjectAt(simplifier->literals, inst->literal);
+	if (!foldSmallIntegerOperation(selector, receiver, arg, &result)) {
+		return 0;
+	}
+
+	if (inst->bytecode == BYTECODE_SEND) {
+		inst->isRemoved = 1;
+	} else {
+		inst->bytecode = BYTECODE_COPY;
+		inst->operands[1] = inst->operands[2];
+		inst->operands[0] = result;
+		inst->operandsSize = 2;
+	}
+	return 1;
+}
+
+
+// folded send does not return anymore, its state is emitted right before it
+static void removeDeoptimizationState(Simplifier *simplifier, ptrdiff_t index)
+{
+	ptrdiff_t state = index - 1;
+	while (state >= 0 && simplifier->insts[state].isRemoved) {
+		state--;
+	}
+	if (state >= 0 && simplifier->insts[state].bytecode == BYTECODE_DEOPTIMIZATION_STATE) {
+		simplifier->insts[state].isRemoved = 1;
+	}
+}
+
+
+// tagged integers are added and compared as they are, overflows are left to the send like in native code
+static _Bool foldSmallIntegerOperation(String *selector, Value receiver, Value arg, Operand *result)
+{
+	SignedValue a = receiver;
+	SignedValue b = arg;
+	SignedValue value;
+	_Bool isTrue;
+
+	if (stringEqualsC(selector, "+")) {
+		if (__builtin_add_overflow(a, b, &value)) {
+			return 0;
+		}
+	} else if (stringEqualsC(selector, "-")) {
+		if (__builtin_sub_overflow(a, b, &value)) {
+			return 0;
+		}
+	} else if (stringEqualsC(selector, "*")) {
+		if (__builtin_mul_overflow(a, b >> 2, &value)) {
+			return 0;
+		}
+	} else {
+		if (stringEqualsC(selector, "<")) {
+			isTrue = a < b;
+		} else if (stringEqualsC(selector, ">")) {
+			isTrue = a > b;
+		} else if (stringEqualsC(selector, "<=")) {
+			isTrue = a <= b;
+		} else if (stringEqualsC(selector, ">=")) {
+			isTrue = a >= b;
+		} else if (stringEqualsC(selector, "=")) {
+			isTrue = a == b;
+		} else if (stringEqualsC(selector, "~=")) {
+			isTrue = a != b;
+		} else {
+			return 0;
+		}
+		*result = (Operand) { .isValid = 1, .type = isTrue ? OPERAND_TRUE : OPERAND_FALSE };
+		return 1;
+	}
+
+	*result = (Operand) { .isValid = 1, .type = OPERAND_VALUE, .value = value };
+	return 1;
+}
+
+
+static _Bool knownSmallInteger(KnownValues *known, Operand operand, Value *value)
+{
+	if (operand.type == OPERAND_TEMP_VAR && known->copies[operand.index].isValid) {
+		operand = known->copies[operand.index];
+	}
+	if (operand.type != OPERAND_VALUE || !valueTypeOf(operand.value, VALUE_INT)) {
+		return 0;
+	}
+	*value = operand.value;
+	return 1;
+}
+
+
+// constants other than booleans are never jumped on, like in native code
+static _Bool resolveBooleanJump(Instruction *inst)
+{
+	Operand operand = inst->operands[0];
+	if (!isConstantOperand(operand)) {
+		return 0;
+	}
+	if ((operand.type == OPERAND_TRUE && inst->bytecode == BYTECODE_JUMP_IF_TRUE)
+			|| (operand.type == OPERAND_FALSE && inst->bytecode == BYTECODE_JUMP_IF_FALSE)) {
+		inst->bytecode = BYTECODE_JUMP;
+		inst->operandsSize = 0;
+	} else {
+		inst->isRemoved = 1;
+	}
+	return 1;
+}
+
+
+static _Bool resolveClassCheck(Simplifier *simplifier, KnownValues *known, Instruction *inst)
+{
+	Operand operand = inst->operands[0];
+	Value class = ordCollAt(simplifier->literals, inst->literal);
+	Value operandClass = knownClass(simplifier, known, operand);
+
+	if (operandClass == 0) {
+		if (isLocalOperand(operand) && known->factsSize < MAX_CLASS_FACTS) {
+			known->facts[known->factsSize++] = (ClassFact) { .var = operand, .class = class };
+		}
+		return 0;
+	}
+	if (operandClass == class) {
+		inst->isRemoved = 1;
+	} else {
+		inst->bytecode = BYTECODE_JUMP;
+		inst->operandsSize = 0;
+	}
+	return 1;
+}
+
+
+static Value knownClass(Simplifier *simplifier, KnownValues *known, Operand operand)
+{
+	switch (operand.type) {
+	case OPERAND_VALUE:
+		return tagPtr(getClassOf(operand.value));
+	case OPERAND_NIL:
+		return tagPtr(Handles.UndefinedObject->raw);
+	case OPERAND_TRUE:
+		return tagPtr(Handles.True->raw);
+	case OPERAND_FALSE:
+		return tagPtr(Handles.False->raw);
+	case OPERAND_LITERAL:
+		return tagPtr(getClassOf(ordCollAt(simplifier->literals, operand.index)));
+	case OPERAND_TEMP_VAR:
+	case OPERAND_ARG_VAR:
+		for (size_t i = 0; i < known->factsSize; i++) {
+			ClassFact *fact = &known->facts[i];
+			if (fact->var.type == operand.type && fact->var.index == operand.index) {
+				return fact->class;
+			}
+		}
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+
+static void forgetValues(KnownValues *known)
+{
+	for (size_t i = 0; i < 256; i++) {
+		known->copies[i].isValid = 0;
+	}
+	known->factsSize = 0;
+}
+
+
+// copies of and to redefined temporary no longer hold, as well as its class
+static void forgetVar(KnownValues *known, uint8_t index)
+{
+	known->copies[index].isValid = 0;
+	for (size_t i = 0; i < 256; i++) {
+		Operand *copy = &known->copies[i];
+		if (copy->isValid && copy->type == OPERAND_TEMP_VAR && copy->index == index) {
+			copy->isValid = 0;
+		}
+	}
+
+	size_t size = 0;
+	for (size_t i = 0; i < known->factsSize; i++) {
+		ClassFact *fact = &known->facts[i];
+		if (fact->var.type != OPERAND_TEMP_VAR || fact->var.index != index) {
+			known->facts[size++] = *fact;
+		}
+	}
+	known->factsSize = size;
+}
+
+
+static _Bool removeUnreachableCode(Simplifier *simplifier)
+{
+	_Bool *isReachable = calloc(simplifier->size + 1, sizeof(_Bool));
+	ptrdiff_t *worklist = malloc((simplifier->size + 1) * sizeof(ptrdiff_t));
+	size_t worklistSize = 0;
+	_Bool changed = 0;
+
+	ptrdiff_t first = nextInstruction(simplifier, 0);
+	isReachable[first] = 1;
+	worklist[worklistSize++] = first;
+
+	while (worklistSize > 0) {
+		ptrdiff_t index = worklist[--worklistSize];
+		if (index == (ptrdiff_t) simplifier->size) {
+			continue;
+		}
+		Instruction *inst = &simplifier->insts[index];
+		ptrdiff_t successors[2];
+		size_t successorsSize = 0;
+		if (isJump(inst)) {
+			successors[successorsSize++] = nextInstruction(simplifier, inst->target);
+		}
+		if (fallsThrough(inst)) {
+			successors[successorsSize++] = nextInstruction(simplifier, index + 1);
+		}
+		for (size_t i = 0; i < successorsSize; i++) {
+			if (!isReachable[successors[i]]) {
+				isReachable[successors[i]] = 1;
+				worklist[worklistSize++] = successors[i];
+			}
+		}
+	}
+
+	for (size_t i = 0; i < simplifier->size; i++) {
+		Instruction *inst = &simplifier->insts[i];
+		if (!inst->isRemoved && !isReachable[i]) {
+			inst->isRemoved = 1;
+			changed = 1;
+		}
+	}
+
+	free(isReachable);
+	free(worklist);
+	return changed;
+}
+
+
+// reading variables has no side effects, so copies to dead temporaries are removed whatever they copy
+static _Bool removeDeadStores(Simplifier *simplifier)
+{
+	_Bool changed = 0;
+
+	computeLiveVars(simplifier);
+	for (size_t i = 0; i < simplifier->size; i++) {
+		Instruction *inst = &simplifier->insts[i];
+		Operand *result = instructionResult(inst);
+		if (inst->isRemoved || result == NULL || result->type != OPERAND_TEMP_VAR || inst->bytecode == BYTECODE_FALLBACK_SEND) {
+			continue;
+		}
+		LiveVars live = liveVarsAfter(simplifier, i);
+		if (isLiveVar(&live, result->index)) {
+			continue;
+		}
+		if (inst->bytecode == BYTECODE_COPY) {
+			inst->isRemoved = 1;
+		} else {
+			inst->bytecode = BYTECODE_SEND;
+			inst->operandsSize--;
+		}
+		changed = 1;
+	}
+	return changed;
+}
+
+
+// temporaries live before each instruction are computed backwards until they settle, none is live at the end
+static void computeLiveVars(Simplifier *simplifier)
+{
+	_Bool changed;
+
+	memset(simplifier->live, 0, (simplifier->size + 1) * sizeof(LiveVars));
+	do {
+		changed = 0;
+		for (ptrdiff_t i = simplifier->size - 1; i >= 0; i--) {
+			Instruction *inst = &simplifier->insts[i];
+			if (inst->isRemoved) {
+				continue;
+			}
+			LiveVars live = liveVarsAfter(simplifier, i);
+			Operand *result = instructionResult(inst);
+			if (result != NULL && result->type == OPERAND_TEMP_VAR) {
+				live.set[result->index / 64] &= ~((uint64_t) 1 << (result->index % 64));
+			}
+			for (size_t j = 0; j < inst->operandsSize; j++) {
+				Operand *operand = &inst->operands[j];
+				if (operand != result) {
+					addUsedVar(&live, *operand);
+				} else if (operand->type == OPERAND_INST_VAR_OF) {
+					addUsedVar(&live, bytecodeInstanceOperand(operand));
+				} else if (operand->type == OPERAND_BOUND_VAR) {
+					// value is stored into box as well
+					addUsedVar(&live, (Operand) { .type = OPERAND_TEMP_VAR, .index = operand->index + 1 });
+				}
+			}
+			if (memcmp(&live, &simplifier->live[i], sizeof(live)) != 0) {
+				simplifier->live[i] = live;
+				changed = 1;
+			}
+		}
+	} while (changed);
+}
+
+
+static LiveVars liveVarsAfter(Simplifier *simplifier, ptrdiff_t index)
+{
+	Instruction *inst = &simplifier->insts[index];
+	LiveVars live = { { 0 } };
+
+	if (isJump(inst)) {
+		live = simplifier->live[nextInstruction(simplifier, inst->target)];
+	}
+	if (fallsThrough(inst)) {
+		LiveVars *next = &simplifier->live[nextInstruction(simplifier, index + 1)];
+		for (size_t i = 0; i < 4; i++) {
+			live.set[i] |= next->set[i];
+		}
+	}
+	return live;
+}
+
+
+// bound variable is read from its box once it has one
+static void addUsedVar(LiveVars *live, Operand operand)
+{
+	if (operand.type == OPERAND_BOUND_VAR) {
+		live->set[operand.index / 64] |= (uint64_t) 1 << (operand.index % 64);
+		live->set[(operand.index + 1) / 64] |= (uint64_t) 1 << ((operand.index + 1) % 64);
+	} else if (operand.type == OPERAND_TEMP_VAR) {
+		live->set[operand.index / 64] |= (uint64_t) 1 << (operand.index % 64);
+	} else if (operand.type == OPERAND_INST_VAR_OF && operand.instance.type == OPERAND_TEMP_VAR) {
+		live->set[operand.instance.index / 64] |= (uint64_t) 1 << (operand.instance.index % 64);
+	}
+}
+
+
+static _Bool isLiveVar(LiveVars *live, uint8_t index)
+{
+	return (live->set[index / 64] & ((uint64_t) 1 << (index % 64))) != 0;
+}
+
+
+static _Bool removeRedundantJumps(Simplifier *simplifier)
+{
+	_Bool changed = 0;
+
+	for (size_t i = 0; i < simplifier->size; i++) {
+		Instruction *inst = &simplifier->insts[i];
+		if (!inst->isRemoved && isJump(inst)
+				&& nextInstruction(simplifier, inst->target) == nextInstruction(simplifier, i + 1)) {
+			inst->isRemoved = 1;
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+
+static void markJumpTargets(Simplifier *simplifier)
+{
+	memset(simplifier->isTarget, 0, (simplifier->size + 1) * sizeof(_Bool));
+	for (size_t i = 0; i < simplifier->size; i++) {
+		Instruction *inst = &simplifier->insts[i];
+		if (!inst->isRemoved && isJump(inst)) {
+			simplifier->isTarget[nextInstruction(simplifier, inst->target)] = 1;
+		}
+	}
+}
+
+
+// removed instructions fall through to the next one, jumps to them land there too
+static ptrdiff_t nextInstruction(Simplifier *simplifier, ptrdiff_t index)
+{
+	while (index < (ptrdiff_t) simplifier->size && simplifier->insts[index].isRemoved) {
+		index++;
+	}
+	return index;
+}
+
+
+static Operand *instructionResult(Instruction *inst)
+{
+	switch (inst->bytecode) {
+	case BYTECODE_COPY:
+		return &inst->operands[1];
+	case BYTECODE_SEND_WITH_STORE:
+	case BYTECODE_FALLBACK_SEND:
+		return &inst->operands[inst->operandsSize - 1];
+	default:
+		return NULL;
+	}
+}
+
+
+static _Bool isJump(Instruction *inst)
+{
+	switch (inst->bytecode) {
+	case BYTECODE_JUMP:
+	case BYTECODE_JUMP_NOT_MEMBER_OF:
+	case BYTECODE_JUMP_IF_TRUE:
+	case BYTECODE_JUMP_IF_FALSE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+
+static _Bool fallsThrough(Instruction *inst)
+{
+	return inst->bytecode != BYTECODE_JUMP
+		&& inst->bytecode != BYTECODE_RETURN
+		&& inst->bytecode != BYTECODE_OUTER_RETURN;
+}
+
+
+static _Bool isLocalOperand(Operand operand)
+{
+	return operand.type == OPERAND_TEMP_VAR || operand.type == OPERAND_ARG_VAR;
+}
+
+
+static _Bool isConstantOperand(Operand operand)
+{
+	switch (operand.type) {
+	case OPERAND_VALUE:
+	case OPERAND_NIL:
+	case OPERAND_TRUE:
+	case OPERAND_FALSE:
+	case OPERAND_LITERAL:
+		return 1;
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,9 @@
+#ifndef SIMPLIFIER_H
+#define SIMPLIFIER_H
+
+#include "Assembler.h"
+#include "Collection.h"
+
+void simplifyBytecodes(AssemblerBuffer *buffer, OrderedCollection *literals, OrderedCollection *descriptors);
+
+#endif
@@ -1,6 +1,7 @@
 #include "Smalltalk.h"
 #include "Thread.h"
 #include "Heap.h"
+#include "GarbageCollector.h"
 #include "Handle.h"
 #include "StackFrame.h"
 #include "CodeDescriptors.h"
@@ -34,7 +35,7 @@ String *asSymbol(String *string)
 		symbol->raw = (RawString *) asObject(table->vars[index]);
 		if (isNil(symbol)) {
 			String *newSymbol = (String *) copyResizedObject((Object *) string, string->raw->size);
-			newSymbol->raw->class = Handles.Symbol->raw;
+			rawObjectSetClass((RawObject *) newSymbol->raw, Handles.Symbol->raw);
 			newSymbol->raw->hash = hash;
 			arrayAtPutObject(Handles.SymbolTable, index, (Object *) newSymbol);
 			return closeHandleScope(&scope, newSymbol);
@@ -144,6 +145,7 @@ static void swapObjectInNewSpace(Object *old, Object *new)
 
 static void swapObjectInOldSpace(Object *old, Object *new)
 {
+	gcPauseSweeping();
 	PageSpaceIterator iterator;
 	pageSpaceIteratorInit(&iterator, &CurrentThread.heap.oldSpace);
 	RawObject *object = pageSpaceIteratorNext(&iterator);
@@ -155,6 +157,7 @@ static void swapObjectInOldSpace(Object *old, Object *new)
 		iterateObject(object, new, old);
 		object = pageSpaceIteratorNext(&iterator);
 	}
+	gcResumeSweeping();
 }
 
 
@@ -167,6 +170,8 @@ static void swapObjectOnStack(Object *old, Object *new)
 	while (entryFrame != NULL) {
 		StackFrame *prev = entryFrame->exit;
 		StackFrame *frame = stackFrameGetParent(prev, entryFrame);
+		RegisterMap map;
+		initRegisterMap(&map, prev);
 		while (frame != NULL) {
 			NativeCode *code = stackFrameGetNativeCode(frame);
 
@@ -178,18 +183,23 @@ static void swapObjectOnStack(Object *old, Object *new)
 				}
 			}
 
-			RawStackmap *stackmap = findStackmap(code, (ptrdiff_t) prev->parentIc);
-			ASSERT(stackmap != NULL);
-			size_t frameSize = (stackmap->size - sizeof(Value)) * 8;
-			for (size_t i = 0; i < frameSize; i++) {
-				//ASSERT(i != 0 || stackmapIncludes(stackmap, i));
-				if (stackmapIncludes(stackmap, i)) {
+			Stackmap stackmap = findStackmap(code, (ptrdiff_t) prev->parentIc);
+			ASSERT(stackmap.set != NULL);
+			for (size_t i = 0; i < stackmap.size; i++) {
+				//ASSERT(i != 0 || stackmapIncludes(&stackmap, i));
+				if (stackmapIncludes(&stackmap, i)) {
 					Value value = stackFrameGetSlot(frame, i);
 					if (value == tOld) {
 						stackFrameSetSlot(frame, i, tNew);
 					}
 				}
 			}
+			for (size_t i = 0; i < SAVED_REGS_SIZE; i++) {
+				if ((stackmap.regs.live & (1 << i)) && *map.regs[i] == tOld) {
+					*map.regs[i] = tNew;
+				}
+			}
+			registerMapUpdate(&map, frame, stackmap.regs.saved);
 
 			prev = frame;
 			frame = stackFrameGetParent(frame, entryFrame);
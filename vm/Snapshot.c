@@ -193,6 +193,8 @@ void snapshotRead(FILE *file)
 	Snapshot snapshot;
 	snapshot.file = file;
 	initDicitonary(&snapshot.dict);
+	// read objects are kept as raw pointers until whole snapshot is read
+	disableScavenges(&CurrentThread.heap);
 
 	do {
 		int64_t field;
@@ -203,6 +205,7 @@ void snapshotRead(FILE *file)
 	} while (1);
 
 	createBuiltinObjectsHandles(&snapshot);
+	enableScavenges(&CurrentThread.heap);
 	freeDictionary(&snapshot.dict);
 }
 
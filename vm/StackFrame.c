@@ -33,9 +33,15 @@ RawContext *stackFrameGetParentContext(StackFrame *frame)
 	Value contextSlotValue = stackFrameGetSlot(parent, CONTEXT_SLOT);
 	RawContext *context;
 	if (contextSlotValue == CurrentThread.context) {
-		context = (RawContext *) allocateObject(&CurrentThread.heap, Handles.MethodContext->raw, 0);
+		// methods and blocks running without context get one once it is needed
+		RawObject *code = stackFrameGetNativeCode(parent)->compiledCode;
+		_Bool isBlock = code->class == Handles.CompiledBlock->raw;
+		RawClass *class = (isBlock ? Handles.BlockContext : Handles.MethodContext)->raw;
+		context = (RawContext *) allocateObject(&CurrentThread.heap, class, 0);
 		context->frame = parent;
 		context->code = tagPtr(stackFrameGetNativeCode(parent)->compiledCode);
+		// frame reloads its context from slot, which must keep thread of dummy context
+		context->thread = &CurrentThread;
 		stackFrameSetSlot(parent, CONTEXT_SLOT, tagPtr(context));
 	} else {
 		context = (RawContext *) asObject(contextSlotValue);
@@ -90,6 +96,37 @@ NativeCode *stackFrameGetNativeCode(StackFrame *frame)
 }
 
 
+// registers stored in frame follow its context in order of their indexes
+size_t stackFrameGetSavedRegSlot(uint8_t savedRegs, size_t index)
+{
+	size_t slot = FRAME_VARS_OFFSET;
+	for (size_t i = 0; i < index; i++) {
+		slot += (savedRegs >> i) & 1;
+	}
+	return slot;
+}
+
+
+// exit frame stores registers after context in its first slot, see generateCCall
+void initRegisterMap(RegisterMap *map, StackFrame *exitFrame)
+{
+	for (size_t i = 0; i < SAVED_REGS_SIZE; i++) {
+		map->regs[i] = stackFrameGetSlotPtr(exitFrame, i + 1);
+	}
+}
+
+
+// values seen by parent of frame are those it stored in its prologue
+void registerMapUpdate(RegisterMap *map, StackFrame *frame, uint8_t savedRegs)
+{
+	for (size_t i = 0; i < SAVED_REGS_SIZE; i++) {
+		if (savedRegs & (1 << i)) {
+			map->regs[i] = stackFrameGetSlotPtr(frame, stackFrameGetSavedRegSlot(savedRegs, i));
+		}
+	}
+}
+
+
 _Bool contextHasValidFrame(RawContext *context)
 {
 	return stackFrameGetSlot(context->frame, CONTEXT_SLOT) == tagPtr(context);
@@ -4,6 +4,9 @@
 #define FRAME_VARS_OFFSET 2
 #define FRAME_CODE_OFFSET 0
 #define CONTEXT_SLOT 1
+// callee-saved registers keeping variables across sends, code stores those it uses after context, see SavedRegisters
+#define SAVED_REGS_SIZE 4
+#define SAVED_REGS_ALL ((1 << SAVED_REGS_SIZE) - 1)
 
 #include "Thread.h"
 #include "Object.h"
@@ -24,6 +27,11 @@ typedef struct EntryStackFrame {
 	StackFrame *exit;
 } EntryStackFrame;
 
+// slots holding values of callee-saved registers seen by frame, frames are walked from the exit one to the entry one
+typedef struct {
+	Value *regs[SAVED_REGS_SIZE];
+} RegisterMap;
+
 typedef struct {
 	OBJECT_HEADER;
 	Value size;
@@ -48,6 +56,9 @@ void stackFrameSetSlot(StackFrame *frame, ptrdiff_t index, Value value);
 Value stackFrameGetSlot(StackFrame *frame, ptrdiff_t index);
 Value *stackFrameGetSlotPtr(StackFrame *frame, ptrdiff_t index);
 NativeCode *stackFrameGetNativeCode(StackFrame *frame);
+size_t stackFrameGetSavedRegSlot(uint8_t savedRegs, size_t index);
+void initRegisterMap(RegisterMap *map, StackFrame *exitFrame);
+void registerMapUpdate(RegisterMap *map, StackFrame *frame, uint8_t savedRegs);
 _Bool contextHasValidFrame(RawContext *context);
 
 #endif
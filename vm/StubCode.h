@@ -13,6 +13,10 @@ typedef struct {
 extern StubCode SmalltalkEntry;
 extern StubCode AllocateStub;
 extern StubCode LookupStub;
+extern StubCode InlineCacheMissStub;
+extern StubCode MegamorphicLookupStub;
+extern StubCode OptimizeStub;
+extern StubCode DeoptimizeStub;
 extern StubCode DoesNotUnderstandStub;
 
 NativeCode *getStubNativeCode(StubCode *stub);
@@ -1,6 +1,7 @@
 #include "StubCode.h"
 #include "Heap.h"
 #include "Lookup.h"
+#include "Optimizer.h"
 #include "CodeGenerator.h"
 #include "CodeDescriptors.h"
 #include "AssemblerX64.h"
@@ -19,14 +20,18 @@ NativeCode *getStubNativeCode(StubCode *stub)
 		HandleScope scope;
 		openHandleScope(&scope);
 
+		disableScavenges(&CurrentThread.heap);
 		CodeGenerator generator;
 		initCodeGenerator(&generator);
 		stub->generator(&generator);
 		stub->nativeCode = buildNativeCode(&generator);
+		// stubs are called from any code without being referenced by it
+		stub->nativeCode->tags |= TAG_PINNED;
 		if (generator.code.methodOrBlock != NULL) {
 			compiledMethodSetNativeCode((CompiledMethod *) generator.code.methodOrBlock, stub->nativeCode);
 		}
-		asmFreeBuffer(&generator.buffer);
+		freeCodeGenerator(&generator);
+		enableScavenges(&CurrentThread.heap);
 
 		closeHandleScope(&scope, NULL);
 	}
@@ -40,11 +45,23 @@ static void initCodeGenerator(CodeGenerator *generator)
 	generator->code.methodOrBlock = NULL;
 	generator->regsAlloc.varsSize = 0;
 	generator->regsAlloc.frameSize = generator->frameSize = 0;
+	generator->regsAlloc.savedRegs = 0;
+	generator->savedRegs = 0;
 	generator->frameRawAreaSize = 0;
 	generator->tmpVar = 0;
 	generator->bytecodeNumber = 0;
-	generator->stackmaps = newOrdColl(8);
+	generator->stackmapsIcs = NULL;
+	generator->stackmapsSets = NULL;
+	generator->stackmapsRegs = NULL;
+	generator->stackmapsSize = 0;
+	generator->stackmapsCapacity = 0;
+	generator->stackmapSetSize = 0;
 	generator->descriptors = NULL;
+	generator->descriptorsSize = 0;
+	generator->descriptorsCapacity = 0;
+	generator->sendFeedbackSize = 0;
+	generator->hasDeoptimizationState = 0;
+	generator->deoptimizationSitesSize = 0;
 }
 
 
@@ -54,9 +71,7 @@ void generateStubCall(CodeGenerator *generator, StubCode *stubCode)
 	asmMovqImm(buffer, (uint64_t) getStubNativeCode(stubCode)->insts, TMP);
 	asmCallq(buffer, TMP);
 	generateStackmap(generator);
-	if (generator->descriptors != NULL) {
-		ordCollAdd(generator->descriptors, createBytecodeDescriptor(asmOffset(buffer), generator->bytecodeNumber));
-	}
+	generateDescriptor(generator);
 }
 
 
@@ -144,6 +159,8 @@ static void generateAllocate(CodeGenerator *generator)
 {
 	AssemblerBuffer *buffer = &generator->buffer;
 	AssemblerLabel noFreeSpace;
+	AssemblerLabel largeObject;
+	AssemblerLabel pretenured;
 	AssemblerLabel bytes;
 	AssemblerLabel align;
 	AssemblerLabel notIndexed;
@@ -163,6 +180,8 @@ static void generateAllocate(CodeGenerator *generator)
 	ptrdiff_t isIndexedOffset = offsetof(RawClass, instanceShape) + offsetof(InstanceShape, isIndexed);
 
 	asmInitLabel(&noFreeSpace);
+	asmInitLabel(&largeObject);
+	asmInitLabel(&pretenured);
 	asmInitLabel(&bytes);
 	asmInitLabel(&align);
 	asmInitLabel(&notIndexed);
@@ -199,16 +218,25 @@ static void generateAllocate(CodeGenerator *generator)
 	asmAddqImm(buffer, RCX, HEAP_OBJECT_ALIGN - 1);
 	asmAndqImm(buffer, RCX, -HEAP_OBJECT_ALIGN); // RCX: aligned size
 
+	asmMovqMem(buffer, asmMem(CTX, NO_REGISTER, SS_1, varOffset(RawContext, thread)), R9); // R9: thread
+
+	// large objects are allocated by runtime
+	asmCmpqImm(buffer, RCX, LARGE_OBJECT_SIZE);
+	asmJ(buffer, COND_ABOVE_EQUAL, &largeObject);
+
+	// instances of pretenured classes are allocated in old space by runtime
+	asmTestbMemImm(buffer, asmMem(RSI, NO_REGISTER, SS_1, offsetof(RawClass, tags)), TAG_PRETENURED);
+	asmJ(buffer, COND_NOT_ZERO, &pretenured);
+
 	// check free space
-	asmMovqMem(buffer, asmMem(CTX, NO_REGISTER, SS_1, varOffset(RawContext, thread)), RBX); // RBX: thread
-	asmMovqMem(buffer, asmMem(RBX, NO_REGISTER, SS_1, scavengerOffset + offsetof(Scavenger, end)), TMP); // TMP: scavenger end
-	asmMovqMem(buffer, asmMem(RBX, NO_REGISTER, SS_1, scavengerOffset + offsetof(Scavenger, top)), RAX); // RAX: new object
+	asmMovqMem(buffer, asmMem(R9, NO_REGISTER, SS_1, scavengerOffset + offsetof(Scavenger, end)), TMP); // TMP: scavenger end
+	asmMovqMem(buffer, asmMem(R9, NO_REGISTER, SS_1, scavengerOffset + offsetof(Scavenger, top)), RAX); // RAX: new object
 	asmSubq(buffer, RAX, TMP); // TMP: scavenger free space
 	asmCmpq(buffer, RCX, TMP);
 	asmJ(buffer, COND_ABOVE, &noFreeSpace);
 
 	// move top cursor
-	asmAddqToMem(buffer, RCX, asmMem(RBX, NO_REGISTER, SS_1, scavengerOffset + offsetof(Scavenger, top)));
+	asmAddqToMem(buffer, RCX, asmMem(R9, NO_REGISTER, SS_1, scavengerOffset + offsetof(Scavenger, top)));
 
 	// class
 	asmMovqToMem(buffer, RSI, asmMem(RAX, NO_REGISTER, SS_1, offsetof(RawObject, class)));
@@ -228,15 +256,15 @@ static void generateAllocate(CodeGenerator *generator)
 	asmLabelBind(buffer, &notIndexed, asmOffset(buffer));
 
 	// zero payload
-	asmMovzxbMemq(buffer, asmMem(RSI, NO_REGISTER, SS_1, payloadOffset), RBX); // RBX: payload size
-	asmCmpqImm(buffer, RBX, 0);
-	asmMovbToMem(buffer, BL, asmMem(RAX, NO_REGISTER, SS_1, offsetof(RawObject, payloadSize))); // store payload size in instance
-	asmLeaq(buffer, asmMem(R8, RBX, SS_8, offsetof(RawObject, body)), RCX); // save pointer to inst vars
+	asmMovzxbMemq(buffer, asmMem(RSI, NO_REGISTER, SS_1, payloadOffset), R9); // R9: payload size
+	asmCmpqImm(buffer, R9, 0);
+	asmMovbToMem(buffer, R9L, asmMem(RAX, NO_REGISTER, SS_1, offsetof(RawObject, payloadSize))); // store payload size in instance
+	asmLeaq(buffer, asmMem(R8, R9, SS_8, offsetof(RawObject, body)), RCX); // save pointer to inst vars
 	asmJ(buffer, COND_EQUAL, &noPayload);
 
 	asmLabelBind(buffer, &payloadLoop, asmOffset(buffer));
-	asmMovqMemImm(buffer, 0, asmMem(R8, RBX, SS_8, offsetof(RawObject, body) - sizeof(Value)));
-	asmDecq(buffer, RBX);
+	asmMovqMemImm(buffer, 0, asmMem(R8, R9, SS_8, offsetof(RawObject, body) - sizeof(Value)));
+	asmDecq(buffer, R9);
 	asmJ(buffer, COND_NOT_ZERO, &payloadLoop);
 
 	asmLabelBind(buffer, &noPayload, asmOffset(buffer));
@@ -245,12 +273,12 @@ static void generateAllocate(CodeGenerator *generator)
 	asmCmpqImm(buffer, RDI, 0);
 	asmJ(buffer, COND_EQUAL, &noVars);
 	generateLoadObject(buffer, Handles.nil->raw, TMP, 1);
-	asmMovq(buffer, RDI, RBX);
-	asmMovbToMem(buffer, BL, asmMem(RAX, NO_REGISTER, SS_1, offsetof(RawObject, varsSize)));
+	asmMovq(buffer, RDI, R9);
+	asmMovbToMem(buffer, R9L, asmMem(RAX, NO_REGISTER, SS_1, offsetof(RawObject, varsSize)));
 
 	asmLabelBind(buffer, &varsLoop, asmOffset(buffer));
-	asmMovqToMem(buffer, TMP, asmMem(RCX, RBX, SS_8, -sizeof(Value)));
-	asmDecq(buffer, RBX);
+	asmMovqToMem(buffer, TMP, asmMem(RCX, R9, SS_8, -sizeof(Value)));
+	asmDecq(buffer, R9);
 	asmJ(buffer, COND_NOT_ZERO, &varsLoop);
 
 	asmLabelBind(buffer, &noVars, asmOffset(buffer));
@@ -260,12 +288,12 @@ static void generateAllocate(CodeGenerator *generator)
 	asmJ(buffer, COND_ZERO, &noBytes);
 	asmCmpqImm(buffer, RDX, 0);
 	asmJ(buffer, COND_EQUAL, &zeroBytes);
-	asmMovq(buffer, RDX, RBX);
+	asmMovq(buffer, RDX, R9);
 	asmLeaq(buffer, asmMem(RCX, RDI, SS_8, 0), RCX);
 
 	asmLabelBind(buffer, &zeroBytesLoop, asmOffset(buffer));
-	asmMovbMemImm(buffer, 0, asmMem(RCX, RBX, SS_1, -1));
-	asmDecq(buffer, RBX);
+	asmMovbMemImm(buffer, 0, asmMem(RCX, R9, SS_1, -1));
+	asmDecq(buffer, R9);
 	asmJ(buffer, COND_NOT_ZERO, &zeroBytesLoop);
 
 	asmLabelBind(buffer, &noBytes, asmOffset(buffer));
@@ -275,7 +303,9 @@ static void generateAllocate(CodeGenerator *generator)
 	asmRet(buffer);
 
 	asmLabelBind(buffer, &noFreeSpace, asmOffset(buffer));
-	asmLeaq(buffer, asmMem(RBX, NO_REGISTER, SS_1, offsetof(Thread, heap)), RDI);
+	asmLabelBind(buffer, &largeObject, asmOffset(buffer));
+	asmLabelBind(buffer, &pretenured, asmOffset(buffer));
+	asmLeaq(buffer, asmMem(R9, NO_REGISTER, SS_1, offsetof(Thread, heap)), RDI);
 	generateCCall(generator, (intptr_t) allocateObject, 3, 0);
 	asmIncq(buffer, RAX);
 	asmRet(buffer);
@@ -293,6 +323,106 @@ static void generateLookup(CodeGenerator *generator)
 StubCode LookupStub = { .generator = generateLookup, .nativeCode = NULL };
 
 
+// RDI: class
+// RSI: selector
+// RDX: inline cache
+static void generateInlineCacheMiss(CodeGenerator *generator)
+{
+	AssemblerBuffer *buffer = &generator->buffer;
+	generateCCall(generator, (intptr_t) lookupInlineCache, 3, 0);
+	asmMovq(buffer, RAX, R11);
+	asmRet(buffer);
+}
+StubCode InlineCacheMissStub = { .generator = generateInlineCacheMiss, .nativeCode = NULL };
+
+
+// RDI: class
+// RSI: selector
+// R11: native code
+static void generateMegamorphicLookup(CodeGenerator *generator)
+{
+	AssemblerBuffer *buffer = &generator->buffer;
+	AssemblerLabel lookup;
+	AssemblerLabel cache;
+	asmInitLabel(&lookup);
+	asmInitLabel(&cache);
+
+	// hash class and selector
+	asmMovq(buffer, RDI, RDX);
+	asmXorq(buffer, RSI, RDX);
+	asmAndqImm(buffer, RDX, LOOKUP_CACHE_SIZE - 1);
+
+	// check class
+	asmMovqImm(buffer, (uint64_t) &LookupCache, TMP);
+	asmCmpqMem(buffer, asmMem(TMP, RDX, SS_8, offsetof(LookupTable, classes)), RDI);
+	asmJ(buffer, COND_NOT_EQUAL, &lookup);
+
+	// check selector
+	asmCmpqMem(buffer, asmMem(TMP, RDX, SS_8, offsetof(LookupTable, selectors)), RSI);
+	asmJ(buffer, COND_EQUAL, &cache);
+
+	// not in cache -> lookup
+	asmLabelBind(buffer, &lookup, asmOffset(buffer));
+	asmMovqImm(buffer, (uint64_t) getStubNativeCode(&LookupStub)->insts, TMP);
+	asmJmpq(buffer, TMP);
+
+	// load code from cache
+	asmLabelBind(buffer, &cache, asmOffset(buffer));
+	asmMovqMem(buffer, asmMem(TMP, RDX, SS_8, offsetof(LookupTable, codes)), R11);
+	asmRet(buffer);
+}
+StubCode MegamorphicLookupStub = { .generator = generateMegamorphicLookup, .nativeCode = NULL };
+
+
+// RDI: native code entry
+static void generateOptimize(CodeGenerator *generator)
+{
+	generateCCall(generator, (intptr_t) optimizeHotMethod, 1, 0);
+	asmRet(&generator->buffer);
+}
+StubCode OptimizeStub = { .generator = generateOptimize, .nativeCode = NULL };
+
+
+// RAX: result of send
+// send of deoptimized frame returns through trampoline, whose call is right behind the original return address,
+// frame is replaced by baseline frames which continue after the same send
+static void generateDeoptimize(CodeGenerator *generator)
+{
+	AssemblerBuffer *buffer = &generator->buffer;
+	AssemblerLabel loop;
+	asmInitLabel(&loop);
+
+	// restore return address of send, so that frame is walked as if the send did not return yet
+	asmPopq(buffer, RDI);
+	asmSubqImm(buffer, RDI, 5); // call rel32 of deoptimization site
+	asmPushq(buffer, RDI);
+	asmMovq(buffer, RBP, RSI);
+	asmMovq(buffer, RAX, RDX);
+	generateCCall(generator, (intptr_t) deoptimizeFrame, 3, 0);
+
+	// copy baseline frames
+	asmMovqMem(buffer, asmMem(RAX, NO_REGISTER, SS_1, offsetof(DeoptimizedFrames, size)), RCX);
+	asmMovqMem(buffer, asmMem(RAX, NO_REGISTER, SS_1, offsetof(DeoptimizedFrames, slots)), RSI);
+	asmMovqMem(buffer, asmMem(RAX, NO_REGISTER, SS_1, offsetof(DeoptimizedFrames, rsp)), RSP);
+	asmMovqMem(buffer, asmMem(RAX, NO_REGISTER, SS_1, offsetof(DeoptimizedFrames, rbp)), RBP);
+	asmMovqMem(buffer, asmMem(RAX, NO_REGISTER, SS_1, offsetof(DeoptimizedFrames, ic)), R11);
+	for (size_t i = 0; i < SAVED_REGS_SIZE; i++) {
+		asmMovqMem(buffer, asmMem(RAX, NO_REGISTER, SS_1, offsetof(DeoptimizedFrames, regs) + i * sizeof(Value)), SavedRegisters[i]);
+	}
+	asmMovqMem(buffer, asmMem(RAX, NO_REGISTER, SS_1, offsetof(DeoptimizedFrames, result)), RAX);
+	asmLabelBind(buffer, &loop, asmOffset(buffer));
+	asmMovqMem(buffer, asmMem(RSI, RCX, SS_8, -sizeof(Value)), TMP);
+	asmMovqToMem(buffer, TMP, asmMem(RSP, RCX, SS_8, -sizeof(Value)));
+	asmDecq(buffer, RCX);
+	asmJ(buffer, COND_NOT_ZERO, &loop);
+
+	// continue in baseline code with context of the innermost frame
+	asmMovqMem(buffer, asmMem(RBP, NO_REGISTER, SS_1, -(CONTEXT_SLOT + 1) * sizeof(intptr_t)), CTX);
+	asmJmpq(buffer, R11);
+}
+StubCode DeoptimizeStub = { .generator = generateDeoptimize, .nativeCode = NULL };
+
+
 static void generateDoesNotUnderstandStub(CodeGenerator *generator)
 {
 	AssemblerBuffer *buffer = &generator->buffer;
@@ -302,6 +432,7 @@ static void generateDoesNotUnderstandStub(CodeGenerator *generator)
 	asmInitLabel(&zeroArgs);
 
 	generator->code.methodOrBlock = createDoesNotUnderstandCode();
+	generator->code.header = compiledMethodGetHeader(generator->code.methodOrBlock);
 	generator->frameSize = 3;
 
 	asmPushq(buffer, RBP);
@@ -319,13 +450,13 @@ static void generateDoesNotUnderstandStub(CodeGenerator *generator)
 	generateStubCall(generator, &AllocateStub);
 
 	// fill arguments array from stack
-	asmMovqMem(buffer, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawArray, size)), RBX);
-	asmTestq(buffer, RBX, RBX);
+	asmMovqMem(buffer, asmMem(RAX, NO_REGISTER, SS_1, varOffset(RawArray, size)), RCX);
+	asmTestq(buffer, RCX, RCX);
 	asmJ(buffer, COND_ZERO, &zeroArgs);
 	asmLabelBind(buffer, &loop, asmOffset(buffer));
-	asmMovqMem(buffer, asmMem(RBP, RBX, SS_8, 3 * sizeof(intptr_t)), TMP);
-	asmMovqToMem(buffer, TMP, asmMem(RAX, RBX, SS_8, varOffset(RawArray, vars) - sizeof(intptr_t)));
-	asmDecq(buffer, RBX);
+	asmMovqMem(buffer, asmMem(RBP, RCX, SS_8, 3 * sizeof(intptr_t)), TMP);
+	asmMovqToMem(buffer, TMP, asmMem(RAX, RCX, SS_8, varOffset(RawArray, vars) - sizeof(intptr_t)));
+	asmDecq(buffer, RCX);
 	asmJ(buffer, COND_NOT_ZERO, &loop);
 	asmLabelBind(buffer, &zeroArgs, asmOffset(buffer));
 
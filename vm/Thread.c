@@ -7,10 +7,10 @@
 __thread Thread CurrentThread = { 0 };
 
 
-void initThread(Thread *thread)
+_Bool initThread(Thread *thread)
 {
-	initHeap(&thread->heap, thread);
 	thread->stackFramesTail = NULL;
+	return initHeap(&thread->heap, thread);
 }
 
 
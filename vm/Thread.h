@@ -17,24 +17,44 @@ typedef struct Thread {
 
 extern __thread Thread CurrentThread;
 
-void initThread(Thread *thread);
+_Bool initThread(Thread *thread);
 void initThreadContext(Thread *thread);
 void freeThread(Thread *thread);
 void threadSetExitFrame(struct StackFrame *stackFrame);
 
 
+// while old space is marked, any store into it is remembered for the remark
 static inline void rawObjectStorePtr(RawObject *object, Value *field, RawObject *value)
 {
-	if (isOldObject(object) && isNewObject(value) && (object->tags & TAG_REMEMBERED) == 0) {
-		rememberedSetAdd(&CurrentThread.heap.rememberedSet, object);
+	if (isOldObject(object) && (isNewObject(value) || CurrentThread.heap.isMarking)) {
+		markCard(object, field);
 	}
 	*field = tagPtr(value);
 }
 
 
+static inline void rawObjectSetClass(RawObject *object, RawClass *class)
+{
+	if (isOldObject(object) && (isNewObject((RawObject *) class) || CurrentThread.heap.isMarking)) {
+		markCard(object, &object->class);
+	}
+	object->class = class;
+}
+
+
 static inline void objectStorePtr(Object *object, Value *field, Object *value)
 {
 	rawObjectStorePtr(object->raw, field, value->raw);
 }
 
+
+static inline void rawObjectStoreValue(RawObject *object, Value *field, Value value)
+{
+	if (valueTypeOf(value, VALUE_POINTER)) {
+		rawObjectStorePtr(object, field, asObject(value));
+	} else {
+		*field = value;
+	}
+}
+
 #endif
@@ -9,9 +9,9 @@ typedef struct {
 	uint8_t index;
 	uint8_t level;
 	uint8_t ctxCopy;
-	uint8_t unused0;
-	uint8_t unused1;
-	uint8_t unused2;
+	uint8_t isReadonly;
+	uint8_t isBoxed;
+	uint8_t isUsed;
 } Variable;
 
 
@@ -23,9 +23,9 @@ static Value defineVariable(uint8_t type, uint8_t index, uint8_t level)
 	tmp.index = index;
 	tmp.level = level;
 	tmp.ctxCopy = 0;
-	tmp.unused0 = 0;
-	tmp.unused1 = 0;
-	tmp.unused2 = 0;
+	tmp.isReadonly = 0;
+	tmp.isBoxed = 0;
+	tmp.isUsed = 0;
 	return *(Value *) &tmp;
 }
 
@@ -84,4 +84,41 @@ static _Bool hasVarCtxCopy(Value var)
 }
 
 
+static void setVarReadonly(Value *var)
+{
+	((Variable *) var)->isReadonly = 1;
+}
+
+
+static _Bool isVarReadonly(Value var)
+{
+	return ((Variable *) &var)->isReadonly;
+}
+
+
+// temporary captured by fallback blocks is moved into box once they are sent, see analyzeBoundVars
+static void setVarBoxed(Value *var, _Bool isBoxed)
+{
+	((Variable *) var)->isBoxed = isBoxed;
+}
+
+
+static _Bool isVarBoxed(Value var)
+{
+	return ((Variable *) &var)->isBoxed;
+}
+
+
+static void setVarUsed(Value *var)
+{
+	((Variable *) var)->isUsed = 1;
+}
+
+
+static _Bool isVarUsed(Value var)
+{
+	return ((Variable *) &var)->isUsed;
+}
+
+
 #endif
@@ -0,0 +1,98 @@
+#include "WorkerPool.h"
+#include "Assert.h"
+#include <pthread.h>
+
+static void startWorkers(void);
+static void *runWorker(void *arg);
+
+static size_t Size = 1;
+static _Bool IsStarted = 0;
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t JobStarted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t JobFinished = PTHREAD_COND_INITIALIZER;
+static size_t Generation = 0;
+static size_t Running = 0;
+static WorkerJob Job;
+static void *JobArg;
+
+
+// threads are started by first job, size cannot be changed after that
+void initWorkerPool(size_t size)
+{
+	ASSERT(size > 0);
+	if (!IsStarted) {
+		Size = size < WORKER_POOL_MAX_SIZE ? size : WORKER_POOL_MAX_SIZE;
+	}
+}
+
+
+size_t workerPoolSize(void)
+{
+	return Size;
+}
+
+
+// calling thread runs the job as worker 0 and returns when all workers have finished it
+void workerPoolRun(WorkerJob job, void *arg)
+{
+	if (Size == 1) {
+		job(0, arg);
+		return;
+	}
+	if (!IsStarted) {
+		startWorkers();
+	}
+
+	pthread_mutex_lock(&Lock);
+	Job = job;
+	JobArg = arg;
+	Running = Size - 1;
+	Generation++;
+	pthread_cond_broadcast(&JobStarted);
+	pthread_mutex_unlock(&Lock);
+
+	job(0, arg);
+
+	pthread_mutex_lock(&Lock);
+	while (Running > 0) {
+		pthread_cond_wait(&JobFinished, &Lock);
+	}
+	pthread_mutex_unlock(&Lock);
+}
+
+
+static void startWorkers(void)
+{
+	for (size_t i = 1; i < Size; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, runWorker, (void *) i) != 0) {
+			FAIL();
+		}
+		pthread_detach(thread);
+	}
+	IsStarted = 1;
+}
+
+
+static void *runWorker(void *arg)
+{
+	size_t worker = (size_t) arg;
+	// workers are started before first job is published
+	size_t generation = 0;
+	pthread_mutex_lock(&Lock);
+	while (1) {
+		while (generation == Generation) {
+			pthread_cond_wait(&JobStarted, &Lock);
+		}
+		generation = Generation;
+		pthread_mutex_unlock(&Lock);
+
+		Job(worker, JobArg);
+
+		pthread_mutex_lock(&Lock);
+		if (--Running == 0) {
+			pthread_cond_signal(&JobFinished);
+		}
+	}
+	return NULL;
+}
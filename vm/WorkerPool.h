@@ -0,0 +1,14 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stddef.h>
+
+#define WORKER_POOL_MAX_SIZE 64
+
+typedef void (*WorkerJob)(size_t worker, void *arg);
+
+void initWorkerPool(size_t size);
+size_t workerPoolSize(void);
+void workerPoolRun(WorkerJob job, void *arg);
+
+#endif